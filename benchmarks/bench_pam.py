@@ -0,0 +1,472 @@
+#!/usr/bin/env python3
+"""
+Throughput and concurrency benchmarks for truenas_pypam.
+
+Runs against PAM stacks written to a temporary confdir so results do not
+depend on the system PAM configuration:
+
+    permit   pam_permit for every management group
+    deny     pam_deny for every management group
+    unix     pam_unix (nodelay) for auth and account, using the test user
+             from tests/conftest.py
+    tt-*     the synthetic pam_tnpam_test module built with the extension
+             (synthetic suite only, skipped when the module is not found)
+
+Results are written as JSON (to stdout or --output). Pass --compare with
+the JSON of a previous run to report cases whose throughput dropped by
+more than --tolerance; the exit status is then 1 if any did.
+
+Example:
+    python3 benchmarks/bench_pam.py --duration 2 --output new.json \\
+        --compare baseline.json
+"""
+
+import argparse
+import importlib.util
+import json
+import os
+import platform
+import sys
+import sysconfig
+import tempfile
+import threading
+import time
+
+import truenas_pypam
+from truenas_authenticator import SimpleAuthenticator, UserPamAuthenticator
+
+
+# Test credentials from tests/conftest.py
+TEST_USER = 'bob'
+TEST_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+UNKNOWN_USER = 'bench-no-such-user'
+
+MSGStyle = truenas_pypam.MSGStyle
+
+STACKS = {
+    'permit': (
+        'auth required pam_permit.so\n'
+        'account required pam_permit.so\n'
+        'session required pam_permit.so\n'
+        'password required pam_permit.so\n'
+    ),
+    'deny': (
+        'auth required pam_deny.so\n'
+        'account required pam_deny.so\n'
+        'session required pam_deny.so\n'
+        'password required pam_deny.so\n'
+    ),
+    'unix': (
+        'auth required pam_unix.so nodelay\n'
+        'account required pam_unix.so\n'
+        'session required pam_permit.so\n'
+        'password required pam_deny.so\n'
+    ),
+}
+
+# Stacks of the synthetic module, see src/pam/pam_tnpam_test.c
+TEST_MODULE_SPEC = importlib.util.find_spec('pam_tnpam_test')
+TEST_MODULE = TEST_MODULE_SPEC.origin if TEST_MODULE_SPEC else None
+SYNTHETIC_STACKS = {
+    'tt-rounds': (
+        'auth required {module} rounds=4 style=info,echo_off '
+        f'password={TEST_PASSWORD}\n'
+    ),
+    'tt-latency': 'auth required {module} delay_us=1000\n',
+    'tt-flaky': 'auth required {module} fail_rate=0.25 seed=1\n',
+}
+
+
+def conv_password(ctx, messages, password):
+    return [
+        password if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF else None
+        for m in messages
+    ]
+
+
+class Bench:
+    def __init__(self, confdir, duration, warmup):
+        self.confdir = confdir
+        self.duration = duration
+        self.warmup = warmup
+        self.results = []
+
+    def context(self, stack, conv='responses', password=TEST_PASSWORD,
+                user=TEST_USER):
+        if conv == 'responses':
+            return truenas_pypam.get_context(
+                service_name=stack,
+                user=user,
+                confdir=self.confdir,
+                conversation_responses={
+                    MSGStyle.PAM_PROMPT_ECHO_OFF: password
+                }
+            )
+
+        return truenas_pypam.get_context(
+            service_name=stack,
+            user=user,
+            confdir=self.confdir,
+            conversation_function=conv_password,
+            conversation_private_data=password
+        )
+
+    def run(self, name, op, threads=1, **params):
+        """
+        Call op() repeatedly from the given number of threads for the
+        configured duration and record throughput, per-call latency and the
+        extension's own histograms for the interval.
+        """
+        deadline = time.monotonic() + self.warmup
+        while time.monotonic() < deadline:
+            op()
+
+        barrier = threading.Barrier(threads + 1)
+        latencies = [[] for _ in range(threads)]
+        errors = []
+        stop = threading.Event()
+
+        def worker(samples):
+            barrier.wait()
+            try:
+                while not stop.is_set():
+                    t0 = time.perf_counter_ns()
+                    op()
+                    samples.append(time.perf_counter_ns() - t0)
+            except Exception as exc:
+                errors.append(exc)
+                stop.set()
+
+        workers = [
+            threading.Thread(target=worker, args=(latencies[i],))
+            for i in range(threads)
+        ]
+        for t in workers:
+            t.start()
+
+        truenas_pypam.stats(reset=True)
+        barrier.wait()
+        start = time.perf_counter()
+        time.sleep(self.duration)
+        stop.set()
+        for t in workers:
+            t.join()
+        elapsed = time.perf_counter() - start
+        ext_stats = truenas_pypam.stats(reset=True)
+
+        if errors:
+            raise RuntimeError(f'{name}: {errors[0]!r}') from errors[0]
+
+        samples = sorted(s for per_thread in latencies for s in per_thread)
+        result = {
+            'name': name,
+            'params': dict(params, threads=threads),
+            'ops': len(samples),
+            'seconds': round(elapsed, 6),
+            'ops_per_sec': round(len(samples) / elapsed, 3),
+            'latency_ns': summarize(samples),
+            'extension_ns': {
+                key: hist_summary(hist)
+                for key, hist in ext_stats.items() if hist['count']
+            },
+        }
+        self.results.append(result)
+        print(f"{name:<24} {json.dumps(result['params']):<48} "
+              f"{result['ops_per_sec']:>10.1f} ops/s  "
+              f"p50 {result['latency_ns']['p50'] / 1000:>9.1f}us",
+              file=sys.stderr)
+        return result
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0
+    idx = min(len(samples) - 1, int(len(samples) * pct / 100))
+    return samples[idx]
+
+
+def summarize(samples):
+    return {
+        'mean': int(sum(samples) / len(samples)) if samples else 0,
+        'p50': percentile(samples, 50),
+        'p90': percentile(samples, 90),
+        'p99': percentile(samples, 99),
+        'max': samples[-1] if samples else 0,
+    }
+
+
+def hist_summary(hist):
+    """Approximate percentiles (bucket upper bounds) of an extension histogram."""
+    out = {
+        'count': hist['count'],
+        'mean': hist['total_ns'] // hist['count'],
+        'max': hist['max_ns'],
+    }
+    for pct in (50, 99):
+        target = hist['count'] * pct / 100
+        seen = 0
+        for idx, count in enumerate(hist['buckets']):
+            seen += count
+            if seen >= target:
+                out[f'p{pct}_le'] = min(1 << idx, hist['max_ns'])
+                break
+    return out
+
+
+def bench_lifecycle(bench, threads):
+    """get_context() + authenticate() + pam_end() on success paths."""
+    for stack in ('permit', 'unix'):
+        for conv in ('responses', 'callback'):
+            def op(stack=stack, conv=conv):
+                ctx = bench.context(stack, conv)
+                ctx.authenticate()
+                del ctx
+
+            for count in threads:
+                bench.run('lifecycle', op, stack=stack, conv=conv,
+                          threads=count)
+
+
+def bench_errors(bench):
+    """Cost of failed transactions including raising PAMError."""
+    cases = (
+        ('deny', 'denied', TEST_USER, TEST_PASSWORD),
+        ('unix', 'bad_password', TEST_USER, WRONG_PASSWORD),
+        ('unix', 'unknown_user', UNKNOWN_USER, TEST_PASSWORD),
+    )
+    for stack, reason, user, password in cases:
+        def op(stack=stack, user=user, password=password):
+            ctx = bench.context(stack, password=password, user=user)
+            try:
+                ctx.authenticate()
+            except truenas_pypam.PAMError:
+                pass
+            else:
+                raise AssertionError(f'{stack}: authentication succeeded')
+
+        bench.run('error_path', op, stack=stack, reason=reason)
+
+
+def bench_conversation(bench):
+    """Latency of one conversation round with each conversation mechanism."""
+    def op_callback():
+        bench.context('unix', 'callback').authenticate()
+
+    def op_responses():
+        bench.context('unix', 'responses').authenticate()
+
+    def op_resumable():
+        ctx = bench.context('unix', 'callback')
+        messages = ctx.auth_begin()
+        ctx.auth_resume(responses=conv_password(ctx, messages, TEST_PASSWORD))
+
+    bench.run('conversation', op_callback, mode='callback')
+    bench.run('conversation', op_responses, mode='responses')
+    bench.run('conversation', op_resumable, mode='resumable')
+
+    # auth_begin() alone measures start-up and the hand-off of the prompt
+    # from the PAM thread without including the password hash.
+    def op_begin():
+        ctx = bench.context('unix', 'callback')
+        ctx.auth_begin()
+        ctx.auth_abort()
+
+    bench.run('conversation', op_begin, mode='resumable_prompt')
+
+
+def bench_shared_context(bench, threads):
+    """Contention on a single handle (lock wait paths)."""
+    ctx = bench.context('permit')
+    for count in threads:
+        bench.run('shared_context', ctx.acct_mgmt, stack='permit',
+                  threads=count)
+
+
+def bench_authenticators(bench, threads):
+    """SimpleAuthenticator versus UserPamAuthenticator."""
+    def op_simple():
+        auth = SimpleAuthenticator(
+            username=TEST_USER, password=TEST_PASSWORD,
+            service='unix', confdir=bench.confdir
+        )
+        if not auth.authenticate_simple():
+            raise AssertionError('SimpleAuthenticator failed')
+        auth.end()
+
+    def op_user():
+        auth = UserPamAuthenticator(
+            username=TEST_USER, service='unix', confdir=bench.confdir
+        )
+        resp = auth.auth_init()
+        while resp.code == truenas_pypam.PAMCode.PAM_CONV_AGAIN:
+            resp = auth.auth_continue(
+                conv_password(None, resp.reason, TEST_PASSWORD)
+            )
+        if resp.code != truenas_pypam.PAMCode.PAM_SUCCESS:
+            raise AssertionError(f'UserPamAuthenticator failed: {resp.reason}')
+        auth.end()
+
+    for count in threads:
+        bench.run('authenticator', op_simple, cls='SimpleAuthenticator',
+                  threads=count)
+        bench.run('authenticator', op_user, cls='UserPamAuthenticator',
+                  threads=count)
+
+
+def bench_synthetic(bench, threads):
+    """Conversation rounds, module latency and failures of pam_tnpam_test."""
+    if TEST_MODULE is None:
+        print('synthetic: pam_tnpam_test not found, skipped', file=sys.stderr)
+        return
+
+    for conv in ('responses', 'callback'):
+        def op_rounds(conv=conv):
+            bench.context('tt-rounds', conv).authenticate()
+
+        bench.run('synthetic', op_rounds, stack='tt-rounds', conv=conv)
+
+    # A fixed 1ms module latency shows how well calls overlap across threads
+    def op_latency():
+        bench.context('tt-latency').authenticate()
+
+    for count in threads:
+        bench.run('synthetic', op_latency, stack='tt-latency', threads=count)
+
+    def op_flaky():
+        try:
+            bench.context('tt-flaky').authenticate()
+        except truenas_pypam.PAMError:
+            pass
+
+    bench.run('synthetic', op_flaky, stack='tt-flaky')
+
+
+SUITES = {
+    'lifecycle': lambda b, t: bench_lifecycle(b, t),
+    'errors': lambda b, t: bench_errors(b),
+    'conversation': lambda b, t: bench_conversation(b),
+    'shared_context': lambda b, t: bench_shared_context(b, t),
+    'authenticator': lambda b, t: bench_authenticators(b, t),
+    'synthetic': lambda b, t: bench_synthetic(b, t),
+}
+
+
+def result_key(result):
+    return (result['name'], json.dumps(result['params'], sort_keys=True))
+
+
+def compare(results, baseline_path, tolerance):
+    """Return results whose ops_per_sec dropped more than tolerance."""
+    with open(baseline_path) as f:
+        baseline = {result_key(r): r for r in json.load(f)['results']}
+
+    regressions = []
+    for result in results:
+        old = baseline.get(result_key(result))
+        if old is None or not old['ops_per_sec']:
+            continue
+
+        ratio = result['ops_per_sec'] / old['ops_per_sec']
+        if ratio < 1 - tolerance:
+            regressions.append({
+                'name': result['name'],
+                'params': result['params'],
+                'baseline_ops_per_sec': old['ops_per_sec'],
+                'ops_per_sec': result['ops_per_sec'],
+                'ratio': round(ratio, 3),
+            })
+
+    return regressions
+
+
+def thread_counts(max_threads):
+    counts = []
+    count = 1
+    while count < max_threads:
+        counts.append(count)
+        count *= 2
+    counts.append(max_threads)
+    return counts
+
+
+def write_stacks(confdir):
+    for name, stack in STACKS.items():
+        with open(os.path.join(confdir, name), 'w') as f:
+            f.write(stack)
+
+    if TEST_MODULE is not None:
+        for name, stack in SYNTHETIC_STACKS.items():
+            with open(os.path.join(confdir, name), 'w') as f:
+                f.write(stack.format(module=TEST_MODULE))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--duration', type=float, default=1.0,
+                        help='seconds to measure each case (default 1.0)')
+    parser.add_argument('--warmup', type=float, default=0.1,
+                        help='seconds to run each case before measuring')
+    parser.add_argument('--max-threads', type=int,
+                        default=max(4, min(os.cpu_count() or 1, 16)),
+                        help='largest thread count for scaling cases')
+    parser.add_argument('--suite', action='append', choices=sorted(SUITES),
+                        help='suite to run (repeatable, default all)')
+    parser.add_argument('--output', help='write JSON results to this file')
+    parser.add_argument('--compare', metavar='BASELINE',
+                        help='JSON results of a previous run to compare with')
+    parser.add_argument('--tolerance', type=float, default=0.2,
+                        help='allowed fractional throughput drop for '
+                             '--compare (default 0.2)')
+    args = parser.parse_args()
+
+    if args.max_threads < 1:
+        parser.error('--max-threads must be positive')
+
+    threads = thread_counts(args.max_threads)
+
+    with tempfile.TemporaryDirectory() as confdir:
+        write_stacks(confdir)
+        bench = Bench(confdir, args.duration, args.warmup)
+        for name in args.suite or SUITES:
+            SUITES[name](bench, threads)
+
+    gil_enabled = getattr(sys, '_is_gil_enabled', lambda: True)()
+    report = {
+        'meta': {
+            'timestamp': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+            'python': sys.version,
+            'implementation': platform.python_implementation(),
+            'free_threaded': bool(sysconfig.get_config_var('Py_GIL_DISABLED')),
+            'gil_enabled': gil_enabled,
+            'machine': platform.machine(),
+            'cpu_count': os.cpu_count(),
+            'extension': truenas_pypam.__file__,
+            'duration': args.duration,
+            'threads': threads,
+        },
+        'results': bench.results,
+    }
+
+    regressions = []
+    if args.compare:
+        regressions = compare(bench.results, args.compare, args.tolerance)
+        report['regressions'] = regressions
+        for reg in regressions:
+            print(f"REGRESSION {reg['name']} {json.dumps(reg['params'])}: "
+                  f"{reg['baseline_ops_per_sec']} -> {reg['ops_per_sec']} "
+                  f"ops/s", file=sys.stderr)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2)
+            f.write('\n')
+    else:
+        json.dump(report, sys.stdout, indent=2)
+        sys.stdout.write('\n')
+
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -5,21 +5,52 @@ truenas_pypam_ext = Extension(
     sources=[
         'src/ext/truenas_pypam.c',
         'src/ext/py_acct_mgmt.c',
+        'src/ext/py_args.c',
+        'src/ext/py_async.c',
         'src/ext/py_auth.c',
+        'src/ext/py_authcache.c',
+        'src/ext/py_batch.c',
         'src/ext/py_chauthtok.c',
         'src/ext/py_ctx.c',
         'src/ext/py_conv.c',
         'src/ext/py_cred.c',
         'src/ext/py_env.c',
+        'src/ext/py_enum.c',
         'src/ext/py_error.c',
+        'src/ext/py_events.c',
+        'src/ext/py_history.c',
+        'src/ext/py_lock.c',
+        'src/ext/py_login.c',
+        'src/ext/py_memory.c',
+        'src/ext/py_message.c',
+        'src/ext/py_op.c',
+        'src/ext/py_passwd.c',
+        'src/ext/py_pool.c',
+        'src/ext/py_procpool.c',
+        'src/ext/py_ratelimit.c',
+        'src/ext/py_responder.c',
+        'src/ext/py_resume.c',
+        'src/ext/py_secret.c',
         'src/ext/py_session.c',
+        'src/ext/py_stats.c',
     ],
     include_dirs=['src/ext'],
     libraries=['pam', 'pam_misc', 'bsd']
 )
 
+# Synthetic PAM module for the tests and benchmarks. It is a plain PAM
+# module (no python entry point) installed next to the extension, see
+# src/pam/pam_tnpam_test.c. It stays loaded after pam_end() so that its
+# process-wide call counter survives between transactions.
+pam_tnpam_test = Extension(
+    'pam_tnpam_test',
+    sources=['src/pam/pam_tnpam_test.c'],
+    libraries=['pam'],
+    extra_link_args=['-Wl,-z,nodelete']
+)
+
 setup(
     packages=['truenas_authenticator'],
     package_dir={'truenas_authenticator': 'src/truenas_authenticator'},
-    ext_modules=[truenas_pypam_ext]
+    ext_modules=[truenas_pypam_ext, pam_tnpam_test]
 )
@@ -3,23 +3,34 @@
 #include <string.h>
 #include "truenas_pypam.h"
 
-PyObject *
-py_tnpam_acct_mgmt(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+/*
+ * Parse arguments for acct_mgmt() / acct_mgmt_async() into PAM flags and a
+ * deadline and emit the audit event for the check.
+ */
+static bool
+acct_mgmt_prepare(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		  PyObject *kwnames, int *flags_out, uint64_t *deadline_out)
 {
 	static char *kwlist[] = {
 		"silent",
 		"disallow_null_authtok",
+		"timeout",
 		NULL
 	};
 	boolean_t silent = B_FALSE;
 	boolean_t disallow_null_authtok = B_FALSE;
+	PyObject *py_timeout = NULL;
 	int flags = 0;
-	pamcode_t ret;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$pp", kwlist,
-					 &silent,
-					 &disallow_null_authtok)) {
-		return NULL;
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$ppO", kwlist,
+			      &silent,
+			      &disallow_null_authtok,
+			      &py_timeout)) {
+		return false;
+	}
+
+	if (!tnpam_op_deadline(self, py_timeout, deadline_out)) {
+		return false;
 	}
 
 	if (silent) {
@@ -32,20 +43,37 @@ py_tnpam_acct_mgmt(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 
 	// Audit the account management check
 	if (PySys_Audit(MODULE_NAME ".acct_mgmt", "O", self->user) < 0) {
+		return false;
+	}
+
+	*flags_out = flags;
+	return true;
+}
+
+PyObject *
+py_tnpam_acct_mgmt(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		   PyObject *kwnames)
+{
+	uint64_t deadline;
+	int flags;
+
+	if (!acct_mgmt_prepare(self, args, nargs, kwnames, &flags, &deadline)) {
 		return NULL;
 	}
 
-	PYPAM_LOCK(self);
-	ret = pam_acct_mgmt(self->hdl, flags);
-	self->last_pam_result = ret;
-	PYPAM_UNLOCK(self);
+	return tnpam_op_run(self, TNPAM_OP_ACCT_MGMT, flags, deadline);
+}
+
+PyObject *
+py_tnpam_acct_mgmt_async(tnpam_ctx_t *self, PyObject *const *args,
+			 Py_ssize_t nargs, PyObject *kwnames)
+{
+	uint64_t deadline;
+	int flags;
 
-	if (ret != PAM_SUCCESS) {
-		if (!PyErr_Occurred()) {
-			set_pam_exc(ret, "pam_acct_mgmt() failed");
-		}
+	if (!acct_mgmt_prepare(self, args, nargs, kwnames, &flags, &deadline)) {
 		return NULL;
 	}
 
-	Py_RETURN_NONE;
+	return tnpam_op_submit(self, TNPAM_OP_ACCT_MGMT, flags, deadline);
 }
@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include "truenas_pypam.h"
+
+/*
+ * Argument parsing for METH_FASTCALL | METH_KEYWORDS functions and vectorcall.
+ *
+ * CPython has no public equivalent of PyArg_ParseTupleAndKeywords() for the
+ * vectorcall convention, and using it would mean building an args tuple and a
+ * kwargs dict for every call. tnpam_parse_args() accepts the subset of format
+ * units used by this module with the same meaning:
+ *
+ *   s   str -> const char * (borrowed, no embedded NUL)
+ *   z   str or None -> const char * (NULL for None)
+ *   O   object -> PyObject * (borrowed)
+ *   p   bool predicate -> int
+ *   n   index -> Py_ssize_t
+ *   I   index -> unsigned int (no overflow checking)
+ *   |   remaining arguments are optional
+ *   $   remaining arguments are keyword-only
+ *
+ * Outputs for arguments that were not given are left untouched so that
+ * callers can initialize defaults as they would for PyArg_Parse*().
+ */
+
+#define TNPAM_ARGS_MAX 16
+
+static bool
+args_convert(char code, PyObject *obj, const char *name, void *out)
+{
+	Py_ssize_t len;
+	const char *str;
+	int truth;
+
+	switch (code) {
+	case 'O':
+		*(PyObject **)out = obj;
+		return true;
+	case 'p':
+		truth = PyObject_IsTrue(obj);
+		if (truth < 0) {
+			return false;
+		}
+		*(int *)out = truth;
+		return true;
+	case 'n':
+		len = PyNumber_AsSsize_t(obj, PyExc_OverflowError);
+		if ((len == -1) && PyErr_Occurred()) {
+			return false;
+		}
+		*(Py_ssize_t *)out = len;
+		return true;
+	case 'I': {
+		PyObject *idx = PyNumber_Index(obj);
+		unsigned long val;
+
+		if (idx == NULL) {
+			return false;
+		}
+		val = PyLong_AsUnsignedLongMask(idx);
+		Py_DECREF(idx);
+		if ((val == (unsigned long)-1) && PyErr_Occurred()) {
+			return false;
+		}
+		*(unsigned int *)out = (unsigned int)val;
+		return true;
+	}
+	case 'z':
+		if (obj == Py_None) {
+			*(const char **)out = NULL;
+			return true;
+		}
+		// fallthrough
+	case 's':
+		if (!PyUnicode_Check(obj)) {
+			PyErr_Format(PyExc_TypeError,
+				     "argument '%s' must be str%s, not %.200s",
+				     name, (code == 'z') ? " or None" : "",
+				     Py_TYPE(obj)->tp_name);
+			return false;
+		}
+		str = PyUnicode_AsUTF8AndSize(obj, &len);
+		if (str == NULL) {
+			return false;
+		}
+		if (strlen(str) != (size_t)len) {
+			PyErr_SetString(PyExc_ValueError, "embedded null character");
+			return false;
+		}
+		*(const char **)out = str;
+		return true;
+	default:
+		break;
+	}
+
+	PyErr_Format(PyExc_SystemError, "bad format unit '%c'", code);
+	return false;
+}
+
+bool
+tnpam_parse_args(PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+		 const char *format, char **kwlist, ...)
+{
+	PyObject *vals[TNPAM_ARGS_MAX] = { NULL };
+	char codes[TNPAM_ARGS_MAX];
+	Py_ssize_t nparams = 0, npos = -1, nrequired = -1;
+	Py_ssize_t nkw, i, j;
+	const char *fmt;
+	bool ok = true;
+	va_list ap;
+
+	for (fmt = format; *fmt != '\0'; fmt++) {
+		if (*fmt == '|') {
+			nrequired = nparams;
+		} else if (*fmt == '$') {
+			npos = nparams;
+		} else {
+			PYPAM_ASSERT((nparams < TNPAM_ARGS_MAX) &&
+				     (kwlist[nparams] != NULL),
+				     "format does not match kwlist");
+			codes[nparams++] = *fmt;
+		}
+	}
+
+	if (npos < 0) {
+		npos = nparams;
+	}
+	if (nrequired < 0) {
+		nrequired = nparams;
+	}
+
+	if (nargs > npos) {
+		if (npos == 0) {
+			PyErr_SetString(PyExc_TypeError,
+					"function takes no positional arguments");
+		} else {
+			PyErr_Format(PyExc_TypeError,
+				     "function takes at most %zd positional "
+				     "argument%s (%zd given)",
+				     npos, (npos == 1) ? "" : "s", nargs);
+		}
+		return false;
+	}
+
+	for (i = 0; i < nargs; i++) {
+		vals[i] = args[i];
+	}
+
+	nkw = (kwnames != NULL) ? PyTuple_GET_SIZE(kwnames) : 0;
+	for (i = 0; i < nkw; i++) {
+		PyObject *key = PyTuple_GET_ITEM(kwnames, i);
+
+		for (j = 0; j < nparams; j++) {
+			if (PyUnicode_CompareWithASCIIString(key, kwlist[j]) == 0) {
+				break;
+			}
+		}
+
+		if (j == nparams) {
+			PyErr_Format(PyExc_TypeError,
+				     "'%U' is an invalid keyword argument for "
+				     "this function", key);
+			return false;
+		}
+
+		if (vals[j] != NULL) {
+			PyErr_Format(PyExc_TypeError,
+				     "argument for function given by name ('%s') "
+				     "and position (%zd)", kwlist[j], j + 1);
+			return false;
+		}
+
+		vals[j] = args[nargs + i];
+	}
+
+	for (i = 0; i < nrequired; i++) {
+		if (vals[i] == NULL) {
+			PyErr_Format(PyExc_TypeError,
+				     "function missing required argument '%s' "
+				     "(pos %zd)", kwlist[i], i + 1);
+			return false;
+		}
+	}
+
+	va_start(ap, kwlist);
+	for (i = 0; i < nparams; i++) {
+		void *out = va_arg(ap, void *);
+
+		if ((vals[i] != NULL) &&
+		    !args_convert(codes[i], vals[i], kwlist[i], out)) {
+			ok = false;
+			break;
+		}
+	}
+	va_end(ap);
+
+	return ok;
+}
@@ -0,0 +1,516 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include <pthread.h>
+#include "truenas_pypam.h"
+
+/*
+ * Native worker pool backing the PamContext *_async() methods.
+ *
+ * Each *_async() call captures the running asyncio event loop, creates a
+ * future on it and queues a job. A pool thread picks the job up, performs
+ * the PAM call exactly as the synchronous method would (including running
+ * the conversation callback), and then hands the result back to the loop
+ * via loop.call_soon_threadsafe(). Pool threads are created on demand up to
+ * the configured maximum and are reused for the life of the process, so
+ * a large number of concurrent logins does not require a python thread per
+ * login.
+ *
+ * The pool is shared by all interpreters. Workers keep a thread state for the
+ * main interpreter and use a temporary one for jobs from subinterpreters since
+ * Py_EndInterpreter() requires that no other thread state of the interpreter
+ * exists. For the same reason subinterpreters wait for their outstanding jobs
+ * in an atexit hook.
+ */
+
+#define TNPAM_ASYNC_DEFAULT_WORKERS 16
+
+typedef struct tnpam_async_job {
+	struct tnpam_async_job *next;
+	PyInterpreterState *interp;	/* interpreter that submitted the job */
+	tnpam_state_t *state;	/* module state of a subinterpreter, else NULL */
+	tnpam_ctx_t *ctx;	/* strong reference */
+	tnpam_op_t op;
+	int flags;
+	uint64_t deadline_ns;	/* includes time spent queued */
+	PyObject *loop;		/* strong reference */
+	PyObject *future;	/* strong reference */
+	PyObject *complete_fn;	/* strong reference */
+} tnpam_async_job_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	pthread_cond_t done_cv;	/* subinterpreter job finished */
+	tnpam_async_job_t *head;
+	tnpam_async_job_t *tail;
+	size_t nthreads;	/* threads currently in pool */
+	size_t idle;		/* threads waiting for work */
+	size_t max_threads;
+	boolean_t atfork_registered;
+} tnpam_async_pool_t;
+
+static tnpam_async_pool_t async_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cv = PTHREAD_COND_INITIALIZER,
+	.done_cv = PTHREAD_COND_INITIALIZER,
+	.max_threads = TNPAM_ASYNC_DEFAULT_WORKERS,
+};
+
+/*
+ * Pool threads do not survive fork(). Reset the pool in the child so that
+ * new threads get spawned on first use. Any jobs that were queued at the
+ * time of fork belong to the parent and are simply forgotten.
+ */
+static void
+async_pool_atfork_child(void)
+{
+	pthread_mutex_init(&async_pool.lock, NULL);
+	pthread_cond_init(&async_pool.cv, NULL);
+	pthread_cond_init(&async_pool.done_cv, NULL);
+	async_pool.head = NULL;
+	async_pool.tail = NULL;
+	async_pool.nthreads = 0;
+	async_pool.idle = 0;
+}
+
+/*
+ * Take the currently raised python exception as a single object so that it
+ * can be passed to future.set_exception(). Clears the error indicator.
+ */
+static PyObject *
+async_fetch_exception(void)
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	return PyErr_GetRaisedException();
+#else
+	PyObject *type, *value, *tb;
+
+	PyErr_Fetch(&type, &value, &tb);
+	PyErr_NormalizeException(&type, &value, &tb);
+	if (tb != NULL) {
+		PyException_SetTraceback(value, tb);
+	}
+	Py_XDECREF(type);
+	Py_XDECREF(tb);
+	return value;
+#endif
+}
+
+static void
+async_job_free(tnpam_async_job_t *job)
+{
+	// GIL must be held
+	Py_CLEAR(job->ctx);
+	Py_CLEAR(job->loop);
+	Py_CLEAR(job->future);
+	Py_CLEAR(job->complete_fn);
+	PyMem_RawFree(job);
+}
+
+/*
+ * Run the queued PAM operation and schedule completion of the future on the
+ * event loop. Called from a pool thread with the GIL held.
+ */
+static void
+async_job_run(tnpam_async_job_t *job)
+{
+	PyObject *result = NULL;
+	PyObject *ret = NULL;
+	pamcode_t code;
+	uint32_t fail_delay;
+
+	PYPAM_LOCK(job->ctx);
+	code = tnpam_op_call(job->ctx, job->op, job->flags, job->deadline_ns);
+	fail_delay = atomic_load_explicit(&job->ctx->fail_delay_usec,
+					  memory_order_relaxed);
+	PYPAM_UNLOCK(job->ctx);
+
+	result = tnpam_op_result(job->ctx, job->op, code);
+	if (result == NULL) {
+		result = async_fetch_exception();
+	}
+
+	if (job->ctx->defer_fail_delay && (fail_delay > 0)) {
+		// Enforce the fail delay libpam skipped with a timer on the event
+		// loop rather than by sleeping in this thread. call_later() is not
+		// thread-safe and so is itself scheduled with call_soon_threadsafe().
+		PyObject *call_later = PyObject_GetAttrString(job->loop,
+							      "call_later");
+		if (call_later != NULL) {
+			ret = PyObject_CallMethod(job->loop, "call_soon_threadsafe",
+						  "OdOOO", call_later,
+						  fail_delay / 1e6,
+						  job->complete_fn, job->future,
+						  result);
+			Py_DECREF(call_later);
+		}
+	} else {
+		ret = PyObject_CallMethod(job->loop, "call_soon_threadsafe", "OOO",
+					  job->complete_fn, job->future, result);
+	}
+	if (ret == NULL) {
+		// Most likely the event loop was closed while the PAM call was
+		// in progress. There is nobody left to deliver the result to.
+		PyErr_WriteUnraisable(job->future);
+	}
+
+	Py_XDECREF(ret);
+	Py_XDECREF(result);
+	async_job_free(job);
+}
+
+static void *
+async_worker(void *arg)
+{
+	PyGILState_STATE gstate;
+	PyThreadState *tstate;
+	tnpam_async_job_t *job;
+
+	// Create a python thread state once for the life of this worker and
+	// then immediately release the GIL while waiting for work.
+	gstate = PyGILState_Ensure();
+	tstate = PyEval_SaveThread();
+
+	for (;;) {
+		pthread_mutex_lock(&async_pool.lock);
+		while (async_pool.head == NULL) {
+			async_pool.idle++;
+			pthread_cond_wait(&async_pool.cv, &async_pool.lock);
+			async_pool.idle--;
+		}
+		job = async_pool.head;
+		async_pool.head = job->next;
+		if (async_pool.head == NULL) {
+			async_pool.tail = NULL;
+		}
+		pthread_mutex_unlock(&async_pool.lock);
+
+		if (job->interp == PyThreadState_GetInterpreter(tstate)) {
+			PyEval_RestoreThread(tstate);
+			async_job_run(job);
+			tstate = PyEval_SaveThread();
+		} else {
+			tnpam_state_t *state = job->state;
+			PyThreadState *sub = PyThreadState_New(job->interp);
+			PYPAM_ASSERT((sub != NULL), "Failed to create thread state");
+
+			PyEval_RestoreThread(sub);
+			async_job_run(job);
+			PyThreadState_Clear(sub);
+			PyThreadState_DeleteCurrent();
+
+			// The interpreter may be finalized once this drops to 0
+			pthread_mutex_lock(&async_pool.lock);
+			state->async_jobs--;
+			pthread_cond_broadcast(&async_pool.done_cv);
+			pthread_mutex_unlock(&async_pool.lock);
+		}
+	}
+
+	// not reached
+	PyEval_RestoreThread(tstate);
+	PyGILState_Release(gstate);
+	return NULL;
+}
+
+/*
+ * Queue job and wake (or spawn) a worker. Called with the GIL held.
+ */
+static bool
+async_pool_enqueue(tnpam_async_job_t *job)
+{
+	pthread_attr_t attr;
+	pthread_t thd;
+	int err = 0;
+
+	pthread_mutex_lock(&async_pool.lock);
+	if (!async_pool.atfork_registered) {
+		pthread_atfork(NULL, NULL, async_pool_atfork_child);
+		async_pool.atfork_registered = B_TRUE;
+	}
+
+	if ((async_pool.idle == 0) &&
+	    (async_pool.nthreads < async_pool.max_threads)) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		err = pthread_create(&thd, &attr, async_worker, NULL);
+		pthread_attr_destroy(&attr);
+		if (err == 0) {
+			async_pool.nthreads++;
+		} else if (async_pool.nthreads == 0) {
+			// No thread exists that could ever pick up the job
+			pthread_mutex_unlock(&async_pool.lock);
+			errno = err;
+			PyErr_SetFromErrno(PyExc_OSError);
+			return false;
+		}
+	}
+
+	job->next = NULL;
+	if (async_pool.tail != NULL) {
+		async_pool.tail->next = job;
+	} else {
+		async_pool.head = job;
+	}
+	async_pool.tail = job;
+	if (job->state != NULL) {
+		job->state->async_jobs++;
+	}
+	pthread_cond_signal(&async_pool.cv);
+	pthread_mutex_unlock(&async_pool.lock);
+	return true;
+}
+
+/*
+ * Callback scheduled on the event loop by a pool thread.
+ * Arguments are (future, result) where result is either None or an
+ * exception instance. Futures that were cancelled while the PAM call was in
+ * progress are left alone.
+ */
+static PyObject *
+async_complete(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+	PyObject *future, *result, *done, *ret;
+	int is_done;
+
+	if (nargs != 2) {
+		PyErr_SetString(PyExc_TypeError, "expected (future, result)");
+		return NULL;
+	}
+
+	future = args[0];
+	result = args[1];
+
+	done = PyObject_CallMethod(future, "done", NULL);
+	if (done == NULL) {
+		return NULL;
+	}
+
+	is_done = PyObject_IsTrue(done);
+	Py_DECREF(done);
+	if (is_done < 0) {
+		return NULL;
+	} else if (is_done) {
+		Py_RETURN_NONE;
+	}
+
+	if (PyExceptionInstance_Check(result)) {
+		ret = PyObject_CallMethod(future, "set_exception", "O", result);
+	} else {
+		ret = PyObject_CallMethod(future, "set_result", "O", result);
+	}
+
+	if (ret == NULL) {
+		return NULL;
+	}
+
+	Py_DECREF(ret);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef async_complete_def = {
+	.ml_name = "_async_complete",
+	.ml_meth = (PyCFunction)(void(*)(void))async_complete,
+	.ml_flags = METH_FASTCALL,
+};
+
+/*
+ * Return a new reference to asyncio.get_running_loop. Avoid importing asyncio
+ * until someone actually uses the async API. The pool lock makes the lazy
+ * initialization safe without the GIL; no python code runs while holding it.
+ */
+static PyObject *
+async_get_running_loop_fn(tnpam_state_t *state)
+{
+	PyObject *asyncio = NULL;
+	PyObject *fn = NULL;
+
+	pthread_mutex_lock(&async_pool.lock);
+	fn = Py_XNewRef(state->get_running_loop);
+	pthread_mutex_unlock(&async_pool.lock);
+
+	if (fn != NULL) {
+		return fn;
+	}
+
+	asyncio = PyImport_ImportModule("asyncio");
+	if (asyncio == NULL) {
+		return NULL;
+	}
+
+	fn = PyObject_GetAttrString(asyncio, "get_running_loop");
+	Py_DECREF(asyncio);
+	if (fn == NULL) {
+		return NULL;
+	}
+
+	// Another thread may have done the same meanwhile, keep the first one
+	pthread_mutex_lock(&async_pool.lock);
+	if (state->get_running_loop == NULL) {
+		state->get_running_loop = Py_NewRef(fn);
+	}
+	pthread_mutex_unlock(&async_pool.lock);
+
+	return fn;
+}
+
+/*
+ * Queue the PAM operation on the worker pool and return an asyncio future
+ * that is completed from the running event loop. Called with the GIL held
+ * and after argument validation and auditing are complete.
+ */
+PyObject *
+tnpam_op_submit(tnpam_ctx_t *ctx, tnpam_op_t op, int flags,
+		uint64_t deadline_ns)
+{
+	tnpam_state_t *state = NULL;
+	tnpam_async_job_t *job = NULL;
+	PyObject *get_running_loop = NULL;
+	PyObject *loop = NULL;
+	PyObject *future = NULL;
+
+	if (tnpam_resume_busy(ctx)) {
+		return NULL;
+	}
+
+	state = tnpam_ctx_state(ctx);
+
+	get_running_loop = async_get_running_loop_fn(state);
+	if (get_running_loop == NULL) {
+		return NULL;
+	}
+
+	// Raises RuntimeError if there is no running event loop
+	loop = PyObject_CallNoArgs(get_running_loop);
+	Py_DECREF(get_running_loop);
+	if (loop == NULL) {
+		return NULL;
+	}
+
+	future = PyObject_CallMethod(loop, "create_future", NULL);
+	if (future == NULL) {
+		Py_DECREF(loop);
+		return NULL;
+	}
+
+	job = PyMem_RawCalloc(1, sizeof(tnpam_async_job_t));
+	if (job == NULL) {
+		Py_DECREF(future);
+		Py_DECREF(loop);
+		return PyErr_NoMemory();
+	}
+
+	job->interp = PyInterpreterState_Get();
+	if (job->interp != PyInterpreterState_Main()) {
+		job->state = state;
+	}
+	job->ctx = (tnpam_ctx_t *)Py_NewRef((PyObject *)ctx);
+	job->op = op;
+	job->flags = flags;
+	job->deadline_ns = deadline_ns;
+	job->loop = loop;
+	job->future = Py_NewRef(future);
+	job->complete_fn = Py_NewRef(state->async_complete);
+
+	if (!async_pool_enqueue(job)) {
+		async_job_free(job);
+		Py_DECREF(future);
+		return NULL;
+	}
+
+	return future;
+}
+
+PyObject *
+py_tnpam_set_async_workers(PyObject *self, PyObject *const *args,
+			   Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = { "max_workers", NULL };
+	Py_ssize_t max_workers = 0;
+	size_t prev;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "n", kwlist,
+			      &max_workers)) {
+		return NULL;
+	}
+
+	if (max_workers < 1) {
+		PyErr_SetString(PyExc_ValueError,
+				"max_workers must be a positive integer");
+		return NULL;
+	}
+
+	// Shrinking the pool does not stop threads that already exist. It only
+	// prevents new ones from being spawned.
+	pthread_mutex_lock(&async_pool.lock);
+	prev = async_pool.max_threads;
+	async_pool.max_threads = (size_t)max_workers;
+	pthread_mutex_unlock(&async_pool.lock);
+
+	return PyLong_FromSize_t(prev);
+}
+
+/*
+ * atexit hook of subinterpreters. Wait for pool threads to finish jobs of
+ * this interpreter (and drop their thread states) before it is finalized.
+ */
+static PyObject *
+async_wait_jobs(PyObject *module, PyObject *Py_UNUSED(ignored))
+{
+	tnpam_state_t *state = py_get_pam_state(module);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&async_pool.lock);
+	while (state->async_jobs > 0) {
+		pthread_cond_wait(&async_pool.done_cv, &async_pool.lock);
+	}
+	pthread_mutex_unlock(&async_pool.lock);
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef async_wait_jobs_def = {
+	.ml_name = "_async_wait_jobs",
+	.ml_meth = (PyCFunction)async_wait_jobs,
+	.ml_flags = METH_NOARGS,
+};
+
+bool init_async_state(PyObject *module_ref)
+{
+	tnpam_state_t *state = NULL;
+	PyObject *atexit = NULL;
+	PyObject *fn = NULL;
+	PyObject *ret = NULL;
+
+	state = py_get_pam_state(module_ref);
+	if (state == NULL) {
+		return false;
+	}
+
+	state->async_complete = PyCFunction_NewEx(&async_complete_def, NULL,
+						  module_ref);
+	if (state->async_complete == NULL) {
+		return false;
+	}
+
+	if (PyInterpreterState_Get() == PyInterpreterState_Main()) {
+		return true;
+	}
+
+	atexit = PyImport_ImportModule("atexit");
+	if (atexit == NULL) {
+		return false;
+	}
+
+	fn = PyCFunction_NewEx(&async_wait_jobs_def, module_ref, module_ref);
+	if (fn != NULL) {
+		ret = PyObject_CallMethod(atexit, "register", "O", fn);
+	}
+
+	Py_DECREF(atexit);
+	Py_XDECREF(fn);
+	Py_XDECREF(ret);
+	return ret != NULL;
+}
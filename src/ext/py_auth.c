@@ -3,53 +3,191 @@
 #include <string.h>
 #include "truenas_pypam.h"
 
+/*
+ * Convert authenticate() keyword arguments into PAM flags and emit the audit
+ * event for the attempt.
+ */
+static bool
+authenticate_flags(tnpam_ctx_t *self, boolean_t silent,
+		   boolean_t disallow_null_authtok, int *flags_out)
+{
+	int flags = 0;
+
+	if (silent) {
+		flags |= PAM_SILENT;
+	}
+
+	if (disallow_null_authtok) {
+		flags |= PAM_DISALLOW_NULL_AUTHTOK;
+	}
+
+	// Audit the authentication attempt
+	if (PySys_Audit(MODULE_NAME ".authenticate", "O", self->user) < 0) {
+		return false;
+	}
+
+	*flags_out = flags;
+	return true;
+}
+
+/*
+ * Parse arguments for authenticate() / authenticate_async() into PAM flags
+ * and a deadline and emit the audit event for the attempt.
+ */
+static bool
+authenticate_prepare(tnpam_ctx_t *self, PyObject *const *args,
+		     Py_ssize_t nargs, PyObject *kwnames, int *flags_out,
+		     uint64_t *deadline_out)
+{
+	static char *kwlist[] = {
+		"silent",
+		"disallow_null_authtok",
+		"timeout",
+		NULL
+	};
+	boolean_t silent = B_FALSE;
+	boolean_t disallow_null_authtok = B_FALSE;
+	PyObject *py_timeout = NULL;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$ppO", kwlist,
+			      &silent,
+			      &disallow_null_authtok,
+			      &py_timeout)) {
+		return false;
+	}
+
+	if (!tnpam_op_deadline(self, py_timeout, deadline_out)) {
+		return false;
+	}
+
+	return authenticate_flags(self, silent, disallow_null_authtok, flags_out);
+}
+
 PyObject *
-py_tnpam_authenticate(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+py_tnpam_authenticate(tnpam_ctx_t *self, PyObject *const *args,
+		      Py_ssize_t nargs, PyObject *kwnames)
 {
 	// Wrapper around pam_authenticate(3)
 	// Multi-step authentication will be handled throuh the callback
 	// function specified when creating the PAM context object.
+	uint64_t deadline;
+	int flags;
+
+	if (!authenticate_prepare(self, args, nargs, kwnames, &flags,
+				  &deadline)) {
+		return NULL;
+	}
+
+	return tnpam_op_run(self, TNPAM_OP_AUTHENTICATE, flags, deadline);
+}
+
+PyObject *
+py_tnpam_authenticate_async(tnpam_ctx_t *self, PyObject *const *args,
+			    Py_ssize_t nargs, PyObject *kwnames)
+{
+	uint64_t deadline;
+	int flags;
+
+	if (!authenticate_prepare(self, args, nargs, kwnames, &flags,
+				  &deadline)) {
+		return NULL;
+	}
+
+	return tnpam_op_submit(self, TNPAM_OP_AUTHENTICATE, flags, deadline);
+}
+
+PyObject *
+py_tnpam_auth_begin(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		    PyObject *kwnames)
+{
 	static char *kwlist[] = {
 		"silent",
 		"disallow_null_authtok",
+		"timeout",
 		NULL
 	};
 	boolean_t silent = B_FALSE;
 	boolean_t disallow_null_authtok = B_FALSE;
-	int flags = 0;
-	pamcode_t ret;
+	PyObject *py_timeout = NULL;
+	uint64_t deadline;
+	double timeout;
+	int flags;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$pp", kwlist,
-					 &silent,
-					 &disallow_null_authtok)) {
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$ppO", kwlist,
+			      &silent,
+			      &disallow_null_authtok,
+			      &py_timeout)) {
 		return NULL;
 	}
 
-	if (silent) {
-		flags |= PAM_SILENT;
+	if (!tnpam_parse_timeout(py_timeout, &timeout)) {
+		return NULL;
 	}
 
-	if (disallow_null_authtok) {
-		flags |= PAM_DISALLOW_NULL_AUTHTOK;
+	// timeout is how long to wait for the first conversation. The
+	// operation as a whole is bounded by the context default.
+	if (!tnpam_op_deadline(self, NULL, &deadline)) {
+		return NULL;
 	}
 
-	// Audit the authentication attempt
-	if (PySys_Audit(MODULE_NAME ".authenticate", "O", self->user) < 0) {
+	if (!authenticate_flags(self, silent, disallow_null_authtok, &flags)) {
+		return NULL;
+	}
+
+	return tnpam_resume_begin(self, TNPAM_OP_AUTHENTICATE, flags, deadline,
+				  timeout);
+}
+
+PyObject *
+py_tnpam_auth_resume(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		     PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"responses",
+		"timeout",
+		NULL
+	};
+	PyObject *responses = NULL;
+	PyObject *py_timeout = NULL;
+	double timeout;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$OO", kwlist,
+			      &responses,
+			      &py_timeout)) {
+		return NULL;
+	}
+
+	if (responses == NULL) {
+		PyErr_SetString(PyExc_ValueError, "responses is required");
+		return NULL;
+	}
+
+	if (!tnpam_parse_timeout(py_timeout, &timeout)) {
 		return NULL;
 	}
 
-	PYPAM_LOCK(self);
-	ret = pam_authenticate(self->hdl, flags);
-	self->last_pam_result = ret;
-	PYPAM_UNLOCK(self);
+	return tnpam_resume_continue(self, responses, timeout);
+}
+
+PyObject *
+py_tnpam_auth_abort(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		    PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"timeout",
+		NULL
+	};
+	PyObject *py_timeout = NULL;
+	double timeout;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$O", kwlist,
+			      &py_timeout)) {
+		return NULL;
+	}
 
-	if (ret != PAM_SUCCESS) {
-		if (!PyErr_Occurred()) {
-			set_pam_exc(ret, "pam_authenticate() failed");
-		}
+	if (!tnpam_parse_timeout(py_timeout, &timeout)) {
 		return NULL;
 	}
 
-	self->authenticated = B_TRUE;
-	Py_RETURN_NONE;
+	return tnpam_resume_abort(self, timeout);
 }
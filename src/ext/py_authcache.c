@@ -0,0 +1,467 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "truenas_pypam.h"
+
+/*
+ * Cache of recently verified credentials.
+ *
+ * API clients re-authenticate with the same key on every request and each
+ * attempt would otherwise run the whole PAM stack. Once enabled with
+ * set_auth_cache(), contexts and authenticate_many() calls that opt in with
+ * auth_cache=True remember a successful pam_authenticate() for ttl seconds
+ * and answer an identical attempt without calling into PAM.
+ *
+ * An attempt is identical when the service, confdir, user, ruser, rhost,
+ * PAM_DISALLOW_NULL_AUTHTOK flag and the declared conversation responses
+ * are. get_context() and set_conversation() refuse a python conversation
+ * function on opted-in contexts, and attempts of a context that has one
+ * anyway are never cached, so that is everything the stack gets to see.
+ * Neither the secret nor the names are stored: an entry is the keyed
+ * SipHash-2-4 of the service and of the user (for invalidation) and a
+ * 128-bit keyed SipHash tag over all of the above. Keys are random per
+ * process.
+ *
+ * The table has a fixed size chosen by set_auth_cache(). Entries are never
+ * extended; expired slots are reused first, otherwise the entry closest to
+ * expiry among TNPAM_AC_PROBE slots is replaced. A successful chauthtok()
+ * invalidates every entry of its user and invalidate_auth_cache() lets the
+ * application do the same, e.g. when an API key is revoked.
+ */
+
+#define TNPAM_AC_PROBE 8
+#define TNPAM_AC_DEFAULT_MAXSIZE 1024
+
+typedef struct {
+	uint64_t service_h;
+	uint64_t user_h;
+	uint64_t tag[2];
+	uint64_t expires_ns;	/* 0 if unused */
+} tnpam_ac_entry_t;
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	_Atomic bool enabled;
+	bool keys_ready;	/* set only once ac_init() got random keys */
+	uint64_t keys[3][2];	/* service/user names, tag[0], tag[1] */
+	uint64_t ttl_ns;
+	size_t maxsize;
+	tnpam_ac_entry_t *entries;
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+} ac = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while (0)
+
+/*
+ * SipHash-2-4 of len bytes at data with the 128-bit key k.
+ */
+static uint64_t
+siphash24(const uint64_t k[2], const void *data, size_t len)
+{
+	const unsigned char *in = data;
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ k[1];
+	uint64_t b = (uint64_t)len << 56;
+	uint64_t m;
+	size_t i;
+
+	for (; len >= 8; in += 8, len -= 8) {
+		m = 0;
+		for (i = 0; i < 8; i++) {
+			m |= (uint64_t)in[i] << (8 * i);
+		}
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	for (i = 0; i < len; i++) {
+		b |= (uint64_t)in[i] << (8 * i);
+	}
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint64_t
+name_hash(const char *name)
+{
+	return siphash24(ac.keys[0], name ? name : "", name ? strlen(name) : 0);
+}
+
+static void
+ac_atfork_child(void)
+{
+	pthread_mutex_init(&ac.lock, NULL);
+}
+
+static void
+ac_init(void)
+{
+	if (getrandom(ac.keys, sizeof(ac.keys), 0) != sizeof(ac.keys)) {
+		// No entropy is available this early only in broken containers.
+		// Leave the cache disabled rather than use predictable keys.
+		return;
+	}
+
+	pthread_atfork(NULL, NULL, ac_atfork_child);
+	ac.keys_ready = true;
+}
+
+/*
+ * Set up the cache identity of a context or batch for service and confdir.
+ * May be called without the GIL.
+ */
+void
+tnpam_authcache_scope_init(tnpam_authcache_scope_t *scope, const char *service,
+			   const char *confdir)
+{
+	uint64_t h[2];
+
+	pthread_once(&ac.once, ac_init);
+
+	h[0] = name_hash(service);
+	h[1] = name_hash(confdir);
+
+	scope->enabled = B_TRUE;
+	scope->service_h = h[0];
+	scope->scope_h = siphash24(ac.keys[0], h, sizeof(h));
+}
+
+/*
+ * Append an optional string to buf, prefixed by whether it is absent (0),
+ * present without text (1) or has text (2).
+ */
+static size_t
+key_append(char *buf, size_t off, bool present, const char *str, size_t len)
+{
+	buf[off++] = !present ? 0 : (str == NULL) ? 1 : 2;
+	if (present && (str != NULL)) {
+		memcpy(buf + off, str, len);
+		off += len;
+		buf[off++] = '\0';
+	}
+	return off;
+}
+
+/*
+ * Compute the cache key of an attempt with the pam_authenticate() flags.
+ * Returns false if the cache is disabled (or out of memory), in which case
+ * the attempt is not cacheable. May be called without the GIL.
+ */
+bool
+tnpam_authcache_key(const tnpam_authcache_scope_t *scope, const char *user,
+		    const char *ruser, const char *rhost,
+		    const tnpam_responder_t *responder, int flags,
+		    tnpam_authcache_key_t *key)
+{
+	const char *strs[3] = { user, ruser, rhost };
+	size_t lens[3], size = sizeof(uint64_t) + 1, off, i;
+	char *buf;
+
+	if (!scope->enabled ||
+	    !atomic_load_explicit(&ac.enabled, memory_order_relaxed)) {
+		return false;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(strs); i++) {
+		lens[i] = (strs[i] != NULL) ? strlen(strs[i]) : 0;
+		size += lens[i] + 2;
+	}
+	for (i = 0; i < ARRAY_SIZE(responder->styles); i++) {
+		size += responder->styles[i].len + 2;
+	}
+
+	// Holds the secret, so it is zeroed on free
+	buf = tnpam_secret_alloc(size);
+	if (buf == NULL) {
+		return false;
+	}
+
+	memcpy(buf, &scope->scope_h, sizeof(uint64_t));
+	off = sizeof(uint64_t);
+	buf[off++] = (flags & PAM_DISALLOW_NULL_AUTHTOK) != 0;
+	for (i = 0; i < ARRAY_SIZE(strs); i++) {
+		off = key_append(buf, off, strs[i] != NULL, strs[i], lens[i]);
+	}
+	for (i = 0; i < ARRAY_SIZE(responder->styles); i++) {
+		const tnpam_resp_entry_t *entry = &responder->styles[i];
+
+		off = key_append(buf, off, entry->present, entry->value,
+				 entry->len);
+	}
+
+	key->service_h = scope->service_h;
+	key->user_h = name_hash(user);
+	key->tag[0] = siphash24(ac.keys[1], buf, off);
+	key->tag[1] = siphash24(ac.keys[2], buf, off);
+
+	tnpam_secret_free(buf, size);
+	return true;
+}
+
+static bool
+entry_matches(const tnpam_ac_entry_t *e, const tnpam_authcache_key_t *key)
+{
+	// Compare the tag in constant time
+	uint64_t diff = (e->tag[0] ^ key->tag[0]) | (e->tag[1] ^ key->tag[1]);
+
+	return (e->service_h == key->service_h) && (e->user_h == key->user_h) &&
+	       (diff == 0);
+}
+
+static size_t
+entry_start(const tnpam_authcache_key_t *key)
+{
+	return (size_t)((key->service_h ^ key->user_h) % ac.maxsize);
+}
+
+/*
+ * Whether an unexpired entry for key exists. May be called without the GIL.
+ */
+bool
+tnpam_authcache_lookup(const tnpam_authcache_key_t *key)
+{
+	uint64_t now = tnpam_now_ns();
+	bool hit = false;
+	size_t start, i;
+
+	pthread_mutex_lock(&ac.lock);
+	if (ac.entries != NULL) {
+		start = entry_start(key);
+		for (i = 0; (i < TNPAM_AC_PROBE) && (i < ac.maxsize); i++) {
+			tnpam_ac_entry_t *e = &ac.entries[(start + i) % ac.maxsize];
+
+			if ((e->expires_ns > now) && entry_matches(e, key)) {
+				hit = true;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&ac.lock);
+
+	atomic_fetch_add_explicit(hit ? &ac.hits : &ac.misses, 1,
+				  memory_order_relaxed);
+	return hit;
+}
+
+/*
+ * Remember a successful authentication for key. May be called without the
+ * GIL.
+ */
+void
+tnpam_authcache_store(const tnpam_authcache_key_t *key)
+{
+	uint64_t now = tnpam_now_ns();
+	tnpam_ac_entry_t *victim = NULL;
+	size_t start, i;
+
+	pthread_mutex_lock(&ac.lock);
+	if ((ac.entries == NULL) || (ac.ttl_ns == 0)) {
+		goto out;
+	}
+
+	start = entry_start(key);
+	for (i = 0; (i < TNPAM_AC_PROBE) && (i < ac.maxsize); i++) {
+		tnpam_ac_entry_t *e = &ac.entries[(start + i) % ac.maxsize];
+
+		if ((e->expires_ns <= now) || entry_matches(e, key)) {
+			victim = e;
+			break;
+		}
+
+		if ((victim == NULL) || (e->expires_ns < victim->expires_ns)) {
+			victim = e;
+		}
+	}
+
+	victim->service_h = key->service_h;
+	victim->user_h = key->user_h;
+	victim->tag[0] = key->tag[0];
+	victim->tag[1] = key->tag[1];
+	victim->expires_ns = now + ac.ttl_ns;
+out:
+	pthread_mutex_unlock(&ac.lock);
+}
+
+/*
+ * Drop entries of user (NULL for every user) and service (NULL for every
+ * service). Returns the number of unexpired entries dropped. May be called
+ * without the GIL.
+ */
+size_t
+tnpam_authcache_invalidate(const char *user, const char *service)
+{
+	uint64_t now = tnpam_now_ns();
+	uint64_t user_h = 0, service_h = 0;
+	size_t count = 0, i;
+
+	if (atomic_load(&ac.enabled)) {
+		user_h = name_hash(user);
+		service_h = name_hash(service);
+	}
+
+	pthread_mutex_lock(&ac.lock);
+	for (i = 0; (ac.entries != NULL) && (i < ac.maxsize); i++) {
+		tnpam_ac_entry_t *e = &ac.entries[i];
+
+		if (((user != NULL) && (e->user_h != user_h)) ||
+		    ((service != NULL) && (e->service_h != service_h))) {
+			continue;
+		}
+
+		if (e->expires_ns > now) {
+			count++;
+		}
+		memset(e, 0, sizeof(*e));
+	}
+	pthread_mutex_unlock(&ac.lock);
+
+	return count;
+}
+
+PyObject *
+py_tnpam_set_auth_cache(PyObject *self, PyObject *const *args,
+			Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"ttl",
+		"maxsize",
+		NULL
+	};
+	PyObject *py_ttl = NULL;
+	Py_ssize_t maxsize = TNPAM_AC_DEFAULT_MAXSIZE;
+	tnpam_ac_entry_t *entries = NULL, *old = NULL;
+	double ttl = 0;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$On", kwlist,
+			      &py_ttl, &maxsize)) {
+		return NULL;
+	}
+
+	if (py_ttl != NULL) {
+		ttl = PyFloat_AsDouble(py_ttl);
+		if ((ttl == -1.0) && PyErr_Occurred()) {
+			return NULL;
+		}
+	}
+
+	if (!isfinite(ttl) || (ttl < 0)) {
+		PyErr_SetString(PyExc_ValueError,
+				"ttl must be a non-negative number");
+		return NULL;
+	}
+
+	if (maxsize < 1) {
+		PyErr_SetString(PyExc_ValueError,
+				"maxsize must be a positive integer");
+		return NULL;
+	}
+
+	pthread_once(&ac.once, ac_init);
+	if ((ttl > 0) && !ac.keys_ready) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"no random keys are available for the "
+				"authentication cache");
+		return NULL;
+	}
+
+	if (ttl > 0) {
+		entries = PyMem_RawCalloc((size_t)maxsize, sizeof(tnpam_ac_entry_t));
+		if (entries == NULL) {
+			return PyErr_NoMemory();
+		}
+	}
+
+	// Existing entries were verified under the old ttl, so drop them
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&ac.lock);
+	old = ac.entries;
+	ac.entries = entries;
+	ac.ttl_ns = (uint64_t)(ttl * 1e9);
+	ac.maxsize = (size_t)maxsize;
+	atomic_store(&ac.enabled, entries != NULL);
+	pthread_mutex_unlock(&ac.lock);
+	Py_END_ALLOW_THREADS
+
+	PyMem_RawFree(old);
+	Py_RETURN_NONE;
+}
+
+PyObject *
+py_tnpam_get_auth_cache(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	uint64_t now = tnpam_now_ns();
+	size_t maxsize, entries = 0, i;
+	double ttl;
+
+	pthread_mutex_lock(&ac.lock);
+	ttl = (double)ac.ttl_ns / 1e9;
+	maxsize = (ac.entries != NULL) ? ac.maxsize : 0;
+	for (i = 0; i < maxsize; i++) {
+		if (ac.entries[i].expires_ns > now) {
+			entries++;
+		}
+	}
+	pthread_mutex_unlock(&ac.lock);
+
+	return Py_BuildValue(
+		"{s:d,s:n,s:n,s:K,s:K}",
+		"ttl", ttl,
+		"maxsize", (Py_ssize_t)maxsize,
+		"entries", (Py_ssize_t)entries,
+		"hits", (unsigned long long)atomic_load(&ac.hits),
+		"misses", (unsigned long long)atomic_load(&ac.misses));
+}
+
+PyObject *
+py_tnpam_invalidate_auth_cache(PyObject *self, PyObject *const *args,
+			       Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"user",
+		"service_name",
+		NULL
+	};
+	const char *user = NULL;
+	const char *service = NULL;
+	size_t count;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$zz", kwlist,
+			      &user, &service)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	count = tnpam_authcache_invalidate(user, service);
+	Py_END_ALLOW_THREADS
+
+	return PyLong_FromSize_t(count);
+}
@@ -0,0 +1,451 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "truenas_pypam.h"
+
+/*
+ * authenticate_many(): validate a batch of credentials on native threads.
+ *
+ * Each credential gets its own PAM transaction (pam_start_confdir() /
+ * pam_authenticate() / pam_end()) with a C conversation function that
+ * answers password prompts with the secret and echoed prompts with the
+ * username. The input is copied before the GIL is released and the only
+ * python work afterwards is building the tuple of results. With a lock
+ * domain each whole transaction runs with the domain lock held.
+ *
+ * With auth_cache=True an item is looked up in the credential cache with the
+ * responses the conversation function would give before any PAM call.
+ */
+
+#define TNPAM_BATCH_DEFAULT_CONCURRENCY 8
+
+typedef struct {
+	char *user;
+	char *secret;
+	size_t secret_len;
+	char *rhost;
+	pamcode_t result;
+} tnpam_batch_item_t;
+
+typedef struct {
+	const char *service;
+	const char *confdir;
+	int flags;
+	tnpam_lock_domain_t *lock_domain;
+	tnpam_authcache_scope_t auth_cache;
+	tnpam_batch_item_t *items;
+	size_t count;
+	atomic_size_t next;	/* index of next item to process */
+} tnpam_batch_t;
+
+static int
+batch_conv(int num_msg, const struct pam_message **msg,
+	   struct pam_response **resp, void *appdata_ptr)
+{
+	tnpam_batch_item_t *item = (tnpam_batch_item_t *)appdata_ptr;
+	struct pam_response *reply = NULL;
+	int i;
+
+	// Must use regular malloc as the PAM stack frees responses
+	reply = calloc((num_msg > 0) ? (size_t)num_msg : 1,
+		       sizeof(struct pam_response));
+	if (reply == NULL) {
+		return PAM_BUF_ERR;
+	}
+
+	for (i = 0; i < num_msg; i++) {
+		const char *value = NULL;
+
+		switch (msg[i]->msg_style) {
+		case PAM_PROMPT_ECHO_OFF:
+			value = item->secret;
+			break;
+		case PAM_PROMPT_ECHO_ON:
+			value = item->user;
+			break;
+		case PAM_ERROR_MSG:
+		case PAM_TEXT_INFO:
+			continue;
+		default:
+			goto fail;
+		}
+
+		reply[i].resp = strdup(value);
+		if (reply[i].resp == NULL) {
+			goto fail;
+		}
+	}
+
+	*resp = reply;
+	return PAM_SUCCESS;
+
+fail:
+	while (i--) {
+		if (reply[i].resp != NULL) {
+			explicit_bzero(reply[i].resp, strlen(reply[i].resp));
+			free(reply[i].resp);
+		}
+	}
+	free(reply);
+	return PAM_CONV_ERR;
+}
+
+/*
+ * Compute the credential cache key of an item from the responses given by
+ * batch_conv(). Returns false if the batch doesn't use the cache.
+ */
+static bool
+batch_cache_key(tnpam_batch_t *batch, tnpam_batch_item_t *item,
+		tnpam_authcache_key_t *key)
+{
+	tnpam_responder_t responses = { 0 };
+
+	responses.styles[PAM_PROMPT_ECHO_OFF] = (tnpam_resp_entry_t) {
+		B_TRUE, item->secret, item->secret_len
+	};
+	responses.styles[PAM_PROMPT_ECHO_ON] = (tnpam_resp_entry_t) {
+		B_TRUE, item->user, strlen(item->user)
+	};
+
+	return tnpam_authcache_key(&batch->auth_cache, item->user, NULL,
+				   item->rhost, &responses, batch->flags, key);
+}
+
+static pamcode_t
+batch_authenticate(tnpam_batch_t *batch, tnpam_batch_item_t *item)
+{
+	struct pam_conv conv = { .conv = batch_conv, .appdata_ptr = item };
+	pam_handle_t *hdl = NULL;
+	tnpam_authcache_key_t key;
+	bool cacheable;
+	pamcode_t ret;
+	uint64_t t0, t1;
+
+	t0 = tnpam_now_ns();
+	cacheable = batch_cache_key(batch, item, &key);
+	if (cacheable && tnpam_authcache_lookup(&key)) {
+		ret = PAM_SUCCESS;
+		goto done;
+	}
+
+	if (!tnpam_ratelimit_admit(item->rhost, item->user)) {
+		ret = PAM_MAXTRIES;
+		goto done;
+	}
+
+	TNPAM_DOMAIN_LOCK(batch)
+	ret = pam_start_confdir(batch->service, item->user, &conv,
+				batch->confdir, &hdl);
+	tnpam_stats_record(NULL, TNPAM_STAT_START, tnpam_now_ns() - t0);
+	if (ret != PAM_SUCCESS) {
+		if (hdl != NULL) {
+			pam_end(hdl, ret);
+		}
+		goto out;
+	}
+
+	ret = pam_set_item(hdl, PAM_RHOST, item->rhost);
+	if (ret == PAM_SUCCESS) {
+		t1 = tnpam_now_ns();
+		ret = pam_authenticate(hdl, batch->flags);
+		tnpam_stats_record(NULL, TNPAM_STAT_AUTHENTICATE,
+				   tnpam_now_ns() - t1);
+	}
+
+	pam_end(hdl, ret);
+	if (cacheable && (ret == PAM_SUCCESS)) {
+		tnpam_authcache_store(&key);
+	}
+out:
+	TNPAM_DOMAIN_UNLOCK(batch)
+done:
+	if (TNPAM_PROBE_ENABLED(batch__return)) {
+		TNPAM_PROBE(batch__return, batch->service, item->user,
+			    item->rhost, ret, tnpam_now_ns() - t0);
+	}
+	tnpam_events_record(TNPAM_OP_AUTHENTICATE, ret, batch->service,
+			    item->user, item->rhost, tnpam_now_ns() - t0);
+	return ret;
+}
+
+static void *
+batch_worker(void *arg)
+{
+	tnpam_batch_t *batch = (tnpam_batch_t *)arg;
+	size_t idx;
+
+	while ((idx = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+		batch->items[idx].result = batch_authenticate(batch,
+							      &batch->items[idx]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run the batch on up to concurrency threads including the calling thread.
+ * Called without the GIL. Failure to create extra threads only reduces
+ * concurrency.
+ */
+static void
+batch_run(tnpam_batch_t *batch, size_t concurrency)
+{
+	pthread_t *threads = NULL;
+	size_t nthreads = 0, i;
+
+	if (concurrency > batch->count) {
+		concurrency = batch->count;
+	}
+
+	if (concurrency > 1) {
+		threads = calloc(concurrency - 1, sizeof(pthread_t));
+	}
+
+	if (threads != NULL) {
+		for (i = 0; i < concurrency - 1; i++) {
+			if (pthread_create(&threads[i], NULL, batch_worker, batch) != 0) {
+				break;
+			}
+			nthreads++;
+		}
+	}
+
+	batch_worker(batch);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+}
+
+static void
+batch_items_free(tnpam_batch_item_t *items, size_t count)
+{
+	size_t i;
+
+	if (items == NULL) {
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		tnpam_secret_free(items[i].secret, items[i].secret_len + 1);
+		PyMem_RawFree(items[i].user);
+		PyMem_RawFree(items[i].rhost);
+	}
+
+	PyMem_RawFree(items);
+}
+
+/* Copy a str value for use without the GIL */
+static char *
+batch_copy_str(PyObject *value, const char *what)
+{
+	const char *data = NULL;
+	Py_ssize_t len;
+	char *out = NULL;
+
+	if (PyUnicode_Check(value)) {
+		data = PyUnicode_AsUTF8AndSize(value, &len);
+		if (data == NULL) {
+			return NULL;
+		}
+	} else {
+		PyErr_Format(PyExc_TypeError, "%s: %s must be a string",
+			     Py_TYPE(value)->tp_name, what);
+		return NULL;
+	}
+
+	if (memchr(data, '\0', len) != NULL) {
+		PyErr_Format(PyExc_ValueError,
+			     "%s may not contain embedded null characters", what);
+		return NULL;
+	}
+
+	out = PyMem_RawMalloc(len + 1);
+	if (out == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	memcpy(out, data, len);
+	out[len] = '\0';
+	return out;
+}
+
+/*
+ * Parse one (user, secret[, rhost]) entry and emit the audit event for it.
+ */
+static bool
+batch_parse_item(PyObject *entry, tnpam_batch_item_t *item)
+{
+	PyObject *user = NULL, *secret = NULL, *rhost = Py_None;
+
+	if (!PyTuple_Check(entry) ||
+	    !PyArg_ParseTuple(entry, "OO|O", &user, &secret, &rhost)) {
+		if (!PyErr_Occurred() || PyErr_ExceptionMatches(PyExc_TypeError)) {
+			PyErr_Clear();
+			PyErr_SetString(PyExc_TypeError,
+					"credentials must be (user, secret) or "
+					"(user, secret, rhost) tuples");
+		}
+		return false;
+	}
+
+	if (PySys_Audit(MODULE_NAME ".authenticate", "O", user) < 0) {
+		return false;
+	}
+
+	item->user = batch_copy_str(user, "user");
+	if (item->user == NULL) {
+		return false;
+	}
+
+	item->secret = tnpam_secret_copy(secret, "secret", &item->secret_len);
+	if (item->secret == NULL) {
+		return false;
+	}
+
+	if (rhost != Py_None) {
+		item->rhost = batch_copy_str(rhost, "rhost");
+		if (item->rhost == NULL) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static PyObject *
+batch_results(tnpam_state_t *state, tnpam_batch_t *batch)
+{
+	PyObject *out = NULL;
+	size_t i;
+
+	out = PyTuple_New(batch->count);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		pamcode_t code = batch->items[i].result;
+		PyObject *member;
+
+		if ((code >= 0) && (code < _PAM_RETURN_VALUES)) {
+			member = tnpam_enum_member(state, TNPAM_ENUM_PAM_CODE,
+						   code);
+		} else {
+			member = PyLong_FromLong(code);
+		}
+		if (member == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		PyTuple_SET_ITEM(out, i, member);
+	}
+
+	return out;
+}
+
+PyObject *
+py_tnpam_authenticate_many(PyObject *self, PyObject *const *args,
+			   Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"service_name",
+		"credentials",
+		"concurrency",
+		"confdir",
+		"silent",
+		"disallow_null_authtok",
+		"lock_policy",
+		"lock_group",
+		"auth_cache",
+		NULL
+	};
+	tnpam_batch_t batch = { 0 };
+	tnpam_state_t *state = py_get_pam_state(self);
+	const char *service = NULL;
+	PyObject *credentials = NULL;
+	PyObject *lock_policy = NULL;
+	const char *lock_group = NULL;
+	PyObject *seq = NULL;
+	PyObject *out = NULL;
+	Py_ssize_t concurrency = TNPAM_BATCH_DEFAULT_CONCURRENCY;
+	boolean_t silent = B_FALSE;
+	boolean_t disallow_null_authtok = B_FALSE;
+	boolean_t auth_cache = B_FALSE;
+	Py_ssize_t i;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "sO|$nzppOzp", kwlist,
+			      &service,
+			      &credentials,
+			      &concurrency,
+			      &batch.confdir,
+			      &silent,
+			      &disallow_null_authtok,
+			      &lock_policy,
+			      &lock_group,
+			      &auth_cache)) {
+		return NULL;
+	}
+
+	if (concurrency < 1) {
+		PyErr_SetString(PyExc_ValueError,
+				"concurrency must be a positive integer");
+		return NULL;
+	}
+
+	if (tnpam_lock_resolve(state, service, lock_policy, lock_group,
+			       &batch.lock_domain) < 0) {
+		return NULL;
+	}
+
+	seq = PySequence_Fast(credentials, "credentials must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+
+	batch.service = service;
+	if (auth_cache) {
+		tnpam_authcache_scope_init(&batch.auth_cache, service,
+					   batch.confdir);
+	}
+	batch.count = PySequence_Fast_GET_SIZE(seq);
+	if (silent) {
+		batch.flags |= PAM_SILENT;
+	}
+	if (disallow_null_authtok) {
+		batch.flags |= PAM_DISALLOW_NULL_AUTHTOK;
+	}
+
+	batch.items = PyMem_RawCalloc(batch.count ? batch.count : 1,
+				      sizeof(tnpam_batch_item_t));
+	if (batch.items == NULL) {
+		PyErr_NoMemory();
+		goto cleanup;
+	}
+
+	for (i = 0; i < (Py_ssize_t)batch.count; i++) {
+		if (!batch_parse_item(PySequence_Fast_GET_ITEM(seq, i),
+				      &batch.items[i])) {
+			goto cleanup;
+		}
+	}
+
+	if (batch.count > 0) {
+		Py_BEGIN_ALLOW_THREADS
+		batch_run(&batch, (size_t)concurrency);
+		Py_END_ALLOW_THREADS
+	}
+
+	out = batch_results(state, &batch);
+
+cleanup:
+	batch_items_free(batch.items, batch.count);
+	Py_DECREF(seq);
+	return out;
+}
@@ -3,189 +3,98 @@
 #include <string.h>
 #include "truenas_pypam.h"
 
-typedef struct {
-	const char *name;
-	int value;
-} msg_style_entry_t;
-
-static const msg_style_entry_t msg_style_tbl[] = {
-	{"PAM_PROMPT_ECHO_OFF", PAM_PROMPT_ECHO_OFF},
-	{"PAM_PROMPT_ECHO_ON", PAM_PROMPT_ECHO_ON},
-	{"PAM_ERROR_MSG", PAM_ERROR_MSG},
-	{"PAM_TEXT_INFO", PAM_TEXT_INFO}
+static const tnpam_enum_entry_t msg_style_tbl[] = {
+	{PAM_PROMPT_ECHO_OFF, "PAM_PROMPT_ECHO_OFF"},
+	{PAM_PROMPT_ECHO_ON, "PAM_PROMPT_ECHO_ON"},
+	{PAM_ERROR_MSG, "PAM_ERROR_MSG"},
+	{PAM_TEXT_INFO, "PAM_TEXT_INFO"}
 };
 
-static PyObject *
-create_msg_style_enum(void)
-{
-	PyObject *enum_module = NULL;
-	PyObject *int_enum_class = NULL;
-	PyObject *enum_dict = NULL;
-	PyObject *py_enum_name = NULL;
-	PyObject *result_enum = NULL;
-	size_t i;
-
-	// Import enum module and get IntEnum class
-	enum_module = PyImport_ImportModule("enum");
-	if (enum_module == NULL) {
-		return NULL;
-	}
+const tnpam_enum_spec_t tnpam_msg_style_enum_spec = {
+	.name = "MSGStyle",
+	.entries = msg_style_tbl,
+	.count = ARRAY_SIZE(msg_style_tbl),
+};
 
-	int_enum_class = PyObject_GetAttrString(enum_module, "IntEnum");
-	Py_DECREF(enum_module);
-	if (int_enum_class == NULL) {
-		return NULL;
-	}
+PyObject *py_pam_messages_parse(tnpam_state_t *state, int num_msg,
+				const struct pam_message **msg)
+{
+	PyObject *out = NULL;
+	int i;
 
-	// Create enum dictionary
-	enum_dict = PyDict_New();
-	if (enum_dict == NULL) {
-		Py_DECREF(int_enum_class);
+	// we already assert if num_msg is negative
+	out = PyTuple_New(num_msg);
+	if (out == NULL) {
 		return NULL;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(msg_style_tbl); i++) {
-		PyObject *py_value = PyLong_FromLong(msg_style_tbl[i].value);
-		if (py_value == NULL ||
-		    PyDict_SetItemString(enum_dict, msg_style_tbl[i].name,
-					 py_value) < 0) {
-			Py_XDECREF(py_value);
-			Py_DECREF(enum_dict);
-			Py_DECREF(int_enum_class);
+	for (i = 0; i < num_msg; i++) {
+		PyObject *entry = tnpam_msg_new(state, msg[i]);
+		if (entry == NULL) {
+			Py_CLEAR(out);
 			return NULL;
 		}
-		Py_DECREF(py_value);
-	}
 
-	py_enum_name = PyUnicode_FromString(MODULE_NAME ".MSGStyle");
-	if (py_enum_name == NULL) {
-		Py_DECREF(enum_dict);
-		Py_DECREF(int_enum_class);
-		return NULL;
+		PyTuple_SET_ITEM(out, i, entry);
 	}
 
-	result_enum = PyObject_CallFunction(int_enum_class, "OO",
-					    py_enum_name, enum_dict);
-
-	Py_DECREF(py_enum_name);
-	Py_DECREF(enum_dict);
-	Py_DECREF(int_enum_class);
-
-	return result_enum;
+	return out;
 }
 
-PyStructSequence_Field struct_pam_msg [] = {
-	{"msg_style", "Message type (MSGStyle enum): PAM_PROMPT_ECHO_OFF, "
-		      "PAM_PROMPT_ECHO_ON, PAM_ERROR_MSG, or PAM_TEXT_INFO"},
-	{"msg", "Message text from PAM module"},
-	{0},
-};
-
-PyStructSequence_Desc struct_pam_msg_desc = {
-	.name = MODULE_NAME ".struct_pam_message",
-	.fields = struct_pam_msg,
-	.doc = "Python wrapper around struct pam_message from pam_conv(3).\n\n"
-	       "Represents a single message in the PAM conversation mechanism.\n"
-	       "PAM modules use this structure to communicate with applications\n"
-	       "through the conversation callback function.",
-	.n_in_sequence = 2
-};
-
-#define MSG_STYLE_IDX 0
-#define MSG_DATA_IDX 1
-
-static
-PyObject *py_pam_msg(tnpam_state_t *state, const struct pam_message *msg)
+void free_pam_resp(int num_msg, struct pam_response *reply_array)
 {
-	PyObject *entry = NULL;
-	PyObject *value = NULL;
-	PyObject *style_enum_member = NULL;
-	PyObject *style_obj = NULL;
-
-	entry = PyStructSequence_New(state->struct_pam_msg_type);
-	if (entry == NULL) {
-		return NULL;
-	}
-
-	value = PyUnicode_FromString(msg->msg);
-	if (value == NULL) {
-		Py_CLEAR(entry);
-		return NULL;
-	}
-	PyStructSequence_SET_ITEM(entry, MSG_DATA_IDX, value);
-
-	// Create MSGStyle enum member for msg_style
-	PYPAM_ASSERT((state->msg_style_enum != NULL), "MSGStyle enum not initialized");
-
-	style_obj = PyLong_FromLong(msg->msg_style);
-	if (style_obj == NULL) {
-		Py_CLEAR(entry);
-		return NULL;
-	}
-
-	style_enum_member = PyObject_CallFunctionObjArgs(state->msg_style_enum, style_obj, NULL);
-	Py_DECREF(style_obj);
+	int i;
 
-	if (style_enum_member == NULL) {
-		Py_CLEAR(entry);
-		return NULL;
+	for (i = 0; i < num_msg; i++) {
+		if (reply_array[i].resp != NULL) {
+			explicit_bzero(reply_array[i].resp,
+				       strlen(reply_array[i].resp));
+		}
+		free(reply_array[i].resp);
 	}
-	PyStructSequence_SET_ITEM(entry, MSG_STYLE_IDX, style_enum_member);
 
-	return entry;
+	free(reply_array);
 }
 
-static
-PyObject *py_pam_messages_parse(int num_msg, const struct pam_message **msg)
+/*
+ * Copy one response item (str or bytes-like object) into a NUL-terminated
+ * string allocated with malloc() for the PAM stack to free. The text is
+ * copied exactly once and no UTF-8 encoding is cached in str items.
+ */
+static char *
+resp_item_copy(PyObject *item)
 {
-	PyObject *out = NULL;
-	tnpam_state_t *state = NULL;
-	int i;
-	PyObject *msgs = NULL;
+	tnpam_secret_view_t view;
+	char *out = NULL;
 
-	state = py_get_pam_state(NULL);
-	if (state == NULL) {
+	if (!tnpam_secret_check(item)) {
+		PyErr_Format(PyExc_TypeError,
+			     "%s: response items must be str, a bytes-like "
+			     "object or None", Py_TYPE(item)->tp_name);
 		return NULL;
 	}
 
-	msgs = PyList_New(0);
-	if (msgs == NULL) {
+	if (!tnpam_secret_view(item, &view)) {
 		return NULL;
 	}
 
-	// we already assert if num_msg is negative
-	for (i = 0; i < num_msg; i++) {
-		PyObject *entry = NULL;
-		int ret;
-
-		entry = py_pam_msg(state, msg[i]);
-		if (entry == NULL) {
-			Py_CLEAR(msgs);
-			return NULL;
-		}
-
-		ret = PyList_Append(msgs, entry);
-		Py_CLEAR(entry);
-		if (ret != 0) {
-			Py_CLEAR(msgs);
-			return NULL;
-		}
+	if (memchr(view.data, '\0', view.len) != NULL) {
+		PyErr_SetString(PyExc_ValueError, "embedded null character");
+		goto out;
 	}
-	out = PyList_AsTuple(msgs);
-	Py_CLEAR(msgs);
-	return out;
-}
 
-static
-void free_pam_resp(int num_msg, struct pam_response *reply_array)
-{
-	int i;
-
-	for (i = 0; i < num_msg; i++) {
-		free(reply_array[i].resp);
+	out = malloc(view.len + 1);
+	if (out == NULL) {
+		PyErr_SetString(PyExc_MemoryError, "malloc() failed");
+		goto out;
 	}
 
-	free(reply_array);
+	memcpy(out, view.data, view.len);
+	out[view.len] = '\0';
+
+out:
+	tnpam_secret_view_release(&view);
+	return out;
 }
 
 /*
@@ -193,18 +102,16 @@ void free_pam_resp(int num_msg, struct pam_response *reply_array)
  * and converts it into an array of struct pam_response responses from the application
  * to the PAM stack.
  */
-static
 bool parse_py_pam_resp(int num_msg, struct pam_response **resp, PyObject *pyresp)
 {
 	struct pam_response *reply = NULL;
 	PyObject *iterator = NULL;
 	PyObject *item = NULL;
-	const char *rval;
 	int i = 0;
 
 	// We should have some sort of iterable from the python callback
-	// The iterable should contain either None type (for NULL response)
-	// or strings.
+	// The iterable should contain either None type (for NULL response),
+	// strings or bytes-like objects.
 	iterator = PyObject_GetIter(pyresp);
 	if (iterator == NULL) {
 		// We expected an iterable and didn't get it. Python exception
@@ -238,19 +145,9 @@ bool parse_py_pam_resp(int num_msg, struct pam_response **resp, PyObject *pyresp
 		// Py_None will be treated as msg == NULL which is already set
 		// since we used calloc to allocate
 		if (item != Py_None) {
-			rval = PyUnicode_AsUTF8(item);
-			if (rval == NULL) {
-				// Exception already est
-				free_pam_resp(num_msg, reply);
-				Py_DECREF(item);
-				Py_DECREF(iterator);
-				return false;
-			}
-
-			reply[i].resp = strdup(rval);
+			reply[i].resp = resp_item_copy(item);
 			if (reply[i].resp == NULL) {
-				PyErr_SetString(PyExc_MemoryError,
-						"strdup() failed");
+				// Exception already set
 				free_pam_resp(num_msg, reply);
 				Py_DECREF(item);
 				Py_DECREF(iterator);
@@ -272,7 +169,7 @@ bool parse_py_pam_resp(int num_msg, struct pam_response **resp, PyObject *pyresp
 		return false;
 	}
 
-	// PAM expects one response per input message. We'll hope that library
+	tnpam_mem_count_resp(num_msg, reply);
 	*resp = reply;
 	return true;
 }
@@ -288,21 +185,61 @@ bool parse_py_pam_resp(int num_msg, struct pam_response **resp, PyObject *pyresp
  *
  * On error we return PAM_CONV_ERR, set an exception, and hope the module(s) pass back up to
  * caller.
+ *
+ * The time spent in the python callback (if it was called) is returned in
+ * callback_ns.
  */
-int truenas_pam_conv(int num_msg, const struct pam_message **msg,
-		     struct pam_response **resp, void *appdata_ptr)
+static int
+conv_round(int num_msg, const struct pam_message **msg,
+	   struct pam_response **resp, void *appdata_ptr,
+	   uint64_t *callback_ns)
 {
 	tnpam_ctx_t *ctx = (tnpam_ctx_t *)appdata_ptr;
 	PyObject *pymsg = NULL;
 	PyObject *pyresp = NULL;
+	PyObject *callback_fn = NULL;
+	PyObject *private_data = NULL;
 	int retval = PAM_CONV_ERR;
+	uint64_t t0;
 
 	PYPAM_ASSERT((ctx != NULL), "Unexpected NULL appdata_ptr");
 	PYPAM_ASSERT((num_msg >= 0), "Unexpected negative value for num_msg");
+
+	// Nobody is waiting for the answer once the deadline of the operation
+	// has passed
+	if (tnpam_deadline_passed(ctx->deadline_ns)) {
+		ctx->deadline_hit = B_TRUE;
+		return PAM_CONV_ERR;
+	}
+
+	// Resumable operations (auth_begin) hand the messages back to the
+	// caller instead of calling into python. This thread has no python
+	// thread state.
+	if (tnpam_resume_current(ctx)) {
+		return tnpam_resume_conv(ctx, num_msg, msg, resp);
+	}
+
+	// Declarative responses are answered without the GIL. Conversations
+	// containing a prompt without a declared response go to the callback.
+	if (ctx->conv_data.responder != NULL) {
+		retval = tnpam_responder_conv(ctx, num_msg, msg, resp);
+		if (retval != TNPAM_CONV_FALLBACK) {
+			return retval;
+		}
+
+		retval = PAM_CONV_ERR;
+		if (ctx->conv_data.callback_fn == NULL) {
+			return retval;
+		}
+	}
+
 	PYPAM_ASSERT((ctx->conv_data.callback_fn != NULL), "Undefined callback function");
 
-	// We need to reacquire GIL and unlock the pam context
-	PYPAM_UNLOCK(ctx);
+	// We need to reacquire GIL. The handle lock stays held so that no other
+	// thread can enter the PAM stack with this handle until the PAM call
+	// that started the conversation returns. Threads waiting for it have
+	// released the GIL (see PYPAM_LOCK) and so this can't deadlock.
+	PyEval_RestoreThread(ctx->_save);
 
 	// PAM module may be making multiple attempts but we already have errored out
 	// from a python perspective
@@ -311,20 +248,32 @@ int truenas_pam_conv(int num_msg, const struct pam_message **msg,
 		PyErr_Clear();
 	}
 
-	pymsg = py_pam_messages_parse(num_msg, msg);
-	if (pymsg == NULL) {
+	// Keep history in order with conversations answered natively
+	if (!tnpam_conv_flush_pending(ctx)) {
 		goto cleanup;
 	}
 
-	if (PyList_Append(ctx->conv_data.messages, pymsg) < 0) {
+	pymsg = py_pam_messages_parse(tnpam_ctx_state(ctx), num_msg, msg);
+	if (pymsg == NULL) {
 		goto cleanup;
 	}
 
-	pyresp = PyObject_CallFunctionObjArgs(ctx->conv_data.callback_fn,
+	tnpam_history_append(ctx, pymsg);
+
+	// set_conversation() may replace the callback from another thread
+	Py_BEGIN_CRITICAL_SECTION(ctx);
+	callback_fn = Py_NewRef(ctx->conv_data.callback_fn);
+	private_data = Py_NewRef(ctx->conv_data.private_data);
+	Py_END_CRITICAL_SECTION();
+
+	t0 = tnpam_now_ns();
+	pyresp = PyObject_CallFunctionObjArgs(callback_fn,
 					      ctx,
 					      pymsg,
-					      ctx->conv_data.private_data,
+					      private_data,
 					      NULL);
+	*callback_ns = tnpam_now_ns() - t0;
+	tnpam_stats_record(&ctx->stats, TNPAM_STAT_CONVERSATION, *callback_ns);
 	if (pyresp == NULL) {
 		goto cleanup;
 	}
@@ -338,46 +287,57 @@ int truenas_pam_conv(int num_msg, const struct pam_message **msg,
 cleanup:
 	Py_CLEAR(pymsg);
 	Py_CLEAR(pyresp);
+	Py_CLEAR(callback_fn);
+	Py_CLEAR(private_data);
 
-	// Drop GIL and grab pthread lock on handle because we're going
-	// back into the wonderful world of pure C
-	PYPAM_LOCK(ctx);
+	// Drop GIL because we're going back into the wonderful world of pure C.
+	// The callback may have used methods of this context which overwrite
+	// _save, so store it again.
+	ctx->_save = PyEval_SaveThread();
 	return retval;
 }
 
-/*
- * Initialize python structs and enums related to pam conversations and store
- * references in the module state.
- */
-bool init_pam_conv_struct(PyObject *module_ref)
+int truenas_pam_conv(int num_msg, const struct pam_message **msg,
+		     struct pam_response **resp, void *appdata_ptr)
 {
-	PyTypeObject *obj = NULL;
-	tnpam_state_t *state = NULL;
-	PyObject *msg_style_enum = NULL;
-
-	state = py_get_pam_state(module_ref);
-	if (state == NULL)
-		return false;
-
-	obj = PyStructSequence_NewType(&struct_pam_msg_desc);
-	if (obj == NULL)
-		return false;
+	tnpam_ctx_t *ctx = (tnpam_ctx_t *)appdata_ptr;
+	uint64_t callback_ns = 0;
+	int retval;
 
-	state->struct_pam_msg_type = obj;
+	if (TNPAM_PROBE_ENABLED(conv__entry)) {
+		unsigned int style_mask = 0;
+		int i;
 
-	// Create and add MSGStyle IntEnum
-	msg_style_enum = create_msg_style_enum();
-	if (msg_style_enum == NULL) {
-		return false;
+		for (i = 0; i < num_msg; i++) {
+			if ((msg[i]->msg_style >= 0) && (msg[i]->msg_style < 32)) {
+				style_mask |= 1u << msg[i]->msg_style;
+			}
+		}
+		TNPAM_PROBE(conv__entry, appdata_ptr, num_msg, style_mask);
 	}
 
-	if (PyModule_AddObjectRef(module_ref, "MSGStyle", msg_style_enum) < 0) {
-		Py_DECREF(msg_style_enum);
-		return false;
+	tnpam_mem_add(TNPAM_MEM_CONVERSATIONS, 1);
+	retval = conv_round(num_msg, msg, resp, appdata_ptr, &callback_ns);
+
+	// An answer that took until after the deadline (in the callback or
+	// waiting for the GIL) is discarded so that it can't extend the
+	// operation
+	if ((retval == PAM_SUCCESS) && tnpam_deadline_passed(ctx->deadline_ns)) {
+		free_pam_resp(num_msg, *resp);
+		*resp = NULL;
+		ctx->deadline_hit = B_TRUE;
+		retval = PAM_CONV_ERR;
 	}
+	tnpam_mem_add(TNPAM_MEM_CONVERSATIONS, -1);
+	TNPAM_PROBE(conv__return, appdata_ptr, retval, callback_ns);
+	return retval;
+}
 
-	// Store reference in module state
-	state->msg_style_enum = msg_style_enum;
-
-	return true;
+/*
+ * Initialize python structs related to pam conversations and store
+ * references in the module state. MSGStyle is created on first use.
+ */
+bool init_pam_conv_struct(PyObject *module_ref)
+{
+	return init_message_type(module_ref);
 }
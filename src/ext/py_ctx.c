@@ -3,62 +3,179 @@
 #include <string.h>
 #include "truenas_pypam.h"
 
-typedef struct {
-	const char *service;
-	const char *user;
-	const char *cdir;
-	PyObject *conv_fn;
-	PyObject *private_data;
-	const char *ruser;
-	const char *rhost;
-	uint32_t fail_delay;
-} tnpam_cfg_t;
+/* get_context() arguments, shared by vectorcall and tp_init */
+static char *ctx_cfg_kwlist[] = {
+	"service_name",
+	"user",
+	"conversation_function",
+	"conversation_private_data",
+	"confdir",
+	"rhost",
+	"ruser",
+	"fail_delay",
+	"conversation_responses",
+	"message_history_size",
+	"lock_policy",
+	"lock_group",
+	"defer_fail_delay",
+	"pam_env",
+	"auth_cache",
+	"timeout",
+	NULL
+};
+
+#define CTX_CFG_FORMAT "|$ssOOsssIOnOzpOpO"
+#define CTX_CFG_ARGS(cfg) \
+	&(cfg)->service, \
+	&(cfg)->user, \
+	&(cfg)->conv_fn, \
+	&(cfg)->private_data, \
+	&(cfg)->cdir, \
+	&(cfg)->rhost, \
+	&(cfg)->ruser, \
+	&(cfg)->fail_delay, \
+	&(cfg)->conv_responses, \
+	&(cfg)->history_size, \
+	&(cfg)->lock_policy, \
+	&(cfg)->lock_group, \
+	&(cfg)->defer_fail_delay, \
+	&(cfg)->pam_env, \
+	&(cfg)->auth_cache, \
+	&(cfg)->timeout
+
+#define CTX_CFG_DEFAULTS (tnpam_cfg_t) { \
+	.service = "login", \
+	.history_size = TNPAM_MESSAGE_HISTORY_DEFAULT, \
+}
 
 static int
-py_tnpam_ctx_init(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+ctx_cfg_validate(tnpam_cfg_t *cfg)
 {
-	static char *kwlist[] = {
-		"service_name",
-		"user",
-		"conversation_function",
-		"conversation_private_data",
-		"confdir",
-		"rhost",
-		"ruser",
-		"fail_delay",
-		NULL
-	};
-	tnpam_cfg_t cfg = { .service = "login", };
-	pamcode_t ret, err = 0;
-	const char *msg = NULL;
-
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$ssOOsssI", kwlist,
-					 &cfg.service,
-					 &cfg.user,
-					 &cfg.conv_fn,
-					 &cfg.private_data,
-					 &cfg.cdir,
-					 &cfg.rhost,
-					 &cfg.ruser,
-					 &cfg.fail_delay)) {
+	if (cfg->user == NULL) {
+		PyErr_SetString(PyExc_ValueError, "user is required");
 		return -1;
 	}
 
-	if (cfg.user == NULL) {
-		PyErr_SetString(PyExc_ValueError, "user is required");
-		return -1;
+	if (cfg->conv_responses == Py_None) {
+		cfg->conv_responses = NULL;
 	}
 
-	if (cfg.conv_fn == NULL) {
+	if (cfg->pam_env == Py_None) {
+		cfg->pam_env = NULL;
+	}
+
+	if ((cfg->conv_fn == NULL) && (cfg->conv_responses == NULL)) {
 		PyErr_SetString(PyExc_ValueError, "conversation_function is required");
 		return -1;
 	}
 
-	if (!PyCallable_Check(cfg.conv_fn)) {
+	if ((cfg->conv_fn != NULL) && !PyCallable_Check(cfg->conv_fn)) {
 		PyErr_SetString(PyExc_TypeError, "conversation_function must be callable");
 		return -1;
 	}
 
+	// Only the responses are known to the credential cache, a callback
+	// could answer anything
+	if (cfg->auth_cache &&
+	    ((cfg->conv_fn != NULL) || (cfg->conv_responses == NULL))) {
+		PyErr_SetString(PyExc_ValueError,
+				"auth_cache requires conversation_responses "
+				"without a conversation_function");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse and validate the get_context() arguments. String pointers in cfg
+ * are borrowed from the argument objects.
+ */
+int
+tnpam_ctx_parse_cfg(PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+		    tnpam_cfg_t *cfg)
+{
+	*cfg = CTX_CFG_DEFAULTS;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, CTX_CFG_FORMAT,
+			      ctx_cfg_kwlist, CTX_CFG_ARGS(cfg))) {
+		return -1;
+	}
+
+	return ctx_cfg_validate(cfg);
+}
+
+/*
+ * Same as tnpam_ctx_parse_cfg() for tp_init, which is only used when
+ * __init__() is called explicitly since the type has a vectorcall.
+ */
+static int
+ctx_parse_cfg_tuple(PyObject *args, PyObject *kwds, tnpam_cfg_t *cfg)
+{
+	*cfg = CTX_CFG_DEFAULTS;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, CTX_CFG_FORMAT,
+					 ctx_cfg_kwlist, CTX_CFG_ARGS(cfg))) {
+		return -1;
+	}
+
+	return ctx_cfg_validate(cfg);
+}
+
+/*
+ * pam_hdl_lock is recursive since the python conversation callback runs with
+ * it held and may use methods of the same context (e.g. get_item()).
+ */
+static int
+ctx_hdl_lock_init(pthread_mutex_t *lock)
+{
+	pthread_mutexattr_t attr;
+	int err;
+
+	err = pthread_mutexattr_init(&attr);
+	if (err) {
+		return err;
+	}
+
+	err = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (err == 0) {
+		err = pthread_mutex_init(lock, &attr);
+	}
+
+	pthread_mutexattr_destroy(&attr);
+	return err;
+}
+
+/*
+ * PAM_FAIL_DELAY callback of contexts created with defer_fail_delay=True.
+ * libpam calls this at the end of pam_authenticate() in place of sleeping,
+ * with the randomized delay requested by the application and modules.
+ * Runs with pam_hdl_lock held and without the GIL.
+ */
+static void
+ctx_fail_delay_cb(int retval, unsigned usec_delay, void *appdata_ptr)
+{
+	tnpam_ctx_t *self = (tnpam_ctx_t *)appdata_ptr;
+
+	atomic_store_explicit(&self->fail_delay_usec,
+			      (retval == PAM_SUCCESS) ? 0 : usec_delay,
+			      memory_order_relaxed);
+}
+
+/*
+ * Initialize the context from parsed arguments. If cfg->pool is set then a
+ * warmed handle is taken from the pool when available instead of starting
+ * a new PAM transaction.
+ */
+int
+tnpam_ctx_setup(tnpam_ctx_t *self, const tnpam_cfg_t *cfg)
+{
+	pam_handle_t *pooled = NULL;
+	pamcode_t ret, err = 0;
+	const char *msg = NULL;
+	Py_ssize_t env_failed = -1;
+	tnpam_env_t env = { 0 };
+
 	// truenas_pam_conv is the hard-coded C callback function that wraps around the
 	// provided python callback function in self->conv_data.callback_fn.
 	self->conv.conv = truenas_pam_conv;
@@ -68,49 +185,126 @@ py_tnpam_ctx_init(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 	// within truenas_pam_conv and also allows the *user-provided* private_data to
 	// the user-provided callback function
 	self->conv.appdata_ptr = (void *)self;  // Use borrowed reference
-	self->conv_data.callback_fn = Py_NewRef(cfg.conv_fn);
-	self->conv_data.private_data = cfg.private_data ?
-				       Py_NewRef(cfg.private_data) :
+	self->conv_data.callback_fn = Py_XNewRef(cfg->conv_fn);
+	self->conv_data.private_data = cfg->private_data ?
+				       Py_NewRef(cfg->private_data) :
 				       Py_NewRef(Py_None);
+	self->conv_data.pending_tail = &self->conv_data.pending_head;
+
+	if (cfg->conv_responses != NULL) {
+		self->conv_data.responder = tnpam_responder_new(cfg->conv_responses);
+		if (self->conv_data.responder == NULL) {
+			goto cleanup;
+		}
+	}
+
+	if (cfg->auth_cache) {
+		tnpam_authcache_scope_init(&self->auth_cache, cfg->service,
+					   cfg->cdir);
+	}
+
+	if (!tnpam_ctx_set_timeout(self, cfg->timeout)) {
+		goto cleanup;
+	}
+
+	if (tnpam_lock_resolve(tnpam_ctx_state(self), cfg->service,
+			       cfg->lock_policy, cfg->lock_group,
+			       &self->lock_domain) < 0) {
+		goto cleanup;
+	}
 
 	// history of messages received from PAM service modules.
-	self->conv_data.messages = PyList_New(0);
-	if (self->conv_data.messages == NULL) {
+	if (tnpam_history_init(&self->conv_data.messages, cfg->history_size) < 0) {
 		goto cleanup;
 	}
 
-	Py_BEGIN_ALLOW_THREADS
-	ret = pam_start_confdir(cfg.service, cfg.user, &self->conv,
-				cfg.cdir, &self->hdl);
+	// Converted up front so that the environment can be applied along with
+	// the PAM items without taking the GIL again.
+	if ((cfg->pam_env != NULL) && !tnpam_env_prepare(cfg->pam_env, &env)) {
+		goto cleanup;
+	}
 
-	if (ret != PAM_SUCCESS) {
-		msg = "pam_start_confdir() failed";
-	} else if ((ret = pam_set_item(self->hdl, PAM_RUSER, cfg.ruser)) != PAM_SUCCESS) {
-		msg = "pam_set_item() failed for PAM_RUSER";
-	} else if ((ret = pam_set_item(self->hdl, PAM_RHOST, cfg.rhost)) != PAM_SUCCESS) {
-		msg = "pam_set_item() failed for PAM_HOST";
-	} else if (cfg.fail_delay &&
-		   ((ret = pam_fail_delay(self->hdl, cfg.fail_delay) != PAM_SUCCESS))) {
-		msg = "pam_fail_delay() failed";
+	if (cfg->pool != NULL) {
+		pooled = tnpam_pool_take(cfg->pool, &self->hdl_bytes);
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if (pooled != NULL) {
+		// Warmed handle was reset when returned to the pool
+		self->hdl = pooled;
+		ret = pam_set_item(self->hdl, PAM_CONV, &self->conv);
+		if (ret != PAM_SUCCESS) {
+			msg = "pam_set_item() failed for PAM_CONV";
+		} else if ((ret = pam_set_item(self->hdl, PAM_USER, cfg->user)) != PAM_SUCCESS) {
+			msg = "pam_set_item() failed for PAM_USER";
+		}
 	} else {
-		err = pthread_mutex_init(&self->pam_hdl_lock, NULL);
+		uint64_t t0 = tnpam_now_ns(), elapsed;
+
+		ret = tnpam_mem_start(cfg->service, cfg->user, &self->conv,
+				      cfg->cdir, &self->hdl, &self->hdl_bytes);
+		elapsed = tnpam_now_ns() - t0;
+		tnpam_stats_record(&self->stats, TNPAM_STAT_START, elapsed);
+		TNPAM_PROBE(start__return, self, cfg->service, cfg->user, ret,
+			    elapsed);
+		if (ret != PAM_SUCCESS) {
+			msg = "pam_start_confdir() failed";
+		}
+	}
+
+	if (ret == PAM_SUCCESS) {
+		if ((ret = pam_set_item(self->hdl, PAM_RUSER, cfg->ruser)) != PAM_SUCCESS) {
+			msg = "pam_set_item() failed for PAM_RUSER";
+		} else if ((ret = pam_set_item(self->hdl, PAM_RHOST, cfg->rhost)) != PAM_SUCCESS) {
+			msg = "pam_set_item() failed for PAM_HOST";
+		} else if (cfg->fail_delay &&
+			   ((ret = pam_fail_delay(self->hdl, cfg->fail_delay) != PAM_SUCCESS))) {
+			msg = "pam_fail_delay() failed";
+		} else if (cfg->defer_fail_delay &&
+			   ((ret = pam_set_item(self->hdl, PAM_FAIL_DELAY,
+						(const void *)ctx_fail_delay_cb)) != PAM_SUCCESS)) {
+			msg = "pam_set_item() failed for PAM_FAIL_DELAY";
+		} else if ((cfg->proc_pool != NULL) &&
+			   ((ret = tnpam_proc_attach(self, cfg)) != PAM_SUCCESS)) {
+			msg = "failed to start PAM transaction in worker process";
+		} else if ((ret = tnpam_env_apply(self->hdl, &env, B_FALSE,
+						  &env_failed)) != PAM_SUCCESS) {
+			msg = NULL;
+		} else if ((err = ctx_hdl_lock_init(&self->pam_hdl_lock)) == 0) {
+			err = tnpam_resume_init(&self->resume);
+			if (err == 0) {
+				err = pthread_mutex_init(&self->conv_data.pending_lock, NULL);
+				if (err) {
+					pthread_cond_destroy(&self->resume.cv);
+					pthread_mutex_destroy(&self->resume.lock);
+				}
+			}
+			if (err) {
+				pthread_mutex_destroy(&self->pam_hdl_lock);
+			}
+		}
 	}
 	Py_END_ALLOW_THREADS
 
 	if (ret != PAM_SUCCESS) {
-		set_pam_exc(ret, msg);
+		if (env_failed >= 0) {
+			tnpam_env_set_exc(tnpam_ctx_state(self), &env, ret,
+					  env_failed);
+		} else {
+			set_pam_exc(tnpam_ctx_state(self), ret, msg);
+		}
 		goto cleanup;
 	}
 
 	if (err) {
 		PyErr_Format(PyExc_RuntimeError,
 			     "pthread_muex_init() failed for pam_hdl_lock: %s",
-			     strerror(errno));
+			     strerror(err));
 		goto cleanup;
 	}
 
 	// Store username for audit logging
-	self->user = PyUnicode_FromString(cfg.user);
+	self->user = PyUnicode_FromString(cfg->user);
 	if (self->user == NULL) {
 		goto cleanup_mutex;
 	}
@@ -121,42 +315,255 @@ py_tnpam_ctx_init(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 	// Initialize _save to NULL - it will be set by PYPAM_LOCK on first use
 	self->_save = NULL;
 
+	self->defer_fail_delay = cfg->defer_fail_delay;
+
+	// Handle is offered back to the pool on dealloc
+	self->pool = Py_XNewRef((PyObject *)cfg->pool);
+
+	// Set by tnpam_proc_attach(). Workers are kept by the process pool
+	// until its last context is gone.
+	Py_XINCREF(self->proc_pool);
+
+	// Contexts with an open session are tracked for close_all_sessions()
+	self->registry = &tnpam_ctx_state(self)->sessions;
+
+	tnpam_mem_ctx_created(self);
+
+	tnpam_env_release(&env);
 	return 0;
 
 cleanup_mutex:
 	pthread_mutex_destroy(&self->pam_hdl_lock);
+	pthread_cond_destroy(&self->resume.cv);
+	pthread_mutex_destroy(&self->resume.lock);
+	pthread_mutex_destroy(&self->conv_data.pending_lock);
 cleanup:
+	if (self->proc != NULL) {
+		// the worker may be busy with the conversation of another context
+		Py_BEGIN_ALLOW_THREADS
+		tnpam_proc_detach(self, PAM_ABORT);
+		Py_END_ALLOW_THREADS
+		self->proc_pool = NULL;
+	}
 	if (self->hdl != NULL) {
 		pam_end(self->hdl, PAM_ABORT);
 		self->hdl = NULL;
 	}
+	tnpam_responder_free(self->conv_data.responder);
+	self->conv_data.responder = NULL;
 	Py_CLEAR(self->conv_data.callback_fn);
 	Py_CLEAR(self->conv_data.private_data);
-	Py_CLEAR(self->conv_data.messages);
+	tnpam_history_clear(&self->conv_data.messages);
+	tnpam_env_release(&env);
 	return -1;
 }
 
+static int
+py_tnpam_ctx_init(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+{
+	tnpam_cfg_t cfg;
+
+	if (ctx_parse_cfg_tuple(args, kwds, &cfg) < 0) {
+		return -1;
+	}
+
+	return tnpam_ctx_setup(self, &cfg);
+}
+
+/*
+ * Vectorcall for PamContext(...) and get_context(). Avoids building an args
+ * tuple and kwargs dict for every new context.
+ */
+PyObject *
+tnpam_ctx_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+		     PyObject *kwnames)
+{
+	PyTypeObject *tp = (PyTypeObject *)type;
+	tnpam_ctx_t *ctx = NULL;
+	tnpam_cfg_t cfg;
+
+	if (tnpam_ctx_parse_cfg(args, PyVectorcall_NARGS(nargsf), kwnames,
+				&cfg) < 0) {
+		return NULL;
+	}
+
+	ctx = (tnpam_ctx_t *)tp->tp_alloc(tp, 0);
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	if (tnpam_ctx_setup(ctx, &cfg) < 0) {
+		Py_DECREF(ctx);
+		return NULL;
+	}
+
+	return (PyObject *)ctx;
+}
+
 static void
 py_tnpam_ctx_dealloc(tnpam_ctx_t *self)
 {
+	PyTypeObject *tp;
+
+	// Must happen before anything is freed since close_all_sessions() may
+	// be tearing down the session on another thread.
+	tnpam_session_forget(self);
+
+	// Must happen before pam_end() since the resume worker may still be
+	// using the handle.
+	tnpam_resume_destroy(self);
+
+	if (self->registry != NULL) {
+		tnpam_mem_ctx_destroyed(self);
+	}
+
+	if (self->proc != NULL) {
+		// The worker may be busy with the conversation of another
+		// context, which needs the GIL
+		Py_BEGIN_ALLOW_THREADS
+		tnpam_proc_detach(self, self->last_pam_result);
+		Py_END_ALLOW_THREADS
+	}
+
 	if (self->hdl != NULL) {
-		pam_end(self->hdl, self->last_pam_result);
+		if ((self->pool == NULL) || self->pool_unsafe ||
+		    !tnpam_pool_put((tnpam_pool_t *)self->pool, self->hdl,
+				    self->hdl_bytes)) {
+			if (self->lock_domain != NULL) {
+				// Module cleanup runs in pam_end() and so must be
+				// serialized with the rest of the domain.
+				Py_BEGIN_ALLOW_THREADS
+				TNPAM_DOMAIN_LOCK(self)
+				pam_end(self->hdl, self->last_pam_result);
+				TNPAM_DOMAIN_UNLOCK(self)
+				Py_END_ALLOW_THREADS
+			} else {
+				pam_end(self->hdl, self->last_pam_result);
+			}
+		}
 		self->hdl = NULL;
 	}
+	Py_CLEAR(self->pool);
+	Py_CLEAR(self->proc_pool);
 	pthread_mutex_destroy(&self->pam_hdl_lock);
+	tnpam_conv_clear_pending(self);
+	pthread_mutex_destroy(&self->conv_data.pending_lock);
+	tnpam_responder_free(self->conv_data.responder);
+	self->conv_data.responder = NULL;
+	tnpam_passwd_release(self->passwd);
+	self->passwd = NULL;
 	Py_CLEAR(self->user);
 	Py_CLEAR(self->conv_data.callback_fn);
 	Py_CLEAR(self->conv_data.private_data);
-	Py_CLEAR(self->conv_data.messages);
+	tnpam_history_clear(&self->conv_data.messages);
 	// conv.appdata_ptr is a borrowed reference, no need to clear
 
-	Py_TYPE(self)->tp_free((PyObject *)self);
+	tp = Py_TYPE(self);
+	tp->tp_free((PyObject *)self);
+	Py_DECREF(tp);
 }
 
+PyDoc_STRVAR(py_tnpam_ctx_messages__doc__,
+"messages() -> tuple\n"
+"--------------------\n\n"
+"Return a snapshot of the conversation message history.\n\n"
+"Each item is a tuple of struct_pam_message received from PAM modules in\n"
+"one conversation, oldest first. At most message_history_size\n"
+"conversations are retained (see get_context()). Use the message_history\n"
+"attribute to access the history without copying it.\n"
+);
+
+PyDoc_STRVAR(py_tnpam_ctx_message_history__doc__,
+"MessageHistory: Read-only live view of the conversation message history.\n\n"
+"Supports len(), indexing and iteration. Unlike messages() the history is\n"
+"not copied on access.\n"
+);
+
 static
 PyObject *py_tnpam_ctx_messages(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored))
 {
-	return PyList_AsTuple(self->conv_data.messages);
+	if (!tnpam_conv_flush_pending(self)) {
+		return NULL;
+	}
+
+	return tnpam_history_tuple(self);
+}
+
+PyDoc_STRVAR(py_tnpam_ctx_stats__doc__,
+"stats(*, reset=False) -> dict\n"
+"-----------------------------\n\n"
+"Return latency histograms of the PAM calls made with this context.\n\n"
+"The format is the same as truenas_pypam.stats(). pam_start is only\n"
+"recorded if the context started a new PAM transaction rather than\n"
+"taking an idle handle from a PamContextPool.\n\n"
+"Parameters\n"
+"----------\n"
+"reset : bool, optional\n"
+"    Reset the counters of this context to zero as they are read\n"
+"    (default=False).\n"
+);
+
+static PyObject *
+py_tnpam_ctx_stats(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		   PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"reset",
+		NULL
+	};
+	boolean_t reset = B_FALSE;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$p", kwlist, &reset)) {
+		return NULL;
+	}
+
+	return tnpam_stats_dict(&self->stats, reset);
+}
+
+static PyObject *
+py_tnpam_ctx_get_message_history(tnpam_ctx_t *self, void *closure)
+{
+	return tnpam_history_view_new(self);
+}
+
+PyDoc_STRVAR(py_tnpam_ctx_env__doc__,
+"PamEnv: Read-only live mapping view of the PAM environment.\n\n"
+"Looking up a variable reads it with pam_getenv(3) instead of copying the\n"
+"whole environment as env_dict() does. Iteration and len() take a\n"
+"snapshot on demand. Use set_env() and update_env() to modify it.\n"
+);
+
+static PyObject *
+py_tnpam_ctx_get_env(tnpam_ctx_t *self, void *closure)
+{
+	return tnpam_env_view_new(self);
+}
+
+PyDoc_STRVAR(py_tnpam_ctx_lock_policy__doc__,
+"LockPolicy: Lock policy serializing PAM calls on this context.\n\n"
+"Resolved when the context is created from the lock_policy argument or the\n"
+"default set with set_lock_policy().\n"
+);
+
+static PyObject *
+py_tnpam_ctx_get_lock_policy(tnpam_ctx_t *self, void *closure)
+{
+	return tnpam_lock_policy_member(tnpam_ctx_state(self), self->lock_domain);
+}
+
+PyDoc_STRVAR(py_tnpam_ctx_last_fail_delay__doc__,
+"int: Fail delay in microseconds requested by the last PAM call.\n\n"
+"Only set for contexts created with defer_fail_delay=True, in which case\n"
+"libpam does not sleep after a failed pam_authenticate(3) and the caller is\n"
+"expected to wait this long before reporting the failure. 0 if the last\n"
+"call succeeded or requested no delay.\n"
+);
+
+static PyObject *
+py_tnpam_ctx_get_last_fail_delay(tnpam_ctx_t *self, void *closure)
+{
+	return PyLong_FromUnsignedLong(atomic_load_explicit(&self->fail_delay_usec,
+							    memory_order_relaxed));
 }
 
 /* Getters and setters for PAM items */
@@ -216,12 +623,16 @@ py_tnpam_ctx_get_user(tnpam_ctx_t *self, void *closure)
 	const void *item = NULL;
 	pamcode_t ret;
 
+	if (tnpam_resume_busy(self)) {
+		return NULL;
+	}
+
 	PYPAM_LOCK(self);
 	ret = pam_get_item(self->hdl, PAM_USER, &item);
 	PYPAM_UNLOCK(self);
 
 	if (ret != PAM_SUCCESS) {
-		set_pam_exc(ret, "pam_get_item() failed for PAM_USER");
+		set_pam_exc(tnpam_ctx_state(self), ret, "pam_get_item() failed for PAM_USER");
 		return NULL;
 	}
 
@@ -253,12 +664,16 @@ py_tnpam_ctx_set_user(tnpam_ctx_t *self, PyObject *value, void *closure)
 		return -1;
 	}
 
+	if (tnpam_resume_busy(self)) {
+		return -1;
+	}
+
 	PYPAM_LOCK(self);
 	ret = pam_set_item(self->hdl, PAM_USER, str);
 	PYPAM_UNLOCK(self);
 
 	if (ret != PAM_SUCCESS) {
-		set_pam_exc(ret, "pam_set_item() failed for PAM_USER");
+		set_pam_exc(tnpam_ctx_state(self), ret, "pam_set_item() failed for PAM_USER");
 		return -1;
 	}
 
@@ -271,12 +686,16 @@ py_tnpam_ctx_get_ruser(tnpam_ctx_t *self, void *closure)
 	const void *item = NULL;
 	pamcode_t ret;
 
+	if (tnpam_resume_busy(self)) {
+		return NULL;
+	}
+
 	PYPAM_LOCK(self);
 	ret = pam_get_item(self->hdl, PAM_RUSER, &item);
 	PYPAM_UNLOCK(self);
 
 	if (ret != PAM_SUCCESS) {
-		set_pam_exc(ret, "pam_get_item() failed for PAM_RUSER");
+		set_pam_exc(tnpam_ctx_state(self), ret, "pam_get_item() failed for PAM_RUSER");
 		return NULL;
 	}
 
@@ -308,12 +727,16 @@ py_tnpam_ctx_set_ruser(tnpam_ctx_t *self, PyObject *value, void *closure)
 		return -1;
 	}
 
+	if (tnpam_resume_busy(self)) {
+		return -1;
+	}
+
 	PYPAM_LOCK(self);
 	ret = pam_set_item(self->hdl, PAM_RUSER, str);
 	PYPAM_UNLOCK(self);
 
 	if (ret != PAM_SUCCESS) {
-		set_pam_exc(ret, "pam_set_item() failed for PAM_RUSER");
+		set_pam_exc(tnpam_ctx_state(self), ret, "pam_set_item() failed for PAM_RUSER");
 		return -1;
 	}
 
@@ -326,12 +749,16 @@ py_tnpam_ctx_get_rhost(tnpam_ctx_t *self, void *closure)
 	const void *item = NULL;
 	pamcode_t ret;
 
+	if (tnpam_resume_busy(self)) {
+		return NULL;
+	}
+
 	PYPAM_LOCK(self);
 	ret = pam_get_item(self->hdl, PAM_RHOST, &item);
 	PYPAM_UNLOCK(self);
 
 	if (ret != PAM_SUCCESS) {
-		set_pam_exc(ret, "pam_get_item() failed for PAM_RHOST");
+		set_pam_exc(tnpam_ctx_state(self), ret, "pam_get_item() failed for PAM_RHOST");
 		return NULL;
 	}
 
@@ -363,12 +790,16 @@ py_tnpam_ctx_set_rhost(tnpam_ctx_t *self, PyObject *value, void *closure)
 		return -1;
 	}
 
+	if (tnpam_resume_busy(self)) {
+		return -1;
+	}
+
 	PYPAM_LOCK(self);
 	ret = pam_set_item(self->hdl, PAM_RHOST, str);
 	PYPAM_UNLOCK(self);
 
 	if (ret != PAM_SUCCESS) {
-		set_pam_exc(ret, "pam_set_item() failed for PAM_RHOST");
+		set_pam_exc(tnpam_ctx_state(self), ret, "pam_set_item() failed for PAM_RHOST");
 		return -1;
 	}
 
@@ -392,7 +823,8 @@ PyDoc_STRVAR(py_tnpam_set_conversation__doc__,
 "Raises\n"
 "------\n"
 "ValueError\n"
-"    If conversation_function is not provided\n"
+"    If conversation_function is not provided or the context was created\n"
+"    with auth_cache=True\n"
 "TypeError\n"
 "    If conversation_function is not callable\n\n"
 "Note\n"
@@ -401,7 +833,8 @@ PyDoc_STRVAR(py_tnpam_set_conversation__doc__,
 "The private data remains unchanged.\n"
 );
 static PyObject *
-py_tnpam_set_conversation(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+py_tnpam_set_conversation(tnpam_ctx_t *self, PyObject *const *args,
+			  Py_ssize_t nargs, PyObject *kwnames)
 {
 	static char *kwlist[] = {
 		"conversation_function",
@@ -410,8 +843,8 @@ py_tnpam_set_conversation(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 	PyObject *conv_fn = NULL;
 	PyObject *old_conv_fn = NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$O", kwlist,
-					 &conv_fn)) {
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$O", kwlist,
+			      &conv_fn)) {
 		return NULL;
 	}
 
@@ -425,11 +858,21 @@ py_tnpam_set_conversation(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 		return NULL;
 	}
 
+	// The answers of a callback aren't part of the credential cache key
+	if (self->auth_cache.enabled) {
+		PyErr_SetString(PyExc_ValueError,
+				"auth_cache contexts can't use a "
+				"conversation_function");
+		return NULL;
+	}
+
+	Py_BEGIN_CRITICAL_SECTION(self);
 	// Save old reference
 	old_conv_fn = self->conv_data.callback_fn;
 
 	// Set new reference
 	self->conv_data.callback_fn = Py_NewRef(conv_fn);
+	Py_END_CRITICAL_SECTION();
 
 	// Release old reference
 	Py_XDECREF(old_conv_fn);
@@ -440,34 +883,76 @@ py_tnpam_set_conversation(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 static PyMethodDef py_tnpam_ctx_methods[] = {
 	{
 		.ml_name = "authenticate",
-		.ml_meth = (PyCFunction)py_tnpam_authenticate,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_authenticate,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_authenticate__doc__,
 	},
+	{
+		.ml_name = "authenticate_async",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_authenticate_async,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_authenticate_async__doc__,
+	},
+	{
+		.ml_name = "auth_begin",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_auth_begin,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_auth_begin__doc__,
+	},
+	{
+		.ml_name = "auth_resume",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_auth_resume,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_auth_resume__doc__,
+	},
+	{
+		.ml_name = "auth_abort",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_auth_abort,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_auth_abort__doc__,
+	},
 	{
 		.ml_name = "acct_mgmt",
-		.ml_meth = (PyCFunction)py_tnpam_acct_mgmt,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_acct_mgmt,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_acct_mgmt__doc__,
 	},
+	{
+		.ml_name = "acct_mgmt_async",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_acct_mgmt_async,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_acct_mgmt_async__doc__,
+	},
 	{
 		.ml_name = "chauthtok",
-		.ml_meth = (PyCFunction)py_tnpam_chauthtok,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_chauthtok,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_chauthtok__doc__,
 	},
+	{
+		.ml_name = "chauthtok_async",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_chauthtok_async,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_chauthtok_async__doc__,
+	},
 	{
 		.ml_name = "get_env",
-		.ml_meth = (PyCFunction)py_tnpam_getenv,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_getenv,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_getenv__doc__,
 	},
 	{
 		.ml_name = "set_env",
-		.ml_meth = (PyCFunction)py_tnpam_setenv,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_setenv,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_setenv__doc__,
 	},
+	{
+		.ml_name = "update_env",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_update_env,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_update_env__doc__,
+	},
 	{
 		.ml_name = "env_dict",
 		.ml_meth = (PyCFunction)py_tnpam_envlist,
@@ -476,33 +961,76 @@ static PyMethodDef py_tnpam_ctx_methods[] = {
 	},
 	{
 		.ml_name = "setcred",
-		.ml_meth = (PyCFunction)py_tnpam_setcred,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_setcred,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_setcred__doc__,
 	},
+	{
+		.ml_name = "setcred_async",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_setcred_async,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_setcred_async__doc__,
+	},
 	{
 		.ml_name = "open_session",
-		.ml_meth = (PyCFunction)py_tnpam_open_session,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_open_session,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_open_session__doc__,
 	},
+	{
+		.ml_name = "open_session_async",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_open_session_async,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_open_session_async__doc__,
+	},
 	{
 		.ml_name = "close_session",
-		.ml_meth = (PyCFunction)py_tnpam_close_session,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_close_session,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_close_session__doc__,
 	},
+	{
+		.ml_name = "close_session_async",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_close_session_async,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_close_session_async__doc__,
+	},
+	{
+		.ml_name = "login",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_login,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_login__doc__,
+	},
 	{
 		.ml_name = "messages",
 		.ml_meth = (PyCFunction)py_tnpam_ctx_messages,
 		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_ctx_messages__doc__,
+	},
+	{
+		.ml_name = "stats",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_ctx_stats,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_ctx_stats__doc__,
 	},
 	{
 		.ml_name = "set_conversation",
-		.ml_meth = (PyCFunction)py_tnpam_set_conversation,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_set_conversation,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = py_tnpam_set_conversation__doc__,
 	},
+	{
+		.ml_name = "memory_usage",
+		.ml_meth = (PyCFunction)py_tnpam_ctx_memory_usage,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_ctx_memory_usage__doc__,
+	},
+	{
+		.ml_name = "__sizeof__",
+		.ml_meth = (PyCFunction)py_tnpam_ctx_sizeof,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_ctx_sizeof__doc__,
+	},
 	{NULL}
 };
 
@@ -528,13 +1056,46 @@ static PyGetSetDef py_tnpam_ctx_getsetters[] = {
 		.doc = py_tnpam_ctx_rhost__doc__,
 		.closure = NULL,
 	},
+	{
+		.name = "message_history",
+		.get = (getter)py_tnpam_ctx_get_message_history,
+		.doc = py_tnpam_ctx_message_history__doc__,
+		.closure = NULL,
+	},
+	{
+		.name = "env",
+		.get = (getter)py_tnpam_ctx_get_env,
+		.doc = py_tnpam_ctx_env__doc__,
+		.closure = NULL,
+	},
+	{
+		.name = "lock_policy",
+		.get = (getter)py_tnpam_ctx_get_lock_policy,
+		.doc = py_tnpam_ctx_lock_policy__doc__,
+		.closure = NULL,
+	},
+	{
+		.name = "last_fail_delay",
+		.get = (getter)py_tnpam_ctx_get_last_fail_delay,
+		.doc = py_tnpam_ctx_last_fail_delay__doc__,
+		.closure = NULL,
+	},
+	{
+		.name = "passwd",
+		.get = (getter)py_tnpam_ctx_get_passwd,
+		.doc = py_tnpam_ctx_passwd__doc__,
+		.closure = NULL,
+	},
 	{NULL}
 };
 
 PyDoc_STRVAR(PyPamCtx_Type__doc__,
-"PamContext(service_name='login', *, user, conversation_function,\n"
+"PamContext(service_name='login', *, user, conversation_function=None,\n"
 "           conversation_private_data=None, confdir=None, rhost=None,\n"
-"           ruser=None, fail_delay=0)\n"
+"           ruser=None, fail_delay=0, conversation_responses=None,\n"
+"           message_history_size=64, lock_policy=None,\n"
+"           lock_group=None, defer_fail_delay=False,\n"
+"           pam_env=None, auth_cache=False, timeout=None)\n"
 "----------------------------------------------------------------\n\n"
 "PAM context object for user authentication and session management.\n\n"
 "This object wraps a PAM handle (pam_handle_t) and provides methods for\n"
@@ -547,17 +1108,35 @@ PyDoc_STRVAR(PyPamCtx_Type__doc__,
 "detailed parameter documentation.\n"
 );
 
-PyTypeObject PyPamCtx_Type = {
-	PyVarObject_HEAD_INIT(NULL, 0)
-	.tp_name = MODULE_NAME ".PamContext",
-	.tp_doc = PyPamCtx_Type__doc__,
-	.tp_basicsize = sizeof(tnpam_ctx_t),
-	.tp_itemsize = 0,
-	.tp_flags = Py_TPFLAGS_DEFAULT,
-	.tp_new = PyType_GenericNew,
-	.tp_init = (initproc)py_tnpam_ctx_init,
-	.tp_dealloc = (destructor)py_tnpam_ctx_dealloc,
-	//.tp_repr = (reprfunc)py_tnpam_ctx_repr,
-	.tp_methods = py_tnpam_ctx_methods,
-	.tp_getset = py_tnpam_ctx_getsetters,
+static PyType_Slot py_tnpam_ctx_slots[] = {
+	{Py_tp_doc, (void *)PyPamCtx_Type__doc__},
+	{Py_tp_new, PyType_GenericNew},
+	{Py_tp_init, py_tnpam_ctx_init},
+	{Py_tp_dealloc, py_tnpam_ctx_dealloc},
+	{Py_tp_methods, py_tnpam_ctx_methods},
+	{Py_tp_getset, py_tnpam_ctx_getsetters},
+	{0, NULL}
+};
+
+static PyType_Spec py_tnpam_ctx_spec = {
+	.name = MODULE_NAME ".PamContext",
+	.basicsize = sizeof(tnpam_ctx_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = py_tnpam_ctx_slots,
 };
+
+bool init_ctx_type(PyObject *module_ref)
+{
+	tnpam_state_t *state = py_get_pam_state(module_ref);
+
+	state->ctx_type = (PyTypeObject *)PyType_FromModuleAndSpec(module_ref,
+								   &py_tnpam_ctx_spec,
+								   NULL);
+	if (state->ctx_type == NULL) {
+		return false;
+	}
+
+	// No type slot for this before python 3.14
+	state->ctx_type->tp_vectorcall = tnpam_ctx_vectorcall;
+	return true;
+}
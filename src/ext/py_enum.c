@@ -0,0 +1,382 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include <pthread.h>
+#include "truenas_pypam.h"
+
+/*
+ * IntEnum classes of the module (PAMCode, MSGStyle, CredOp, LockPolicy).
+ *
+ * Building an IntEnum through the functional API imports enum and runs a
+ * fair amount of python code, which made up most of the import time of the
+ * extension. The classes are therefore only created on first use: by the
+ * module __getattr__() for python code, and by tnpam_enum_type() or
+ * tnpam_enum_member() for C paths such as raising PAMError. Members are
+ * resolved once into tnpam_state_t.enum_members, indexed by value, so that
+ * converting a PAM return value or message style is an array lookup.
+ *
+ * As for asyncio.get_running_loop in py_async.c, a class is built without
+ * holding any lock and then published under enum_lock, keeping the first
+ * one if threads race. No python code runs while holding the lock.
+ */
+
+static pthread_mutex_t enum_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t enum_atfork_once = PTHREAD_ONCE_INIT;
+
+static const tnpam_enum_spec_t *const enum_specs[TNPAM_ENUM_COUNT] = {
+	[TNPAM_ENUM_PAM_CODE] = &tnpam_pam_code_enum_spec,
+	[TNPAM_ENUM_MSG_STYLE] = &tnpam_msg_style_enum_spec,
+	[TNPAM_ENUM_CRED_OP] = &tnpam_cred_op_enum_spec,
+	[TNPAM_ENUM_LOCK_POLICY] = &tnpam_lock_policy_enum_spec,
+};
+
+/* The lock may have been held by another thread at the time of fork() */
+static void
+enum_atfork_child(void)
+{
+	pthread_mutex_init(&enum_lock, NULL);
+}
+
+static void
+enum_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, enum_atfork_child);
+}
+
+/*
+ * Create the IntEnum class of spec and store new references to its members
+ * in members, indexed by value.
+ */
+static PyObject *
+enum_create(const tnpam_enum_spec_t *spec, PyObject **members)
+{
+	PyObject *enum_module = NULL;
+	PyObject *int_enum_class = NULL;
+	PyObject *enum_dict = NULL;
+	PyObject *py_enum_name = NULL;
+	PyObject *args = NULL;
+	PyObject *kwargs = NULL;
+	PyObject *result_enum = NULL;
+	size_t i;
+
+	enum_module = PyImport_ImportModule("enum");
+	if (enum_module == NULL) {
+		goto cleanup;
+	}
+
+	int_enum_class = PyObject_GetAttrString(enum_module, "IntEnum");
+	if (int_enum_class == NULL) {
+		goto cleanup;
+	}
+
+	enum_dict = PyDict_New();
+	if (enum_dict == NULL) {
+		goto cleanup;
+	}
+
+	for (i = 0; i < spec->count; i++) {
+		PyObject *py_value = PyLong_FromLong(spec->entries[i].value);
+		int ret;
+
+		if (py_value == NULL) {
+			goto cleanup;
+		}
+
+		ret = PyDict_SetItemString(enum_dict, spec->entries[i].name,
+					   py_value);
+		Py_DECREF(py_value);
+		if (ret < 0) {
+			goto cleanup;
+		}
+	}
+
+	py_enum_name = PyUnicode_FromFormat("%s.%s", MODULE_NAME, spec->name);
+	if (py_enum_name == NULL) {
+		goto cleanup;
+	}
+
+	args = PyTuple_Pack(2, py_enum_name, enum_dict);
+	if (args == NULL) {
+		goto cleanup;
+	}
+
+	// Otherwise __module__ is guessed from the caller's frame, which is
+	// whichever code happened to touch the enum first. Pickle relies on
+	// module and qualname to find the class again.
+	kwargs = Py_BuildValue("{s:s,s:s}", "module", MODULE_NAME,
+			       "qualname", spec->name);
+	if (kwargs == NULL) {
+		goto cleanup;
+	}
+
+	result_enum = PyObject_Call(int_enum_class, args, kwargs);
+	if (result_enum == NULL) {
+		goto cleanup;
+	}
+
+	for (i = 0; i < spec->count; i++) {
+		int value = spec->entries[i].value;
+
+		PYPAM_ASSERT(((value >= 0) && (value < TNPAM_ENUM_MAX_VALUES)),
+			     "enum value out of range");
+
+		members[value] = PyObject_GetAttrString(result_enum,
+							spec->entries[i].name);
+		if (members[value] == NULL) {
+			Py_CLEAR(result_enum);
+			goto cleanup;
+		}
+	}
+
+cleanup:
+	Py_XDECREF(kwargs);
+	Py_XDECREF(args);
+	Py_XDECREF(py_enum_name);
+	Py_XDECREF(enum_dict);
+	Py_XDECREF(int_enum_class);
+	Py_XDECREF(enum_module);
+	return result_enum;
+}
+
+/*
+ * Return a new reference to the IntEnum class, creating it on first use.
+ * GIL must be held.
+ */
+PyObject *
+tnpam_enum_type(tnpam_state_t *state, tnpam_enum_t which)
+{
+	PyObject *members[TNPAM_ENUM_MAX_VALUES] = { NULL };
+	PyObject *type = NULL;
+	PyObject *first = NULL;
+	size_t i;
+
+	pthread_once(&enum_atfork_once, enum_register_atfork);
+
+	pthread_mutex_lock(&enum_lock);
+	type = Py_XNewRef(state->enums[which]);
+	pthread_mutex_unlock(&enum_lock);
+
+	if (type != NULL) {
+		return type;
+	}
+
+	type = enum_create(enum_specs[which], members);
+	if (type == NULL) {
+		for (i = 0; i < ARRAY_SIZE(members); i++) {
+			Py_XDECREF(members[i]);
+		}
+		return NULL;
+	}
+
+	// Another thread may have done the same meanwhile, keep the first one
+	pthread_mutex_lock(&enum_lock);
+	if (state->enums[which] == NULL) {
+		state->enums[which] = Py_NewRef(type);
+		memcpy(state->enum_members[which], members, sizeof(members));
+		memset(members, 0, sizeof(members));
+	} else {
+		first = Py_NewRef(state->enums[which]);
+	}
+	pthread_mutex_unlock(&enum_lock);
+
+	if (first != NULL) {
+		for (i = 0; i < ARRAY_SIZE(members); i++) {
+			Py_XDECREF(members[i]);
+		}
+		Py_SETREF(type, first);
+	}
+
+	return type;
+}
+
+/*
+ * Return a new reference to the member of the enum for value. Values that
+ * are not members raise ValueError as calling the enum class would.
+ * GIL must be held.
+ */
+PyObject *
+tnpam_enum_member(tnpam_state_t *state, tnpam_enum_t which, int value)
+{
+	PyObject *member = NULL;
+	PyObject *type = NULL;
+	bool in_range = (value >= 0) && (value < TNPAM_ENUM_MAX_VALUES);
+
+	if (in_range) {
+		pthread_mutex_lock(&enum_lock);
+		member = Py_XNewRef(state->enum_members[which][value]);
+		pthread_mutex_unlock(&enum_lock);
+
+		if (member != NULL) {
+			return member;
+		}
+	}
+
+	type = tnpam_enum_type(state, which);
+	if (type == NULL) {
+		return NULL;
+	}
+
+	if (in_range) {
+		pthread_mutex_lock(&enum_lock);
+		member = Py_XNewRef(state->enum_members[which][value]);
+		pthread_mutex_unlock(&enum_lock);
+	}
+
+	if (member == NULL) {
+		member = PyObject_CallFunction(type, "i", value);
+	}
+
+	Py_DECREF(type);
+	return member;
+}
+
+/*
+ * Check whether obj is a member of the enum and store its value. Returns 1
+ * if it is, 0 if it isn't and -1 with an exception set on error. This never
+ * creates the class: if it doesn't exist yet obj can't be one of its
+ * members. GIL must be held.
+ */
+int
+tnpam_enum_value(tnpam_state_t *state, tnpam_enum_t which, PyObject *obj,
+		 int *value_out)
+{
+	long value;
+	bool is_member;
+
+	// Enums with members can't be subclassed, so the type is exact
+	pthread_mutex_lock(&enum_lock);
+	is_member = (state->enums[which] != NULL) &&
+		    Py_IS_TYPE(obj, (PyTypeObject *)state->enums[which]);
+	pthread_mutex_unlock(&enum_lock);
+
+	if (!is_member) {
+		return 0;
+	}
+
+	value = PyLong_AsLong(obj);
+	if ((value == -1) && PyErr_Occurred()) {
+		return -1;
+	}
+
+	*value_out = (int)value;
+	return 1;
+}
+
+/* Module __getattr__() (PEP 562) creating the enum classes on first access */
+PyObject *
+py_tnpam_module_getattr(PyObject *self, PyObject *name)
+{
+	// importlib looks up attributes before module exec allocated the state
+	tnpam_state_t *state = (tnpam_state_t *)PyModule_GetState(self);
+	size_t i;
+
+	for (i = 0; (state != NULL) && PyUnicode_Check(name) &&
+	     (i < TNPAM_ENUM_COUNT); i++) {
+		PyObject *type = NULL;
+
+		if (PyUnicode_CompareWithASCIIString(name,
+						     enum_specs[i]->name) != 0) {
+			continue;
+		}
+
+		type = tnpam_enum_type(state, (tnpam_enum_t)i);
+		if (type == NULL) {
+			return NULL;
+		}
+
+		// Later lookups find it in the module dict directly
+		if (PyObject_SetAttr(self, name, type) < 0) {
+			Py_DECREF(type);
+			return NULL;
+		}
+
+		return type;
+	}
+
+	PyErr_Format(PyExc_AttributeError,
+		     "module '%s' has no attribute %R", MODULE_NAME, name);
+	return NULL;
+}
+
+/* Module __dir__() listing the enum classes that weren't created yet */
+PyObject *
+py_tnpam_module_dir(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	PyObject *dict = PyModule_GetDict(self);	// borrowed
+	PyObject *out = NULL;
+	size_t i;
+
+	out = PyDict_Keys(dict);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TNPAM_ENUM_COUNT; i++) {
+		PyObject *name = NULL;
+		int ret;
+
+		name = PyUnicode_FromString(enum_specs[i]->name);
+		if (name == NULL) {
+			goto fail;
+		}
+
+		ret = PyDict_Contains(dict, name);
+		if ((ret == 0) && (PyList_Append(out, name) < 0)) {
+			ret = -1;
+		}
+		Py_DECREF(name);
+		if (ret < 0) {
+			goto fail;
+		}
+	}
+
+	if (PyList_Sort(out) < 0) {
+		goto fail;
+	}
+
+	return out;
+
+fail:
+	Py_DECREF(out);
+	return NULL;
+}
+
+/*
+ * Set __all__ to the public names of the module including the enum classes
+ * so that "from truenas_pypam import *" goes through __getattr__() for them.
+ * Must be called last in module exec.
+ */
+bool
+init_enum_names(PyObject *module_ref)
+{
+	PyObject *names = NULL;
+	PyObject *public = NULL;
+	Py_ssize_t i;
+	bool success = false;
+
+	names = py_tnpam_module_dir(module_ref, NULL);
+	if (names == NULL) {
+		goto cleanup;
+	}
+
+	public = PyList_New(0);
+	if (public == NULL) {
+		goto cleanup;
+	}
+
+	for (i = 0; i < PyList_GET_SIZE(names); i++) {
+		PyObject *name = PyList_GET_ITEM(names, i);
+
+		if ((PyUnicode_READ_CHAR(name, 0) != '_') &&
+		    (PyList_Append(public, name) < 0)) {
+			goto cleanup;
+		}
+	}
+
+	success = PyModule_AddObjectRef(module_ref, "__all__", public) == 0;
+
+cleanup:
+	Py_XDECREF(public);
+	Py_XDECREF(names);
+	return success;
+}
@@ -8,7 +8,8 @@
 // merged into the application's overall env.
 
 PyObject *
-py_tnpam_setenv(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+py_tnpam_setenv(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		PyObject *kwnames)
 {
 	// set the value of the specified environmental variable
 	static char *kwlist[] = {
@@ -23,10 +24,10 @@ py_tnpam_setenv(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 	PyObject *pyval = NULL;
 	pamcode_t ret;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$sOp", kwlist,
-					 &cname,
-					 &pyval,
-					 &ro)) {
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$sOp", kwlist,
+			      &cname,
+			      &pyval,
+			      &ro)) {
 		return NULL;
 	}
 
@@ -45,6 +46,10 @@ py_tnpam_setenv(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 		}
 	}
 
+	if (tnpam_resume_busy(self)) {
+		return NULL;
+	}
+
 	PYPAM_LOCK(self);
 	if (cvalue == NULL)
 		// pam_misc_setenv can't be used to actually remove
@@ -55,23 +60,226 @@ py_tnpam_setenv(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 	PYPAM_UNLOCK(self);
 
 	if (ret != PAM_SUCCESS) {
-		set_pam_exc(ret, "pam_misc_setenv() failed");
+		set_pam_exc(tnpam_ctx_state(self), ret, "pam_misc_setenv() failed");
 		return NULL;
 	}
 
 	Py_RETURN_NONE;
 }
 
+/*
+ * Convert a mapping of variable names to values (str, or None to remove the
+ * variable) for tnpam_env_apply(). The strings are borrowed from the items
+ * list held by env so that they remain valid without the GIL. Must be
+ * released with tnpam_env_release().
+ */
+bool
+tnpam_env_prepare(PyObject *mapping, tnpam_env_t *env)
+{
+	Py_ssize_t i;
+
+	*env = (tnpam_env_t) { 0 };
+
+	// PyMapping_Check() is also true for sequences
+	if (!PyDict_Check(mapping) &&
+	    !PyObject_HasAttrString(mapping, "items")) {
+		PyErr_Format(PyExc_TypeError,
+			     "PAM environment must be a mapping, not %.200s",
+			     Py_TYPE(mapping)->tp_name);
+		return false;
+	}
+
+	env->items = PyMapping_Items(mapping);
+	if (env->items == NULL) {
+		return false;
+	}
+
+	env->count = PyList_GET_SIZE(env->items);
+	if (env->count == 0) {
+		return true;
+	}
+
+	env->names = PyMem_Calloc(env->count, sizeof(char *));
+	env->values = PyMem_Calloc(env->count, sizeof(char *));
+	if ((env->names == NULL) || (env->values == NULL)) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+
+	for (i = 0; i < env->count; i++) {
+		PyObject *item = PyList_GET_ITEM(env->items, i);
+		PyObject *key, *value;
+		Py_ssize_t len;
+
+		if (!PyTuple_Check(item) || (PyTuple_GET_SIZE(item) != 2)) {
+			PyErr_SetString(PyExc_TypeError,
+					"mapping items must be (key, value) pairs");
+			goto fail;
+		}
+
+		key = PyTuple_GET_ITEM(item, 0);
+		value = PyTuple_GET_ITEM(item, 1);
+
+		if (!PyUnicode_Check(key)) {
+			PyErr_Format(PyExc_TypeError,
+				     "PAM environment variable name must be str, "
+				     "not %.200s", Py_TYPE(key)->tp_name);
+			goto fail;
+		}
+
+		env->names[i] = PyUnicode_AsUTF8AndSize(key, &len);
+		if (env->names[i] == NULL) {
+			goto fail;
+		}
+
+		if ((len == 0) || (strlen(env->names[i]) != (size_t)len) ||
+		    (strchr(env->names[i], '=') != NULL)) {
+			PyErr_Format(PyExc_ValueError,
+				     "%R: invalid PAM environment variable name",
+				     key);
+			goto fail;
+		}
+
+		if (value == Py_None) {
+			continue;
+		}
+
+		if (!PyUnicode_Check(value)) {
+			PyErr_Format(PyExc_TypeError,
+				     "%R: value must be str or None, not %.200s",
+				     key, Py_TYPE(value)->tp_name);
+			goto fail;
+		}
+
+		env->values[i] = PyUnicode_AsUTF8AndSize(value, &len);
+		if (env->values[i] == NULL) {
+			goto fail;
+		}
+
+		if (strlen(env->values[i]) != (size_t)len) {
+			PyErr_Format(PyExc_ValueError,
+				     "%R: value contains embedded null character",
+				     key);
+			goto fail;
+		}
+	}
+
+	return true;
+
+fail:
+	tnpam_env_release(env);
+	return false;
+}
+
+void
+tnpam_env_release(tnpam_env_t *env)
+{
+	PyMem_Free(env->names);
+	PyMem_Free(env->values);
+	Py_CLEAR(env->items);
+	*env = (tnpam_env_t) { 0 };
+}
+
+/*
+ * Apply variables to the PAM environment in order. May be called without the
+ * GIL; the caller holds pam_hdl_lock or otherwise owns the handle. On failure
+ * the index of the variable that could not be set is stored in failed and
+ * variables before it remain set.
+ */
+pamcode_t
+tnpam_env_apply(pam_handle_t *hdl, const tnpam_env_t *env, boolean_t ro,
+		Py_ssize_t *failed)
+{
+	pamcode_t ret = PAM_SUCCESS;
+	Py_ssize_t i;
+
+	for (i = 0; i < env->count; i++) {
+		if (env->values[i] == NULL) {
+			ret = pam_putenv(hdl, env->names[i]);
+		} else {
+			ret = pam_misc_setenv(hdl, env->names[i], env->values[i], ro);
+		}
+
+		if (ret != PAM_SUCCESS) {
+			*failed = i;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Raise PAMError for a failed tnpam_env_apply(). GIL must be held.
+ */
+void
+tnpam_env_set_exc(tnpam_state_t *state, const tnpam_env_t *env,
+		  pamcode_t ret, Py_ssize_t failed)
+{
+	PyObject *item = PyList_GET_ITEM(env->items, failed);
+
+	set_pam_exc_fmt(state, ret, "%R: failed to set PAM environment variable",
+			PyTuple_GET_ITEM(item, 0));
+}
+
 PyObject *
-py_tnpam_getenv(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+py_tnpam_update_env(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		    PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"env",
+		"readonly",
+		NULL
+	};
+	PyObject *mapping = NULL;
+	boolean_t ro = B_FALSE;
+	Py_ssize_t failed = -1;
+	tnpam_env_t env;
+	pamcode_t ret;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "O|$p", kwlist,
+			      &mapping,
+			      &ro)) {
+		return NULL;
+	}
+
+	if (tnpam_resume_busy(self)) {
+		return NULL;
+	}
+
+	if (!tnpam_env_prepare(mapping, &env)) {
+		return NULL;
+	}
+
+	PYPAM_LOCK(self);
+	ret = tnpam_env_apply(self->hdl, &env, ro, &failed);
+	PYPAM_UNLOCK(self);
+
+	if (ret != PAM_SUCCESS) {
+		tnpam_env_set_exc(tnpam_ctx_state(self), &env, ret, failed);
+		tnpam_env_release(&env);
+		return NULL;
+	}
+
+	tnpam_env_release(&env);
+	Py_RETURN_NONE;
+}
+
+PyObject *
+py_tnpam_getenv(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+		PyObject *kwnames)
 {
 	// get value of the specified environmental variable
 	static char *kwlist[] = {"name", NULL};
 	const char *cname = NULL;
 	const char *value = NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist,
-					 &cname)) {
+	if (!tnpam_parse_args(args, nargs, kwnames, "s", kwlist,
+			      &cname)) {
+		return NULL;
+	}
+
+	if (tnpam_resume_busy(self)) {
 		return NULL;
 	}
 
@@ -89,41 +297,78 @@ py_tnpam_getenv(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 	return PyUnicode_FromString(value);
 }
 
-
-PyObject *
-py_tnpam_envlist(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored))
+/*
+ * Copy the PAM environment with pam_getenvlist(3). Stores NULL in envp if no
+ * variables are set. Returns false with an exception set on failure.
+ */
+static bool
+env_getlist(tnpam_ctx_t *ctx, char ***envp)
 {
-	// convert pam environment variable list to dict
 	char **pamenv = NULL;
-	char *envar;
-	PyObject *out = NULL;
-	int i;
 
-	PYPAM_LOCK(self);
+	if (tnpam_resume_busy(ctx)) {
+		return false;
+	}
+
+	PYPAM_LOCK(ctx);
 	// manually set errno to zero to differentiate between
 	// malloc failure and simply no enviornmental variables
 	errno = 0;
-	pamenv = pam_getenvlist(self->hdl);
-	PYPAM_UNLOCK(self);
+	pamenv = pam_getenvlist(ctx->hdl);
+	PYPAM_UNLOCK(ctx);
 
-	if (pamenv == NULL) {
-		if (errno == 0) {
-			// no environmental variables set
-			// return an empty dict
-			return PyDict_New();
-		}
+	if ((pamenv == NULL) && (errno != 0)) {
 		// malloc failure
-		return PyErr_NoMemory();
+		PyErr_NoMemory();
+		return false;
+	}
+
+	*envp = pamenv;
+	return true;
+}
+
+static void
+env_freelist(char **pamenv)
+{
+	char **p;
+
+	if (pamenv == NULL) {
+		return;
+	}
+
+	for (p = pamenv; *p != NULL; p++) {
+		free(*p);
+	}
+
+	free(pamenv);
+}
+
+/*
+ * Convert the PAM environment to a dict. Variables with empty values are
+ * omitted if skip_empty is set.
+ */
+static PyObject *
+env_snapshot(tnpam_ctx_t *ctx, bool skip_empty)
+{
+	char **pamenv = NULL;
+	PyObject *out = NULL;
+	size_t i;
+
+	if (!env_getlist(ctx, &pamenv)) {
+		return NULL;
 	}
 
 	out = PyDict_New();
-	if (out == NULL) {
+	if ((out == NULL) || (pamenv == NULL)) {
+		// no environmental variables set
+		// return an empty dict
 		goto cleanup;
 	}
 
-	for (i = 0, envar = *pamenv; (envar = pamenv[i]) != NULL; i++) {
+	for (i = 0; pamenv[i] != NULL; i++) {
 		// malloced NULL-terminated strings of format
 		// key=value
+		char *envar = pamenv[i];
 		char *cval = strchr(envar, '=');
 		PyObject *pyval = NULL;
 		int ret;
@@ -133,7 +378,7 @@ py_tnpam_envlist(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored))
 		// separate the key and value
 		*cval = '\0';
 		cval++;
-		if (*cval == '\0')
+		if (skip_empty && (*cval == '\0'))
 			continue;
 
 		pyval = PyUnicode_FromString(cval);
@@ -151,11 +396,379 @@ py_tnpam_envlist(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored))
 	}
 
 cleanup:
-	for (i = 0, envar = *pamenv; (envar = pamenv[i]) != NULL; i++) {
-		free(envar);
-		envar = NULL;
+	env_freelist(pamenv);
+	return out;
+}
+
+PyObject *
+py_tnpam_envlist(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored))
+{
+	// convert pam environment variable list to dict
+	return env_snapshot(self, true);
+}
+
+/*
+ * PamEnv: live mapping view of the PAM environment of a context.
+ *
+ * Lookups go straight through pam_getenv(3) and only copy the requested
+ * value. len(), iteration and the keys() / items() / values() / copy()
+ * methods work on a snapshot taken with pam_getenvlist(3) when called.
+ */
+typedef struct {
+	PyObject_HEAD
+	tnpam_ctx_t *ctx;
+} tnpam_env_view_t;
+
+/*
+ * Look up a variable. Returns 1 and a new reference in out if it is set,
+ * 0 if not and -1 with an exception set on error. Keys that can't name a
+ * PAM environment variable are reported as not set.
+ */
+static int
+env_view_lookup(tnpam_env_view_t *self, PyObject *key, PyObject **out)
+{
+	const char *name, *value;
+	char *copy = NULL;
+	Py_ssize_t len;
+
+	*out = NULL;
+
+	if (!PyUnicode_Check(key)) {
+		return 0;
 	}
 
-	free(pamenv);
+	name = PyUnicode_AsUTF8AndSize(key, &len);
+	if (name == NULL) {
+		return -1;
+	}
+
+	if ((len == 0) || (strlen(name) != (size_t)len) ||
+	    (strchr(name, '=') != NULL)) {
+		return 0;
+	}
+
+	if (tnpam_resume_busy(self->ctx)) {
+		return -1;
+	}
+
+	// The value is owned by the handle and may be replaced by another
+	// thread as soon as the lock is dropped, so copy it while locked.
+	PYPAM_LOCK(self->ctx);
+	value = pam_getenv(self->ctx->hdl, name);
+	if (value != NULL) {
+		copy = strdup(value);
+	}
+	PYPAM_UNLOCK(self->ctx);
+
+	if (value == NULL) {
+		return 0;
+	}
+
+	if (copy == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	*out = PyUnicode_FromString(copy);
+	free(copy);
+	return (*out != NULL) ? 1 : -1;
+}
+
+static void
+env_view_dealloc(tnpam_env_view_t *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+
+	Py_CLEAR(self->ctx);
+	tp->tp_free((PyObject *)self);
+	Py_DECREF(tp);
+}
+
+static PyObject *
+env_view_subscript(tnpam_env_view_t *self, PyObject *key)
+{
+	PyObject *value = NULL;
+
+	if (env_view_lookup(self, key, &value) == 0) {
+		PyErr_SetObject(PyExc_KeyError, key);
+	}
+
+	return value;
+}
+
+static int
+env_view_contains(tnpam_env_view_t *self, PyObject *key)
+{
+	PyObject *value = NULL;
+	int ret;
+
+	ret = env_view_lookup(self, key, &value);
+	Py_XDECREF(value);
+	return ret;
+}
+
+static Py_ssize_t
+env_view_len(tnpam_env_view_t *self)
+{
+	char **pamenv = NULL;
+	Py_ssize_t len = 0;
+
+	if (!env_getlist(self->ctx, &pamenv)) {
+		return -1;
+	}
+
+	if (pamenv != NULL) {
+		while (pamenv[len] != NULL) {
+			len++;
+		}
+	}
+
+	env_freelist(pamenv);
+	return len;
+}
+
+static PyObject *
+env_view_iter(tnpam_env_view_t *self)
+{
+	PyObject *snapshot = NULL;
+	PyObject *out = NULL;
+
+	snapshot = env_snapshot(self->ctx, false);
+	if (snapshot == NULL) {
+		return NULL;
+	}
+
+	out = PyObject_GetIter(snapshot);
+	Py_DECREF(snapshot);
 	return out;
 }
+
+static PyObject *
+env_view_repr(tnpam_env_view_t *self)
+{
+	PyObject *snapshot = NULL;
+	PyObject *out = NULL;
+
+	snapshot = env_snapshot(self->ctx, false);
+	if (snapshot == NULL) {
+		return NULL;
+	}
+
+	out = PyUnicode_FromFormat("PamEnv(%R)", snapshot);
+	Py_DECREF(snapshot);
+	return out;
+}
+
+static PyObject *
+env_view_richcompare(tnpam_env_view_t *self, PyObject *other, int op)
+{
+	PyObject *snapshot = NULL;
+	PyObject *other_snapshot = NULL;
+	PyObject *out = NULL;
+
+	if ((op != Py_EQ) && (op != Py_NE)) {
+		Py_RETURN_NOTIMPLEMENTED;
+	}
+
+	if (Py_IS_TYPE(other, Py_TYPE(self))) {
+		other_snapshot = env_snapshot(((tnpam_env_view_t *)other)->ctx, false);
+		if (other_snapshot == NULL) {
+			return NULL;
+		}
+	} else if (PyDict_Check(other)) {
+		other_snapshot = Py_NewRef(other);
+	} else {
+		Py_RETURN_NOTIMPLEMENTED;
+	}
+
+	snapshot = env_snapshot(self->ctx, false);
+	if (snapshot != NULL) {
+		out = PyObject_RichCompare(snapshot, other_snapshot, op);
+		Py_DECREF(snapshot);
+	}
+
+	Py_DECREF(other_snapshot);
+	return out;
+}
+
+static PyObject *
+env_view_get(tnpam_env_view_t *self, PyObject *const *args, Py_ssize_t nargs)
+{
+	PyObject *value = NULL;
+	int ret;
+
+	if ((nargs < 1) || (nargs > 2)) {
+		PyErr_Format(PyExc_TypeError,
+			     "get expected 1 or 2 arguments, got %zd", nargs);
+		return NULL;
+	}
+
+	ret = env_view_lookup(self, args[0], &value);
+	if (ret == 0) {
+		return Py_NewRef((nargs == 2) ? args[1] : Py_None);
+	}
+
+	return value;
+}
+
+static PyObject *
+env_view_copy(tnpam_env_view_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return env_snapshot(self->ctx, false);
+}
+
+/* keys(), items() and values() are the dict views of a snapshot */
+static PyObject *
+env_view_snapshot_method(tnpam_env_view_t *self, const char *method)
+{
+	PyObject *snapshot = NULL;
+	PyObject *out = NULL;
+
+	snapshot = env_snapshot(self->ctx, false);
+	if (snapshot == NULL) {
+		return NULL;
+	}
+
+	out = PyObject_CallMethod(snapshot, method, NULL);
+	Py_DECREF(snapshot);
+	return out;
+}
+
+static PyObject *
+env_view_keys(tnpam_env_view_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return env_view_snapshot_method(self, "keys");
+}
+
+static PyObject *
+env_view_items(tnpam_env_view_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return env_view_snapshot_method(self, "items");
+}
+
+static PyObject *
+env_view_values(tnpam_env_view_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return env_view_snapshot_method(self, "values");
+}
+
+static PyMethodDef env_view_methods[] = {
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)(void(*)(void))env_view_get,
+		.ml_flags = METH_FASTCALL,
+		.ml_doc = "get(key, default=None, /) -> str\n\n"
+			  "Value of key if it is set, else default.",
+	},
+	{
+		.ml_name = "copy",
+		.ml_meth = (PyCFunction)env_view_copy,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "copy() -> dict[str, str]\n\n"
+			  "Snapshot of the PAM environment.",
+	},
+	{
+		.ml_name = "keys",
+		.ml_meth = (PyCFunction)env_view_keys,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "keys() -> KeysView\n\n"
+			  "Names of the variables set when called.",
+	},
+	{
+		.ml_name = "items",
+		.ml_meth = (PyCFunction)env_view_items,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "items() -> ItemsView\n\n"
+			  "(name, value) pairs of the variables set when called.",
+	},
+	{
+		.ml_name = "values",
+		.ml_meth = (PyCFunction)env_view_values,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "values() -> ValuesView\n\n"
+			  "Values of the variables set when called.",
+	},
+	{NULL}
+};
+
+PyDoc_STRVAR(PyPamEnv_Type__doc__,
+"PamEnv\n"
+"------\n\n"
+"Read-only mapping view of the PAM environment of a PamContext.\n\n"
+"Indexing, get() and the in operator look up a single variable with\n"
+"pam_getenv(3) and reflect changes made after the view was obtained.\n"
+"len(), iteration, comparisons and keys() / items() / values() / copy()\n"
+"use a snapshot of the whole environment taken with pam_getenvlist(3).\n"
+"Unlike env_dict(), variables with empty values are included.\n"
+);
+
+static PyType_Slot env_view_slots[] = {
+	{Py_tp_doc, (void *)PyPamEnv_Type__doc__},
+	{Py_tp_dealloc, env_view_dealloc},
+	{Py_tp_repr, env_view_repr},
+	{Py_tp_iter, env_view_iter},
+	{Py_tp_richcompare, env_view_richcompare},
+	{Py_tp_methods, env_view_methods},
+	{Py_mp_length, env_view_len},
+	{Py_mp_subscript, env_view_subscript},
+	{Py_sq_contains, env_view_contains},
+	{0, NULL}
+};
+
+static PyType_Spec env_view_spec = {
+	.name = MODULE_NAME ".PamEnv",
+	.basicsize = sizeof(tnpam_env_view_t),
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_MAPPING |
+		 Py_TPFLAGS_DISALLOW_INSTANTIATION,
+	.slots = env_view_slots,
+};
+
+bool init_env_type(PyObject *module_ref)
+{
+	tnpam_state_t *state = py_get_pam_state(module_ref);
+	PyObject *abc = NULL;
+	PyObject *mapping = NULL;
+	PyObject *ret = NULL;
+
+	state->env_type = (PyTypeObject *)PyType_FromModuleAndSpec(module_ref,
+								   &env_view_spec,
+								   NULL);
+	if (state->env_type == NULL) {
+		return false;
+	}
+
+	// Register as a virtual subclass so isinstance(ctx.env, Mapping) holds
+	abc = PyImport_ImportModule("collections.abc");
+	if (abc == NULL) {
+		return false;
+	}
+
+	mapping = PyObject_GetAttrString(abc, "Mapping");
+	Py_DECREF(abc);
+	if (mapping == NULL) {
+		return false;
+	}
+
+	ret = PyObject_CallMethod(mapping, "register", "O", state->env_type);
+	Py_DECREF(mapping);
+	if (ret == NULL) {
+		return false;
+	}
+
+	Py_DECREF(ret);
+	return true;
+}
+
+PyObject *
+tnpam_env_view_new(tnpam_ctx_t *ctx)
+{
+	tnpam_env_view_t *view = NULL;
+
+	view = PyObject_New(tnpam_env_view_t, tnpam_ctx_state(ctx)->env_type);
+	if (view == NULL) {
+		return NULL;
+	}
+
+	view->ctx = (tnpam_ctx_t *)Py_NewRef((PyObject *)ctx);
+	return (PyObject *)view;
+}
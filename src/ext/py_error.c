@@ -3,11 +3,6 @@
 #include <string.h>
 #include "truenas_pypam.h"
 
-typedef struct {
-	int value;
-	const char *name;
-} intenum_entry_t;
-
 /**
  * @brief Lookup table for PAM codes / names.
  *
@@ -25,7 +20,7 @@ typedef struct {
  * will never be returned to clients.
  */
 
-static const intenum_entry_t pam_code_tbl[] = {
+static const tnpam_enum_entry_t pam_code_tbl[] = {
 	// 0	Successful function return
 	{ PAM_SUCCESS, "PAM_SUCCESS" },
 
@@ -130,6 +125,12 @@ _Static_assert(
 	"PAM code lookup table needs updating - last value changed"
 );
 
+const tnpam_enum_spec_t tnpam_pam_code_enum_spec = {
+	.name = "PAMCode",
+	.entries = pam_code_tbl,
+	.count = ARRAY_SIZE(pam_code_tbl),
+};
+
 const char *py_pamcode_to_string(int code)
 {
 	for (size_t i = 0; i < ARRAY_SIZE(pam_code_tbl); i++) {
@@ -179,67 +180,238 @@ PyObject *py_pamcode_dict(void)
 	return code_dict;
 }
 
+/**
+ * @brief PAMError instance layout
+ *
+ * Exceptions raised by this module fill in the slots directly from tables
+ * prebuilt at module init so that raising a PAM failure only allocates the
+ * exception object itself. message and location are always string literals
+ * (see set_pam_exc()) and are only converted to python strings if accessed.
+ */
+typedef struct {
+	PyBaseExceptionObject base;
+	PyObject *code;		/* PAMCode member */
+	PyObject *name;		/* interned PAMCode name */
+	PyObject *err_str;	/* interned pam_strerror() */
+	PyObject *message;	/* created lazily from message_c unless formatted */
+	PyObject *location;	/* created lazily from location_c */
+	const char *message_c;
+	const char *location_c;
+} tnpam_error_t;
+
+static int
+pam_error_traverse(tnpam_error_t *self, visitproc visit, void *arg)
+{
+	// Instances of heap types must visit their type
+	Py_VISIT(Py_TYPE(self));
+	Py_VISIT(self->code);
+	Py_VISIT(self->name);
+	Py_VISIT(self->err_str);
+	Py_VISIT(self->message);
+	Py_VISIT(self->location);
+	return ((PyTypeObject *)PyExc_RuntimeError)->tp_traverse((PyObject *)self,
+								 visit, arg);
+}
+
+static int
+pam_error_clear(tnpam_error_t *self)
+{
+	Py_CLEAR(self->code);
+	Py_CLEAR(self->name);
+	Py_CLEAR(self->err_str);
+	Py_CLEAR(self->message);
+	Py_CLEAR(self->location);
+	return ((PyTypeObject *)PyExc_RuntimeError)->tp_clear((PyObject *)self);
+}
+
+static void
+pam_error_dealloc(tnpam_error_t *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+
+	PyObject_GC_UnTrack(self);
+	pam_error_clear(self);
+	tp->tp_free((PyObject *)self);
+	Py_DECREF(tp);
+}
+
+/*
+ * Return a new reference to the lazily created string for a slot. Instances
+ * created from python have neither and get an empty string, matching the
+ * class defaults of earlier versions.
+ */
 static PyObject *
-create_pam_code_enum(void)
+pam_error_lazy_str(tnpam_error_t *self, PyObject **slot, const char *literal)
 {
-	PyObject *enum_module = NULL;
-	PyObject *int_enum_class = NULL;
-	PyObject *enum_dict = NULL;
-	PyObject *py_enum_name = NULL;
-	PyObject *result_enum = NULL;
-	size_t i;
+	PyObject *out;
 
-	// Import enum module and get IntEnum class
-	enum_module = PyImport_ImportModule("enum");
-	if (enum_module == NULL) {
-		return NULL;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (*slot == NULL) {
+		*slot = PyUnicode_FromString(literal ? literal : "");
 	}
+	out = Py_XNewRef(*slot);
+	Py_END_CRITICAL_SECTION();
 
-	int_enum_class = PyObject_GetAttrString(enum_module, "IntEnum");
-	Py_DECREF(enum_module);
-	if (int_enum_class == NULL) {
-		return NULL;
+	return out;
+}
+
+static PyObject *
+pam_error_get_message(tnpam_error_t *self, void *closure)
+{
+	return pam_error_lazy_str(self, &self->message, self->message_c);
+}
+
+static PyObject *
+pam_error_get_location(tnpam_error_t *self, void *closure)
+{
+	return pam_error_lazy_str(self, &self->location, self->location_c);
+}
+
+static PyObject *
+pam_error_get_code(tnpam_error_t *self, void *closure)
+{
+	if (self->code == NULL) {
+		return PyLong_FromLong(PAM_SUCCESS);
 	}
 
-	// Create enum dictionary
-	enum_dict = PyDict_New();
-	if (enum_dict == NULL) {
-		Py_DECREF(int_enum_class);
-		return NULL;
+	return Py_NewRef(self->code);
+}
+
+static PyObject *
+pam_error_get_name(tnpam_error_t *self, void *closure)
+{
+	return pam_error_lazy_str(self, &self->name, NULL);
+}
+
+static PyObject *
+pam_error_get_err_str(tnpam_error_t *self, void *closure)
+{
+	return pam_error_lazy_str(self, &self->err_str, NULL);
+}
+
+static PyObject *
+pam_error_str(tnpam_error_t *self)
+{
+	if (self->message_c == NULL) {
+		// Raised from python code
+		return ((PyTypeObject *)PyExc_RuntimeError)->tp_str((PyObject *)self);
 	}
 
-	for (i = 0; i < ARRAY_SIZE(pam_code_tbl); i++) {
-		PyObject *py_value = PyLong_FromLong(pam_code_tbl[i].value);
-		if (py_value == NULL ||
-		    PyDict_SetItemString(enum_dict, pam_code_tbl[i].name,
-					 py_value) < 0) {
-			Py_XDECREF(py_value);
-			Py_DECREF(enum_dict);
-			Py_DECREF(int_enum_class);
-			return NULL;
-		}
-		Py_DECREF(py_value);
+	if (self->message != NULL) {
+		return PyUnicode_FromFormat("[%U]: %U", self->name, self->message);
+	}
+
+	return PyUnicode_FromFormat("[%U]: %s", self->name, self->message_c);
+}
+
+static PyObject *
+pam_error_repr(tnpam_error_t *self)
+{
+	PyObject *str, *out;
+
+	if (self->message_c == NULL) {
+		return ((PyTypeObject *)PyExc_RuntimeError)->tp_repr((PyObject *)self);
 	}
 
-	py_enum_name = PyUnicode_FromString(MODULE_NAME ".PAMCode");
-	if (py_enum_name == NULL) {
-		Py_DECREF(enum_dict);
-		Py_DECREF(int_enum_class);
+	str = pam_error_str(self);
+	if (str == NULL) {
 		return NULL;
 	}
 
-	result_enum = PyObject_CallFunction(int_enum_class, "OO",
-					    py_enum_name, enum_dict);
+	out = PyUnicode_FromFormat("%s(%R)", _PyType_Name(Py_TYPE(self)), str);
+	Py_DECREF(str);
+	return out;
+}
+
+/*
+ * args is materialized on first access so that code relying on
+ * exc.args[0] containing the formatted message keeps working.
+ */
+static PyObject *
+pam_error_get_args(tnpam_error_t *self, void *closure)
+{
+	PyObject *str, *args, *out = NULL;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if ((self->message_c != NULL) &&
+	    ((self->base.args == NULL) || (PyTuple_GET_SIZE(self->base.args) == 0))) {
+		str = pam_error_str(self);
+		if (str == NULL) {
+			goto done;
+		}
+
+		args = PyTuple_Pack(1, str);
+		Py_DECREF(str);
+		if (args == NULL) {
+			goto done;
+		}
+
+		Py_XSETREF(self->base.args, args);
+	}
 
-	Py_DECREF(py_enum_name);
-	Py_DECREF(enum_dict);
-	Py_DECREF(int_enum_class);
+	out = Py_NewRef(self->base.args ? self->base.args : Py_None);
+done:
+	Py_END_CRITICAL_SECTION();
+	return out;
+}
 
-	return result_enum;
+static int
+pam_error_set_args(tnpam_error_t *self, PyObject *value, void *closure)
+{
+	PyObject *args;
+
+	if (value == NULL) {
+		PyErr_SetString(PyExc_TypeError, "args may not be deleted");
+		return -1;
+	}
+
+	args = PySequence_Tuple(value);
+	if (args == NULL) {
+		return -1;
+	}
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	Py_XSETREF(self->base.args, args);
+	Py_END_CRITICAL_SECTION();
+	return 0;
 }
 
+static PyGetSetDef pam_error_getsetters[] = {
+	{
+		.name = "args",
+		.get = (getter)pam_error_get_args,
+		.set = (setter)pam_error_set_args,
+	},
+	{
+		.name = "code",
+		.get = (getter)pam_error_get_code,
+		.doc = "PAMCode: PAM response code",
+	},
+	{
+		.name = "name",
+		.get = (getter)pam_error_get_name,
+		.doc = "str: Human-readable name of the response code",
+	},
+	{
+		.name = "err_str",
+		.get = (getter)pam_error_get_err_str,
+		.doc = "str: pam_strerror for the error code",
+	},
+	{
+		.name = "message",
+		.get = (getter)pam_error_get_message,
+		.doc = "str: verbose message describing the error",
+	},
+	{
+		.name = "location",
+		.get = (getter)pam_error_get_location,
+		.doc = "str: line of file in uncompiled source of this module",
+	},
+	{NULL}
+};
+
 PyDoc_STRVAR(py_pam_exception__doc__,
-"PAMError(Exception)\n"
+"PAMError(RuntimeError)\n"
 "-----------------------\n\n"
 "Python wrapper around an unexpected PAM response code.\n\n"
 "attributes:\n"
@@ -255,34 +427,81 @@ PyDoc_STRVAR(py_pam_exception__doc__,
 "location: str\n"
 "    line of file in uncompiled source of this module\n\n"
 );
-bool setup_pam_exception(PyObject *module_ref)
+
+static PyType_Slot pam_error_slots[] = {
+	{Py_tp_doc, (void *)py_pam_exception__doc__},
+	{Py_tp_dealloc, pam_error_dealloc},
+	{Py_tp_traverse, pam_error_traverse},
+	{Py_tp_clear, pam_error_clear},
+	{Py_tp_str, pam_error_str},
+	{Py_tp_repr, pam_error_repr},
+	{Py_tp_getset, pam_error_getsetters},
+	{0, NULL}
+};
+
+static PyType_Spec pam_error_spec = {
+	.name = MODULE_NAME ".PAMError",
+	.basicsize = sizeof(tnpam_error_t),
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = pam_error_slots,
+};
+
+PyDoc_STRVAR(py_rate_limited_exception__doc__,
+"AuthRateLimited(PAMError)\n"
+"-------------------------\n\n"
+"Raised instead of running the PAM stack when an authentication attempt\n"
+"exceeds the limits set with set_auth_rate_limit(). code is\n"
+"PAMCode.PAM_MAXTRIES.\n"
+);
+
+static PyType_Slot rate_limited_slots[] = {
+	{Py_tp_doc, (void *)py_rate_limited_exception__doc__},
+	{0, NULL}
+};
+
+static PyType_Spec rate_limited_spec = {
+	.name = MODULE_NAME ".AuthRateLimited",
+	.basicsize = sizeof(tnpam_error_t),
+	// GC support and all other slots are inherited from PAMError
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.slots = rate_limited_slots,
+};
+
+/*
+ * Populate per-code tables of interned name / err_str strings used when
+ * raising PAMError. The PAMCode members are resolved with the enum itself
+ * (see py_enum.c).
+ */
+static bool
+setup_pam_code_tables(tnpam_state_t *state)
 {
-	tnpam_state_t *state = NULL;
-	PyObject *pam_error = NULL;
-	PyObject *dict = NULL;
-	PyObject *pam_code_enum = NULL;
-	bool success = false;
+	size_t i;
 
-	// Set up spec for the new exception type
-	dict = Py_BuildValue("{s:i,s:s,s:s,s:s,s:s}",
-			     "code", PAM_SUCCESS,
-			     "name", "",
-			     "err_str", "",
-			     "message", "",
-			     "location", "");
-	if (dict == NULL) {
-		goto cleanup;
-	}
+	for (i = 0; i < ARRAY_SIZE(pam_code_tbl); i++) {
+		int code = pam_code_tbl[i].value;
 
-	pam_error = PyErr_NewExceptionWithDoc(MODULE_NAME
-					      ".PAMError",
-					      py_pam_exception__doc__,
-					      PyExc_RuntimeError,
-					      dict);
-	if (pam_error == NULL) {
-		goto cleanup;
+		PYPAM_ASSERT(((size_t)code == i), "PAM code table is not dense");
+
+		state->pam_code_names[i] = PyUnicode_InternFromString(pam_code_tbl[i].name);
+		if (state->pam_code_names[i] == NULL) {
+			return false;
+		}
+
+		// linux-pam doesn't actually use the first arg
+		state->pam_err_strs[i] = PyUnicode_InternFromString(pam_strerror(NULL, code));
+		if (state->pam_err_strs[i] == NULL) {
+			return false;
+		}
 	}
 
+	return true;
+}
+
+bool setup_pam_exception(PyObject *module_ref)
+{
+	tnpam_state_t *state = NULL;
+	bool success = false;
+
 	state = (tnpam_state_t *)PyModule_GetState(module_ref);
 	if (state == NULL) {
 		goto cleanup;
@@ -290,127 +509,154 @@ bool setup_pam_exception(PyObject *module_ref)
 
 	// Add reference to our module state so that it's available generally
 	// for implementation in this extension
-	state->pam_error = Py_NewRef(pam_error);
+	state->pam_error = PyType_FromModuleAndSpec(module_ref, &pam_error_spec,
+						    PyExc_RuntimeError);
+	if (state->pam_error == NULL) {
+		goto cleanup;
+	}
 
 	// Add exception reference to root of module so that it's available
 	// to library consumers
-	if (PyModule_AddObjectRef(module_ref, "PAMError", pam_error) < 0) {
+	if (PyModule_AddObjectRef(module_ref, "PAMError", state->pam_error) < 0) {
 		goto cleanup;
 	}
 
-	// Create and add PAMCode IntEnum
-	pam_code_enum = create_pam_code_enum();
-	if (pam_code_enum == NULL) {
+	state->rate_limited_error = PyType_FromModuleAndSpec(
+		module_ref, &rate_limited_spec, state->pam_error);
+	if (state->rate_limited_error == NULL) {
 		goto cleanup;
 	}
 
-	if (PyModule_AddObjectRef(module_ref, "PAMCode", pam_code_enum) < 0) {
+	if (PyModule_AddObjectRef(module_ref, "AuthRateLimited",
+				  state->rate_limited_error) < 0) {
 		goto cleanup;
 	}
 
-	// Store reference in module state
-	state->pam_code_enum = Py_NewRef(pam_code_enum);
+	if (!setup_pam_code_tables(state)) {
+		goto cleanup;
+	}
 
 	success = true;
 
 cleanup:
-	Py_CLEAR(dict);
-	Py_CLEAR(pam_error);
-	Py_CLEAR(pam_code_enum);
 	return success;
 }
 
-void
-_set_pam_exc(int code, const char *additional_info, const char *location)
+static tnpam_error_t *
+pam_exc_new(tnpam_state_t *state, PyObject *exc_type, int code,
+	    const char *additional_info, const char *location)
 {
-	tnpam_state_t *state = NULL;
-	PyObject *obj = NULL;
-	PyObject *exc = NULL;
-	PyObject *message = NULL;
-	PyObject *enum_member = NULL;
-	const char *err_str = pam_strerror(NULL, code);  // linux-pam doesn't actually use the first arg
-	const char *name = py_pamcode_to_string(code);
-
-	state = py_get_pam_state(NULL);
-	if (state == NULL) {
-		return;
-	}
+	tnpam_error_t *exc = NULL;
+	PyTypeObject *type = NULL;
+	PyObject *args = NULL;
 
-	// first set up str() for exception
-	message = PyUnicode_FromFormat("[%s]: %s", name, additional_info);
-	if (message == NULL) {
-		return;
+	PYPAM_ASSERT((exc_type != NULL), "Pam error not initialized");
+	type = (PyTypeObject *)exc_type;
+
+	// BaseException.__new__ with an empty args tuple; this is the only
+	// allocation for the common case.
+	args = PyTuple_New(0);
+	if (args == NULL) {
+		return NULL;
 	}
 
-	PYPAM_ASSERT((state->pam_error != NULL), "Pam error not initialized");
-	exc = PyObject_CallOneArg(state->pam_error, message);
-	Py_CLEAR(message);
+	exc = (tnpam_error_t *)type->tp_new(type, args, NULL);
+	Py_DECREF(args);
 	if (exc == NULL) {
-		return;
+		return NULL;
 	}
 
-	/* set error code as PAMCode enum member */
-	PYPAM_ASSERT((state->pam_code_enum != NULL), "PAMCode enum not initialized");
-
-	// Create integer object for the code value
-	obj = PyLong_FromLong(code);
-	if (obj == NULL) {
-		Py_CLEAR(exc);
-		return;
+	if ((code >= 0) && ((size_t)code < ARRAY_SIZE(pam_code_tbl))) {
+		exc->code = tnpam_enum_member(state, TNPAM_ENUM_PAM_CODE, code);
+		if (exc->code == NULL) {
+			Py_DECREF(exc);
+			return NULL;
+		}
+		exc->name = Py_NewRef(state->pam_code_names[code]);
+		exc->err_str = Py_NewRef(state->pam_err_strs[code]);
+	} else {
+		// Not a Linux-PAM return value. Should be impossible, but don't
+		// make things worse by failing to report it.
+		exc->code = PyLong_FromLong(code);
+		exc->name = PyUnicode_FromString("UNKNOWN_ERROR");
+		exc->err_str = PyUnicode_FromString(pam_strerror(NULL, code));
+		if (!exc->code || !exc->name || !exc->err_str) {
+			Py_DECREF(exc);
+			return NULL;
+		}
 	}
 
-	// Get the enum member: PAMCode(code)
-	enum_member = PyObject_CallFunctionObjArgs(state->pam_code_enum, obj, NULL);
-	Py_DECREF(obj);
-
-	if (enum_member == NULL) {
-		Py_CLEAR(exc);
-		return;
-	}
+	exc->message_c = additional_info;
+	exc->location_c = location;
+	return exc;
+}
 
-	PyObject_SetAttrString(exc, "code", enum_member);
-	Py_CLEAR(enum_member);
+/*
+ * Raise PAMError. Both additional_info and location must have static storage
+ * duration since they are referenced by the exception object without being
+ * copied.
+ */
+void
+_set_pam_exc(tnpam_state_t *state, int code, const char *additional_info,
+	     const char *location)
+{
+	tnpam_error_t *exc = pam_exc_new(state, state->pam_error, code,
+					 additional_info, location);
 
-	/* set name */
-	obj = PyUnicode_FromString(name);
-	if (obj == NULL) {
-		Py_CLEAR(exc);
+	if (exc == NULL) {
 		return;
 	}
 
-	PyObject_SetAttrString(exc, "name", obj);
-	Py_CLEAR(obj);
+	PyErr_SetObject((PyObject *)Py_TYPE(exc), (PyObject *)exc);
+	Py_DECREF(exc);
+}
 
-	/* set err_str */
-	obj = PyUnicode_FromString(err_str);
-	if (obj == NULL) {
-		Py_CLEAR(exc);
+/*
+ * Raise PAMError with a formatted message. The message is created eagerly;
+ * message_c is set to the format so that the exception is still treated as
+ * raised by this module.
+ */
+void
+_set_pam_exc_fmt(tnpam_state_t *state, int code, const char *location,
+		 const char *format, ...)
+{
+	tnpam_error_t *exc = NULL;
+	PyObject *msg = NULL;
+	va_list ap;
+
+	va_start(ap, format);
+	msg = PyUnicode_FromFormatV(format, ap);
+	va_end(ap);
+	if (msg == NULL) {
 		return;
 	}
 
-	PyObject_SetAttrString(exc, "err_str", obj);
-	Py_CLEAR(obj);
-
-	/* set message */
-	obj = PyUnicode_FromString(additional_info);
-	if (obj == NULL) {
-		Py_CLEAR(exc);
+	exc = pam_exc_new(state, state->pam_error, code, format, location);
+	if (exc == NULL) {
+		Py_DECREF(msg);
 		return;
 	}
 
-	PyObject_SetAttrString(exc, "message", obj);
-	Py_CLEAR(obj);
+	exc->message = msg;
+	PyErr_SetObject((PyObject *)Py_TYPE(exc), (PyObject *)exc);
+	Py_DECREF(exc);
+}
 
-	/* set location */
-	obj = PyUnicode_FromString(location);
-	if (obj == NULL) {
-		Py_CLEAR(exc);
+/*
+ * Raise AuthRateLimited. Same requirements for additional_info and location
+ * as _set_pam_exc().
+ */
+void
+_set_rate_limited_exc(tnpam_state_t *state, const char *additional_info,
+		      const char *location)
+{
+	tnpam_error_t *exc = pam_exc_new(state, state->rate_limited_error,
+					 PAM_MAXTRIES, additional_info, location);
+
+	if (exc == NULL) {
 		return;
 	}
 
-	PyObject_SetAttrString(exc, "location", obj);
-	Py_CLEAR(obj);
-
-	PyErr_SetObject(state->pam_error, exc);
+	PyErr_SetObject((PyObject *)Py_TYPE(exc), (PyObject *)exc);
 	Py_DECREF(exc);
 }
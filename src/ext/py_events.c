@@ -0,0 +1,432 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "truenas_pypam.h"
+
+/*
+ * Ring buffer of authentication events.
+ *
+ * Audit hooks see every PAM operation as it happens, in the thread making
+ * the request, with a python tuple built for it. Accounting consumers that
+ * only need a record of what happened can instead enable this buffer with
+ * set_event_buffer(): tnpam_op_call() and authenticate_many() then copy the
+ * user, service, rhost, operation, result and latency of each call into a
+ * fixed-size record without the GIL or any allocation, and a consumer
+ * collects them in batches with drain_events(). event_fd() returns an
+ * eventfd(2) that is readable while events are pending so that the consumer
+ * can wait for them in an event loop instead of polling.
+ *
+ * The buffer is process-wide and shared by all interpreters. Strings are
+ * truncated to the size of their field. When the buffer is full new events
+ * are dropped and counted as lost rather than overwriting older ones, so
+ * that what a consumer receives has no holes it can't see.
+ */
+
+#define TNPAM_EV_USER_MAX 256
+#define TNPAM_EV_SERVICE_MAX 64
+#define TNPAM_EV_RHOST_MAX 256
+#define TNPAM_EV_SIZE_MAX (1 << 20)
+
+typedef struct {
+	uint64_t timestamp_ns;	/* CLOCK_REALTIME */
+	uint64_t latency_ns;
+	int32_t op;		/* tnpam_op_t */
+	int32_t code;		/* PAM return value */
+	char user[TNPAM_EV_USER_MAX];
+	char service[TNPAM_EV_SERVICE_MAX];
+	char rhost[TNPAM_EV_RHOST_MAX];	/* empty if not set */
+} tnpam_event_t;
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	_Atomic bool enabled;
+	tnpam_event_t *ring;
+	size_t size;		/* capacity of ring */
+	size_t head;		/* index of the oldest event */
+	size_t count;
+	int efd;		/* -1 until event_fd() is first called */
+	_Atomic uint64_t recorded;
+	_Atomic uint64_t lost;
+} ev = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.efd = -1,
+};
+
+static PyStructSequence_Field auth_event_fields[] = {
+	{"timestamp", "Time the call returned, in seconds since the epoch"},
+	{"operation", "Name of the PAM call, e.g. pam_authenticate"},
+	{"service_name", "PAM service name"},
+	{"user", "PAM_USER, or None if not set"},
+	{"rhost", "PAM_RHOST, or None if not set"},
+	{"code", "PAMCode returned by the call"},
+	{"latency_ns", "Duration of the call in nanoseconds"},
+	{0},
+};
+
+static PyStructSequence_Desc auth_event_desc = {
+	.name = MODULE_NAME ".AuthEvent",
+	.fields = auth_event_fields,
+	.doc = "PAM call recorded in the buffer enabled by set_event_buffer().",
+	.n_in_sequence = 7
+};
+
+/*
+ * The events of the parent are not for the child to report, and the
+ * eventfd is shared with the parent after fork(). Give the child a fresh
+ * eventfd under the same number so that an fd handed out by event_fd()
+ * before the fork stays valid.
+ */
+static void
+ev_atfork_child(void)
+{
+	pthread_mutex_init(&ev.lock, NULL);
+	ev.head = 0;
+	ev.count = 0;
+
+	if (ev.efd != -1) {
+		int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if (fd != -1) {
+			if (dup2(fd, ev.efd) != -1) {
+				fcntl(ev.efd, F_SETFD, FD_CLOEXEC);
+			}
+			close(fd);
+		}
+	}
+}
+
+static void
+ev_init(void)
+{
+	pthread_atfork(NULL, NULL, ev_atfork_child);
+}
+
+static void
+ev_copy(char *dst, size_t size, const char *src)
+{
+	size_t len;
+
+	if (src == NULL) {
+		dst[0] = '\0';
+		return;
+	}
+
+	len = strnlen(src, size - 1);
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+/*
+ * Whether set_event_buffer() enabled the buffer, for callers to skip
+ * gathering an event. May be called without the GIL.
+ */
+bool
+tnpam_events_enabled(void)
+{
+	return atomic_load_explicit(&ev.enabled, memory_order_relaxed);
+}
+
+/*
+ * Record a PAM call if the event buffer is enabled. May be called without
+ * the GIL.
+ */
+void
+tnpam_events_record(tnpam_op_t op, pamcode_t code, const char *service,
+		    const char *user, const char *rhost, uint64_t latency_ns)
+{
+	tnpam_event_t *event;
+	struct timespec now;
+	uint64_t one = 1;
+
+	if (!atomic_load_explicit(&ev.enabled, memory_order_relaxed)) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	pthread_mutex_lock(&ev.lock);
+	if ((ev.ring == NULL) || (ev.count == ev.size)) {
+		pthread_mutex_unlock(&ev.lock);
+		atomic_fetch_add_explicit(&ev.lost, 1, memory_order_relaxed);
+		return;
+	}
+
+	event = &ev.ring[(ev.head + ev.count) % ev.size];
+	event->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL +
+			      (uint64_t)now.tv_nsec;
+	event->latency_ns = latency_ns;
+	event->op = (int32_t)op;
+	event->code = code;
+	ev_copy(event->user, sizeof(event->user), user);
+	ev_copy(event->service, sizeof(event->service), service);
+	ev_copy(event->rhost, sizeof(event->rhost), rhost);
+
+	// Only the first pending event needs to wake the consumer
+	if ((ev.count++ == 0) && (ev.efd != -1)) {
+		(void)!write(ev.efd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&ev.lock);
+
+	atomic_fetch_add_explicit(&ev.recorded, 1, memory_order_relaxed);
+}
+
+PyObject *
+py_tnpam_set_event_buffer(PyObject *self, PyObject *const *args,
+			  Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"size",
+		NULL
+	};
+	Py_ssize_t size = 0;
+	tnpam_event_t *ring = NULL, *old = NULL;
+	uint64_t cleared;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$n", kwlist, &size)) {
+		return NULL;
+	}
+
+	if ((size < 0) || (size > TNPAM_EV_SIZE_MAX)) {
+		PyErr_Format(PyExc_ValueError,
+			     "size must be between 0 and %d", TNPAM_EV_SIZE_MAX);
+		return NULL;
+	}
+
+	if (size > 0) {
+		ring = PyMem_RawMalloc((size_t)size * sizeof(tnpam_event_t));
+		if (ring == NULL) {
+			return PyErr_NoMemory();
+		}
+	}
+
+	pthread_once(&ev.once, ev_init);
+
+	// Pending events are discarded along with the old buffer
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&ev.lock);
+	old = ev.ring;
+	ev.ring = ring;
+	ev.size = (size_t)size;
+	ev.head = 0;
+	ev.count = 0;
+	if (ev.efd != -1) {
+		(void)!read(ev.efd, &cleared, sizeof(cleared));
+	}
+	atomic_store(&ev.enabled, ring != NULL);
+	pthread_mutex_unlock(&ev.lock);
+	Py_END_ALLOW_THREADS
+
+	PyMem_RawFree(old);
+	Py_RETURN_NONE;
+}
+
+PyObject *
+py_tnpam_get_event_buffer(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	size_t size, pending;
+
+	pthread_mutex_lock(&ev.lock);
+	size = ev.size;
+	pending = ev.count;
+	pthread_mutex_unlock(&ev.lock);
+
+	return Py_BuildValue(
+		"{s:n,s:n,s:K,s:K}",
+		"size", (Py_ssize_t)size,
+		"pending", (Py_ssize_t)pending,
+		"recorded", (unsigned long long)atomic_load(&ev.recorded),
+		"lost", (unsigned long long)atomic_load(&ev.lost));
+}
+
+PyObject *
+py_tnpam_event_fd(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	uint64_t one = 1;
+	int fd, err = 0;
+
+	pthread_once(&ev.once, ev_init);
+
+	pthread_mutex_lock(&ev.lock);
+	if (ev.efd == -1) {
+		ev.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (ev.efd == -1) {
+			err = errno;
+		} else if (ev.count > 0) {
+			(void)!write(ev.efd, &one, sizeof(one));
+		}
+	}
+	fd = ev.efd;
+	pthread_mutex_unlock(&ev.lock);
+
+	if (fd == -1) {
+		errno = err;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+
+	return PyLong_FromLong(fd);
+}
+
+/* Convert a field to str, None if empty */
+static PyObject *
+ev_str(const char *s, bool none_if_empty)
+{
+	if (none_if_empty && (*s == '\0')) {
+		Py_RETURN_NONE;
+	}
+
+	return PyUnicode_DecodeUTF8(s, (Py_ssize_t)strlen(s), "surrogateescape");
+}
+
+static PyObject *
+ev_to_py(tnpam_state_t *state, const tnpam_event_t *event)
+{
+	PyObject *out = NULL;
+	PyObject *fields[7] = { NULL };
+	size_t i;
+
+	fields[0] = PyFloat_FromDouble((double)event->timestamp_ns / 1e9);
+	fields[1] = PyUnicode_InternFromString(tnpam_op_name(event->op));
+	fields[2] = ev_str(event->service, false);
+	fields[3] = ev_str(event->user, true);
+	fields[4] = ev_str(event->rhost, true);
+	if ((event->code >= 0) && (event->code < _PAM_RETURN_VALUES)) {
+		fields[5] = tnpam_enum_member(state, TNPAM_ENUM_PAM_CODE,
+					      event->code);
+	} else {
+		fields[5] = PyLong_FromLong(event->code);
+	}
+	fields[6] = PyLong_FromUnsignedLongLong(event->latency_ns);
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		if (fields[i] == NULL) {
+			goto fail;
+		}
+	}
+
+	out = PyStructSequence_New(state->auth_event_type);
+	if (out == NULL) {
+		goto fail;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		PyStructSequence_SET_ITEM(out, (Py_ssize_t)i, fields[i]);
+	}
+	return out;
+
+fail:
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		Py_XDECREF(fields[i]);
+	}
+	return NULL;
+}
+
+PyObject *
+py_tnpam_drain_events(PyObject *self, PyObject *const *args,
+		      Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"max",
+		NULL
+	};
+	tnpam_state_t *state = NULL;
+	tnpam_event_t *batch = NULL;
+	Py_ssize_t max = PY_SSIZE_T_MAX, i;
+	PyObject *py_max = NULL, *out = NULL;
+	size_t count = 0, n;
+	uint64_t cleared;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$O", kwlist, &py_max)) {
+		return NULL;
+	}
+
+	if ((py_max != NULL) && (py_max != Py_None)) {
+		max = PyNumber_AsSsize_t(py_max, PyExc_OverflowError);
+		if ((max == -1) && PyErr_Occurred()) {
+			return NULL;
+		}
+	}
+
+	if (max < 0) {
+		PyErr_SetString(PyExc_ValueError, "max must not be negative");
+		return NULL;
+	}
+
+	state = py_get_pam_state(self);
+	if (state == NULL) {
+		return NULL;
+	}
+
+	// Size the copy for what is pending now. More events arriving in the
+	// meantime are left for the next call.
+	pthread_mutex_lock(&ev.lock);
+	count = ev.count;
+	pthread_mutex_unlock(&ev.lock);
+
+	if ((size_t)max < count) {
+		count = (size_t)max;
+	}
+
+	if (count > 0) {
+		batch = PyMem_RawMalloc(count * sizeof(tnpam_event_t));
+		if (batch == NULL) {
+			return PyErr_NoMemory();
+		}
+	}
+
+	// Copy out under the lock and convert afterwards so that recording
+	// threads are blocked for a memcpy at most
+	pthread_mutex_lock(&ev.lock);
+	if (count > ev.count) {
+		count = ev.count;
+	}
+	for (n = 0; n < count; n++) {
+		batch[n] = ev.ring[ev.head];
+		ev.head = (ev.head + 1) % ev.size;
+	}
+	ev.count -= count;
+	if ((ev.count == 0) && (ev.efd != -1)) {
+		(void)!read(ev.efd, &cleared, sizeof(cleared));
+	}
+	pthread_mutex_unlock(&ev.lock);
+
+	out = PyTuple_New((Py_ssize_t)count);
+	if (out == NULL) {
+		goto cleanup;
+	}
+
+	for (i = 0; i < (Py_ssize_t)count; i++) {
+		PyObject *event = ev_to_py(state, &batch[i]);
+
+		if (event == NULL) {
+			Py_CLEAR(out);
+			goto cleanup;
+		}
+		PyTuple_SET_ITEM(out, i, event);
+	}
+
+cleanup:
+	PyMem_RawFree(batch);
+	return out;
+}
+
+bool
+init_auth_event_type(PyObject *module_ref)
+{
+	tnpam_state_t *state = py_get_pam_state(module_ref);
+
+	state->auth_event_type = PyStructSequence_NewType(&auth_event_desc);
+	if (state->auth_event_type == NULL) {
+		return false;
+	}
+
+	return PyModule_AddObjectRef(module_ref, "AuthEvent",
+				     (PyObject *)state->auth_event_type) == 0;
+}
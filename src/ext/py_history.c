@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include "truenas_pypam.h"
+
+/*
+ * Conversation message history.
+ *
+ * Each conversation with a PAM module appends one tuple of struct_pam_message
+ * to the history of the context. The history is a fixed-size ring so that
+ * long-lived contexts (sessions) and chatty modules don't grow memory usage
+ * without bound; once full the oldest conversation is dropped. All functions
+ * here require the GIL. Access after init is serialized with a critical
+ * section on the owning context for free-threaded builds.
+ */
+
+int
+tnpam_history_init(tnpam_history_t *hist, Py_ssize_t capacity)
+{
+	if (capacity < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"message_history_size must not be negative");
+		return -1;
+	}
+
+	hist->items = NULL;
+	hist->capacity = capacity;
+	hist->start = 0;
+	hist->len = 0;
+
+	if (capacity == 0) {
+		return 0;
+	}
+
+	hist->items = PyMem_Calloc(capacity, sizeof(PyObject *));
+	if (hist->items == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+tnpam_history_clear(tnpam_history_t *hist)
+{
+	Py_ssize_t i;
+
+	for (i = 0; i < hist->len; i++) {
+		Py_CLEAR(hist->items[(hist->start + i) % hist->capacity]);
+	}
+
+	PyMem_Free(hist->items);
+	hist->items = NULL;
+	hist->capacity = 0;
+	hist->start = 0;
+	hist->len = 0;
+}
+
+/*
+ * Append a new reference to item to the history of ctx, evicting the oldest
+ * entry if full. This cannot fail.
+ */
+void
+tnpam_history_append(tnpam_ctx_t *ctx, PyObject *item)
+{
+	tnpam_history_t *hist = &ctx->conv_data.messages;
+	PyObject *old = NULL;
+
+	if (hist->capacity == 0) {
+		return;
+	}
+
+	Py_BEGIN_CRITICAL_SECTION(ctx);
+	if (hist->len < hist->capacity) {
+		hist->items[(hist->start + hist->len) % hist->capacity] = Py_NewRef(item);
+		hist->len++;
+	} else {
+		// Full: overwrite oldest
+		old = hist->items[hist->start];
+		hist->items[hist->start] = Py_NewRef(item);
+		hist->start = (hist->start + 1) % hist->capacity;
+	}
+	Py_END_CRITICAL_SECTION();
+
+	// Release evicted entry outside of the critical section since its
+	// destructor may run arbitrary code.
+	Py_XDECREF(old);
+}
+
+/* Borrowed reference to entry idx (oldest first). idx must be in range. */
+static PyObject *
+history_get(tnpam_history_t *hist, Py_ssize_t idx)
+{
+	return hist->items[(hist->start + idx) % hist->capacity];
+}
+
+PyObject *
+tnpam_history_tuple(tnpam_ctx_t *ctx)
+{
+	tnpam_history_t *hist = &ctx->conv_data.messages;
+	PyObject *out = NULL;
+	Py_ssize_t i;
+
+	Py_BEGIN_CRITICAL_SECTION(ctx);
+	out = PyTuple_New(hist->len);
+	if (out != NULL) {
+		for (i = 0; i < hist->len; i++) {
+			PyTuple_SET_ITEM(out, i, Py_NewRef(history_get(hist, i)));
+		}
+	}
+	Py_END_CRITICAL_SECTION();
+
+	return out;
+}
+
+/*
+ * MessageHistory: read-only live sequence view of the history of a context.
+ */
+typedef struct {
+	PyObject_HEAD
+	tnpam_ctx_t *ctx;
+} tnpam_history_view_t;
+
+static void
+history_view_dealloc(tnpam_history_view_t *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+
+	Py_CLEAR(self->ctx);
+	tp->tp_free((PyObject *)self);
+	Py_DECREF(tp);
+}
+
+static Py_ssize_t
+history_view_len(tnpam_history_view_t *self)
+{
+	// Include conversations answered by conversation_responses
+	Py_ssize_t len;
+
+	if (!tnpam_conv_flush_pending(self->ctx)) {
+		return -1;
+	}
+
+	Py_BEGIN_CRITICAL_SECTION(self->ctx);
+	len = self->ctx->conv_data.messages.len;
+	Py_END_CRITICAL_SECTION();
+
+	return len;
+}
+
+static PyObject *
+history_view_item(tnpam_history_view_t *self, Py_ssize_t idx)
+{
+	tnpam_history_t *hist = &self->ctx->conv_data.messages;
+	PyObject *out = NULL;
+
+	if (!tnpam_conv_flush_pending(self->ctx)) {
+		return NULL;
+	}
+
+	// Negative indices have already been adjusted using sq_length
+	Py_BEGIN_CRITICAL_SECTION(self->ctx);
+	if ((idx >= 0) && (idx < hist->len)) {
+		out = Py_NewRef(history_get(hist, idx));
+	}
+	Py_END_CRITICAL_SECTION();
+
+	if (out == NULL) {
+		PyErr_SetString(PyExc_IndexError, "message history index out of range");
+	}
+
+	return out;
+}
+
+static PyObject *
+history_view_repr(tnpam_history_view_t *self)
+{
+	Py_ssize_t len;
+
+	if (!tnpam_conv_flush_pending(self->ctx)) {
+		return NULL;
+	}
+
+	Py_BEGIN_CRITICAL_SECTION(self->ctx);
+	len = self->ctx->conv_data.messages.len;
+	Py_END_CRITICAL_SECTION();
+
+	return PyUnicode_FromFormat("MessageHistory(len=%zd, maxlen=%zd)",
+				    len, self->ctx->conv_data.messages.capacity);
+}
+
+static PyObject *
+history_view_get_maxlen(tnpam_history_view_t *self, void *closure)
+{
+	return PyLong_FromSsize_t(self->ctx->conv_data.messages.capacity);
+}
+
+static PyGetSetDef history_view_getsetters[] = {
+	{
+		.name = "maxlen",
+		.get = (getter)history_view_get_maxlen,
+		.doc = "int: maximum number of conversations retained",
+	},
+	{NULL}
+};
+
+PyDoc_STRVAR(PyPamHistory_Type__doc__,
+"MessageHistory\n"
+"--------------\n\n"
+"Read-only sequence view of the conversation message history of a\n"
+"PamContext. Each item is a tuple of struct_pam_message for one\n"
+"conversation, oldest first. The view is live: it reflects conversations\n"
+"that happen after it was obtained without copying the history.\n"
+);
+
+static PyType_Slot history_view_slots[] = {
+	{Py_tp_doc, (void *)PyPamHistory_Type__doc__},
+	{Py_tp_dealloc, history_view_dealloc},
+	{Py_tp_repr, history_view_repr},
+	{Py_sq_length, history_view_len},
+	{Py_sq_item, history_view_item},
+	{Py_tp_getset, history_view_getsetters},
+	{0, NULL}
+};
+
+static PyType_Spec history_view_spec = {
+	.name = MODULE_NAME ".MessageHistory",
+	.basicsize = sizeof(tnpam_history_view_t),
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_SEQUENCE |
+		 Py_TPFLAGS_DISALLOW_INSTANTIATION,
+	.slots = history_view_slots,
+};
+
+bool init_history_type(PyObject *module_ref)
+{
+	tnpam_state_t *state = py_get_pam_state(module_ref);
+
+	state->history_type = (PyTypeObject *)PyType_FromModuleAndSpec(module_ref,
+								       &history_view_spec,
+								       NULL);
+	return state->history_type != NULL;
+}
+
+PyObject *
+tnpam_history_view_new(tnpam_ctx_t *ctx)
+{
+	tnpam_history_view_t *view = NULL;
+
+	view = PyObject_New(tnpam_history_view_t,
+			    tnpam_ctx_state(ctx)->history_type);
+	if (view == NULL) {
+		return NULL;
+	}
+
+	view->ctx = (tnpam_ctx_t *)Py_NewRef((PyObject *)ctx);
+	return (PyObject *)view;
+}
@@ -0,0 +1,315 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include <pthread.h>
+#include "truenas_pypam.h"
+
+/*
+ * Lock domains: serialization of PAM calls beyond the per-handle lock.
+ *
+ * Some PAM modules are not thread-safe (static buffers, non-reentrant NSS
+ * calls, global library state). Rather than forcing applications to wrap
+ * every context in one global python lock, contexts may share a lock domain
+ * by service name, by an application-chosen group name or process-wide. The
+ * domain lock is taken in PYPAM_LOCK (before the handle lock and without the
+ * GIL) and held for the whole PAM call including conversations, so only the
+ * stacks that need it are serialized.
+ *
+ * Domains and the per-service defaults set with set_lock_policy() live in
+ * process-wide C memory shared by all interpreters since module thread-safety
+ * is a property of the process. Domains are never freed.
+ */
+
+static const tnpam_enum_entry_t lock_policy_tbl[] = {
+	{ TNPAM_LOCK_HANDLE, "HANDLE" },
+	{ TNPAM_LOCK_SERVICE, "SERVICE" },
+	{ TNPAM_LOCK_GROUP, "GROUP" },
+	{ TNPAM_LOCK_GLOBAL, "GLOBAL" },
+};
+
+const tnpam_enum_spec_t tnpam_lock_policy_enum_spec = {
+	.name = "LockPolicy",
+	.entries = lock_policy_tbl,
+	.count = ARRAY_SIZE(lock_policy_tbl),
+};
+
+typedef struct tnpam_lock_rule {
+	struct tnpam_lock_rule *next;
+	char *service;		/* NULL for the default of all services */
+	tnpam_lock_policy_t policy;
+	char *group;
+} tnpam_lock_rule_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_once_t atfork_once;
+	tnpam_lock_rule_t *rules;
+	tnpam_lock_domain_t *domains;
+} lock_registry = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.atfork_once = PTHREAD_ONCE_INIT,
+};
+
+/*
+ * Threads holding domain locks at the time of fork() do not exist in the
+ * child, so reinitialize every lock there.
+ */
+static void
+lock_atfork_child(void)
+{
+	tnpam_lock_domain_t *dom;
+	pthread_mutexattr_t attr;
+
+	pthread_mutex_init(&lock_registry.lock, NULL);
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	for (dom = lock_registry.domains; dom != NULL; dom = dom->next) {
+		pthread_mutex_init(&dom->lock, &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void
+lock_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, lock_atfork_child);
+}
+
+static bool
+lock_name_eq(const char *a, const char *b)
+{
+	if ((a == NULL) || (b == NULL)) {
+		return a == b;
+	}
+
+	return strcmp(a, b) == 0;
+}
+
+/*
+ * Find or create the domain for policy / name. Called with the registry
+ * lock held. Returns NULL on allocation failure.
+ */
+static tnpam_lock_domain_t *
+lock_domain_get(tnpam_lock_policy_t policy, const char *name)
+{
+	tnpam_lock_domain_t *dom;
+	pthread_mutexattr_t attr;
+
+	for (dom = lock_registry.domains; dom != NULL; dom = dom->next) {
+		if ((dom->policy == policy) && lock_name_eq(dom->name, name)) {
+			return dom;
+		}
+	}
+
+	dom = calloc(1, sizeof(tnpam_lock_domain_t));
+	if (dom == NULL) {
+		return NULL;
+	}
+
+	if (name != NULL) {
+		dom->name = strdup(name);
+		if (dom->name == NULL) {
+			free(dom);
+			return NULL;
+		}
+	}
+
+	if (pthread_mutexattr_init(&attr) != 0) {
+		free(dom->name);
+		free(dom);
+		return NULL;
+	}
+
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(&dom->lock, &attr) != 0) {
+		pthread_mutexattr_destroy(&attr);
+		free(dom->name);
+		free(dom);
+		return NULL;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	dom->policy = policy;
+	dom->next = lock_registry.domains;
+	lock_registry.domains = dom;
+	return dom;
+}
+
+/* Called with the registry lock held */
+static tnpam_lock_rule_t **
+lock_rule_find(const char *service)
+{
+	tnpam_lock_rule_t **rulep;
+
+	for (rulep = &lock_registry.rules; *rulep != NULL; rulep = &(*rulep)->next) {
+		if (lock_name_eq((*rulep)->service, service)) {
+			break;
+		}
+	}
+
+	return rulep;
+}
+
+/*
+ * Convert a LockPolicy argument. None is returned as -1. lock_group must be
+ * given for, and only for, LockPolicy.GROUP.
+ */
+static int
+lock_parse_policy(tnpam_state_t *state, PyObject *obj, const char *group,
+		  int *policy_out)
+{
+	int policy = -1;
+	int ret;
+
+	if ((obj != NULL) && (obj != Py_None)) {
+		ret = tnpam_enum_value(state, TNPAM_ENUM_LOCK_POLICY, obj,
+				       &policy);
+		if (ret < 0) {
+			return -1;
+		} else if (ret == 0) {
+			PyErr_SetString(PyExc_TypeError,
+					"lock_policy must be a LockPolicy");
+			return -1;
+		}
+	}
+
+	if ((policy == TNPAM_LOCK_GROUP) != (group != NULL)) {
+		PyErr_SetString(PyExc_ValueError,
+				"lock_group is required for and only valid with "
+				"LockPolicy.GROUP");
+		return -1;
+	}
+
+	*policy_out = policy;
+	return 0;
+}
+
+/*
+ * Resolve the lock domain of a context for service. policy is the
+ * lock_policy argument; if it is NULL or None the default registered with
+ * set_lock_policy() is used. *out is set to NULL for LockPolicy.HANDLE.
+ * GIL must be held.
+ */
+int
+tnpam_lock_resolve(tnpam_state_t *state, const char *service, PyObject *policy,
+		   const char *group, tnpam_lock_domain_t **out)
+{
+	tnpam_lock_domain_t *dom = NULL;
+	const char *name = NULL;
+	int pol;
+
+	if (lock_parse_policy(state, policy, group, &pol) < 0) {
+		return -1;
+	}
+
+	pthread_once(&lock_registry.atfork_once, lock_register_atfork);
+	pthread_mutex_lock(&lock_registry.lock);
+
+	if (pol == -1) {
+		tnpam_lock_rule_t *rule = *lock_rule_find(service);
+
+		if (rule == NULL) {
+			rule = *lock_rule_find(NULL);
+		}
+
+		pol = rule ? rule->policy : TNPAM_LOCK_HANDLE;
+		group = rule ? rule->group : NULL;
+	}
+
+	switch (pol) {
+	case TNPAM_LOCK_SERVICE:
+		name = service;
+		break;
+	case TNPAM_LOCK_GROUP:
+		name = group;
+		break;
+	default:
+		break;
+	}
+
+	if (pol != TNPAM_LOCK_HANDLE) {
+		dom = lock_domain_get(pol, name);
+	}
+
+	pthread_mutex_unlock(&lock_registry.lock);
+
+	if ((pol != TNPAM_LOCK_HANDLE) && (dom == NULL)) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	*out = dom;
+	return 0;
+}
+
+/*
+ * LockPolicy member for a context's domain. GIL must be held.
+ */
+PyObject *
+tnpam_lock_policy_member(tnpam_state_t *state, tnpam_lock_domain_t *dom)
+{
+	return tnpam_enum_member(state, TNPAM_ENUM_LOCK_POLICY,
+				 dom ? dom->policy : TNPAM_LOCK_HANDLE);
+}
+
+PyObject *
+py_tnpam_set_lock_policy(PyObject *self, PyObject *const *args,
+			 Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"lock_policy",
+		"service_name",
+		"lock_group",
+		NULL
+	};
+	tnpam_state_t *state = py_get_pam_state(self);
+	PyObject *policy = NULL;
+	const char *service = NULL;
+	const char *group = NULL;
+	tnpam_lock_rule_t **rulep, *rule = NULL, *old = NULL;
+	int pol;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "O|$zz", kwlist,
+			      &policy, &service, &group)) {
+		return NULL;
+	}
+
+	if (lock_parse_policy(state, policy, group, &pol) < 0) {
+		return NULL;
+	}
+
+	// Allocate before taking the lock. None removes the rule.
+	if (pol != -1) {
+		rule = calloc(1, sizeof(tnpam_lock_rule_t));
+		if ((rule == NULL) ||
+		    ((service != NULL) && ((rule->service = strdup(service)) == NULL)) ||
+		    ((group != NULL) && ((rule->group = strdup(group)) == NULL))) {
+			if (rule != NULL) {
+				free(rule->service);
+				free(rule);
+			}
+			return PyErr_NoMemory();
+		}
+		rule->policy = pol;
+	}
+
+	pthread_mutex_lock(&lock_registry.lock);
+	rulep = lock_rule_find(service);
+	old = *rulep;
+	if (rule != NULL) {
+		rule->next = old ? old->next : NULL;
+		*rulep = rule;
+	} else if (old != NULL) {
+		*rulep = old->next;
+	}
+	pthread_mutex_unlock(&lock_registry.lock);
+
+	if (old != NULL) {
+		free(old->service);
+		free(old->group);
+		free(old);
+	}
+
+	Py_RETURN_NONE;
+}
@@ -0,0 +1,371 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include "truenas_pypam.h"
+
+/*
+ * login(): run authenticate / acct_mgmt / setcred / open_session for a
+ * context in one GIL-released section under a single handle lock
+ * acquisition instead of one python -> C transition per call.
+ */
+
+typedef struct {
+	const char *name;	/* step name accepted in steps= */
+	tnpam_op_t op;
+	const char *audit;	/* audit event of the individual method */
+} login_step_entry_t;
+
+static const login_step_entry_t login_step_tbl[] = {
+	{ "authenticate", TNPAM_OP_AUTHENTICATE, MODULE_NAME ".authenticate" },
+	{ "acct_mgmt", TNPAM_OP_ACCT_MGMT, MODULE_NAME ".acct_mgmt" },
+	{ "setcred", TNPAM_OP_SETCRED, MODULE_NAME ".setcred" },
+	{ "open_session", TNPAM_OP_OPEN_SESSION, MODULE_NAME ".open_session" },
+};
+
+#define LOGIN_MAX_STEPS ARRAY_SIZE(login_step_tbl)
+
+typedef struct {
+	const login_step_entry_t *steps[LOGIN_MAX_STEPS];
+	int flags[LOGIN_MAX_STEPS];
+	size_t count;
+	size_t completed;	/* number of steps that succeeded */
+	pamcode_t result;	/* result of the last step run */
+} tnpam_login_t;
+
+static PyStructSequence_Field login_result_fields[] = {
+	{"code", "PAMCode of the step that failed, or PAM_SUCCESS"},
+	{"step", "Name of the step that failed, or None if all succeeded"},
+	{"completed", "Tuple of names of the steps that succeeded, in order"},
+	{0},
+};
+
+static PyStructSequence_Desc login_result_desc = {
+	.name = MODULE_NAME ".LoginResult",
+	.fields = login_result_fields,
+	.doc = "Result of PamContext.login().\n\n"
+	       "PAM failures of a step are reported here rather than raised so\n"
+	       "that the caller can tell which stage of the login failed.",
+	.n_in_sequence = 3
+};
+
+#define LOGIN_CODE_IDX 0
+#define LOGIN_STEP_IDX 1
+#define LOGIN_COMPLETED_IDX 2
+
+static const login_step_entry_t *
+login_step_lookup(PyObject *name)
+{
+	size_t i;
+
+	if (!PyUnicode_Check(name)) {
+		PyErr_Format(PyExc_TypeError,
+			     "login step must be str, not %.200s",
+			     Py_TYPE(name)->tp_name);
+		return NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(login_step_tbl); i++) {
+		if (PyUnicode_CompareWithASCIIString(name,
+						     login_step_tbl[i].name) == 0) {
+			return &login_step_tbl[i];
+		}
+	}
+
+	PyErr_Format(PyExc_ValueError, "%R: unknown login step", name);
+	return NULL;
+}
+
+/*
+ * Convert the steps argument (None for all steps in the default order) into
+ * login->steps. Each step may be given at most once.
+ */
+static bool
+login_parse_steps(PyObject *steps, tnpam_login_t *login)
+{
+	PyObject *seq = NULL;
+	Py_ssize_t i, len;
+	size_t j;
+
+	if ((steps == NULL) || (steps == Py_None)) {
+		for (j = 0; j < ARRAY_SIZE(login_step_tbl); j++) {
+			login->steps[j] = &login_step_tbl[j];
+		}
+		login->count = ARRAY_SIZE(login_step_tbl);
+		return true;
+	}
+
+	if (PyUnicode_Check(steps)) {
+		PyErr_SetString(PyExc_TypeError,
+				"steps must be a sequence of step names, not str");
+		return false;
+	}
+
+	seq = PySequence_Fast(steps, "steps must be a sequence of step names");
+	if (seq == NULL) {
+		return false;
+	}
+
+	len = PySequence_Fast_GET_SIZE(seq);
+	if (len == 0) {
+		PyErr_SetString(PyExc_ValueError, "steps must not be empty");
+		goto fail;
+	}
+
+	for (i = 0; i < len; i++) {
+		PyObject *name = PySequence_Fast_GET_ITEM(seq, i);
+		const login_step_entry_t *step = login_step_lookup(name);
+
+		if (step == NULL) {
+			goto fail;
+		}
+
+		for (j = 0; j < login->count; j++) {
+			if (login->steps[j] == step) {
+				PyErr_Format(PyExc_ValueError,
+					     "%R: login step given more than once",
+					     name);
+				goto fail;
+			}
+		}
+
+		login->steps[login->count++] = step;
+	}
+
+	Py_DECREF(seq);
+	return true;
+
+fail:
+	Py_DECREF(seq);
+	return false;
+}
+
+/*
+ * Check the context state the way the individual methods do, compute the
+ * PAM flags of every step and emit their audit events. All audit events are
+ * raised before any step runs.
+ */
+static bool
+login_prepare(tnpam_ctx_t *self, tnpam_login_t *login, boolean_t silent,
+	      boolean_t disallow_null_authtok)
+{
+	boolean_t authenticated = self->authenticated;
+	PyObject *cred_op = NULL;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < login->count; i++) {
+		tnpam_op_t op = login->steps[i]->op;
+
+		if (op == TNPAM_OP_AUTHENTICATE) {
+			authenticated = B_TRUE;
+		} else if (op == TNPAM_OP_OPEN_SESSION) {
+			if (!authenticated) {
+				PyErr_SetString(PyExc_ValueError,
+						"pam_authenticate has not been "
+						"successfully called on pam handle.");
+				return false;
+			}
+
+			if (self->session_opened) {
+				PyErr_SetString(PyExc_ValueError,
+						"session is already opened for "
+						"this handle.");
+				return false;
+			}
+		}
+	}
+
+	for (i = 0; i < login->count; i++) {
+		const login_step_entry_t *step = login->steps[i];
+		int flags = silent ? PAM_SILENT : 0;
+
+		switch (step->op) {
+		case TNPAM_OP_AUTHENTICATE:
+		case TNPAM_OP_ACCT_MGMT:
+			if (disallow_null_authtok) {
+				flags |= PAM_DISALLOW_NULL_AUTHTOK;
+			}
+			ret = PySys_Audit(step->audit, "O", self->user);
+			break;
+		case TNPAM_OP_SETCRED:
+			flags |= PAM_ESTABLISH_CRED;
+			cred_op = tnpam_enum_member(tnpam_ctx_state(self),
+						    TNPAM_ENUM_CRED_OP,
+						    PAM_ESTABLISH_CRED);
+			if (cred_op == NULL) {
+				return false;
+			}
+			ret = PySys_Audit(step->audit, "OO", self->user, cred_op);
+			Py_DECREF(cred_op);
+			break;
+		default:
+			ret = PySys_Audit(step->audit, "O", self->user);
+			break;
+		}
+
+		if (ret < 0) {
+			return false;
+		}
+
+		login->flags[i] = flags;
+	}
+
+	return true;
+}
+
+static PyObject *
+login_completed(tnpam_login_t *login)
+{
+	PyObject *out = NULL;
+	size_t i;
+
+	out = PyTuple_New(login->completed);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < login->completed; i++) {
+		PyObject *name = PyUnicode_InternFromString(login->steps[i]->name);
+		if (name == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(out, i, name);
+	}
+
+	return out;
+}
+
+static PyObject *
+login_result(tnpam_ctx_t *self, tnpam_login_t *login)
+{
+	tnpam_state_t *state = tnpam_ctx_state(self);
+	PyObject *out = NULL;
+	PyObject *code = NULL;
+	PyObject *step = NULL;
+	PyObject *completed = NULL;
+
+	if ((login->result == TNPAM_OP_BAD_STATE) ||
+	    (login->result == TNPAM_OP_RATE_LIMITED) ||
+	    (login->result == TNPAM_OP_TIMED_OUT) ||
+	    (login->result == TNPAM_OP_WORKER_LOST) ||
+	    (login->result == TNPAM_OP_WORKER_BUSY)) {
+		// Another thread changed the session state since login_prepare(),
+		// set_auth_rate_limit() refused the attempt, the deadline
+		// passed or the PamProcessPool worker is unavailable
+		return tnpam_op_result(self, login->steps[login->completed]->op,
+				       login->result);
+	}
+
+	// Preserve exceptions raised by the conversation callback
+	if (PyErr_Occurred()) {
+		return NULL;
+	}
+
+	if ((login->result >= 0) && (login->result < _PAM_RETURN_VALUES)) {
+		code = tnpam_enum_member(state, TNPAM_ENUM_PAM_CODE,
+					 login->result);
+	} else {
+		code = PyLong_FromLong(login->result);
+	}
+	if (code == NULL) {
+		return NULL;
+	}
+
+	if (login->result == PAM_SUCCESS) {
+		step = Py_NewRef(Py_None);
+	} else {
+		step = PyUnicode_InternFromString(login->steps[login->completed]->name);
+		if (step == NULL) {
+			goto fail;
+		}
+	}
+
+	completed = login_completed(login);
+	if (completed == NULL) {
+		goto fail;
+	}
+
+	out = PyStructSequence_New(state->login_result_type);
+	if (out == NULL) {
+		goto fail;
+	}
+
+	PyStructSequence_SET_ITEM(out, LOGIN_CODE_IDX, code);
+	PyStructSequence_SET_ITEM(out, LOGIN_STEP_IDX, step);
+	PyStructSequence_SET_ITEM(out, LOGIN_COMPLETED_IDX, completed);
+	return out;
+
+fail:
+	Py_XDECREF(code);
+	Py_XDECREF(step);
+	Py_XDECREF(completed);
+	return NULL;
+}
+
+PyObject *
+py_tnpam_login(tnpam_ctx_t *self, PyObject *const *args, Py_ssize_t nargs,
+	       PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"steps",
+		"silent",
+		"disallow_null_authtok",
+		"timeout",
+		NULL
+	};
+	PyObject *steps = NULL;
+	PyObject *py_timeout = NULL;
+	uint64_t deadline;
+	boolean_t silent = B_FALSE;
+	boolean_t disallow_null_authtok = B_FALSE;
+	tnpam_login_t login = { 0 };
+	size_t i;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$OppO", kwlist,
+			      &steps,
+			      &silent,
+			      &disallow_null_authtok,
+			      &py_timeout)) {
+		return NULL;
+	}
+
+	// One deadline for all of the steps
+	if (!tnpam_op_deadline(self, py_timeout, &deadline)) {
+		return NULL;
+	}
+
+	if (!login_parse_steps(steps, &login)) {
+		return NULL;
+	}
+
+	if (tnpam_resume_busy(self)) {
+		return NULL;
+	}
+
+	if (!login_prepare(self, &login, silent, disallow_null_authtok)) {
+		return NULL;
+	}
+
+	PYPAM_LOCK(self);
+	for (i = 0; i < login.count; i++) {
+		login.result = tnpam_op_call(self, login.steps[i]->op,
+					     login.flags[i], deadline);
+		if (login.result != PAM_SUCCESS) {
+			break;
+		}
+		login.completed++;
+	}
+	PYPAM_UNLOCK(self);
+
+	return login_result(self, &login);
+}
+
+bool
+init_login_result_type(PyObject *module_ref)
+{
+	tnpam_state_t *state = py_get_pam_state(module_ref);
+
+	state->login_result_type = PyStructSequence_NewType(&login_result_desc);
+	return state->login_result_type != NULL;
+}
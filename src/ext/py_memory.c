@@ -0,0 +1,464 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include <pthread.h>
+#include "truenas_pypam.h"
+
+#if defined(__GLIBC__) && \
+    ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 33)))
+#include <malloc.h>
+#define TNPAM_HAVE_MALLINFO2 1
+#endif
+
+/*
+ * Memory accounting.
+ *
+ * Python-side allocations (context objects, message tuples, the history
+ * ring, responder tables) go through the python allocators and so are
+ * already visible to tracemalloc. What it can't see is the memory libpam
+ * and the service modules allocate for a handle with plain malloc(). That
+ * is estimated from the growth of the C heap across the first
+ * pam_start_confdir() of each service and confdir, since mallinfo2() locks
+ * and walks every arena and is too costly to call on every start. Later
+ * handles of the same stack reuse the cached estimate. Each live context
+ * traces its estimate in TNPAM_TRACEMALLOC_DOMAIN,
+ * keyed by the address of the context so that the trace can't collide with
+ * that of another handle reusing the address after pam_end().
+ *
+ * Counters are process-wide relaxed atomics like the latency histograms in
+ * py_stats.c so that they can be updated without the GIL.
+ */
+
+static const char *mem_counter_names[] = {
+	[TNPAM_MEM_CONTEXTS] = "contexts",
+	[TNPAM_MEM_OPEN_SESSIONS] = "open_sessions",
+	[TNPAM_MEM_CONVERSATIONS] = "pending_conversations",
+	[TNPAM_MEM_HANDLE_BYTES] = "handle_bytes",
+	[TNPAM_MEM_RESPONSES] = "responses",
+	[TNPAM_MEM_RESPONSE_BYTES] = "response_bytes",
+	[TNPAM_MEM_SECRET_BYTES] = "secret_bytes",
+};
+
+_Static_assert(
+	TNPAM_MEM_COUNT == ARRAY_SIZE(mem_counter_names),
+	"memory counter name table needs updating"
+);
+
+static _Atomic int64_t mem_counters[TNPAM_MEM_COUNT];
+
+/*
+ * Cached handle estimates, one per service and confdir. The table is small
+ * and fixed-size; when it is full the oldest entry is replaced so that an
+ * application cycling through many confdirs measures again rather than
+ * growing the table.
+ */
+#define MEM_ESTIMATES_MAX 64
+
+typedef struct {
+	char *service;
+	char *confdir;		/* NULL for the default */
+	size_t bytes;
+} mem_estimate_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_once_t atfork_once;
+	mem_estimate_t entries[MEM_ESTIMATES_MAX];
+	size_t next;
+} mem_estimates = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.atfork_once = PTHREAD_ONCE_INIT,
+};
+
+/*
+ * Adjust a counter. May be called without the GIL.
+ */
+void
+tnpam_mem_add(tnpam_mem_counter_t counter, int64_t delta)
+{
+	atomic_fetch_add_explicit(&mem_counters[counter], delta,
+				  memory_order_relaxed);
+}
+
+/*
+ * Bytes of the C heap currently in use, or 0 if this can't be determined.
+ * May be called without the GIL.
+ */
+static size_t
+mem_heap_used(void)
+{
+#ifdef TNPAM_HAVE_MALLINFO2
+	return mallinfo2().uordblks;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Growth of the C heap since mem_heap_used() returned before. Other
+ * threads may free memory meanwhile, so this is clamped at zero.
+ */
+static size_t
+mem_heap_delta(size_t before)
+{
+	size_t now = mem_heap_used();
+
+	return (now > before) ? now - before : 0;
+}
+
+static void
+mem_estimates_atfork_child(void)
+{
+	pthread_mutex_init(&mem_estimates.lock, NULL);
+}
+
+static void
+mem_estimates_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, mem_estimates_atfork_child);
+}
+
+static bool
+mem_name_eq(const char *a, const char *b)
+{
+	if ((a == NULL) || (b == NULL)) {
+		return a == b;
+	}
+
+	return strcmp(a, b) == 0;
+}
+
+/* Called with the estimates lock held */
+static mem_estimate_t *
+mem_estimate_find(const char *service, const char *confdir)
+{
+	size_t i;
+
+	for (i = 0; i < MEM_ESTIMATES_MAX; i++) {
+		mem_estimate_t *e = &mem_estimates.entries[i];
+
+		if ((e->service != NULL) && mem_name_eq(e->service, service) &&
+		    mem_name_eq(e->confdir, confdir)) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static bool
+mem_estimate_lookup(const char *service, const char *confdir, size_t *bytes)
+{
+	mem_estimate_t *e;
+
+	pthread_mutex_lock(&mem_estimates.lock);
+	if ((e = mem_estimate_find(service, confdir)) != NULL) {
+		*bytes = e->bytes;
+	}
+	pthread_mutex_unlock(&mem_estimates.lock);
+
+	return e != NULL;
+}
+
+/*
+ * Remember the estimate for service / confdir. Failing to copy the names
+ * only means the next start measures again.
+ */
+static void
+mem_estimate_store(const char *service, const char *confdir, size_t bytes)
+{
+	mem_estimate_t *e;
+	char *svc_copy, *cdir_copy = NULL;
+
+	svc_copy = strdup(service);
+	if ((confdir != NULL) && ((cdir_copy = strdup(confdir)) == NULL)) {
+		free(svc_copy);
+		return;
+	}
+	if (svc_copy == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&mem_estimates.lock);
+	if ((e = mem_estimate_find(service, confdir)) != NULL) {
+		// Another thread measured the same stack meanwhile
+		pthread_mutex_unlock(&mem_estimates.lock);
+		free(svc_copy);
+		free(cdir_copy);
+		return;
+	}
+
+	e = &mem_estimates.entries[mem_estimates.next];
+	mem_estimates.next = (mem_estimates.next + 1) % MEM_ESTIMATES_MAX;
+	free(e->service);
+	free(e->confdir);
+	e->service = svc_copy;
+	e->confdir = cdir_copy;
+	e->bytes = bytes;
+	pthread_mutex_unlock(&mem_estimates.lock);
+}
+
+/*
+ * pam_start_confdir() that also returns in *hdl_bytes the estimated heap
+ * usage of the new handle. The C heap is only measured for the first
+ * successful start of each service and confdir. May be called without the
+ * GIL.
+ */
+pamcode_t
+tnpam_mem_start(const char *service, const char *user,
+		const struct pam_conv *conv, const char *confdir,
+		pam_handle_t **hdl, size_t *hdl_bytes)
+{
+	pamcode_t ret;
+	size_t heap;
+
+	pthread_once(&mem_estimates.atfork_once, mem_estimates_register_atfork);
+	if (mem_estimate_lookup(service, confdir, hdl_bytes)) {
+		return pam_start_confdir(service, user, conv, confdir, hdl);
+	}
+
+	heap = mem_heap_used();
+	ret = pam_start_confdir(service, user, conv, confdir, hdl);
+	*hdl_bytes = mem_heap_delta(heap);
+
+	// Nothing to cache without mallinfo2(), or if other threads freed
+	// more than the handle took
+	if ((ret == PAM_SUCCESS) && (*hdl_bytes != 0)) {
+		mem_estimate_store(service, confdir, *hdl_bytes);
+	}
+
+	return ret;
+}
+
+/*
+ * Count a response array (and the strings in it) that is being handed to a
+ * PAM module, which will free() it. May be called without the GIL.
+ */
+void
+tnpam_mem_count_resp(int num_msg, const struct pam_response *resp)
+{
+	size_t bytes = (size_t)num_msg * sizeof(struct pam_response);
+	int i;
+
+	for (i = 0; i < num_msg; i++) {
+		if (resp[i].resp != NULL) {
+			bytes += strlen(resp[i].resp) + 1;
+		}
+	}
+
+	tnpam_mem_add(TNPAM_MEM_RESPONSES, 1);
+	tnpam_mem_add(TNPAM_MEM_RESPONSE_BYTES, (int64_t)bytes);
+}
+
+/*
+ * Account for a context that was successfully set up. GIL must be held.
+ */
+void
+tnpam_mem_ctx_created(tnpam_ctx_t *ctx)
+{
+	tnpam_mem_add(TNPAM_MEM_CONTEXTS, 1);
+	tnpam_mem_add(TNPAM_MEM_HANDLE_BYTES, (int64_t)ctx->hdl_bytes);
+
+	if (ctx->hdl_bytes != 0) {
+		// -2 if tracemalloc is not tracing, which is fine
+		(void)PyTraceMalloc_Track(TNPAM_TRACEMALLOC_DOMAIN,
+					  (uintptr_t)ctx, ctx->hdl_bytes);
+	}
+}
+
+/*
+ * Undo tnpam_mem_ctx_created() when the context is deallocated. GIL must be
+ * held.
+ */
+void
+tnpam_mem_ctx_destroyed(tnpam_ctx_t *ctx)
+{
+	tnpam_mem_add(TNPAM_MEM_CONTEXTS, -1);
+	tnpam_mem_add(TNPAM_MEM_HANDLE_BYTES, -(int64_t)ctx->hdl_bytes);
+
+	if (ctx->hdl_bytes != 0) {
+		(void)PyTraceMalloc_Untrack(TNPAM_TRACEMALLOC_DOMAIN,
+					    (uintptr_t)ctx);
+	}
+}
+
+static bool
+dict_set_size(PyObject *dict, const char *key, size_t val)
+{
+	PyObject *pyval = PyLong_FromSize_t(val);
+	int ret;
+
+	if (pyval == NULL) {
+		return false;
+	}
+
+	ret = PyDict_SetItemString(dict, key, pyval);
+	Py_DECREF(pyval);
+	return ret == 0;
+}
+
+PyObject *
+py_tnpam_memory_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	PyObject *out = NULL;
+	size_t i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TNPAM_MEM_COUNT; i++) {
+		int64_t val = atomic_load_explicit(&mem_counters[i],
+						   memory_order_relaxed);
+		PyObject *pyval = PyLong_FromLongLong(val);
+
+		if (pyval == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		if (PyDict_SetItemString(out, mem_counter_names[i], pyval) < 0) {
+			Py_DECREF(pyval);
+			Py_DECREF(out);
+			return NULL;
+		}
+		Py_DECREF(pyval);
+	}
+
+	if (!dict_set_size(out, "secret_locked_bytes",
+			   tnpam_secret_locked_bytes())) {
+		Py_DECREF(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+static Py_ssize_t
+ctx_sizeof(tnpam_ctx_t *self)
+{
+	tnpam_responder_t *responder = self->conv_data.responder;
+	tnpam_msg_entry_t *entry;
+	Py_ssize_t size;
+	size_t i;
+
+	size = Py_TYPE(self)->tp_basicsize;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	size += self->conv_data.messages.capacity * (Py_ssize_t)sizeof(PyObject *);
+	Py_END_CRITICAL_SECTION();
+
+	if (responder != NULL) {
+		size += sizeof(tnpam_responder_t);
+		for (i = 0; i < ARRAY_SIZE(responder->styles); i++) {
+			if (responder->styles[i].value != NULL) {
+				size += responder->styles[i].len + 1;
+			}
+		}
+	}
+
+	// Setup may have failed before the lock was initialized
+	if (self->registry != NULL) {
+		pthread_mutex_lock(&self->conv_data.pending_lock);
+		for (entry = self->conv_data.pending_head; entry != NULL;
+		     entry = entry->next) {
+			size += sizeof(tnpam_msg_entry_t);
+			if (entry->msg != NULL) {
+				size += strlen(entry->msg) + 1;
+			}
+		}
+		pthread_mutex_unlock(&self->conv_data.pending_lock);
+	}
+
+	return size;
+}
+
+PyObject *
+py_tnpam_ctx_sizeof(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyLong_FromSsize_t(ctx_sizeof(self));
+}
+
+/*
+ * Add the result of obj.__sizeof__() to *total.
+ */
+static bool
+obj_sizeof(PyObject *obj, Py_ssize_t *total)
+{
+	PyObject *res = NULL;
+	Py_ssize_t size;
+
+	res = PyObject_CallMethod(obj, "__sizeof__", NULL);
+	if (res == NULL) {
+		return false;
+	}
+
+	size = PyLong_AsSsize_t(res);
+	Py_DECREF(res);
+	if ((size == -1) && PyErr_Occurred()) {
+		return false;
+	}
+
+	*total += size;
+	return true;
+}
+
+/*
+ * Size of the conversation tuples in the message history. Messages count
+ * their own text. Enum members (msg_style) are shared and so not counted.
+ */
+static bool
+ctx_messages_sizeof(tnpam_ctx_t *self, Py_ssize_t *total)
+{
+	PyObject *history = NULL;
+	Py_ssize_t i, j;
+	bool ok = false;
+
+	if (!tnpam_conv_flush_pending(self)) {
+		return false;
+	}
+
+	history = tnpam_history_tuple(self);
+	if (history == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < PyTuple_GET_SIZE(history); i++) {
+		PyObject *conv = PyTuple_GET_ITEM(history, i);
+
+		if (!obj_sizeof(conv, total)) {
+			goto out;
+		}
+
+		for (j = 0; j < PyTuple_GET_SIZE(conv); j++) {
+			if (!obj_sizeof(PyTuple_GET_ITEM(conv, j), total)) {
+				goto out;
+			}
+		}
+	}
+
+	ok = true;
+out:
+	Py_DECREF(history);
+	return ok;
+}
+
+PyObject *
+py_tnpam_ctx_memory_usage(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored))
+{
+	Py_ssize_t object, messages = 0, handle;
+
+	if (!ctx_messages_sizeof(self, &messages)) {
+		return NULL;
+	}
+
+	object = ctx_sizeof(self);
+	handle = (Py_ssize_t)self->hdl_bytes;
+
+	return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+			     "object", object,
+			     "messages", messages,
+			     "handle", handle,
+			     "total", object + messages + handle);
+}
@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <stddef.h>
+#include <string.h>
+#include "truenas_pypam.h"
+
+/*
+ * struct_pam_message: one message of a PAM conversation.
+ *
+ * Conversations can have several messages per round (pam_faillock, OTP
+ * modules) and every one used to cost a struct sequence, a str and an
+ * enum call. Messages are instead a single variable-size allocation that
+ * holds the raw text inline. msg_style is a MSGStyle member resolved when
+ * the module is loaded and the text is only decoded to str the first time
+ * msg is read.
+ *
+ * Messages are immutable. They behave like the (msg_style, msg) tuple they
+ * used to be for indexing, unpacking, comparison and hashing.
+ */
+
+typedef struct {
+	PyObject_VAR_HEAD	/* ob_size is len + 1 */
+	PyObject *style;	/* MSGStyle member */
+	PyObject *text;		/* decoded msg, NULL until first accessed */
+	Py_ssize_t len;
+	char data[1];		/* NUL terminated text */
+} tnpam_msg_t;
+
+#define MSG_FIELDS 2
+
+/*
+ * Build a message from a struct pam_message. GIL must be held.
+ */
+PyObject *
+tnpam_msg_new(tnpam_state_t *state, const struct pam_message *msg)
+{
+	const char *text = msg->msg ? msg->msg : "";
+	PyObject *style = NULL;
+	tnpam_msg_t *out = NULL;
+	size_t len = strlen(text);
+
+	// Raises ValueError for styles MSGStyle doesn't know
+	style = tnpam_enum_member(state, TNPAM_ENUM_MSG_STYLE, msg->msg_style);
+	if (style == NULL) {
+		return NULL;
+	}
+
+	out = PyObject_NewVar(tnpam_msg_t, state->struct_pam_msg_type, len + 1);
+	if (out == NULL) {
+		Py_DECREF(style);
+		return NULL;
+	}
+
+	out->style = style;
+	out->text = NULL;
+	out->len = len;
+	memcpy(out->data, text, len + 1);
+
+	return (PyObject *)out;
+}
+
+static void
+msg_dealloc(tnpam_msg_t *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+
+	Py_CLEAR(self->style);
+	Py_CLEAR(self->text);
+	PyObject_Free(self);
+	Py_DECREF(tp);
+}
+
+/* New reference to the decoded text */
+static PyObject *
+msg_text(tnpam_msg_t *self)
+{
+	PyObject *text = NULL;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->text == NULL) {
+		self->text = PyUnicode_DecodeUTF8(self->data, self->len, NULL);
+	}
+	text = Py_XNewRef(self->text);
+	Py_END_CRITICAL_SECTION();
+
+	return text;
+}
+
+/* New reference to (msg_style, msg) */
+static PyObject *
+msg_as_tuple(tnpam_msg_t *self)
+{
+	PyObject *text = msg_text(self);
+
+	if (text == NULL) {
+		return NULL;
+	}
+
+	return Py_BuildValue("(ON)", self->style, text);
+}
+
+static PyObject *
+msg_get_style(tnpam_msg_t *self, void *closure)
+{
+	return Py_NewRef(self->style);
+}
+
+static PyObject *
+msg_get_text(tnpam_msg_t *self, void *closure)
+{
+	return msg_text(self);
+}
+
+static PyObject *
+msg_get_bytes(tnpam_msg_t *self, void *closure)
+{
+	return PyBytes_FromStringAndSize(self->data, self->len);
+}
+
+static Py_ssize_t
+msg_length(tnpam_msg_t *self)
+{
+	return MSG_FIELDS;
+}
+
+static PyObject *
+msg_item(tnpam_msg_t *self, Py_ssize_t idx)
+{
+	// Negative indices have already been adjusted using sq_length
+	switch (idx) {
+	case 0:
+		return Py_NewRef(self->style);
+	case 1:
+		return msg_text(self);
+	default:
+		break;
+	}
+
+	PyErr_SetString(PyExc_IndexError, "struct_pam_message index out of range");
+	return NULL;
+}
+
+static PyObject *
+msg_richcompare(tnpam_msg_t *self, PyObject *other, int op)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject *mine = NULL;
+	PyObject *theirs = NULL;
+	PyObject *out = NULL;
+
+	if (Py_IS_TYPE(other, tp) && ((op == Py_EQ) || (op == Py_NE))) {
+		tnpam_msg_t *o = (tnpam_msg_t *)other;
+		bool eq = (self->style == o->style) && (self->len == o->len) &&
+			  (memcmp(self->data, o->data, self->len) == 0);
+
+		return PyBool_FromLong((op == Py_EQ) ? eq : !eq);
+	}
+
+	if (!Py_IS_TYPE(other, tp) && !PyTuple_Check(other)) {
+		Py_RETURN_NOTIMPLEMENTED;
+	}
+
+	mine = msg_as_tuple(self);
+	if (mine == NULL) {
+		return NULL;
+	}
+
+	if (Py_IS_TYPE(other, tp)) {
+		theirs = msg_as_tuple((tnpam_msg_t *)other);
+		if (theirs == NULL) {
+			Py_DECREF(mine);
+			return NULL;
+		}
+	} else {
+		theirs = Py_NewRef(other);
+	}
+
+	out = PyObject_RichCompare(mine, theirs, op);
+	Py_DECREF(mine);
+	Py_DECREF(theirs);
+	return out;
+}
+
+static Py_hash_t
+msg_hash(tnpam_msg_t *self)
+{
+	PyObject *tuple = msg_as_tuple(self);
+	Py_hash_t hash;
+
+	// Same as the equal tuple
+	if (tuple == NULL) {
+		return -1;
+	}
+
+	hash = PyObject_Hash(tuple);
+	Py_DECREF(tuple);
+	return hash;
+}
+
+static PyObject *
+msg_repr(tnpam_msg_t *self)
+{
+	PyObject *text = msg_text(self);
+	PyObject *out = NULL;
+
+	if (text == NULL) {
+		// Show undecodable text as bytes
+		PyErr_Clear();
+		text = PyBytes_FromStringAndSize(self->data, self->len);
+		if (text == NULL) {
+			return NULL;
+		}
+	}
+
+	out = PyUnicode_FromFormat("%s(msg_style=%R, msg=%R)",
+				   Py_TYPE(self)->tp_name, self->style, text);
+	Py_DECREF(text);
+	return out;
+}
+
+static PyObject *
+msg_sizeof(tnpam_msg_t *self, PyObject *Py_UNUSED(ignored))
+{
+	Py_ssize_t size = offsetof(tnpam_msg_t, data) + self->len + 1;
+	PyObject *out = NULL;
+
+	// The decoded text is owned by the message alone
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if ((self->text != NULL) && (self->len > 0)) {
+		PyObject *res = PyObject_CallMethod(self->text, "__sizeof__", NULL);
+		if (res != NULL) {
+			size += PyLong_AsSsize_t(res);
+			Py_DECREF(res);
+			out = PyErr_Occurred() ? NULL : PyLong_FromSsize_t(size);
+		}
+	} else {
+		out = PyLong_FromSsize_t(size);
+	}
+	Py_END_CRITICAL_SECTION();
+
+	return out;
+}
+
+static PyMethodDef msg_methods[] = {
+	{
+		.ml_name = "__sizeof__",
+		.ml_meth = (PyCFunction)msg_sizeof,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Size of the message including its text in bytes.",
+	},
+	{NULL}
+};
+
+static PyGetSetDef msg_getsetters[] = {
+	{
+		.name = "msg_style",
+		.get = (getter)msg_get_style,
+		.doc = "Message type (MSGStyle enum): PAM_PROMPT_ECHO_OFF, "
+		       "PAM_PROMPT_ECHO_ON, PAM_ERROR_MSG, or PAM_TEXT_INFO",
+	},
+	{
+		.name = "msg",
+		.get = (getter)msg_get_text,
+		.doc = "Message text from PAM module. Decoded from UTF-8 on "
+		       "first access.",
+	},
+	{
+		.name = "msg_bytes",
+		.get = (getter)msg_get_bytes,
+		.doc = "Message text from PAM module as undecoded bytes.",
+	},
+	{NULL}
+};
+
+PyDoc_STRVAR(PyPamMessage_Type__doc__,
+"struct_pam_message\n"
+"------------------\n\n"
+"Python wrapper around struct pam_message from pam_conv(3).\n\n"
+"Represents a single message in the PAM conversation mechanism.\n"
+"PAM modules use this structure to communicate with applications\n"
+"through the conversation callback function.\n\n"
+"Behaves as the tuple (msg_style, msg) for indexing, unpacking,\n"
+"comparison and hashing. msg is decoded from UTF-8 on first access and\n"
+"raises UnicodeDecodeError if the module sent invalid UTF-8, in which\n"
+"case msg_bytes still gives the raw text.\n"
+);
+
+static PyType_Slot msg_slots[] = {
+	{Py_tp_doc, (void *)PyPamMessage_Type__doc__},
+	{Py_tp_dealloc, msg_dealloc},
+	{Py_tp_repr, msg_repr},
+	{Py_tp_hash, msg_hash},
+	{Py_tp_richcompare, msg_richcompare},
+	{Py_tp_methods, msg_methods},
+	{Py_tp_getset, msg_getsetters},
+	{Py_sq_length, msg_length},
+	{Py_sq_item, msg_item},
+	{0, NULL}
+};
+
+static PyType_Spec msg_spec = {
+	.name = MODULE_NAME ".struct_pam_message",
+	.basicsize = offsetof(tnpam_msg_t, data),
+	.itemsize = 1,
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_SEQUENCE |
+		 Py_TPFLAGS_DISALLOW_INSTANTIATION,
+	.slots = msg_slots,
+};
+
+/*
+ * Create the message type.
+ */
+bool
+init_message_type(PyObject *module_ref)
+{
+	tnpam_state_t *state = py_get_pam_state(module_ref);
+
+	state->struct_pam_msg_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+		module_ref, &msg_spec, NULL);
+	return state->struct_pam_msg_type != NULL;
+}
@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include "truenas_pypam.h"
+
+typedef struct {
+	int (*fn)(pam_handle_t *pamh, int flags);
+	const char *name;
+	const char *errmsg;
+} tnpam_op_entry_t;
+
+/**
+ * @brief Lookup table of PAM application calls that take (pamh, flags).
+ *
+ * Indexed by tnpam_op_t. The name identifies the call in USDT probes. The
+ * errmsg is used as the PAMError message when the call fails without the
+ * conversation callback having raised.
+ */
+static const tnpam_op_entry_t op_tbl[] = {
+	[TNPAM_OP_AUTHENTICATE] = {
+		pam_authenticate, "pam_authenticate", "pam_authenticate() failed"
+	},
+	[TNPAM_OP_ACCT_MGMT] = {
+		pam_acct_mgmt, "pam_acct_mgmt", "pam_acct_mgmt() failed"
+	},
+	[TNPAM_OP_SETCRED] = {
+		pam_setcred, "pam_setcred", "pam_setcred() failed"
+	},
+	[TNPAM_OP_OPEN_SESSION] = {
+		pam_open_session, "pam_open_session", "pam_open_session() failed"
+	},
+	[TNPAM_OP_CLOSE_SESSION] = {
+		pam_close_session, "pam_close_session", "pam_close_session() failed"
+	},
+	[TNPAM_OP_CHAUTHTOK] = {
+		pam_chauthtok, "pam_chauthtok", "pam_chauthtok() failed"
+	},
+};
+
+_Static_assert(
+	TNPAM_OP_COUNT == ARRAY_SIZE(op_tbl),
+	"PAM operation lookup table needs updating"
+);
+
+/*
+ * Name of the PAM call of op, e.g. "pam_authenticate".
+ */
+const char *
+tnpam_op_name(tnpam_op_t op)
+{
+	return ((op >= 0) && (op < TNPAM_OP_COUNT)) ? op_tbl[op].name : "unknown";
+}
+
+/*
+ * Make the PAM call of op on hdl. Also used by PamProcessPool workers.
+ */
+pamcode_t
+tnpam_op_pam(pam_handle_t *hdl, tnpam_op_t op, int flags)
+{
+	return op_tbl[op].fn(hdl, flags);
+}
+
+/* Convert seconds to nanoseconds, saturating far beyond any real timeout */
+static uint64_t
+op_timeout_ns(double seconds)
+{
+	return (seconds > 1e9) ? UINT64_MAX / 2 : (uint64_t)(seconds * 1e9) + 1;
+}
+
+/*
+ * Set the default time limit of operations on ctx from the timeout argument
+ * of get_context(). GIL must be held.
+ */
+bool
+tnpam_ctx_set_timeout(tnpam_ctx_t *ctx, PyObject *timeout)
+{
+	double seconds;
+
+	if (!tnpam_parse_timeout(timeout, &seconds)) {
+		return false;
+	}
+
+	ctx->op_timeout_ns = (seconds < 0) ? 0 : op_timeout_ns(seconds);
+	return true;
+}
+
+/*
+ * Convert the timeout argument of an operation into a deadline for
+ * tnpam_op_call(). None (or NULL) uses the default set with
+ * get_context(timeout=). The deadline is 0 if there is no time limit.
+ */
+bool
+tnpam_op_deadline(tnpam_ctx_t *ctx, PyObject *timeout, uint64_t *deadline_out)
+{
+	uint64_t delta = ctx->op_timeout_ns;
+	double seconds;
+
+	if (!tnpam_parse_timeout(timeout, &seconds)) {
+		return false;
+	}
+
+	if (seconds >= 0) {
+		delta = op_timeout_ns(seconds);
+	}
+
+	*deadline_out = (delta == 0) ? 0 : tnpam_now_ns() + delta;
+	return true;
+}
+
+/*
+ * Whether deadline_ns (0 for none) has passed. May be called without the GIL.
+ */
+bool
+tnpam_deadline_passed(uint64_t deadline_ns)
+{
+	return (deadline_ns != 0) && (tnpam_now_ns() >= deadline_ns);
+}
+
+/*
+ * Check the remote host and user of an authentication attempt against
+ * set_auth_rate_limit(). Called with the pam_hdl_lock held.
+ */
+static bool
+op_admit(tnpam_ctx_t *ctx)
+{
+	const void *user = NULL, *rhost = NULL;
+
+	pam_get_item(ctx->hdl, PAM_RHOST, &rhost);
+	pam_get_item(ctx->hdl, PAM_USER, &user);
+
+	return tnpam_ratelimit_admit(rhost, user);
+}
+
+/*
+ * Compute the credential cache key of an authentication attempt. Returns
+ * false if the context doesn't use the cache, or if a conversation function
+ * could answer prompts that the key doesn't cover. Called with the
+ * pam_hdl_lock held.
+ */
+static bool
+op_cache_key(tnpam_ctx_t *ctx, int flags, tnpam_authcache_key_t *key)
+{
+	const void *user = NULL, *ruser = NULL, *rhost = NULL;
+
+	if (!ctx->auth_cache.enabled || (ctx->conv_data.responder == NULL) ||
+	    (ctx->conv_data.callback_fn != NULL)) {
+		return false;
+	}
+
+	pam_get_item(ctx->hdl, PAM_USER, &user);
+	pam_get_item(ctx->hdl, PAM_RUSER, &ruser);
+	pam_get_item(ctx->hdl, PAM_RHOST, &rhost);
+
+	return tnpam_authcache_key(&ctx->auth_cache, user, ruser, rhost,
+				   ctx->conv_data.responder, flags, key);
+}
+
+/*
+ * Add the outcome of op to the event buffer (see set_event_buffer()). Called
+ * with the pam_hdl_lock held.
+ */
+static void
+op_event(tnpam_ctx_t *ctx, tnpam_op_t op, pamcode_t code, uint64_t latency_ns)
+{
+	const void *service = NULL, *user = NULL, *rhost = NULL;
+
+	if (!tnpam_events_enabled()) {
+		return;
+	}
+
+	pam_get_item(ctx->hdl, PAM_SERVICE, &service);
+	pam_get_item(ctx->hdl, PAM_USER, &user);
+	pam_get_item(ctx->hdl, PAM_RHOST, &rhost);
+	tnpam_events_record(op, code, service, user, rhost, latency_ns);
+}
+
+/*
+ * Perform the PAM call for the specified operation. Caller must hold the
+ * pam_hdl_lock and must have released the GIL (i.e. be inside
+ * PYPAM_LOCK / PYPAM_UNLOCK). State changes on the context that result from
+ * the call are made here so that they happen under the handle lock.
+ *
+ * The session state checks done by the python methods before taking the lock
+ * are repeated here since another thread may have opened or closed the
+ * session in the meantime. TNPAM_OP_BAD_STATE is returned in that case.
+ * TNPAM_OP_ENDED is returned if close_all_sessions() has ended the handle and
+ * TNPAM_OP_RATE_LIMITED if set_auth_rate_limit() refused an authentication.
+ *
+ * deadline_ns (see tnpam_op_deadline()) bounds the conversation: once it has
+ * passed, truenas_pam_conv() fails every round with PAM_CONV_ERR without
+ * calling the python callback so that the stack unwinds promptly. The call
+ * is not started at all if the deadline passed while waiting for the handle.
+ * TNPAM_OP_TIMED_OUT is returned in these cases unless the stack succeeded
+ * anyway.
+ */
+pamcode_t
+tnpam_op_call(tnpam_ctx_t *ctx, tnpam_op_t op, int flags, uint64_t deadline_ns)
+{
+	tnpam_authcache_key_t key;
+	bool cacheable = false;
+	pamcode_t ret, code;
+	uint64_t t0, elapsed;
+
+	if (ctx->hdl == NULL) {
+		return TNPAM_OP_ENDED;
+	}
+
+	switch (op) {
+	case TNPAM_OP_OPEN_SESSION:
+		if (!ctx->authenticated || ctx->session_opened) {
+			return TNPAM_OP_BAD_STATE;
+		}
+		break;
+	case TNPAM_OP_CLOSE_SESSION:
+		if (!ctx->session_opened) {
+			return TNPAM_OP_BAD_STATE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	switch (op) {
+	case TNPAM_OP_SETCRED:
+	case TNPAM_OP_OPEN_SESSION:
+	case TNPAM_OP_CLOSE_SESSION:
+	case TNPAM_OP_CHAUTHTOK:
+		// These leave per-user state in module data (credentials,
+		// session bookkeeping) that can't be reset from the application
+		// and so the handle must not be handed to another context.
+		ctx->pool_unsafe = B_TRUE;
+		break;
+	default:
+		break;
+	}
+
+	if (op == TNPAM_OP_AUTHENTICATE) {
+		// A cached authentication is not an attempt against the stack
+		// and so takes no rate limit tokens
+		cacheable = op_cache_key(ctx, flags, &key);
+		if (cacheable && tnpam_authcache_lookup(&key)) {
+			atomic_store_explicit(&ctx->fail_delay_usec, 0,
+					      memory_order_relaxed);
+			ctx->last_pam_result = PAM_SUCCESS;
+			ctx->authenticated = B_TRUE;
+			op_event(ctx, op, PAM_SUCCESS, 0);
+			return PAM_SUCCESS;
+		}
+
+		if (!op_admit(ctx)) {
+			// Reported like authenticate_many() does
+			op_event(ctx, op, PAM_MAXTRIES, 0);
+			return TNPAM_OP_RATE_LIMITED;
+		}
+	}
+
+	if (TNPAM_PROBE_ENABLED(op__entry)) {
+		const void *service = NULL, *user = NULL, *rhost = NULL;
+
+		pam_get_item(ctx->hdl, PAM_SERVICE, &service);
+		pam_get_item(ctx->hdl, PAM_USER, &user);
+		pam_get_item(ctx->hdl, PAM_RHOST, &rhost);
+		TNPAM_PROBE(op__entry, ctx, op_tbl[op].name, service, user, rhost);
+	}
+
+	if (tnpam_deadline_passed(deadline_ns)) {
+		return TNPAM_OP_TIMED_OUT;
+	}
+
+	// Set by the PAM_FAIL_DELAY callback if defer_fail_delay is enabled
+	atomic_store_explicit(&ctx->fail_delay_usec, 0, memory_order_relaxed);
+
+	ctx->deadline_ns = deadline_ns;
+	ctx->deadline_hit = B_FALSE;
+	t0 = tnpam_now_ns();
+	if (ctx->proc != NULL) {
+		ret = tnpam_proc_op(ctx, op, flags);
+	} else {
+		ret = op_tbl[op].fn(ctx->hdl, flags);
+	}
+	elapsed = tnpam_now_ns() - t0;
+	ctx->deadline_ns = 0;
+
+	// The PamProcessPool worker could not make the call
+	code = (ret < 0) ? PAM_SYSTEM_ERR : ret;
+	tnpam_stats_record(&ctx->stats, (tnpam_stat_t)op, elapsed);
+	TNPAM_PROBE(op__return, ctx, op_tbl[op].name, code, elapsed);
+	op_event(ctx, op, code, elapsed);
+	ctx->last_pam_result = code;
+
+	if (ret != PAM_SUCCESS) {
+		return ctx->deadline_hit ? TNPAM_OP_TIMED_OUT : ret;
+	}
+
+	switch (op) {
+	case TNPAM_OP_AUTHENTICATE:
+		ctx->authenticated = B_TRUE;
+		if (cacheable) {
+			tnpam_authcache_store(&key);
+		}
+		break;
+	case TNPAM_OP_ACCT_MGMT:
+		// The account was just resolved by the modules, so this is the
+		// cheapest time to get the passwd entry. Failures are left for
+		// ctx.passwd to report.
+		tnpam_passwd_refresh(ctx);
+		break;
+	case TNPAM_OP_CHAUTHTOK: {
+		const void *user = NULL;
+
+		// Authentications cached with the old password must not
+		// outlive it
+		pam_get_item(ctx->hdl, PAM_USER, &user);
+		if (user != NULL) {
+			tnpam_authcache_invalidate(user, NULL);
+		}
+		break;
+	}
+	case TNPAM_OP_OPEN_SESSION:
+		tnpam_session_set_opened(ctx, B_TRUE);
+		break;
+	case TNPAM_OP_CLOSE_SESSION:
+		tnpam_session_set_opened(ctx, B_FALSE);
+		break;
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ * Convert the result of tnpam_op_call() into a python return value. Must be
+ * called with the GIL held. If the conversation callback raised an exception
+ * during the PAM call then that exception is preserved rather than being
+ * replaced by a PAMError.
+ */
+PyObject *
+tnpam_op_result(tnpam_ctx_t *ctx, tnpam_op_t op, pamcode_t ret)
+{
+	if (ret == TNPAM_OP_ENDED) {
+		PyErr_SetString(PyExc_ValueError,
+				"PAM handle was ended by close_all_sessions().");
+		return NULL;
+	}
+
+	if (ret == TNPAM_OP_RATE_LIMITED) {
+		set_rate_limited_exc(tnpam_ctx_state(ctx),
+				     "Too many authentication attempts for the "
+				     "remote host or user of this handle");
+		return NULL;
+	}
+
+	if (ret == TNPAM_OP_TIMED_OUT) {
+		PyErr_Format(PyExc_TimeoutError,
+			     "%s did not complete before the deadline of the "
+			     "operation", op_tbl[op].name);
+		return NULL;
+	}
+
+	if (ret == TNPAM_OP_WORKER_LOST) {
+		set_pam_exc(tnpam_ctx_state(ctx), PAM_SYSTEM_ERR,
+			    "PAM worker process exited");
+		return NULL;
+	}
+
+	if (ret == TNPAM_OP_WORKER_BUSY) {
+		PyErr_Format(PyExc_RuntimeError,
+			     "%s can't be called from a conversation of the same "
+			     "PAM worker process", op_tbl[op].name);
+		return NULL;
+	}
+
+	if (ret == TNPAM_OP_BAD_STATE) {
+		PyErr_SetString(PyExc_ValueError,
+				(op == TNPAM_OP_OPEN_SESSION) ?
+				"session is already opened for this handle." :
+				"session is not opened for this handle.");
+		return NULL;
+	}
+
+	if (ret != PAM_SUCCESS) {
+		if (!PyErr_Occurred()) {
+			set_pam_exc(tnpam_ctx_state(ctx), ret, op_tbl[op].errmsg);
+		}
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * Synchronously perform the operation from the calling python thread.
+ */
+PyObject *
+tnpam_op_run(tnpam_ctx_t *ctx, tnpam_op_t op, int flags, uint64_t deadline_ns)
+{
+	pamcode_t ret;
+
+	if (tnpam_resume_busy(ctx)) {
+		return NULL;
+	}
+
+	PYPAM_LOCK(ctx);
+	ret = tnpam_op_call(ctx, op, flags, deadline_ns);
+	PYPAM_UNLOCK(ctx);
+
+	return tnpam_op_result(ctx, op, ret);
+}
@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <string.h>
+#include <unistd.h>
+#include "truenas_pypam.h"
+
+/*
+ * passwd entry of the PAM user.
+ *
+ * Directory service backends (SSSD, winbind) can take a long time to answer
+ * NSS lookups and pwd.getpwnam() holds the GIL for all of it. The entry is
+ * instead looked up with getpwnam_r(3) and getgrouplist(3) without the GIL,
+ * right after a successful pam_acct_mgmt() (which has normally just warmed
+ * the backend's cache for the user) or on first access of ctx.passwd, and is
+ * kept for the context. Entries are reference counted so that the getter can
+ * convert one to a dict after dropping the handle lock while another thread
+ * replaces it.
+ */
+
+#define TNPAM_PW_BUF_MAX (1 << 20)	/* give up on larger entries */
+#define TNPAM_PW_NGROUPS_DEFAULT 64
+
+struct tnpam_passwd {
+	_Atomic size_t refcnt;
+	struct passwd pw;
+	gid_t *groups;
+	int ngroups;
+	char *buf;		/* strings of pw */
+};
+
+void
+tnpam_passwd_release(tnpam_passwd_t *entry)
+{
+	if ((entry == NULL) ||
+	    (atomic_fetch_sub_explicit(&entry->refcnt, 1,
+				       memory_order_acq_rel) != 1)) {
+		return;
+	}
+
+	PyMem_RawFree(entry->groups);
+	PyMem_RawFree(entry->buf);
+	PyMem_RawFree(entry);
+}
+
+static int
+passwd_getpwnam(const char *user, tnpam_passwd_t *entry)
+{
+	struct passwd *result = NULL;
+	long initial = sysconf(_SC_GETPW_R_SIZE_MAX);
+	size_t size = (initial > 0) ? (size_t)initial : 1024;
+	int err;
+
+	for (;;) {
+		char *buf = PyMem_RawRealloc(entry->buf, size);
+
+		if (buf == NULL) {
+			return ENOMEM;
+		}
+		entry->buf = buf;
+
+		err = getpwnam_r(user, &entry->pw, entry->buf, size, &result);
+		if ((err != ERANGE) || (size >= TNPAM_PW_BUF_MAX)) {
+			break;
+		}
+		size *= 2;
+	}
+
+	if (err != 0) {
+		return err;
+	}
+
+	// Not found is not an error for getpwnam_r()
+	return (result == NULL) ? ENOENT : 0;
+}
+
+static int
+passwd_getgrouplist(tnpam_passwd_t *entry)
+{
+	int ngroups = TNPAM_PW_NGROUPS_DEFAULT;
+
+	for (;;) {
+		int count = ngroups;
+		gid_t *groups = PyMem_RawRealloc(entry->groups,
+						 (size_t)ngroups * sizeof(gid_t));
+
+		if (groups == NULL) {
+			return ENOMEM;
+		}
+		entry->groups = groups;
+
+		if (getgrouplist(entry->pw.pw_name, entry->pw.pw_gid,
+				 entry->groups, &count) != -1) {
+			entry->ngroups = count;
+			return 0;
+		}
+
+		// count is set to the number of groups needed, but some NSS
+		// modules don't do so reliably
+		ngroups = (count > ngroups) ? count : ngroups * 2;
+		if (ngroups > (int)(TNPAM_PW_BUF_MAX / sizeof(gid_t))) {
+			return ERANGE;
+		}
+	}
+}
+
+/*
+ * Look up user with getpwnam_r() and getgrouplist(), normally without the
+ * GIL. Returns 0 and a new entry in *out, ENOENT if the user doesn't exist
+ * or another errno value.
+ */
+int
+tnpam_passwd_lookup(const char *user, tnpam_passwd_t **out)
+{
+	tnpam_passwd_t *entry = NULL;
+	int err;
+
+	entry = PyMem_RawCalloc(1, sizeof(tnpam_passwd_t));
+	if (entry == NULL) {
+		return ENOMEM;
+	}
+	entry->refcnt = 1;
+
+	err = passwd_getpwnam(user, entry);
+	if (err == 0) {
+		err = passwd_getgrouplist(entry);
+	}
+
+	if (err != 0) {
+		tnpam_passwd_release(entry);
+		return err;
+	}
+
+	*out = entry;
+	return 0;
+}
+
+/*
+ * Make sure ctx->passwd is the entry of the current PAM_USER, looking it up
+ * if it isn't. Called with the pam_hdl_lock held and without the GIL.
+ * Returns 0, ENOENT if there is no PAM_USER or no such user, or the errno
+ * value of a failed lookup. ctx->passwd is left alone on failure so that a
+ * transient directory service error doesn't lose a good entry.
+ */
+int
+tnpam_passwd_refresh(tnpam_ctx_t *ctx)
+{
+	const void *user = NULL;
+	tnpam_passwd_t *entry = NULL;
+	int err;
+
+	if ((ctx->hdl == NULL) ||
+	    (pam_get_item(ctx->hdl, PAM_USER, &user) != PAM_SUCCESS) ||
+	    (user == NULL)) {
+		return ENOENT;
+	}
+
+	if ((ctx->passwd != NULL) &&
+	    (strcmp(ctx->passwd->pw.pw_name, user) == 0)) {
+		return 0;
+	}
+
+	err = tnpam_passwd_lookup(user, &entry);
+	if (err == ENOENT) {
+		// The user was renamed or removed, the old entry is wrong
+		tnpam_passwd_release(ctx->passwd);
+		ctx->passwd = NULL;
+	}
+	if (err != 0) {
+		return err;
+	}
+
+	tnpam_passwd_release(ctx->passwd);
+	ctx->passwd = entry;
+	return 0;
+}
+
+/*
+ * Convert an entry to a dict with the fields of pwd.struct_passwd and a
+ * grouplist of gids.
+ */
+static PyObject *
+passwd_to_dict(const tnpam_passwd_t *entry)
+{
+	PyObject *groups = NULL, *out = NULL;
+	int i;
+
+	groups = PyTuple_New(entry->ngroups);
+	if (groups == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < entry->ngroups; i++) {
+		PyObject *gid = PyLong_FromUnsignedLong(entry->groups[i]);
+
+		if (gid == NULL) {
+			Py_DECREF(groups);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(groups, i, gid);
+	}
+
+	out = Py_BuildValue(
+		"{s:s,s:k,s:k,s:s,s:s,s:s,s:N}",
+		"pw_name", entry->pw.pw_name,
+		"pw_uid", (unsigned long)entry->pw.pw_uid,
+		"pw_gid", (unsigned long)entry->pw.pw_gid,
+		"pw_gecos", entry->pw.pw_gecos ? entry->pw.pw_gecos : "",
+		"pw_dir", entry->pw.pw_dir ? entry->pw.pw_dir : "",
+		"pw_shell", entry->pw.pw_shell ? entry->pw.pw_shell : "",
+		"grouplist", groups);
+
+	return out;
+}
+
+PyObject *
+py_tnpam_ctx_get_passwd(tnpam_ctx_t *self, void *closure)
+{
+	tnpam_passwd_t *entry = NULL;
+	PyObject *out = NULL;
+	int err;
+
+	if (tnpam_resume_busy(self)) {
+		return NULL;
+	}
+
+	PYPAM_LOCK(self);
+	err = tnpam_passwd_refresh(self);
+	if (err == 0) {
+		entry = self->passwd;
+		atomic_fetch_add_explicit(&entry->refcnt, 1,
+					  memory_order_relaxed);
+	}
+	PYPAM_UNLOCK(self);
+
+	if (err == ENOENT) {
+		Py_RETURN_NONE;
+	}
+
+	if (err != 0) {
+		errno = err;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+
+	out = passwd_to_dict(entry);
+	tnpam_passwd_release(entry);
+	return out;
+}
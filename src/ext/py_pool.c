@@ -0,0 +1,599 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include "truenas_pypam.h"
+
+/*
+ * PamContextPool: reusable PAM handles.
+ *
+ * pam_start_confdir() parses the service configuration and dlopen()s every
+ * module in the stack and pam_end() unloads them again. For high rates of
+ * short authentications this dominates the cost of the transaction. A pool
+ * keeps handles for one service / confdir open and hands them to new
+ * PamContext objects.
+ *
+ * A handle is only returned to the pool if the context never called
+ * pam_setcred(), pam_open_session(), pam_close_session() or pam_chauthtok()
+ * since modules are free to keep per-user state from those in module data,
+ * which the application has no way of clearing. Linux-PAM itself discards
+ * PAM_AUTHTOK / PAM_OLDAUTHTOK when pam_authenticate() returns. Everything
+ * the application can set is reset before the handle becomes idle.
+ */
+
+#define TNPAM_POOL_DEFAULT_MAXSIZE 8
+
+/*
+ * Conversation function for idle handles. Nothing should converse while a
+ * handle is idle (e.g. during pam_end()), but never point PAM at a context
+ * that no longer exists. Also used by close_all_sessions(), which runs
+ * without the GIL.
+ */
+static int
+pool_conv_idle(int num_msg, const struct pam_message **msg,
+	       struct pam_response **resp, void *appdata_ptr)
+{
+	return PAM_CONV_ERR;
+}
+
+const struct pam_conv tnpam_idle_conv = {
+	.conv = pool_conv_idle,
+	.appdata_ptr = NULL,
+};
+
+static const int pool_reset_items[] = {
+	PAM_USER,
+	PAM_RUSER,
+	PAM_RHOST,
+	PAM_TTY,
+	PAM_USER_PROMPT,
+	PAM_XDISPLAY,
+	PAM_FAIL_DELAY,
+};
+
+/*
+ * Reset items and environment of a handle so that nothing from the previous
+ * context is visible to the next one.
+ */
+static bool
+pool_reset_handle(pam_handle_t *hdl)
+{
+	char **env = NULL, **p;
+	bool ok = true;
+	size_t i;
+
+	if (pam_set_item(hdl, PAM_CONV, &tnpam_idle_conv) != PAM_SUCCESS) {
+		return false;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pool_reset_items); i++) {
+		if (pam_set_item(hdl, pool_reset_items[i], NULL) != PAM_SUCCESS) {
+			return false;
+		}
+	}
+
+	env = pam_getenvlist(hdl);
+	if (env == NULL) {
+		return false;
+	}
+
+	for (p = env; *p != NULL; p++) {
+		char *eq = strchr(*p, '=');
+		size_t len = strlen(*p);
+
+		// pam_putenv() with only a name removes the variable
+		if (eq != NULL) {
+			*eq = '\0';
+		}
+
+		if (pam_putenv(hdl, *p) != PAM_SUCCESS) {
+			ok = false;
+		}
+
+		explicit_bzero(*p, len);
+		free(*p);
+	}
+
+	free(env);
+	return ok;
+}
+
+static Py_ssize_t
+pool_nidle(tnpam_pool_t *pool)
+{
+	Py_ssize_t nidle;
+
+	Py_BEGIN_CRITICAL_SECTION(pool);
+	nidle = pool->nidle;
+	Py_END_CRITICAL_SECTION();
+
+	return nidle;
+}
+
+/*
+ * Take an idle handle from the pool. Returns NULL if there is none and the
+ * caller should start a new transaction. GIL must be held.
+ *
+ * Pool state is protected by a critical section on the pool object for
+ * free-threaded builds. No PAM calls are made while inside it.
+ */
+pam_handle_t *
+tnpam_pool_take(tnpam_pool_t *pool, size_t *hdl_bytes)
+{
+	pam_handle_t *hdl = NULL;
+
+	Py_BEGIN_CRITICAL_SECTION(pool);
+	if (pool->nidle == 0) {
+		pool->started++;
+	} else {
+		pool->reused++;
+		hdl = pool->idle[--pool->nidle];
+		*hdl_bytes = pool->hdl_bytes;
+	}
+	Py_END_CRITICAL_SECTION();
+
+	return hdl;
+}
+
+/*
+ * Offer a handle back to the pool. Returns false if the pool is full or the
+ * handle could not be reset, in which case the caller must pam_end() it.
+ * GIL must be held.
+ */
+bool
+tnpam_pool_put(tnpam_pool_t *pool, pam_handle_t *hdl, size_t hdl_bytes)
+{
+	bool ok = false;
+
+	// Early check only avoids a pointless reset. The handle is still
+	// exclusively owned by the caller while it is being reset.
+	if ((pool->idle == NULL) || (pool_nidle(pool) >= pool->maxsize)) {
+		return false;
+	}
+
+	if (!pool_reset_handle(hdl)) {
+		return false;
+	}
+
+	Py_BEGIN_CRITICAL_SECTION(pool);
+	if (pool->nidle < pool->maxsize) {
+		pool->idle[pool->nidle++] = hdl;
+		if (hdl_bytes != 0) {
+			pool->hdl_bytes = hdl_bytes;
+		}
+		ok = true;
+	}
+	Py_END_CRITICAL_SECTION();
+
+	return ok;
+}
+
+/*
+ * pam_end() all idle handles. GIL is released while doing so since module
+ * cleanup may be arbitrarily slow.
+ */
+static void
+pool_drain(tnpam_pool_t *self)
+{
+	pam_handle_t **idle = NULL;
+	Py_ssize_t i, nidle = 0;
+
+	// Size is bounded by maxsize, so allocate for the worst case rather
+	// than retry if the pool grows meanwhile.
+	idle = PyMem_Malloc(((self->maxsize > 0) ? self->maxsize : 1) *
+			    sizeof(pam_handle_t *));
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	nidle = self->nidle;
+	if (idle == NULL) {
+		// Do it without releasing the GIL rather than leak
+		for (i = 0; i < nidle; i++) {
+			pam_end(self->idle[i], PAM_SUCCESS);
+		}
+	} else if (nidle > 0) {
+		memcpy(idle, self->idle, nidle * sizeof(pam_handle_t *));
+	}
+	self->nidle = 0;
+	Py_END_CRITICAL_SECTION();
+
+	if ((idle == NULL) || (nidle == 0)) {
+		PyMem_Free(idle);
+		return;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < nidle; i++) {
+		pam_end(idle[i], PAM_SUCCESS);
+	}
+	Py_END_ALLOW_THREADS
+
+	PyMem_Free(idle);
+}
+
+static int
+py_tnpam_pool_init(tnpam_pool_t *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"service_name",
+		"confdir",
+		"maxsize",
+		NULL
+	};
+	const char *service = "login";
+	const char *confdir = NULL;
+	Py_ssize_t maxsize = TNPAM_POOL_DEFAULT_MAXSIZE;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$szn", kwlist,
+					 &service, &confdir, &maxsize)) {
+		return -1;
+	}
+
+	if (self->service != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "pool is already initialized");
+		return -1;
+	}
+
+	if (maxsize < 1) {
+		PyErr_SetString(PyExc_ValueError, "maxsize must be at least 1");
+		return -1;
+	}
+
+	self->idle = PyMem_Calloc(maxsize, sizeof(pam_handle_t *));
+	self->service = strdup(service);
+	self->confdir = confdir ? strdup(confdir) : NULL;
+	if ((self->idle == NULL) || (self->service == NULL) ||
+	    ((confdir != NULL) && (self->confdir == NULL))) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	self->maxsize = maxsize;
+	return 0;
+}
+
+static void
+py_tnpam_pool_dealloc(tnpam_pool_t *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+
+	pool_drain(self);
+	PyMem_Free(self->idle);
+	free(self->service);
+	free(self->confdir);
+	tp->tp_free((PyObject *)self);
+	Py_DECREF(tp);
+}
+
+PyDoc_STRVAR(py_tnpam_pool_get_context__doc__,
+"get_context(*, user, conversation_function=None,\n"
+"            conversation_private_data=None, rhost=None, ruser=None,\n"
+"            fail_delay=0, conversation_responses=None,\n"
+"            message_history_size=64, lock_policy=None,\n"
+"            lock_group=None, defer_fail_delay=False,\n"
+"            pam_env=None, auth_cache=False,\n"
+"            timeout=None) -> PamContext\n"
+"------------------------------------------------------------\n\n"
+"Create a PAM context for the service and confdir of the pool.\n\n"
+"Arguments are the same as truenas_pypam.get_context() except that\n"
+"service_name and confdir are taken from the pool. An idle handle is used\n"
+"if one is available, otherwise a new PAM transaction is started. When the\n"
+"context is deallocated its handle is returned to the pool unless the pool\n"
+"is full or the context called setcred(), open_session(), close_session()\n"
+"or chauthtok().\n\n"
+"Raises\n"
+"------\n"
+"TypeError\n"
+"    If service_name or confdir is given\n"
+"PAMError, ValueError\n"
+"    Same as truenas_pypam.get_context()\n"
+);
+
+static PyObject *
+py_tnpam_pool_get_context(tnpam_pool_t *self, PyObject *const *args,
+			  Py_ssize_t nargs, PyObject *kwnames)
+{
+	tnpam_ctx_t *ctx = NULL;
+	PyTypeObject *ctx_type = NULL;
+	tnpam_cfg_t cfg;
+	Py_ssize_t nkw, i;
+
+	if (self->service == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "pool is not initialized");
+		return NULL;
+	}
+
+	nkw = (kwnames != NULL) ? PyTuple_GET_SIZE(kwnames) : 0;
+	for (i = 0; i < nkw; i++) {
+		PyObject *key = PyTuple_GET_ITEM(kwnames, i);
+
+		if ((PyUnicode_CompareWithASCIIString(key, "service_name") == 0) ||
+		    (PyUnicode_CompareWithASCIIString(key, "confdir") == 0)) {
+			PyErr_SetString(PyExc_TypeError,
+					"service_name and confdir are set by the pool");
+			return NULL;
+		}
+	}
+
+	if (tnpam_ctx_parse_cfg(args, nargs, kwnames, &cfg) < 0) {
+		return NULL;
+	}
+
+	cfg.service = self->service;
+	cfg.cdir = self->confdir;
+	cfg.pool = self;
+
+	ctx_type = py_get_pam_state_from_type(Py_TYPE(self))->ctx_type;
+	ctx = (tnpam_ctx_t *)ctx_type->tp_alloc(ctx_type, 0);
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	if (tnpam_ctx_setup(ctx, &cfg) < 0) {
+		Py_DECREF(ctx);
+		return NULL;
+	}
+
+	return (PyObject *)ctx;
+}
+
+PyDoc_STRVAR(py_tnpam_pool_prewarm__doc__,
+"prewarm(*, count=None) -> int\n"
+"------------------------------\n\n"
+"Start idle handles ahead of time.\n\n"
+"Parameters\n"
+"----------\n"
+"count : int, optional\n"
+"    Number of handles to start. The pool is never filled beyond maxsize\n"
+"    (default=None to fill the pool).\n\n"
+"Returns\n"
+"-------\n"
+"int\n"
+"    Number of idle handles in the pool.\n\n"
+"Raises\n"
+"------\n"
+"PAMError\n"
+"    If pam_start_confdir(3) fails.\n"
+);
+
+static PyObject *
+py_tnpam_pool_prewarm(tnpam_pool_t *self, PyObject *const *args,
+		      Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"count",
+		NULL
+	};
+	PyObject *pycount = Py_None;
+	Py_ssize_t count, i;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$O", kwlist, &pycount)) {
+		return NULL;
+	}
+
+	if (self->service == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "pool is not initialized");
+		return NULL;
+	}
+
+	if (pycount == Py_None) {
+		count = self->maxsize;
+	} else {
+		count = PyLong_AsSsize_t(pycount);
+		if ((count == -1) && PyErr_Occurred()) {
+			return NULL;
+		}
+	}
+
+	for (i = 0; (i < count) && (pool_nidle(self) < self->maxsize); i++) {
+		pam_handle_t *hdl = NULL;
+		bool stored = false;
+		pamcode_t ret;
+		uint64_t t0;
+		size_t hdl_bytes;
+
+		Py_BEGIN_ALLOW_THREADS
+		t0 = tnpam_now_ns();
+		ret = tnpam_mem_start(self->service, NULL, &tnpam_idle_conv,
+				      self->confdir, &hdl, &hdl_bytes);
+		tnpam_stats_record(NULL, TNPAM_STAT_START, tnpam_now_ns() - t0);
+		Py_END_ALLOW_THREADS
+
+		if (ret != PAM_SUCCESS) {
+			if (hdl != NULL) {
+				pam_end(hdl, ret);
+			}
+			set_pam_exc(py_get_pam_state_from_type(Py_TYPE(self)), ret,
+				    "pam_start_confdir() failed");
+			return NULL;
+		}
+
+		// Another thread may have filled the pool while we didn't hold
+		// the GIL.
+		Py_BEGIN_CRITICAL_SECTION(self);
+		self->started++;
+		if (self->nidle < self->maxsize) {
+			self->idle[self->nidle++] = hdl;
+			if (hdl_bytes != 0) {
+				self->hdl_bytes = hdl_bytes;
+			}
+			stored = true;
+		}
+		Py_END_CRITICAL_SECTION();
+
+		if (!stored) {
+			pam_end(hdl, PAM_SUCCESS);
+			break;
+		}
+	}
+
+	return PyLong_FromSsize_t(pool_nidle(self));
+}
+
+PyDoc_STRVAR(py_tnpam_pool_clear__doc__,
+"clear() -> None\n"
+"----------------\n\n"
+"End all idle handles. Contexts currently in use are not affected and may\n"
+"still return their handles to the pool afterwards.\n"
+);
+
+static PyObject *
+py_tnpam_pool_clear(tnpam_pool_t *self, PyObject *Py_UNUSED(ignored))
+{
+	pool_drain(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_tnpam_pool_get_service(tnpam_pool_t *self, void *closure)
+{
+	if (self->service == NULL) {
+		Py_RETURN_NONE;
+	}
+
+	return PyUnicode_FromString(self->service);
+}
+
+static PyObject *
+py_tnpam_pool_get_confdir(tnpam_pool_t *self, void *closure)
+{
+	if (self->confdir == NULL) {
+		Py_RETURN_NONE;
+	}
+
+	return PyUnicode_FromString(self->confdir);
+}
+
+static PyObject *
+py_tnpam_pool_get_maxsize(tnpam_pool_t *self, void *closure)
+{
+	return PyLong_FromSsize_t(self->maxsize);
+}
+
+static PyObject *
+py_tnpam_pool_get_idle(tnpam_pool_t *self, void *closure)
+{
+	return PyLong_FromSsize_t(pool_nidle(self));
+}
+
+static PyObject *
+py_tnpam_pool_get_started(tnpam_pool_t *self, void *closure)
+{
+	uint64_t started;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	started = self->started;
+	Py_END_CRITICAL_SECTION();
+
+	return PyLong_FromUnsignedLongLong(started);
+}
+
+static PyObject *
+py_tnpam_pool_get_reused(tnpam_pool_t *self, void *closure)
+{
+	uint64_t reused;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	reused = self->reused;
+	Py_END_CRITICAL_SECTION();
+
+	return PyLong_FromUnsignedLongLong(reused);
+}
+
+static PyMethodDef py_tnpam_pool_methods[] = {
+	{
+		.ml_name = "get_context",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_pool_get_context,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_pool_get_context__doc__,
+	},
+	{
+		.ml_name = "prewarm",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_pool_prewarm,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_pool_prewarm__doc__,
+	},
+	{
+		.ml_name = "clear",
+		.ml_meth = (PyCFunction)py_tnpam_pool_clear,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_pool_clear__doc__,
+	},
+	{NULL}
+};
+
+static PyGetSetDef py_tnpam_pool_getsetters[] = {
+	{
+		.name = "service_name",
+		.get = (getter)py_tnpam_pool_get_service,
+		.doc = "str: PAM service of handles in the pool",
+	},
+	{
+		.name = "confdir",
+		.get = (getter)py_tnpam_pool_get_confdir,
+		.doc = "str or None: PAM configuration directory",
+	},
+	{
+		.name = "maxsize",
+		.get = (getter)py_tnpam_pool_get_maxsize,
+		.doc = "int: maximum number of idle handles kept",
+	},
+	{
+		.name = "idle",
+		.get = (getter)py_tnpam_pool_get_idle,
+		.doc = "int: number of idle handles currently in the pool",
+	},
+	{
+		.name = "started",
+		.get = (getter)py_tnpam_pool_get_started,
+		.doc = "int: number of PAM transactions started by the pool",
+	},
+	{
+		.name = "reused",
+		.get = (getter)py_tnpam_pool_get_reused,
+		.doc = "int: number of contexts that were given an idle handle",
+	},
+	{NULL}
+};
+
+PyDoc_STRVAR(PyPamPool_Type__doc__,
+"PamContextPool(*, service_name='login', confdir=None, maxsize=8)\n"
+"-----------------------------------------------------------------\n\n"
+"Pool of reusable PAM handles for one service and confdir.\n\n"
+"Contexts created with get_context() reuse idle handles from the pool so\n"
+"that the PAM configuration is parsed and the service modules are loaded\n"
+"once rather than for every transaction. Before a handle becomes idle its\n"
+"conversation, PAM items (PAM_USER, PAM_RUSER, PAM_RHOST, PAM_TTY,\n"
+"PAM_USER_PROMPT, PAM_XDISPLAY) and PAM environment are reset.\n\n"
+"Data kept privately by PAM modules cannot be reset by the application.\n"
+"For this reason handles of contexts that called setcred(),\n"
+"open_session(), close_session() or chauthtok() are ended rather than\n"
+"reused, and pools should only be used with services whose authentication\n"
+"and account modules do not retain per-user state in the handle.\n\n"
+"See truenas_pypam.get_context_pool().\n"
+);
+
+static PyType_Slot py_tnpam_pool_slots[] = {
+	{Py_tp_doc, (void *)PyPamPool_Type__doc__},
+	{Py_tp_new, PyType_GenericNew},
+	{Py_tp_init, py_tnpam_pool_init},
+	{Py_tp_dealloc, py_tnpam_pool_dealloc},
+	{Py_tp_methods, py_tnpam_pool_methods},
+	{Py_tp_getset, py_tnpam_pool_getsetters},
+	{0, NULL}
+};
+
+static PyType_Spec py_tnpam_pool_spec = {
+	.name = MODULE_NAME ".PamContextPool",
+	.basicsize = sizeof(tnpam_pool_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = py_tnpam_pool_slots,
+};
+
+bool init_pool_type(PyObject *module_ref)
+{
+	tnpam_state_t *state = py_get_pam_state(module_ref);
+
+	state->pool_type = (PyTypeObject *)PyType_FromModuleAndSpec(module_ref,
+								    &py_tnpam_pool_spec,
+								    NULL);
+	return state->pool_type != NULL;
+}
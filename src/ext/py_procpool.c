@@ -0,0 +1,1696 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "truenas_pypam.h"
+
+/*
+ * PamProcessPool: PAM handles owned by worker processes.
+ *
+ * Some module stacks are not thread-safe, leak memory or crash. A process
+ * pool runs the PAM calls of its contexts in worker processes instead so
+ * that such stacks can be spread over several processes and a crashing or
+ * hung module only takes down a worker.
+ *
+ * When the pool is created a fork server is forked from the application.
+ * Workers are forked from the fork server on demand, so they start from a
+ * single-threaded process and never run python code. Each worker is
+ * connected to the application by an AF_UNIX SOCK_SEQPACKET socket pair
+ * that carries requests, conversation rounds and results as one datagram
+ * each, and reports the death of the worker as EOF.
+ *
+ * A context created through the pool keeps a local PAM handle that is never
+ * passed to a PAM call. It holds the items and environment visible to the
+ * application and its PAM_CONV. Items (PAM_USER, PAM_RUSER, PAM_RHOST,
+ * PAM_TTY, PAM_USER_PROMPT, PAM_XDISPLAY) and the environment are sent to
+ * the worker with every call and the worker's copy is applied back when the
+ * call returns. Conversation rounds are answered by calling the local
+ * PAM_CONV, so callbacks, declarative responses, resumable operations and
+ * deadlines behave as for in-process contexts.
+ *
+ * Contexts are bound to one worker for their lifetime and a worker runs one
+ * call at a time, conversation included. New contexts get an idle worker,
+ * a new one if the pool isn't full, or the least loaded one. A worker that
+ * served max_requests calls takes no new contexts and exits once its last
+ * context is gone.
+ *
+ * The worker side only uses malloc(3) and plain syscalls. Everything in
+ * the parent that runs without the GIL is protected by pool->lock (worker
+ * list, assignment) and worker->lock (the socket and message buffers).
+ * worker->lock is taken first.
+ *
+ * A conversation callback runs with worker->lock held, and may create or
+ * drop other contexts of the pool (including through garbage collection).
+ * New contexts then avoid the worker of the conversation, and contexts
+ * dropped while the lock is unavailable have their END message queued for
+ * the next holder of the lock rather than waiting for it.
+ */
+
+#define TNPAM_PROC_DEFAULT_WORKERS 2
+#define TNPAM_PROC_MAX_WORKERS 256
+#define TNPAM_PROC_MSG_MAX (64 * 1024)
+#define TNPAM_PROC_NO_STR UINT32_MAX
+
+typedef enum {
+	PROC_MSG_START = 1,	/* id, service, user, confdir, fail_delay, defer */
+	PROC_MSG_RESULT,	/* code: reply to START */
+	PROC_MSG_OP,		/* id, op, flags, state */
+	PROC_MSG_CONV,		/* count, (style, msg) * count */
+	PROC_MSG_CONV_REPLY,	/* code, count, resp * count */
+	PROC_MSG_DONE,		/* code, fail_delay_usec, has_state, state */
+	PROC_MSG_END,		/* id, code: no reply */
+} proc_msg_type_t;
+
+/* Outgoing message */
+typedef struct {
+	char *buf;
+	size_t len;
+	bool overflow;
+} proc_msg_t;
+
+/* Incoming message. Strings point into buf. */
+typedef struct {
+	const char *buf;
+	size_t len;
+	size_t off;
+	bool bad;
+} proc_rd_t;
+
+/* END message of a context detached while its worker was busy */
+typedef struct proc_end {
+	struct proc_end *next;
+	uint32_t id;
+	uint32_t code;
+} proc_end_t;
+
+struct tnpam_proc_worker {
+	// Held for a whole call including its conversation rounds
+	pthread_mutex_t lock;
+	int fd;			/* -1 once the worker is lost */
+	pid_t pid;
+	char *in;
+	proc_msg_t out;
+	uint64_t requests;
+	// Sent by the next holder of lock. Protected by end_lock.
+	pthread_mutex_t end_lock;
+	proc_end_t *ends;
+	// Protected by pool->lock
+	size_t contexts;
+	boolean_t retiring;	/* no new contexts */
+	tnpam_proc_worker_t *next;
+};
+
+struct tnpam_proc_pool {
+	PyObject_HEAD
+	pthread_mutex_t lock;
+	boolean_t ready;	/* set up by tp_init */
+	int server_fd;		/* -1 if the fork server is gone */
+	pid_t server_pid;
+	size_t max_workers;
+	uint64_t max_requests;
+	uint32_t next_id;
+	uint64_t spawned;
+	tnpam_proc_worker_t *workers;
+	tnpam_proc_pool_t *next;	/* proc_pools */
+};
+
+/* Items synchronized between the context and its worker */
+static const int proc_items[] = {
+	PAM_USER,
+	PAM_RUSER,
+	PAM_RHOST,
+	PAM_TTY,
+	PAM_USER_PROMPT,
+	PAM_XDISPLAY,
+};
+
+/* Pools of the process, for the atfork handler */
+static pthread_once_t proc_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t proc_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static tnpam_proc_pool_t *proc_pools = NULL;
+
+// Worker whose call the thread is making, to refuse (rather than deadlock
+// on) a conversation that uses a context of the same worker
+static _Thread_local tnpam_proc_worker_t *proc_tls_worker = NULL;
+
+static void
+msg_put(proc_msg_t *m, const void *data, size_t len)
+{
+	if (m->overflow || (len > TNPAM_PROC_MSG_MAX - m->len)) {
+		m->overflow = true;
+		return;
+	}
+
+	memcpy(m->buf + m->len, data, len);
+	m->len += len;
+}
+
+static void
+msg_u32(proc_msg_t *m, uint32_t val)
+{
+	msg_put(m, &val, sizeof(val));
+}
+
+static void
+msg_str(proc_msg_t *m, const char *str)
+{
+	size_t len;
+
+	if (str == NULL) {
+		msg_u32(m, TNPAM_PROC_NO_STR);
+		return;
+	}
+
+	len = strlen(str);
+	msg_u32(m, (uint32_t)len);
+	msg_put(m, str, len + 1);
+}
+
+static void
+msg_reset(proc_msg_t *m, proc_msg_type_t type)
+{
+	m->len = 0;
+	m->overflow = false;
+	msg_u32(m, type);
+}
+
+/* Wipe a message that may have carried a secret */
+static void
+msg_wipe(proc_msg_t *m)
+{
+	explicit_bzero(m->buf, m->len);
+	m->len = 0;
+}
+
+static uint32_t
+rd_u32(proc_rd_t *r)
+{
+	uint32_t val = 0;
+
+	if (r->bad || (r->len - r->off < sizeof(val))) {
+		r->bad = true;
+		return 0;
+	}
+
+	memcpy(&val, r->buf + r->off, sizeof(val));
+	r->off += sizeof(val);
+	return val;
+}
+
+/* Returns NULL for a NULL string and on error, check r->bad */
+static const char *
+rd_str(proc_rd_t *r)
+{
+	const char *str;
+	uint32_t len = rd_u32(r);
+
+	if (r->bad || (len == TNPAM_PROC_NO_STR)) {
+		return NULL;
+	}
+
+	if ((len >= r->len - r->off) || (r->buf[r->off + len] != '\0')) {
+		r->bad = true;
+		return NULL;
+	}
+
+	str = r->buf + r->off;
+	r->off += len + 1;
+	return str;
+}
+
+static bool
+proc_send(int fd, const proc_msg_t *m)
+{
+	ssize_t n;
+
+	do {
+		n = send(fd, m->buf, m->len, MSG_NOSIGNAL);
+	} while ((n == -1) && (errno == EINTR));
+
+	return n == (ssize_t)m->len;
+}
+
+/* Receive a message into buf and return its type, or 0 on EOF / error */
+static uint32_t
+proc_recv(int fd, char *buf, proc_rd_t *r)
+{
+	ssize_t n;
+
+	do {
+		n = recv(fd, buf, TNPAM_PROC_MSG_MAX, 0);
+	} while ((n == -1) && (errno == EINTR));
+
+	*r = (proc_rd_t) { .buf = buf, .len = (n > 0) ? (size_t)n : 0 };
+	return (n > 0) ? rd_u32(r) : 0;
+}
+
+/*
+ * Append the items and environment of hdl to m. Environment strings are
+ * wiped since modules may keep secrets there.
+ */
+static void
+proc_put_state(proc_msg_t *m, pam_handle_t *hdl)
+{
+	char **env, **p;
+	uint32_t count = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(proc_items); i++) {
+		const void *val = NULL;
+
+		if (pam_get_item(hdl, proc_items[i], &val) != PAM_SUCCESS) {
+			val = NULL;
+		}
+		msg_str(m, val);
+	}
+
+	env = pam_getenvlist(hdl);
+	if (env == NULL) {
+		m->overflow = true;
+		return;
+	}
+
+	for (p = env; *p != NULL; p++) {
+		count++;
+	}
+
+	msg_u32(m, count);
+	for (p = env; *p != NULL; p++) {
+		msg_str(m, *p);
+		explicit_bzero(*p, strlen(*p));
+		free(*p);
+	}
+
+	free(env);
+}
+
+/* Whether one of the count NAME=VALUE strings in r has the name */
+static bool
+proc_env_listed(proc_rd_t r, uint32_t count, const char *name, size_t len)
+{
+	while (count-- > 0) {
+		const char *entry = rd_str(&r);
+
+		if ((entry != NULL) && (strncmp(entry, name, len) == 0) &&
+		    (entry[len] == '=')) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Make the items and environment of hdl those read from r by
+ * proc_put_state().
+ */
+static pamcode_t
+proc_apply_state(pam_handle_t *hdl, proc_rd_t *r)
+{
+	pamcode_t ret = PAM_SUCCESS;
+	char **env, **p;
+	proc_rd_t envlist;
+	uint32_t count, i;
+	size_t item;
+
+	for (item = 0; item < ARRAY_SIZE(proc_items); item++) {
+		const void *cur = NULL;
+		const char *val = rd_str(r);
+
+		if (r->bad) {
+			return PAM_SYSTEM_ERR;
+		}
+
+		pam_get_item(hdl, proc_items[item], &cur);
+		if ((cur == val) ||
+		    ((cur != NULL) && (val != NULL) && (strcmp(cur, val) == 0))) {
+			continue;
+		}
+
+		if ((ret = pam_set_item(hdl, proc_items[item], val)) != PAM_SUCCESS) {
+			return ret;
+		}
+	}
+
+	count = rd_u32(r);
+	envlist = *r;
+
+	// Remove variables that are gone first. pam_putenv() with only a name
+	// removes the variable.
+	env = pam_getenvlist(hdl);
+	if (env == NULL) {
+		return PAM_BUF_ERR;
+	}
+
+	for (p = env; *p != NULL; p++) {
+		char *eq = strchr(*p, '=');
+		size_t len = strlen(*p);
+
+		if (eq != NULL) {
+			*eq = '\0';
+			if (!proc_env_listed(envlist, count, *p, eq - *p) &&
+			    (ret == PAM_SUCCESS)) {
+				ret = pam_putenv(hdl, *p);
+			}
+		}
+
+		explicit_bzero(*p, len);
+		free(*p);
+	}
+	free(env);
+
+	for (i = 0; i < count; i++) {
+		const char *entry = rd_str(r);
+
+		if (r->bad || (entry == NULL)) {
+			return PAM_SYSTEM_ERR;
+		}
+
+		if (ret == PAM_SUCCESS) {
+			ret = pam_putenv(hdl, entry);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Worker process
+ */
+
+typedef struct proc_slot {
+	uint32_t id;
+	pam_handle_t *hdl;
+	struct pam_conv conv;
+	uint32_t fail_delay_usec;
+	struct proc_slot *next;
+} proc_slot_t;
+
+static struct {
+	int fd;
+	char *in;
+	proc_msg_t out;
+	proc_slot_t *slots;
+} wk;
+
+/*
+ * Conversation function of the handles in the worker. Forwards the round
+ * to the application and waits for its answer. The worker exits if the
+ * application went away.
+ */
+static int
+worker_conv(int num_msg, const struct pam_message **msg,
+	    struct pam_response **resp, void *appdata_ptr)
+{
+	struct pam_response *reply = NULL;
+	proc_rd_t r;
+	uint32_t ret, count;
+	int i;
+
+	if ((num_msg <= 0) || (num_msg > PAM_MAX_NUM_MSG)) {
+		return PAM_CONV_ERR;
+	}
+
+	msg_reset(&wk.out, PROC_MSG_CONV);
+	msg_u32(&wk.out, (uint32_t)num_msg);
+	for (i = 0; i < num_msg; i++) {
+		msg_u32(&wk.out, (uint32_t)msg[i]->msg_style);
+		msg_str(&wk.out, msg[i]->msg);
+	}
+
+	if (wk.out.overflow) {
+		return PAM_CONV_ERR;
+	}
+
+	if (!proc_send(wk.fd, &wk.out) ||
+	    (proc_recv(wk.fd, wk.in, &r) != PROC_MSG_CONV_REPLY)) {
+		_exit(1);
+	}
+
+	ret = rd_u32(&r);
+	count = rd_u32(&r);
+	if (r.bad || (ret != PAM_SUCCESS) || (count != (uint32_t)num_msg)) {
+		ret = r.bad ? PAM_CONV_ERR : ret;
+		goto out;
+	}
+
+	reply = calloc(num_msg, sizeof(struct pam_response));
+	if (reply == NULL) {
+		ret = PAM_BUF_ERR;
+		goto out;
+	}
+
+	for (i = 0; i < num_msg; i++) {
+		const char *str = rd_str(&r);
+
+		if (str != NULL) {
+			reply[i].resp = strdup(str);
+			if (reply[i].resp == NULL) {
+				ret = PAM_BUF_ERR;
+				break;
+			}
+		}
+	}
+
+	if (r.bad) {
+		ret = PAM_CONV_ERR;
+	}
+
+	if (ret != PAM_SUCCESS) {
+		free_pam_resp(num_msg, reply);
+		reply = NULL;
+	}
+
+out:
+	explicit_bzero(wk.in, r.len);
+	*resp = reply;
+	return (int)ret;
+}
+
+static void
+worker_fail_delay_cb(int retval, unsigned usec_delay, void *appdata_ptr)
+{
+	proc_slot_t *slot = (proc_slot_t *)appdata_ptr;
+
+	slot->fail_delay_usec = (retval == PAM_SUCCESS) ? 0 : usec_delay;
+}
+
+static proc_slot_t *
+worker_slot(uint32_t id, bool unlink)
+{
+	proc_slot_t **pp, *slot;
+
+	for (pp = &wk.slots; (slot = *pp) != NULL; pp = &slot->next) {
+		if (slot->id == id) {
+			if (unlink) {
+				*pp = slot->next;
+			}
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+static pamcode_t
+worker_start(proc_rd_t *r)
+{
+	proc_slot_t *slot;
+	uint32_t id = rd_u32(r);
+	const char *service = rd_str(r);
+	const char *user = rd_str(r);
+	const char *confdir = rd_str(r);
+	uint32_t fail_delay = rd_u32(r);
+	uint32_t defer = rd_u32(r);
+	pamcode_t ret;
+
+	if (r->bad || (service == NULL)) {
+		return PAM_SYSTEM_ERR;
+	}
+
+	slot = calloc(1, sizeof(proc_slot_t));
+	if (slot == NULL) {
+		return PAM_BUF_ERR;
+	}
+
+	slot->id = id;
+	slot->conv.conv = worker_conv;
+	slot->conv.appdata_ptr = slot;
+
+	ret = pam_start_confdir(service, user, &slot->conv, confdir, &slot->hdl);
+	if ((ret == PAM_SUCCESS) && fail_delay) {
+		ret = pam_fail_delay(slot->hdl, fail_delay);
+	}
+	if ((ret == PAM_SUCCESS) && defer) {
+		ret = pam_set_item(slot->hdl, PAM_FAIL_DELAY,
+				   (const void *)worker_fail_delay_cb);
+	}
+
+	if (ret != PAM_SUCCESS) {
+		if (slot->hdl != NULL) {
+			pam_end(slot->hdl, ret);
+		}
+		free(slot);
+		return ret;
+	}
+
+	slot->next = wk.slots;
+	wk.slots = slot;
+	return PAM_SUCCESS;
+}
+
+static void
+worker_op(proc_rd_t *r)
+{
+	proc_slot_t *slot = worker_slot(rd_u32(r), false);
+	uint32_t op = rd_u32(r);
+	uint32_t flags = rd_u32(r);
+	pamcode_t ret;
+
+	if (r->bad || (slot == NULL) || (op >= TNPAM_OP_COUNT)) {
+		ret = PAM_SYSTEM_ERR;
+	} else if ((ret = proc_apply_state(slot->hdl, r)) == PAM_SUCCESS) {
+		slot->fail_delay_usec = 0;
+		ret = tnpam_op_pam(slot->hdl, (tnpam_op_t)op, (int)flags);
+	}
+
+	// The request carried the environment
+	explicit_bzero(wk.in, r->len);
+
+	msg_reset(&wk.out, PROC_MSG_DONE);
+	msg_u32(&wk.out, (uint32_t)ret);
+	msg_u32(&wk.out, (slot != NULL) ? slot->fail_delay_usec : 0);
+	msg_u32(&wk.out, slot != NULL);
+	if (slot != NULL) {
+		proc_put_state(&wk.out, slot->hdl);
+	}
+
+	if (wk.out.overflow) {
+		// Report the result without the state rather than nothing
+		msg_reset(&wk.out, PROC_MSG_DONE);
+		msg_u32(&wk.out, PAM_BUF_ERR);
+		msg_u32(&wk.out, 0);
+		msg_u32(&wk.out, 0);
+	}
+
+	if (!proc_send(wk.fd, &wk.out)) {
+		_exit(1);
+	}
+	msg_wipe(&wk.out);
+}
+
+static void
+worker_end(proc_rd_t *r)
+{
+	proc_slot_t *slot = worker_slot(rd_u32(r), true);
+	uint32_t code = rd_u32(r);
+
+	if (slot != NULL) {
+		pam_end(slot->hdl, r->bad ? PAM_SUCCESS : (int)code);
+		free(slot);
+	}
+}
+
+static void
+worker_main(int fd)
+{
+	proc_rd_t r;
+	uint32_t type;
+
+	wk.fd = fd;
+	wk.in = malloc(TNPAM_PROC_MSG_MAX);
+	wk.out.buf = malloc(TNPAM_PROC_MSG_MAX);
+	if ((wk.in == NULL) || (wk.out.buf == NULL)) {
+		_exit(1);
+	}
+
+	while ((type = proc_recv(fd, wk.in, &r)) != 0) {
+		switch (type) {
+		case PROC_MSG_START:
+			msg_reset(&wk.out, PROC_MSG_RESULT);
+			msg_u32(&wk.out, (uint32_t)worker_start(&r));
+			if (!proc_send(fd, &wk.out)) {
+				_exit(1);
+			}
+			break;
+		case PROC_MSG_OP:
+			worker_op(&r);
+			break;
+		case PROC_MSG_END:
+			worker_end(&r);
+			break;
+		default:
+			_exit(1);
+		}
+	}
+
+	// The application closed the socket or exited
+	while (wk.slots != NULL) {
+		proc_slot_t *slot = wk.slots;
+
+		wk.slots = slot->next;
+		pam_end(slot->hdl, PAM_SUCCESS);
+		free(slot);
+	}
+
+	_exit(0);
+}
+
+/*
+ * Fork server
+ */
+
+/*
+ * Give a forked child default signal handling. The application's handlers
+ * (e.g. python's SIGINT handler) must not run there. SIGINT from the
+ * terminal is left to the application, which ends its contexts. The fork
+ * server lets the kernel reap the workers.
+ */
+static void
+proc_reset_signals(bool server)
+{
+	struct sigaction sa = { .sa_handler = SIG_DFL };
+	sigset_t none;
+	int sig;
+
+	for (sig = 1; sig < NSIG; sig++) {
+		if ((sig != SIGKILL) && (sig != SIGSTOP)) {
+			sigaction(sig, &sa, NULL);
+		}
+	}
+
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &sa, NULL);
+	if (server) {
+		sigaction(SIGCHLD, &sa, NULL);
+	}
+
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+/*
+ * Close every descriptor inherited from the application except stdio and
+ * keep, which becomes fd 3.
+ */
+static void
+proc_close_fds(int keep)
+{
+	long max, fd;
+
+	if (keep != 3) {
+		dup2(keep, 3);
+		close(keep);
+	}
+	fcntl(3, F_SETFD, FD_CLOEXEC);
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, 4U, ~0U, 0) == 0) {
+		return;
+	}
+#endif
+	max = sysconf(_SC_OPEN_MAX);
+	if ((max < 0) || (max > 65536)) {
+		max = 65536;
+	}
+	for (fd = 4; fd < max; fd++) {
+		close((int)fd);
+	}
+}
+
+/* Send pid and, if valid, the descriptor fd over sock */
+static bool
+proc_send_fd(int sock, int32_t pid, int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct iovec iov = { .iov_base = &pid, .iov_len = sizeof(pid) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+	ssize_t n;
+
+	if (fd >= 0) {
+		memset(&cmsg, 0, sizeof(cmsg));
+		mh.msg_control = cmsg.buf;
+		mh.msg_controllen = sizeof(cmsg.buf);
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+	}
+
+	do {
+		n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while ((n == -1) && (errno == EINTR));
+
+	return n == sizeof(pid);
+}
+
+/* Returns the pid sent by proc_send_fd() or -1, and the descriptor if any */
+static pid_t
+proc_recv_fd(int sock, int *fd_out)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	int32_t pid = -1;
+	struct iovec iov = { .iov_base = &pid, .iov_len = sizeof(pid) };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf),
+	};
+	struct cmsghdr *hdr;
+	ssize_t n;
+
+	*fd_out = -1;
+	do {
+		n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	} while ((n == -1) && (errno == EINTR));
+
+	if (n != sizeof(pid)) {
+		return -1;
+	}
+
+	for (hdr = CMSG_FIRSTHDR(&mh); hdr != NULL; hdr = CMSG_NXTHDR(&mh, hdr)) {
+		if ((hdr->cmsg_level == SOL_SOCKET) &&
+		    (hdr->cmsg_type == SCM_RIGHTS)) {
+			memcpy(fd_out, CMSG_DATA(hdr), sizeof(int));
+		}
+	}
+
+	if ((pid <= 0) && (*fd_out != -1)) {
+		close(*fd_out);
+		*fd_out = -1;
+	}
+
+	return (*fd_out == -1) ? -1 : pid;
+}
+
+/*
+ * Main loop of the fork server. Every byte received on ctl asks for a new
+ * worker, which is answered with its pid and socket. Exits when the
+ * application closes ctl.
+ */
+static void
+proc_server_main(int ctl)
+{
+	for (;;) {
+		char req;
+		int sv[2];
+		pid_t pid = -1;
+		ssize_t n = recv(ctl, &req, 1, 0);
+
+		if ((n == -1) && (errno == EINTR)) {
+			continue;
+		} else if (n <= 0) {
+			_exit(0);
+		}
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+			proc_send_fd(ctl, -1, -1);
+			continue;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			close(ctl);
+			close(sv[0]);
+			proc_reset_signals(false);
+			proc_close_fds(sv[1]);
+			worker_main(3);
+		}
+
+		proc_send_fd(ctl, pid, (pid > 0) ? sv[0] : -1);
+		close(sv[0]);
+		close(sv[1]);
+	}
+}
+
+/*
+ * Application side
+ */
+
+static void
+proc_worker_free(tnpam_proc_worker_t *w)
+{
+	proc_end_t *end, *next;
+
+	if (w->fd != -1) {
+		// The worker ends its handles and exits on EOF
+		close(w->fd);
+	}
+	for (end = w->ends; end != NULL; end = next) {
+		next = end->next;
+		free(end);
+	}
+	pthread_mutex_destroy(&w->end_lock);
+	pthread_mutex_destroy(&w->lock);
+	free(w->in);
+	free(w->out.buf);
+	free(w);
+}
+
+/*
+ * The worker died, broke the protocol or is being killed. Called with
+ * w->lock held.
+ */
+static void
+proc_worker_lost(tnpam_proc_pool_t *pool, tnpam_proc_worker_t *w)
+{
+	if (w->fd != -1) {
+		kill(w->pid, SIGKILL);
+		close(w->fd);
+		w->fd = -1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	w->retiring = B_TRUE;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Ask the fork server for a new worker. Called with pool->lock held. */
+static tnpam_proc_worker_t *
+proc_spawn(tnpam_proc_pool_t *pool)
+{
+	tnpam_proc_worker_t *w;
+	char req = 0;
+	pid_t pid;
+	int fd;
+
+	if ((pool->server_fd == -1) ||
+	    (send(pool->server_fd, &req, 1, MSG_NOSIGNAL) != 1)) {
+		return NULL;
+	}
+
+	pid = proc_recv_fd(pool->server_fd, &fd);
+	if (pid == -1) {
+		return NULL;
+	}
+
+	w = calloc(1, sizeof(tnpam_proc_worker_t));
+	if ((w == NULL) || (pthread_mutex_init(&w->lock, NULL) != 0)) {
+		free(w);
+		close(fd);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&w->end_lock, NULL) != 0) {
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+		close(fd);
+		return NULL;
+	}
+
+	w->fd = fd;
+	w->pid = pid;
+	w->in = malloc(TNPAM_PROC_MSG_MAX);
+	w->out.buf = malloc(TNPAM_PROC_MSG_MAX);
+	if ((w->in == NULL) || (w->out.buf == NULL)) {
+		proc_worker_free(w);
+		return NULL;
+	}
+
+	w->next = pool->workers;
+	pool->workers = w;
+	pool->spawned++;
+	return w;
+}
+
+/*
+ * Pick the worker of a new context: an idle one, a new one while the pool
+ * isn't full, or the least loaded one. exclude (if not NULL) is never
+ * picked. Called with pool->lock held.
+ */
+static tnpam_proc_worker_t *
+proc_assign(tnpam_proc_pool_t *pool, tnpam_proc_worker_t *exclude)
+{
+	tnpam_proc_worker_t *w, *best = NULL;
+	size_t live = 0;
+
+	for (w = pool->workers; w != NULL; w = w->next) {
+		if (w->retiring) {
+			continue;
+		}
+		live++;
+		if (w == exclude) {
+			continue;
+		}
+		if ((best == NULL) || (w->contexts < best->contexts)) {
+			best = w;
+		}
+	}
+
+	if (((best == NULL) || (best->contexts > 0)) &&
+	    (live < pool->max_workers)) {
+		w = proc_spawn(pool);
+		if (w != NULL) {
+			best = w;
+		}
+	}
+
+	if (best != NULL) {
+		best->contexts++;
+	}
+
+	return best;
+}
+
+/* Drop a context from its worker, freeing a retired worker with none left */
+static void
+proc_release(tnpam_proc_pool_t *pool, tnpam_proc_worker_t *w)
+{
+	tnpam_proc_worker_t **pp;
+	bool free_worker = false;
+
+	pthread_mutex_lock(&pool->lock);
+	w->contexts--;
+	if (w->retiring && (w->contexts == 0)) {
+		for (pp = &pool->workers; *pp != NULL; pp = &(*pp)->next) {
+			if (*pp == w) {
+				*pp = w->next;
+				break;
+			}
+		}
+		free_worker = true;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (free_worker) {
+		proc_worker_free(w);
+	}
+}
+
+/*
+ * Wait for the worker to answer before the deadline of the call. Returns
+ * false if the deadline passed.
+ */
+static bool
+proc_wait(tnpam_proc_worker_t *w, uint64_t deadline_ns)
+{
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+
+	if (deadline_ns == 0) {
+		return true;
+	}
+
+	for (;;) {
+		uint64_t now = tnpam_now_ns();
+		uint64_t ms;
+		int rv;
+
+		if (now >= deadline_ns) {
+			return false;
+		}
+
+		ms = (deadline_ns - now + 999999) / 1000000;
+		rv = poll(&pfd, 1, (ms > INT_MAX) ? INT_MAX : (int)ms);
+		if ((rv > 0) || ((rv == -1) && (errno != EINTR))) {
+			// errors are reported by recv()
+			return true;
+		}
+	}
+}
+
+/*
+ * Send the END messages queued by tnpam_proc_detach(). Called with w->lock
+ * held.
+ */
+static void
+proc_send_ends(tnpam_proc_pool_t *pool, tnpam_proc_worker_t *w)
+{
+	proc_end_t *end, *next;
+
+	pthread_mutex_lock(&w->end_lock);
+	end = w->ends;
+	w->ends = NULL;
+	pthread_mutex_unlock(&w->end_lock);
+
+	for (; end != NULL; end = next) {
+		next = end->next;
+		if (w->fd != -1) {
+			msg_reset(&w->out, PROC_MSG_END);
+			msg_u32(&w->out, end->id);
+			msg_u32(&w->out, end->code);
+			if (!proc_send(w->fd, &w->out)) {
+				proc_worker_lost(pool, w);
+			}
+		}
+		free(end);
+	}
+}
+
+/*
+ * Start the worker side of a context being set up. Called without the GIL.
+ * From a conversation callback the worker of the conversation is skipped
+ * since its lock is held by this thread, and the lock of the one assigned
+ * instead is only tried: it may be held by a thread in a conversation that
+ * is waiting for this one. PAM_SYSTEM_ERR is returned if the pool has no
+ * other worker to offer or it is busy.
+ */
+pamcode_t
+tnpam_proc_attach(tnpam_ctx_t *ctx, const tnpam_cfg_t *cfg)
+{
+	tnpam_proc_pool_t *pool = cfg->proc_pool;
+	tnpam_proc_worker_t *w;
+	proc_rd_t r;
+	pamcode_t ret = PAM_SYSTEM_ERR;
+	uint32_t id;
+
+	pthread_mutex_lock(&pool->lock);
+	w = proc_assign(pool, proc_tls_worker);
+	id = ++pool->next_id;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (w == NULL) {
+		return PAM_SYSTEM_ERR;
+	}
+
+	if (proc_tls_worker == NULL) {
+		pthread_mutex_lock(&w->lock);
+	} else if (pthread_mutex_trylock(&w->lock) != 0) {
+		proc_release(pool, w);
+		return PAM_SYSTEM_ERR;
+	}
+
+	proc_send_ends(pool, w);
+	if (w->fd != -1) {
+		msg_reset(&w->out, PROC_MSG_START);
+		msg_u32(&w->out, id);
+		msg_str(&w->out, cfg->service);
+		msg_str(&w->out, cfg->user);
+		msg_str(&w->out, cfg->cdir);
+		msg_u32(&w->out, cfg->fail_delay);
+		msg_u32(&w->out, cfg->defer_fail_delay ? 1 : 0);
+
+		if (w->out.overflow) {
+			ret = PAM_BUF_ERR;
+		} else if (proc_send(w->fd, &w->out) &&
+			   (proc_recv(w->fd, w->in, &r) == PROC_MSG_RESULT)) {
+			ret = (pamcode_t)rd_u32(&r);
+			if (r.bad) {
+				ret = PAM_SYSTEM_ERR;
+				proc_worker_lost(pool, w);
+			}
+		} else {
+			proc_worker_lost(pool, w);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	if (ret != PAM_SUCCESS) {
+		proc_release(pool, w);
+		return ret;
+	}
+
+	// Borrowed until the context is set up
+	ctx->proc_pool = pool;
+	ctx->proc = w;
+	ctx->proc_id = id;
+	return PAM_SUCCESS;
+}
+
+/*
+ * Queue the END message of a context for the next holder of w->lock.
+ * Without memory the worker keeps the handle until it exits.
+ */
+static void
+proc_queue_end(tnpam_proc_worker_t *w, uint32_t id, pamcode_t code)
+{
+	proc_end_t *end = malloc(sizeof(proc_end_t));
+
+	if (end == NULL) {
+		return;
+	}
+
+	end->id = id;
+	end->code = (uint32_t)code;
+	pthread_mutex_lock(&w->end_lock);
+	end->next = w->ends;
+	w->ends = end;
+	pthread_mutex_unlock(&w->end_lock);
+}
+
+/*
+ * End the worker side of a context. Called without the GIL, with the handle
+ * lock held or from dealloc. Inside a conversation the lock of the worker
+ * may be held by this thread or by a thread waiting for this one, so the
+ * END message is queued unless the lock is free.
+ */
+void
+tnpam_proc_detach(tnpam_ctx_t *ctx, pamcode_t code)
+{
+	tnpam_proc_worker_t *w = ctx->proc;
+
+	if (w == NULL) {
+		return;
+	}
+
+	if (proc_tls_worker != NULL) {
+		if ((w == proc_tls_worker) ||
+		    (pthread_mutex_trylock(&w->lock) != 0)) {
+			proc_queue_end(w, ctx->proc_id, code);
+			goto release;
+		}
+	} else {
+		pthread_mutex_lock(&w->lock);
+	}
+
+	proc_send_ends(ctx->proc_pool, w);
+	if (w->fd != -1) {
+		msg_reset(&w->out, PROC_MSG_END);
+		msg_u32(&w->out, ctx->proc_id);
+		msg_u32(&w->out, (uint32_t)code);
+		if (!proc_send(w->fd, &w->out)) {
+			proc_worker_lost(ctx->proc_pool, w);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+
+release:
+	proc_release(ctx->proc_pool, w);
+	ctx->proc = NULL;
+}
+
+/*
+ * Answer a conversation round of the worker with the PAM_CONV of the local
+ * handle. Returns false if the reply could not be sent.
+ */
+static bool
+proc_converse(tnpam_ctx_t *ctx, tnpam_proc_worker_t *w, proc_rd_t *r)
+{
+	struct pam_message msgs[PAM_MAX_NUM_MSG];
+	const struct pam_message *msgp[PAM_MAX_NUM_MSG];
+	struct pam_response *resp = NULL;
+	const struct pam_conv *conv = NULL;
+	uint32_t count = rd_u32(r), i;
+	int ret;
+	bool ok;
+
+	if (r->bad || (count == 0) || (count > PAM_MAX_NUM_MSG)) {
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		msgs[i].msg_style = (int)rd_u32(r);
+		msgs[i].msg = rd_str(r);
+		msgp[i] = &msgs[i];
+	}
+
+	if (r->bad) {
+		return false;
+	}
+
+	if ((pam_get_item(ctx->hdl, PAM_CONV, (const void **)&conv) != PAM_SUCCESS) ||
+	    (conv == NULL)) {
+		ret = PAM_CONV_ERR;
+	} else {
+		ret = conv->conv((int)count, msgp, &resp, conv->appdata_ptr);
+	}
+
+	msg_reset(&w->out, PROC_MSG_CONV_REPLY);
+	if ((ret == PAM_SUCCESS) && (resp == NULL)) {
+		ret = PAM_CONV_ERR;
+	}
+	msg_u32(&w->out, (uint32_t)ret);
+	msg_u32(&w->out, count);
+	for (i = 0; (ret == PAM_SUCCESS) && (i < count); i++) {
+		msg_str(&w->out, resp[i].resp);
+	}
+
+	if (resp != NULL) {
+		free_pam_resp((int)count, resp);
+	}
+
+	if (w->out.overflow) {
+		msg_reset(&w->out, PROC_MSG_CONV_REPLY);
+		msg_u32(&w->out, PAM_BUF_ERR);
+		msg_u32(&w->out, count);
+	}
+
+	ok = proc_send(w->fd, &w->out);
+	msg_wipe(&w->out);
+	return ok;
+}
+
+/*
+ * Run the PAM call of op in the worker of the context. Called by
+ * tnpam_op_call() in place of the call on the local handle, with the
+ * handle lock held and without the GIL. Returns TNPAM_OP_WORKER_LOST if the
+ * worker is gone (with ctx->deadline_hit set if it was killed because the
+ * deadline passed) and TNPAM_OP_WORKER_BUSY if the thread is in a
+ * conversation of the same worker.
+ */
+pamcode_t
+tnpam_proc_op(tnpam_ctx_t *ctx, tnpam_op_t op, int flags)
+{
+	tnpam_proc_pool_t *pool = ctx->proc_pool;
+	tnpam_proc_worker_t *w = ctx->proc;
+	tnpam_proc_worker_t *prev = proc_tls_worker;
+	pamcode_t ret = TNPAM_OP_WORKER_LOST;
+	bool retire = false;
+	proc_rd_t r;
+
+	if (prev == w) {
+		return TNPAM_OP_WORKER_BUSY;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	proc_send_ends(pool, w);
+	if (w->fd == -1) {
+		goto out;
+	}
+
+	msg_reset(&w->out, PROC_MSG_OP);
+	msg_u32(&w->out, ctx->proc_id);
+	msg_u32(&w->out, (uint32_t)op);
+	msg_u32(&w->out, (uint32_t)flags);
+	proc_put_state(&w->out, ctx->hdl);
+	if (w->out.overflow) {
+		msg_wipe(&w->out);
+		ret = PAM_BUF_ERR;
+		goto out;
+	}
+
+	if (!proc_send(w->fd, &w->out)) {
+		msg_wipe(&w->out);
+		proc_worker_lost(pool, w);
+		goto out;
+	}
+	msg_wipe(&w->out);
+
+	proc_tls_worker = w;
+	for (;;) {
+		uint32_t type;
+
+		if (!proc_wait(w, ctx->deadline_ns)) {
+			// A hung module can't be interrupted otherwise
+			ctx->deadline_hit = B_TRUE;
+			proc_worker_lost(pool, w);
+			break;
+		}
+
+		type = proc_recv(w->fd, w->in, &r);
+		if (type == PROC_MSG_CONV) {
+			bool sent = proc_converse(ctx, w, &r);
+
+			explicit_bzero(w->in, r.len);
+			if (!sent) {
+				proc_worker_lost(pool, w);
+				break;
+			}
+			continue;
+		}
+
+		if (type == PROC_MSG_DONE) {
+			uint32_t code = rd_u32(&r);
+			uint32_t fail_delay = rd_u32(&r);
+			uint32_t has_state = rd_u32(&r);
+
+			ret = (pamcode_t)code;
+			if (has_state && !r.bad) {
+				pamcode_t err = proc_apply_state(ctx->hdl, &r);
+
+				if (ret == PAM_SUCCESS) {
+					ret = err;
+				}
+			}
+
+			if (ctx->defer_fail_delay) {
+				atomic_store_explicit(&ctx->fail_delay_usec,
+						      fail_delay,
+						      memory_order_relaxed);
+			}
+
+			explicit_bzero(w->in, r.len);
+			if (r.bad) {
+				ret = TNPAM_OP_WORKER_LOST;
+				proc_worker_lost(pool, w);
+			}
+			break;
+		}
+
+		proc_worker_lost(pool, w);
+		break;
+	}
+	proc_tls_worker = prev;
+
+	// Contexts dropped by the conversation
+	proc_send_ends(pool, w);
+
+	w->requests++;
+	retire = (pool->max_requests != 0) && (w->requests >= pool->max_requests);
+
+out:
+	if (retire) {
+		pthread_mutex_lock(&pool->lock);
+		w->retiring = B_TRUE;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+/*
+ * Sockets of the parent's pools are not for the child: its calls would
+ * interleave with the parent's. Drop them so that contexts in the child
+ * report the worker as lost.
+ */
+static void
+proc_atfork_child(void)
+{
+	tnpam_proc_pool_t *pool;
+	tnpam_proc_worker_t *w;
+
+	pthread_mutex_init(&proc_pools_lock, NULL);
+	for (pool = proc_pools; pool != NULL; pool = pool->next) {
+		pthread_mutex_init(&pool->lock, NULL);
+		if (pool->server_fd != -1) {
+			close(pool->server_fd);
+			pool->server_fd = -1;
+		}
+		pool->server_pid = 0;
+
+		for (w = pool->workers; w != NULL; w = w->next) {
+			pthread_mutex_init(&w->lock, NULL);
+			pthread_mutex_init(&w->end_lock, NULL);
+			if (w->fd != -1) {
+				close(w->fd);
+				w->fd = -1;
+			}
+			w->retiring = B_TRUE;
+		}
+	}
+}
+
+static void
+proc_init(void)
+{
+	pthread_atfork(NULL, NULL, proc_atfork_child);
+}
+
+static int
+py_tnpam_proc_pool_init(tnpam_proc_pool_t *self, PyObject *args,
+			PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"workers",
+		"max_requests",
+		NULL
+	};
+	Py_ssize_t workers = TNPAM_PROC_DEFAULT_WORKERS;
+	Py_ssize_t max_requests = 0;
+	int sv[2];
+	pid_t pid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$nn", kwlist,
+					 &workers, &max_requests)) {
+		return -1;
+	}
+
+	if (self->ready) {
+		PyErr_SetString(PyExc_RuntimeError, "pool is already initialized");
+		return -1;
+	}
+
+	if ((workers < 1) || (workers > TNPAM_PROC_MAX_WORKERS)) {
+		PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d",
+			     TNPAM_PROC_MAX_WORKERS);
+		return -1;
+	}
+
+	if (max_requests < 0) {
+		PyErr_SetString(PyExc_ValueError, "max_requests must not be negative");
+		return -1;
+	}
+
+	pthread_once(&proc_once, proc_init);
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(sv[0]);
+		proc_reset_signals(true);
+		proc_close_fds(sv[1]);
+		proc_server_main(3);
+	}
+
+	close(sv[1]);
+	pthread_mutex_init(&self->lock, NULL);
+	self->server_fd = sv[0];
+	self->server_pid = pid;
+	self->max_workers = (size_t)workers;
+	self->max_requests = (uint64_t)max_requests;
+	self->ready = B_TRUE;
+
+	pthread_mutex_lock(&proc_pools_lock);
+	self->next = proc_pools;
+	proc_pools = self;
+	pthread_mutex_unlock(&proc_pools_lock);
+	return 0;
+}
+
+static void
+py_tnpam_proc_pool_dealloc(tnpam_proc_pool_t *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	tnpam_proc_pool_t **pp;
+
+	if (self->ready) {
+		pthread_mutex_lock(&proc_pools_lock);
+		for (pp = &proc_pools; *pp != NULL; pp = &(*pp)->next) {
+			if (*pp == self) {
+				*pp = self->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&proc_pools_lock);
+
+		// Every context holds a reference, so the workers are idle
+		while (self->workers != NULL) {
+			tnpam_proc_worker_t *w = self->workers;
+
+			self->workers = w->next;
+			proc_worker_free(w);
+		}
+
+		if (self->server_fd != -1) {
+			close(self->server_fd);
+		}
+
+		if (self->server_pid > 0) {
+			Py_BEGIN_ALLOW_THREADS
+			waitpid(self->server_pid, NULL, 0);
+			Py_END_ALLOW_THREADS
+		}
+		pthread_mutex_destroy(&self->lock);
+	}
+
+	tp->tp_free((PyObject *)self);
+	Py_DECREF(tp);
+}
+
+PyDoc_STRVAR(py_tnpam_proc_pool_get_context__doc__,
+"get_context(*, user, service_name='login', conversation_function=None,\n"
+"            conversation_private_data=None, confdir=None, rhost=None,\n"
+"            ruser=None, fail_delay=0, conversation_responses=None,\n"
+"            message_history_size=64, lock_policy=None,\n"
+"            lock_group=None, defer_fail_delay=False,\n"
+"            pam_env=None, auth_cache=False,\n"
+"            timeout=None) -> PamContext\n"
+"------------------------------------------------------------\n\n"
+"Create a PAM context whose PAM calls run in a worker of the pool.\n\n"
+"Arguments are the same as truenas_pypam.get_context(). The PAM transaction\n"
+"is started in a worker process, which is started first if the pool has\n"
+"fewer than workers processes. Items and the environment set by modules\n"
+"become visible to the application when the PAM call returns.\n\n"
+"If the worker exits or is killed, operations of its contexts fail with\n"
+"PAMError (PAM_SYSTEM_ERR) and the contexts should be discarded. A worker\n"
+"that is still running a PAM call when the deadline of the call passes is\n"
+"killed, which ends the transactions of every context of that worker.\n\n"
+"Raises\n"
+"------\n"
+"PAMError\n"
+"    If no worker could be started (PAM_SYSTEM_ERR) or\n"
+"    pam_start_confdir(3) failed in the worker\n"
+"ValueError, TypeError\n"
+"    Same as truenas_pypam.get_context()\n"
+);
+
+static PyObject *
+py_tnpam_proc_pool_get_context(tnpam_proc_pool_t *self, PyObject *const *args,
+			       Py_ssize_t nargs, PyObject *kwnames)
+{
+	tnpam_ctx_t *ctx = NULL;
+	PyTypeObject *ctx_type = NULL;
+	tnpam_cfg_t cfg;
+
+	if (!self->ready) {
+		PyErr_SetString(PyExc_RuntimeError, "pool is not initialized");
+		return NULL;
+	}
+
+	if (tnpam_ctx_parse_cfg(args, nargs, kwnames, &cfg) < 0) {
+		return NULL;
+	}
+
+	cfg.proc_pool = self;
+
+	ctx_type = py_get_pam_state_from_type(Py_TYPE(self))->ctx_type;
+	ctx = (tnpam_ctx_t *)ctx_type->tp_alloc(ctx_type, 0);
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	if (tnpam_ctx_setup(ctx, &cfg) < 0) {
+		Py_DECREF(ctx);
+		return NULL;
+	}
+
+	return (PyObject *)ctx;
+}
+
+static PyObject *
+py_tnpam_proc_pool_get_workers(tnpam_proc_pool_t *self, void *closure)
+{
+	return PyLong_FromSize_t(self->max_workers);
+}
+
+static PyObject *
+py_tnpam_proc_pool_get_max_requests(tnpam_proc_pool_t *self, void *closure)
+{
+	return PyLong_FromUnsignedLongLong(self->max_requests);
+}
+
+static PyObject *
+py_tnpam_proc_pool_get_spawned(tnpam_proc_pool_t *self, void *closure)
+{
+	uint64_t spawned;
+
+	if (!self->ready) {
+		return PyLong_FromLong(0);
+	}
+
+	pthread_mutex_lock(&self->lock);
+	spawned = self->spawned;
+	pthread_mutex_unlock(&self->lock);
+
+	return PyLong_FromUnsignedLongLong(spawned);
+}
+
+static PyObject *
+py_tnpam_proc_pool_get_pids(tnpam_proc_pool_t *self, void *closure)
+{
+	pid_t pids[TNPAM_PROC_MAX_WORKERS];
+	tnpam_proc_worker_t *w;
+	PyObject *out;
+	size_t count = 0, i;
+
+	if (self->ready) {
+		// Only non-retiring workers are counted against max_workers
+		pthread_mutex_lock(&self->lock);
+		for (w = self->workers; w != NULL; w = w->next) {
+			if (!w->retiring && (count < ARRAY_SIZE(pids))) {
+				pids[count++] = w->pid;
+			}
+		}
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	out = PyTuple_New((Py_ssize_t)count);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		PyObject *pid = PyLong_FromLong(pids[i]);
+
+		if (pid == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(out, (Py_ssize_t)i, pid);
+	}
+
+	return out;
+}
+
+static PyMethodDef py_tnpam_proc_pool_methods[] = {
+	{
+		.ml_name = "get_context",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_proc_pool_get_context,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_proc_pool_get_context__doc__,
+	},
+	{NULL}
+};
+
+static PyGetSetDef py_tnpam_proc_pool_getsetters[] = {
+	{
+		.name = "workers",
+		.get = (getter)py_tnpam_proc_pool_get_workers,
+		.doc = "int: maximum number of worker processes",
+	},
+	{
+		.name = "max_requests",
+		.get = (getter)py_tnpam_proc_pool_get_max_requests,
+		.doc = "int: PAM calls after which a worker is replaced, or 0",
+	},
+	{
+		.name = "spawned",
+		.get = (getter)py_tnpam_proc_pool_get_spawned,
+		.doc = "int: number of worker processes started by the pool",
+	},
+	{
+		.name = "pids",
+		.get = (getter)py_tnpam_proc_pool_get_pids,
+		.doc = "tuple[int, ...]: process IDs of workers taking new contexts",
+	},
+	{NULL}
+};
+
+PyDoc_STRVAR(PyPamProcessPool_Type__doc__,
+"PamProcessPool(*, workers=2, max_requests=0)\n"
+"---------------------------------------------\n\n"
+"Pool of worker processes that run the PAM calls of its contexts.\n\n"
+"Contexts created with get_context() have the same API as other contexts\n"
+"but their PAM handle lives in a worker process, so that module stacks\n"
+"that are not thread-safe can run in parallel in several processes and a\n"
+"module that crashes or hangs does not take down the application.\n\n"
+"A fork server is forked when the pool is created and forks the workers\n"
+"on demand. Create pools early, before the application starts threads or\n"
+"opens descriptors it doesn't want to lend to a copy of the process.\n"
+"Every context is bound to one worker and a worker runs one PAM call at a\n"
+"time, including its conversation. A conversation callback must not use\n"
+"another context of the same worker (RuntimeError).\n\n"
+"See truenas_pypam.get_process_pool().\n"
+);
+
+static PyType_Slot py_tnpam_proc_pool_slots[] = {
+	{Py_tp_doc, (void *)PyPamProcessPool_Type__doc__},
+	{Py_tp_new, PyType_GenericNew},
+	{Py_tp_init, py_tnpam_proc_pool_init},
+	{Py_tp_dealloc, py_tnpam_proc_pool_dealloc},
+	{Py_tp_methods, py_tnpam_proc_pool_methods},
+	{Py_tp_getset, py_tnpam_proc_pool_getsetters},
+	{0, NULL}
+};
+
+static PyType_Spec py_tnpam_proc_pool_spec = {
+	.name = MODULE_NAME ".PamProcessPool",
+	.basicsize = sizeof(tnpam_proc_pool_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = py_tnpam_proc_pool_slots,
+};
+
+bool init_proc_pool_type(PyObject *module_ref)
+{
+	tnpam_state_t *state = py_get_pam_state(module_ref);
+
+	state->proc_pool_type = (PyTypeObject *)PyType_FromModuleAndSpec(module_ref,
+									 &py_tnpam_proc_pool_spec,
+									 NULL);
+	return state->proc_pool_type != NULL;
+}
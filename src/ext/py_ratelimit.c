@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "truenas_pypam.h"
+
+/*
+ * Admission control for pam_authenticate().
+ *
+ * Under a credential stuffing attack every attempt would otherwise run the
+ * whole module stack, including slow directory service backends, before
+ * failing. set_auth_rate_limit() enables token buckets keyed by PAM_RHOST
+ * and by PAM_USER. Each authentication attempt takes a token from the
+ * bucket of its remote host and from the bucket of its user; once either is
+ * empty the attempt fails with AuthRateLimited without calling into PAM.
+ *
+ * Buckets live in process-wide C memory shared by all interpreters, split
+ * into shards with a lock each so that unrelated keys don't contend. A
+ * shard is a fixed-size open addressing table of key hashes. When a key
+ * finds no free slot within TNPAM_RL_PROBE slots, the least recently used
+ * bucket among them is recycled, so memory stays bounded however many keys
+ * an attacker uses. Hashes are seeded per process so that colliding keys
+ * can't be chosen in advance.
+ *
+ * The limits are only written with every shard lock held and so may be read
+ * with any one of them held. rl.enabled lets the common case of no limits
+ * skip the locks entirely.
+ */
+
+#define TNPAM_RL_SHARDS 16
+#define TNPAM_RL_SLOTS 256	/* buckets per shard */
+#define TNPAM_RL_PROBE 8
+
+typedef enum {
+	TNPAM_RL_RHOST,
+	TNPAM_RL_USER,
+	TNPAM_RL_COUNT
+} tnpam_rl_key_t;
+
+typedef struct {
+	uint64_t key;		/* 0 if unused */
+	uint64_t last_ns;	/* time of last refill */
+	double tokens;
+} tnpam_rl_bucket_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	tnpam_rl_bucket_t buckets[TNPAM_RL_SLOTS];
+} tnpam_rl_shard_t;
+
+typedef struct {
+	double rate;		/* tokens per second, 0 if disabled */
+	Py_ssize_t burst;	/* bucket capacity */
+} tnpam_rl_limit_t;
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t config_lock;	/* serializes set_auth_rate_limit() */
+	_Atomic bool enabled;
+	uint64_t seed;
+	tnpam_rl_limit_t limits[TNPAM_RL_COUNT];
+	_Atomic uint64_t rejected[TNPAM_RL_COUNT];
+	tnpam_rl_shard_t shards[TNPAM_RL_SHARDS];
+} rl = {
+	.once = PTHREAD_ONCE_INIT,
+	.config_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const char *rl_key_names[] = {
+	[TNPAM_RL_RHOST] = "rhost",
+	[TNPAM_RL_USER] = "user",
+};
+
+_Static_assert(
+	TNPAM_RL_COUNT == ARRAY_SIZE(rl_key_names),
+	"rate limit key name table needs updating"
+);
+
+/*
+ * Threads holding shard locks at the time of fork() do not exist in the
+ * child, so reinitialize every lock there.
+ */
+static void
+rl_atfork_child(void)
+{
+	size_t i;
+
+	pthread_mutex_init(&rl.config_lock, NULL);
+	for (i = 0; i < TNPAM_RL_SHARDS; i++) {
+		pthread_mutex_init(&rl.shards[i].lock, NULL);
+	}
+}
+
+static void
+rl_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < TNPAM_RL_SHARDS; i++) {
+		pthread_mutex_init(&rl.shards[i].lock, NULL);
+	}
+
+	if (getrandom(&rl.seed, sizeof(rl.seed), 0) != sizeof(rl.seed)) {
+		rl.seed = tnpam_now_ns() ^ (uint64_t)(uintptr_t)&rl;
+	}
+
+	pthread_atfork(NULL, NULL, rl_atfork_child);
+}
+
+/*
+ * Seeded FNV-1a of the key kind and string. Never returns 0, which marks a
+ * free slot.
+ */
+static uint64_t
+rl_hash(tnpam_rl_key_t kind, const char *str)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ rl.seed;
+	const unsigned char *p;
+
+	h = (h ^ (uint64_t)kind) * 0x100000001b3ULL;
+	for (p = (const unsigned char *)str; *p != '\0'; p++) {
+		h = (h ^ *p) * 0x100000001b3ULL;
+	}
+
+	// Final avalanche so that both the shard and slot bits are mixed
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h ? h : 1;
+}
+
+/*
+ * Take a token from the bucket of key. Called with the shard lock held.
+ */
+static bool
+rl_bucket_take(tnpam_rl_shard_t *shard, const tnpam_rl_limit_t *limit,
+	       uint64_t key, uint64_t now)
+{
+	tnpam_rl_bucket_t *bucket = NULL, *victim = NULL;
+	size_t start = key % TNPAM_RL_SLOTS, i;
+	double tokens;
+
+	for (i = 0; i < TNPAM_RL_PROBE; i++) {
+		tnpam_rl_bucket_t *b = &shard->buckets[(start + i) % TNPAM_RL_SLOTS];
+
+		if (b->key == key) {
+			bucket = b;
+			break;
+		}
+
+		// Buckets are only ever cleared all at once, so the key can't
+		// be past a free slot
+		if (b->key == 0) {
+			victim = b;
+			break;
+		}
+
+		if ((victim == NULL) || (b->last_ns < victim->last_ns)) {
+			victim = b;
+		}
+	}
+
+	if (bucket == NULL) {
+		bucket = victim;
+		bucket->key = key;
+		bucket->tokens = (double)limit->burst;
+		bucket->last_ns = now;
+	}
+
+	tokens = bucket->tokens +
+		 (double)(now - bucket->last_ns) * limit->rate / 1e9;
+	bucket->tokens = (tokens < limit->burst) ? tokens : (double)limit->burst;
+	bucket->last_ns = now;
+
+	if (bucket->tokens < 1.0) {
+		return false;
+	}
+
+	bucket->tokens -= 1.0;
+	return true;
+}
+
+static bool
+rl_take(tnpam_rl_key_t kind, const char *str, uint64_t now)
+{
+	tnpam_rl_shard_t *shard;
+	uint64_t key;
+	bool ok = true;
+
+	if ((str == NULL) || (*str == '\0')) {
+		return true;
+	}
+
+	key = rl_hash(kind, str);
+	shard = &rl.shards[key >> 60];
+	_Static_assert(TNPAM_RL_SHARDS == 16, "shard index uses top 4 bits");
+
+	pthread_mutex_lock(&shard->lock);
+	if (rl.limits[kind].rate > 0) {
+		ok = rl_bucket_take(shard, &rl.limits[kind], key, now);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (!ok) {
+		atomic_fetch_add_explicit(&rl.rejected[kind], 1,
+					  memory_order_relaxed);
+	}
+
+	return ok;
+}
+
+/*
+ * Whether an authentication attempt for user from rhost (either may be
+ * NULL) may proceed. May be called without the GIL.
+ */
+bool
+tnpam_ratelimit_admit(const char *rhost, const char *user)
+{
+	uint64_t now;
+
+	if (!atomic_load_explicit(&rl.enabled, memory_order_relaxed)) {
+		return true;
+	}
+
+	now = tnpam_now_ns();
+
+	// Fail on the remote host first so that an attacker spraying many users
+	// from one host doesn't drain the buckets of those users
+	return rl_take(TNPAM_RL_RHOST, rhost, now) &&
+	       rl_take(TNPAM_RL_USER, user, now);
+}
+
+static bool
+rl_parse_limit(PyObject *py_rate, Py_ssize_t burst, const char *what,
+	       tnpam_rl_limit_t *limit)
+{
+	double rate = 0;
+
+	if (py_rate != NULL) {
+		rate = PyFloat_AsDouble(py_rate);
+		if ((rate == -1.0) && PyErr_Occurred()) {
+			return false;
+		}
+	}
+
+	if (!isfinite(rate) || (rate < 0)) {
+		PyErr_Format(PyExc_ValueError,
+			     "%s_rate must be a non-negative number", what);
+		return false;
+	}
+
+	if ((rate > 0) && (burst < 1)) {
+		PyErr_Format(PyExc_ValueError,
+			     "%s_burst must be a positive integer", what);
+		return false;
+	}
+
+	limit->rate = rate;
+	limit->burst = (rate > 0) ? burst : 0;
+	return true;
+}
+
+PyObject *
+py_tnpam_set_auth_rate_limit(PyObject *self, PyObject *const *args,
+			     Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"rhost_rate",
+		"rhost_burst",
+		"user_rate",
+		"user_burst",
+		NULL
+	};
+	PyObject *py_rhost_rate = NULL, *py_user_rate = NULL;
+	Py_ssize_t rhost_burst = 0, user_burst = 0;
+	tnpam_rl_limit_t limits[TNPAM_RL_COUNT];
+	size_t i;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$OnOn", kwlist,
+			      &py_rhost_rate, &rhost_burst,
+			      &py_user_rate, &user_burst)) {
+		return NULL;
+	}
+
+	if (!rl_parse_limit(py_rhost_rate, rhost_burst, "rhost",
+			    &limits[TNPAM_RL_RHOST]) ||
+	    !rl_parse_limit(py_user_rate, user_burst, "user",
+			    &limits[TNPAM_RL_USER])) {
+		return NULL;
+	}
+
+	pthread_once(&rl.once, rl_init);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&rl.config_lock);
+	for (i = 0; i < TNPAM_RL_SHARDS; i++) {
+		pthread_mutex_lock(&rl.shards[i].lock);
+	}
+
+	// New limits start from full buckets
+	memcpy(rl.limits, limits, sizeof(limits));
+	for (i = 0; i < TNPAM_RL_SHARDS; i++) {
+		memset(rl.shards[i].buckets, 0, sizeof(rl.shards[i].buckets));
+	}
+	atomic_store(&rl.enabled, (limits[TNPAM_RL_RHOST].rate > 0) ||
+				  (limits[TNPAM_RL_USER].rate > 0));
+
+	for (i = TNPAM_RL_SHARDS; i > 0; i--) {
+		pthread_mutex_unlock(&rl.shards[i - 1].lock);
+	}
+	pthread_mutex_unlock(&rl.config_lock);
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
+PyObject *
+py_tnpam_get_auth_rate_limit(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	tnpam_rl_limit_t limits[TNPAM_RL_COUNT];
+	PyObject *out = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&rl.config_lock);
+	memcpy(limits, rl.limits, sizeof(limits));
+	pthread_mutex_unlock(&rl.config_lock);
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TNPAM_RL_COUNT; i++) {
+		uint64_t rejected = atomic_load_explicit(&rl.rejected[i],
+							 memory_order_relaxed);
+		PyObject *limit;
+
+		limit = Py_BuildValue("{s:d,s:n,s:K}",
+				      "rate", limits[i].rate,
+				      "burst", limits[i].burst,
+				      "rejected", (unsigned long long)rejected);
+		if (limit == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		if (PyDict_SetItemString(out, rl_key_names[i], limit) < 0) {
+			Py_DECREF(limit);
+			Py_DECREF(out);
+			return NULL;
+		}
+		Py_DECREF(limit);
+	}
+
+	return out;
+}
@@ -0,0 +1,345 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include "truenas_pypam.h"
+
+/*
+ * Declarative conversation responses (conversation_responses).
+ *
+ * For the common case of answering prompts with a fixed password / username
+ * the python callback round trip (reacquire the GIL, build message tuple,
+ * call the function, parse the result) is pure overhead. The application
+ * may instead give a mapping of MSGStyle to the response text when creating
+ * the context and truenas_pam_conv will answer directly from C while still
+ * holding the handle lock and without touching the GIL.
+ */
+
+static void
+responder_entry_clear(tnpam_resp_entry_t *entry)
+{
+	if (entry->value != NULL) {
+		tnpam_secret_free(entry->value, entry->len + 1);
+	}
+
+	entry->value = NULL;
+	entry->len = 0;
+	entry->present = B_FALSE;
+}
+
+void
+tnpam_responder_free(tnpam_responder_t *responder)
+{
+	size_t i;
+
+	if (responder == NULL) {
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(responder->styles); i++) {
+		responder_entry_clear(&responder->styles[i]);
+	}
+
+	PyMem_RawFree(responder);
+}
+
+static bool
+responder_set_entry(tnpam_resp_entry_t *entry, PyObject *value)
+{
+	if (value == Py_None) {
+		entry->present = B_TRUE;
+		return true;
+	}
+
+	if (!tnpam_secret_check(value)) {
+		PyErr_Format(PyExc_TypeError,
+			     "%s: conversation_responses values must be str, "
+			     "a bytes-like object or None", Py_TYPE(value)->tp_name);
+		return false;
+	}
+
+	// Kept in the locked secret arena so that the value may be copied
+	// without the GIL
+	entry->value = tnpam_secret_copy(value, "conversation_responses values",
+					 &entry->len);
+	if (entry->value == NULL) {
+		return false;
+	}
+
+	entry->present = B_TRUE;
+	return true;
+}
+
+/*
+ * Build a responder from a mapping of MSGStyle to str / bytes / None.
+ * GIL must be held.
+ */
+tnpam_responder_t *
+tnpam_responder_new(PyObject *mapping)
+{
+	tnpam_responder_t *responder = NULL;
+	PyObject *items = NULL;
+	Py_ssize_t i;
+
+	// PyMapping_Check() is true for any sequence, so rely on items()
+	items = PyMapping_Items(mapping);
+	if (items == NULL) {
+		if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+			PyErr_Clear();
+			PyErr_SetString(PyExc_TypeError,
+					"conversation_responses must be a mapping");
+		}
+		return NULL;
+	}
+
+	responder = PyMem_RawCalloc(1, sizeof(tnpam_responder_t));
+	if (responder == NULL) {
+		Py_DECREF(items);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	for (i = 0; i < PyList_GET_SIZE(items); i++) {
+		PyObject *item = PyList_GET_ITEM(items, i);
+		PyObject *key = PyTuple_GET_ITEM(item, 0);
+		long style;
+
+		// MSGStyle is an IntEnum
+		style = PyLong_AsLong(key);
+		if ((style == -1) && PyErr_Occurred()) {
+			goto fail;
+		}
+
+		if ((style < PAM_PROMPT_ECHO_OFF) || (style > TNPAM_MSG_STYLE_MAX)) {
+			PyErr_Format(PyExc_ValueError,
+				     "%ld: not a valid MSGStyle", style);
+			goto fail;
+		}
+
+		responder_entry_clear(&responder->styles[style]);
+		if (!responder_set_entry(&responder->styles[style],
+					 PyTuple_GET_ITEM(item, 1))) {
+			goto fail;
+		}
+	}
+
+	Py_DECREF(items);
+	return responder;
+
+fail:
+	Py_DECREF(items);
+	tnpam_responder_free(responder);
+	return NULL;
+}
+
+/*
+ * Queue a copy of the messages so that they appear in messages() history
+ * in the same order as conversations that went through python. Failure to
+ * allocate only loses history and is not treated as conversation error.
+ */
+static void
+responder_queue_messages(tnpam_ctx_t *ctx, int num_msg,
+			 const struct pam_message **msg)
+{
+	tnpam_conv_t *conv = &ctx->conv_data;
+	tnpam_msg_entry_t *head = NULL;
+	tnpam_msg_entry_t **tail = &head;
+	int i;
+
+	// History disabled (message_history_size=0)
+	if (conv->messages.capacity == 0) {
+		return;
+	}
+
+	for (i = 0; i < num_msg; i++) {
+		tnpam_msg_entry_t *entry;
+
+		entry = PyMem_RawCalloc(1, sizeof(tnpam_msg_entry_t));
+		if (entry == NULL) {
+			break;
+		}
+
+		entry->msg_style = msg[i]->msg_style;
+		entry->msg = strdup(msg[i]->msg ? msg[i]->msg : "");
+		if (entry->msg == NULL) {
+			PyMem_RawFree(entry);
+			break;
+		}
+
+		*tail = entry;
+		tail = &entry->next;
+	}
+
+	// Entries for a single conversation are terminated by an entry
+	// with a NULL msg so that they can be grouped into one tuple.
+	if (head != NULL) {
+		tnpam_msg_entry_t *sep = PyMem_RawCalloc(1, sizeof(tnpam_msg_entry_t));
+		if (sep != NULL) {
+			*tail = sep;
+			tail = &sep->next;
+		}
+	}
+
+	if (head == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&conv->pending_lock);
+	*conv->pending_tail = head;
+	conv->pending_tail = tail;
+	pthread_mutex_unlock(&conv->pending_lock);
+}
+
+/*
+ * Answer the conversation from the responder. Called with pam_hdl_lock held
+ * and without the GIL. Returns TNPAM_CONV_FALLBACK if any prompt has no
+ * declared response, in which case the python callback (if any) is used for
+ * the whole conversation. PAM_ERROR_MSG and PAM_TEXT_INFO need no response
+ * and are answered with NULL unless specified otherwise.
+ */
+int
+tnpam_responder_conv(tnpam_ctx_t *ctx, int num_msg,
+		     const struct pam_message **msg,
+		     struct pam_response **resp)
+{
+	tnpam_responder_t *responder = ctx->conv_data.responder;
+	struct pam_response *reply = NULL;
+	int i;
+
+	for (i = 0; i < num_msg; i++) {
+		int style = msg[i]->msg_style;
+
+		if ((style < PAM_PROMPT_ECHO_OFF) || (style > TNPAM_MSG_STYLE_MAX)) {
+			return TNPAM_CONV_FALLBACK;
+		}
+
+		if (!responder->styles[style].present &&
+		    ((style == PAM_PROMPT_ECHO_OFF) || (style == PAM_PROMPT_ECHO_ON))) {
+			return TNPAM_CONV_FALLBACK;
+		}
+	}
+
+	// Must use regular malloc as the PAM stack frees responses
+	reply = calloc((num_msg > 0) ? (size_t)num_msg : 1,
+		       sizeof(struct pam_response));
+	if (reply == NULL) {
+		return PAM_BUF_ERR;
+	}
+
+	for (i = 0; i < num_msg; i++) {
+		tnpam_resp_entry_t *entry = &responder->styles[msg[i]->msg_style];
+
+		if (entry->value == NULL) {
+			continue;
+		}
+
+		reply[i].resp = strdup(entry->value);
+		if (reply[i].resp == NULL) {
+			while (i--) {
+				if (reply[i].resp != NULL) {
+					explicit_bzero(reply[i].resp, strlen(reply[i].resp));
+				}
+				free(reply[i].resp);
+			}
+			free(reply);
+			return PAM_BUF_ERR;
+		}
+	}
+
+	responder_queue_messages(ctx, num_msg, msg);
+	tnpam_mem_count_resp(num_msg, reply);
+	*resp = reply;
+	return PAM_SUCCESS;
+}
+
+/*
+ * Detach the pending list under the lock. Caller owns the returned entries.
+ */
+static tnpam_msg_entry_t *
+pending_detach(tnpam_conv_t *conv)
+{
+	tnpam_msg_entry_t *head;
+
+	pthread_mutex_lock(&conv->pending_lock);
+	head = conv->pending_head;
+	conv->pending_head = NULL;
+	conv->pending_tail = &conv->pending_head;
+	pthread_mutex_unlock(&conv->pending_lock);
+
+	return head;
+}
+
+static void
+pending_free(tnpam_msg_entry_t *entry)
+{
+	while (entry != NULL) {
+		tnpam_msg_entry_t *next = entry->next;
+		free(entry->msg);
+		PyMem_RawFree(entry);
+		entry = next;
+	}
+}
+
+/*
+ * Move natively answered messages into the messages() history.
+ * GIL must be held.
+ */
+bool
+tnpam_conv_flush_pending(tnpam_ctx_t *ctx)
+{
+	tnpam_msg_entry_t *head, *entry, *first;
+	const struct pam_message **msgp = NULL;
+	struct pam_message *msgs = NULL;
+	bool ok = true;
+
+	head = pending_detach(&ctx->conv_data);
+	first = head;
+
+	while (ok && (first != NULL)) {
+		PyObject *pymsg = NULL;
+		int cnt = 0, i;
+
+		for (entry = first; entry && entry->msg; entry = entry->next) {
+			cnt++;
+		}
+
+		msgs = PyMem_Calloc(cnt ? cnt : 1, sizeof(struct pam_message));
+		msgp = PyMem_Calloc(cnt ? cnt : 1, sizeof(struct pam_message *));
+		if ((msgs == NULL) || (msgp == NULL)) {
+			PyErr_NoMemory();
+			ok = false;
+		} else {
+			for (i = 0, entry = first; i < cnt; i++, entry = entry->next) {
+				msgs[i].msg_style = entry->msg_style;
+				msgs[i].msg = entry->msg;
+				msgp[i] = &msgs[i];
+			}
+
+			pymsg = py_pam_messages_parse(tnpam_ctx_state(ctx), cnt, msgp);
+			if (pymsg == NULL) {
+				ok = false;
+			} else {
+				tnpam_history_append(ctx, pymsg);
+				Py_DECREF(pymsg);
+			}
+		}
+
+		PyMem_Free(msgs);
+		PyMem_Free(msgp);
+
+		// skip past the separator
+		for (entry = first; entry && entry->msg; entry = entry->next);
+		first = entry ? entry->next : NULL;
+	}
+
+	pending_free(head);
+	return ok;
+}
+
+/*
+ * Free any queued messages. Called from dealloc.
+ */
+void
+tnpam_conv_clear_pending(tnpam_ctx_t *ctx)
+{
+	pending_free(pending_detach(&ctx->conv_data));
+}
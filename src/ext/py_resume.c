@@ -0,0 +1,623 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "truenas_pypam.h"
+
+/*
+ * Resumable PAM operations (auth_begin / auth_resume / auth_abort).
+ *
+ * The PAM call is performed on a dedicated native thread that never touches
+ * the python interpreter. When a PAM module starts a conversation,
+ * truenas_pam_conv() sees that it is running on that thread and, rather than
+ * calling into python, publishes the messages in ctx->resume and sleeps on
+ * the condition variable. The python caller is woken, copies the messages
+ * and returns them. auth_resume() hands the responses over and signals the
+ * parked thread, which returns them to the PAM module immediately.
+ *
+ * The worker holds pam_hdl_lock for the whole PAM call, as the synchronous
+ * path does, including while it is parked: PAM modules keep pointers into
+ * the handle across the conversation. Every python method that touches the
+ * handle therefore checks tnpam_resume_busy() and raises rather than wait
+ * for the lock.
+ *
+ * Lock ordering: pam_hdl_lock is taken before resume.lock. Python callers
+ * never hold resume.lock while waiting for pam_hdl_lock or the GIL, and the
+ * resume methods never take pam_hdl_lock. The lock domain of the context
+ * (if any) is held as long, since the parked module is still in the middle
+ * of its call: other contexts of the domain wait until auth_resume(),
+ * auth_abort() or the deadline completes the operation.
+ *
+ * With a deadline (get_context(timeout=)) the parked worker stops waiting
+ * once it passes and fails the conversation, so an abandoned operation
+ * finishes and frees its thread without anyone calling auth_abort(). The
+ * next auth_resume() then reports the TimeoutError.
+ */
+
+/* context whose resumable operation is being run by the current thread */
+static _Thread_local tnpam_ctx_t *resume_tls_ctx = NULL;
+
+int
+tnpam_resume_init(tnpam_resume_t *resume)
+{
+	pthread_condattr_t attr;
+	int err;
+
+	memset(resume, 0, sizeof(*resume));
+
+	err = pthread_mutex_init(&resume->lock, NULL);
+	if (err) {
+		return err;
+	}
+
+	err = pthread_condattr_init(&attr);
+	if (err == 0) {
+		err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		if (err == 0) {
+			err = pthread_cond_init(&resume->cv, &attr);
+		}
+		pthread_condattr_destroy(&attr);
+	}
+
+	if (err) {
+		pthread_mutex_destroy(&resume->lock);
+	}
+
+	return err;
+}
+
+/*
+ * Return true if the calling thread is the worker executing the resumable
+ * operation for ctx. Used by truenas_pam_conv() to select the native path.
+ */
+bool
+tnpam_resume_current(tnpam_ctx_t *ctx)
+{
+	return resume_tls_ctx == ctx;
+}
+
+/*
+ * Check whether a resumable operation is in progress on ctx. If so a
+ * RuntimeError is set and true is returned. GIL must be held.
+ */
+bool
+tnpam_resume_busy(tnpam_ctx_t *ctx)
+{
+	tnpam_resume_state_t state;
+
+	pthread_mutex_lock(&ctx->resume.lock);
+	state = ctx->resume.state;
+	pthread_mutex_unlock(&ctx->resume.lock);
+
+	if (state != TNPAM_RESUME_IDLE) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"A resumable PAM operation is in progress on this "
+				"context. Use auth_resume() or auth_abort().");
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Convert an optional timeout argument in seconds. None maps to -1 which
+ * means wait indefinitely.
+ */
+bool
+tnpam_parse_timeout(PyObject *obj, double *timeout_out)
+{
+	double timeout;
+
+	if ((obj == NULL) || (obj == Py_None)) {
+		*timeout_out = -1;
+		return true;
+	}
+
+	timeout = PyFloat_AsDouble(obj);
+	if ((timeout == -1) && PyErr_Occurred()) {
+		return false;
+	}
+
+	if (isnan(timeout) || (timeout < 0)) {
+		PyErr_SetString(PyExc_ValueError,
+				"timeout must be a non-negative number");
+		return false;
+	}
+
+	*timeout_out = timeout;
+	return true;
+}
+
+/* Absolute CLOCK_MONOTONIC time timeout seconds from now */
+static void
+resume_deadline(double timeout, struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += (time_t)timeout;
+	deadline->tv_nsec += (long)((timeout - floor(timeout)) * 1e9);
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * PAM_FAIL_DELAY callback installed for the duration of a resumable call on
+ * contexts that let libpam sleep. The delay is spent waiting on resume.cv
+ * so that auth_abort() cuts it short: nobody waits for the answer of an
+ * aborted attempt. Runs on the resume worker with pam_hdl_lock held.
+ */
+static void
+resume_fail_delay_cb(int retval, unsigned usec_delay, void *appdata_ptr)
+{
+	tnpam_ctx_t *ctx = (tnpam_ctx_t *)appdata_ptr;
+	tnpam_resume_t *r = &ctx->resume;
+	struct timespec deadline;
+	int err = 0;
+
+	if ((retval == PAM_SUCCESS) || (usec_delay == 0)) {
+		return;
+	}
+
+	resume_deadline(usec_delay / 1e6, &deadline);
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->aborted && (err != ETIMEDOUT)) {
+		err = pthread_cond_timedwait(&r->cv, &r->lock, &deadline);
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void *
+resume_worker(void *arg)
+{
+	tnpam_ctx_t *ctx = (tnpam_ctx_t *)arg;
+	tnpam_resume_t *r = &ctx->resume;
+	pamcode_t ret;
+	uint64_t t0;
+	bool delay_cb;
+
+	resume_tls_ctx = ctx;
+
+	t0 = tnpam_now_ns();
+	TNPAM_DOMAIN_LOCK(ctx)
+	pthread_mutex_lock(&ctx->pam_hdl_lock);
+	tnpam_stats_record(&ctx->stats, TNPAM_STAT_LOCK_WAIT, tnpam_now_ns() - t0);
+	// Deferred delays are the caller's business and pool contexts sleep
+	// in the worker process
+	delay_cb = !ctx->defer_fail_delay && (ctx->proc == NULL) &&
+		   (ctx->hdl != NULL);
+	if (delay_cb) {
+		pam_set_item(ctx->hdl, PAM_FAIL_DELAY,
+			     (const void *)resume_fail_delay_cb);
+	}
+	ret = tnpam_op_call(ctx, r->op, r->flags, r->deadline_ns);
+	if (delay_cb && (ctx->hdl != NULL)) {
+		pam_set_item(ctx->hdl, PAM_FAIL_DELAY, NULL);
+	}
+	pthread_mutex_unlock(&ctx->pam_hdl_lock);
+	TNPAM_DOMAIN_UNLOCK(ctx)
+
+	resume_tls_ctx = NULL;
+
+	pthread_mutex_lock(&r->lock);
+	r->result = ret;
+	r->state = TNPAM_RESUME_DONE;
+	pthread_cond_broadcast(&r->cv);
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+/*
+ * Conversation handler used in place of the python callback when PAM is
+ * being driven by the resume worker. Called with pam_hdl_lock held and
+ * without the GIL.
+ */
+int
+tnpam_resume_conv(tnpam_ctx_t *ctx, int num_msg,
+		  const struct pam_message **msg,
+		  struct pam_response **resp)
+{
+	tnpam_resume_t *r = &ctx->resume;
+	uint64_t deadline_ns = ctx->deadline_ns;
+	struct timespec deadline;
+	boolean_t timed_out = B_FALSE;
+	int retval = PAM_CONV_ERR;
+
+	deadline.tv_sec = (time_t)(deadline_ns / 1000000000ULL);
+	deadline.tv_nsec = (long)(deadline_ns % 1000000000ULL);
+
+	// The handle and the lock domain stay locked while we wait, python
+	// methods that would touch the handle fail through tnpam_resume_busy()
+	pthread_mutex_lock(&r->lock);
+
+	if (!r->aborted) {
+		r->num_msg = num_msg;
+		r->msg = msg;
+		r->resp = NULL;
+		r->state = TNPAM_RESUME_PENDING;
+		pthread_cond_broadcast(&r->cv);
+
+		while ((r->state == TNPAM_RESUME_PENDING) && !r->aborted &&
+		       !timed_out) {
+			if (deadline_ns == 0) {
+				pthread_cond_wait(&r->cv, &r->lock);
+			} else if (pthread_cond_timedwait(&r->cv, &r->lock,
+							  &deadline) == ETIMEDOUT) {
+				timed_out = B_TRUE;
+			}
+		}
+
+		if ((r->state == TNPAM_RESUME_RUNNING) && (r->resp != NULL)) {
+			*resp = r->resp;
+			retval = PAM_SUCCESS;
+		}
+
+		r->state = TNPAM_RESUME_RUNNING;
+		r->resp = NULL;
+		r->msg = NULL;
+		r->num_msg = 0;
+	}
+
+	pthread_mutex_unlock(&r->lock);
+	if (timed_out) {
+		ctx->deadline_hit = B_TRUE;
+	}
+	return retval;
+}
+
+/*
+ * Copy the pending messages while holding resume.lock. The strings belong
+ * to the PAM module and become invalid as soon as the worker is released,
+ * which may happen from another python thread once we drop the lock.
+ * Called without the GIL.
+ */
+static struct pam_message *
+resume_copy_messages(tnpam_resume_t *r, int *num_msg_out)
+{
+	struct pam_message *copy = NULL;
+	int i;
+
+	copy = PyMem_RawCalloc(r->num_msg ? r->num_msg : 1,
+			       sizeof(struct pam_message));
+	if (copy == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < r->num_msg; i++) {
+		copy[i].msg_style = r->msg[i]->msg_style;
+		copy[i].msg = strdup(r->msg[i]->msg ? r->msg[i]->msg : "");
+		if (copy[i].msg == NULL) {
+			while (i--) {
+				free((char *)copy[i].msg);
+			}
+			PyMem_RawFree(copy);
+			return NULL;
+		}
+	}
+
+	*num_msg_out = r->num_msg;
+	return copy;
+}
+
+static void
+resume_free_messages(struct pam_message *copy, int num_msg)
+{
+	int i;
+
+	for (i = 0; i < num_msg; i++) {
+		free((char *)copy[i].msg);
+	}
+	PyMem_RawFree(copy);
+}
+
+/*
+ * Convert copied messages into a python tuple and append it to the
+ * conversation history. GIL must be held.
+ */
+static PyObject *
+resume_messages(tnpam_ctx_t *ctx, struct pam_message *copy, int num_msg)
+{
+	const struct pam_message **msgp = NULL;
+	PyObject *pymsg = NULL;
+	int i;
+
+	msgp = PyMem_Calloc(num_msg ? num_msg : 1, sizeof(struct pam_message *));
+	if (msgp == NULL) {
+		return PyErr_NoMemory();
+	}
+
+	for (i = 0; i < num_msg; i++) {
+		msgp[i] = &copy[i];
+	}
+
+	pymsg = py_pam_messages_parse(tnpam_ctx_state(ctx), num_msg, msgp);
+	PyMem_Free(msgp);
+	if (pymsg == NULL) {
+		return NULL;
+	}
+
+	tnpam_history_append(ctx, pymsg);
+
+	return pymsg;
+}
+
+/*
+ * Collect the result of a finished worker and join it. Returns false if the
+ * result was already collected by another caller (e.g. auth_abort() from a
+ * different thread). GIL must be held.
+ */
+static bool
+resume_reap(tnpam_ctx_t *ctx, pamcode_t *result_out)
+{
+	tnpam_resume_t *r = &ctx->resume;
+	pthread_t thread;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->state != TNPAM_RESUME_DONE) {
+		pthread_mutex_unlock(&r->lock);
+		return false;
+	}
+
+	thread = r->thread;
+	*result_out = r->result;
+	r->state = TNPAM_RESUME_IDLE;
+	pthread_mutex_unlock(&r->lock);
+
+	// The worker has already published its result and only needs to
+	// return, so this does not block for any appreciable time.
+	Py_BEGIN_ALLOW_THREADS
+	pthread_join(thread, NULL);
+	Py_END_ALLOW_THREADS
+
+	return true;
+}
+
+/*
+ * Wait for the worker to either request a conversation or finish. GIL must be
+ * held on entry and is released while waiting.
+ */
+static PyObject *
+resume_wait(tnpam_ctx_t *ctx, double timeout)
+{
+	tnpam_resume_t *r = &ctx->resume;
+	tnpam_resume_state_t state;
+	struct pam_message *copy = NULL;
+	struct timespec deadline;
+	int num_msg = 0;
+	int err = 0;
+	pamcode_t result;
+	PyObject *out = NULL;
+
+	if (timeout >= 0) {
+		resume_deadline(timeout, &deadline);
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&r->lock);
+	while ((r->state == TNPAM_RESUME_RUNNING) && (err == 0)) {
+		if (timeout < 0) {
+			pthread_cond_wait(&r->cv, &r->lock);
+		} else {
+			err = pthread_cond_timedwait(&r->cv, &r->lock, &deadline);
+		}
+	}
+
+	state = r->state;
+	if (state == TNPAM_RESUME_RUNNING) {
+		r->expired = B_TRUE;
+	} else if (state == TNPAM_RESUME_PENDING) {
+		copy = resume_copy_messages(r, &num_msg);
+	}
+	pthread_mutex_unlock(&r->lock);
+	Py_END_ALLOW_THREADS
+
+	switch (state) {
+	case TNPAM_RESUME_PENDING:
+		if (copy == NULL) {
+			return PyErr_NoMemory();
+		}
+		out = resume_messages(ctx, copy, num_msg);
+		resume_free_messages(copy, num_msg);
+		return out;
+	case TNPAM_RESUME_DONE:
+		if (!resume_reap(ctx, &result)) {
+			break;
+		}
+		return tnpam_op_result(ctx, ctx->resume.op, result);
+	case TNPAM_RESUME_RUNNING:
+		// PyErr_Format() has no float support
+		PyErr_Format(PyExc_TimeoutError,
+			     "PAM operation did not complete or request a "
+			     "conversation within %ld ms", (long)(timeout * 1000));
+		return NULL;
+	default:
+		break;
+	}
+
+	PyErr_SetString(PyExc_RuntimeError,
+			"Resumable PAM operation was aborted");
+	return NULL;
+}
+
+/*
+ * Start op on a resume worker and wait for the first conversation or the
+ * result. deadline_ns bounds the whole operation, timeout only this wait.
+ * GIL must be held and argument validation / auditing complete.
+ */
+PyObject *
+tnpam_resume_begin(tnpam_ctx_t *ctx, tnpam_op_t op, int flags,
+		   uint64_t deadline_ns, double timeout)
+{
+	tnpam_resume_t *r = &ctx->resume;
+	int err;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->state != TNPAM_RESUME_IDLE) {
+		pthread_mutex_unlock(&r->lock);
+		PyErr_SetString(PyExc_RuntimeError,
+				"A resumable PAM operation is already in progress "
+				"on this context");
+		return NULL;
+	}
+
+	r->op = op;
+	r->flags = flags;
+	r->deadline_ns = deadline_ns;
+	r->aborted = B_FALSE;
+	r->expired = B_FALSE;
+	r->result = PAM_SUCCESS;
+	r->state = TNPAM_RESUME_RUNNING;
+
+	err = pthread_create(&r->thread, NULL, resume_worker, ctx);
+	if (err) {
+		r->state = TNPAM_RESUME_IDLE;
+		pthread_mutex_unlock(&r->lock);
+		errno = err;
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return resume_wait(ctx, timeout);
+}
+
+/*
+ * Hand responses to the parked worker and wait for the next conversation or
+ * the result. GIL must be held.
+ */
+PyObject *
+tnpam_resume_continue(tnpam_ctx_t *ctx, PyObject *pyresp, double timeout)
+{
+	tnpam_resume_t *r = &ctx->resume;
+	struct pam_response *resp = NULL;
+	tnpam_resume_state_t state;
+	int num_msg;
+	const char *errmsg = NULL;
+
+	pthread_mutex_lock(&r->lock);
+	state = r->state;
+	if (r->expired) {
+		errmsg = "Resumable PAM operation timed out and must be "
+			 "ended with auth_abort()";
+	} else if ((state == TNPAM_RESUME_RUNNING) &&
+		   tnpam_deadline_passed(r->deadline_ns)) {
+		// The worker gave up on the conversation and is finishing
+		state = TNPAM_RESUME_DONE;
+	} else if ((state != TNPAM_RESUME_PENDING) &&
+		   (state != TNPAM_RESUME_DONE)) {
+		errmsg = "No PAM conversation is pending on this context";
+	}
+	num_msg = r->num_msg;
+	pthread_mutex_unlock(&r->lock);
+
+	if (errmsg) {
+		PyErr_SetString(PyExc_RuntimeError, errmsg);
+		return NULL;
+	}
+
+	// The worker gave up on the conversation when the deadline of the
+	// operation passed, collect its result
+	if (state == TNPAM_RESUME_DONE) {
+		return resume_wait(ctx, timeout);
+	}
+
+	// The conversation remains pending if the responses are invalid so
+	// that the caller may try again.
+	if (!parse_py_pam_resp(num_msg, &resp, pyresp)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	if ((r->state != TNPAM_RESUME_PENDING) || r->aborted || r->expired) {
+		pthread_mutex_unlock(&r->lock);
+		free_pam_resp(num_msg, resp);
+		PyErr_SetString(PyExc_RuntimeError,
+				"No PAM conversation is pending on this context");
+		return NULL;
+	}
+
+	r->resp = resp;
+	r->state = TNPAM_RESUME_RUNNING;
+	pthread_cond_broadcast(&r->cv);
+	pthread_mutex_unlock(&r->lock);
+
+	return resume_wait(ctx, timeout);
+}
+
+/*
+ * Fail any pending and future conversations and wait for the worker to
+ * finish, at most timeout seconds if it isn't negative. A module blocked
+ * outside of a conversation (e.g. on a network call) can't be interrupted:
+ * TimeoutError is raised and the operation stays aborted until the worker
+ * returns and another auth_abort() collects it. GIL must be held.
+ */
+PyObject *
+tnpam_resume_abort(tnpam_ctx_t *ctx, double timeout)
+{
+	tnpam_resume_t *r = &ctx->resume;
+	struct timespec deadline;
+	pamcode_t result;
+	int err = 0;
+
+	if (timeout >= 0) {
+		resume_deadline(timeout, &deadline);
+	}
+
+	pthread_mutex_lock(&r->lock);
+	if (r->state == TNPAM_RESUME_IDLE) {
+		pthread_mutex_unlock(&r->lock);
+		Py_RETURN_NONE;
+	}
+
+	r->aborted = B_TRUE;
+	pthread_cond_broadcast(&r->cv);
+	pthread_mutex_unlock(&r->lock);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&r->lock);
+	while (((r->state == TNPAM_RESUME_RUNNING) ||
+		(r->state == TNPAM_RESUME_PENDING)) && (err == 0)) {
+		if (timeout < 0) {
+			pthread_cond_wait(&r->cv, &r->lock);
+		} else {
+			err = pthread_cond_timedwait(&r->cv, &r->lock, &deadline);
+		}
+	}
+	if (r->state == TNPAM_RESUME_DONE) {
+		err = 0;
+	}
+	pthread_mutex_unlock(&r->lock);
+	Py_END_ALLOW_THREADS
+
+	if (err) {
+		PyErr_Format(PyExc_TimeoutError,
+			     "Aborted PAM operation did not return within %ld ms",
+			     (long)(timeout * 1000));
+		return NULL;
+	}
+
+	// Result of an aborted operation is intentionally discarded
+	resume_reap(ctx, &result);
+	Py_RETURN_NONE;
+}
+
+/*
+ * Abort any outstanding operation and release resources. Called from
+ * dealloc with the GIL held.
+ */
+void
+tnpam_resume_destroy(tnpam_ctx_t *ctx)
+{
+	PyObject *ret;
+
+	ret = tnpam_resume_abort(ctx, -1);
+	Py_XDECREF(ret);
+
+	pthread_cond_destroy(&ctx->resume.cv);
+	pthread_mutex_destroy(&ctx->resume.lock);
+}
@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "truenas_pypam.h"
+
+/*
+ * Secrets (passwords) supplied by the application.
+ *
+ * tnpam_secret_view() gives access to the bytes of a response without
+ * leaving copies behind: ASCII str objects are read in place, other str
+ * objects are encoded to a temporary that is zeroed on release (rather
+ * than PyUnicode_AsUTF8() caching the encoding in the str for its whole
+ * lifetime) and bytes-like objects are read through the buffer protocol.
+ *
+ * Secrets the extension keeps for longer than a single conversation
+ * (conversation_responses values, authenticate_many() credentials) are
+ * stored in a process-wide arena that is mlock()ed so that it is not
+ * written to swap, excluded from core dumps and zeroed on free. The arena
+ * is fixed-size and carved into chunks tracked by a bitmap. If it is full,
+ * or could not be created, PyMem_Raw memory is used instead and still
+ * zeroed on free. mlock() failing (RLIMIT_MEMLOCK) is not an error.
+ *
+ * Responses handed to PAM modules can't live in the arena since the
+ * modules free() them.
+ */
+
+#define SECRET_ARENA_SIZE (64 * 1024)
+#define SECRET_CHUNK 32
+#define SECRET_NCHUNKS (SECRET_ARENA_SIZE / SECRET_CHUNK)
+
+static struct {
+	pthread_mutex_t lock;
+	char *base;		/* NULL if mmap() failed */
+	_Atomic size_t locked;	/* bytes locked in memory */
+	uint64_t used[SECRET_NCHUNKS / 64];	/* bitmap of allocated chunks */
+} arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void
+arena_init(void)
+{
+	void *base;
+
+	base = mmap(NULL, SECRET_ARENA_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		return;
+	}
+
+#ifdef MADV_DONTDUMP
+	(void)madvise(base, SECRET_ARENA_SIZE, MADV_DONTDUMP);
+#endif
+	if (mlock(base, SECRET_ARENA_SIZE) == 0) {
+		atomic_store(&arena.locked, SECRET_ARENA_SIZE);
+	}
+
+	arena.base = base;
+}
+
+static bool
+chunk_used(size_t idx)
+{
+	return (arena.used[idx / 64] >> (idx % 64)) & 1;
+}
+
+static void
+chunks_mark(size_t first, size_t count, bool used)
+{
+	size_t i;
+
+	for (i = first; i < first + count; i++) {
+		if (used) {
+			arena.used[i / 64] |= (uint64_t)1 << (i % 64);
+		} else {
+			arena.used[i / 64] &= ~((uint64_t)1 << (i % 64));
+		}
+	}
+}
+
+/*
+ * First fit run of count free chunks. Returns SECRET_NCHUNKS if there is
+ * none. arena.lock must be held.
+ */
+static size_t
+chunks_find(size_t count)
+{
+	size_t start = 0, i;
+
+	for (i = 0; i < SECRET_NCHUNKS; i++) {
+		if (chunk_used(i)) {
+			start = i + 1;
+		} else if (i + 1 - start == count) {
+			return start;
+		}
+	}
+
+	return SECRET_NCHUNKS;
+}
+
+/*
+ * Allocate size zeroed bytes for a secret. Returns NULL without setting an
+ * exception if out of memory. May be called without the GIL.
+ */
+char *
+tnpam_secret_alloc(size_t size)
+{
+	size_t count = (size + SECRET_CHUNK - 1) / SECRET_CHUNK;
+	char *out = NULL;
+	size_t first;
+
+	pthread_once(&arena_once, arena_init);
+
+	if ((arena.base != NULL) && (count > 0) && (count <= SECRET_NCHUNKS)) {
+		pthread_mutex_lock(&arena.lock);
+		first = chunks_find(count);
+		if (first < SECRET_NCHUNKS) {
+			chunks_mark(first, count, true);
+			out = arena.base + first * SECRET_CHUNK;
+		}
+		pthread_mutex_unlock(&arena.lock);
+	}
+
+	if (out == NULL) {
+		out = PyMem_RawCalloc(1, size ? size : 1);
+		if (out == NULL) {
+			return NULL;
+		}
+	}
+
+	tnpam_mem_add(TNPAM_MEM_SECRET_BYTES, (int64_t)size);
+	return out;
+}
+
+/*
+ * Zero and free a secret of size bytes from tnpam_secret_alloc(). May be
+ * called without the GIL.
+ */
+void
+tnpam_secret_free(char *secret, size_t size)
+{
+	size_t count = (size + SECRET_CHUNK - 1) / SECRET_CHUNK;
+
+	if (secret == NULL) {
+		return;
+	}
+
+	tnpam_mem_add(TNPAM_MEM_SECRET_BYTES, -(int64_t)size);
+
+	if ((arena.base != NULL) && (secret >= arena.base) &&
+	    (secret < arena.base + SECRET_ARENA_SIZE)) {
+		explicit_bzero(secret, count * SECRET_CHUNK);
+		pthread_mutex_lock(&arena.lock);
+		chunks_mark((secret - arena.base) / SECRET_CHUNK, count, false);
+		pthread_mutex_unlock(&arena.lock);
+		return;
+	}
+
+	explicit_bzero(secret, size);
+	PyMem_RawFree(secret);
+}
+
+/*
+ * Bytes of the arena that are locked in memory (0 until the first secret
+ * is stored or if mlock() failed).
+ */
+size_t
+tnpam_secret_locked_bytes(void)
+{
+	return atomic_load(&arena.locked);
+}
+
+/*
+ * Whether obj is a type accepted by tnpam_secret_view().
+ */
+bool
+tnpam_secret_check(PyObject *obj)
+{
+	return PyUnicode_Check(obj) || PyObject_CheckBuffer(obj);
+}
+
+/*
+ * Get the bytes of a str or bytes-like object. view->data is not NUL
+ * terminated and is only valid until tnpam_secret_view_release(). GIL must
+ * be held.
+ */
+bool
+tnpam_secret_view(PyObject *obj, tnpam_secret_view_t *view)
+{
+	memset(view, 0, sizeof(*view));
+
+	if (PyUnicode_Check(obj)) {
+		if (PyUnicode_IS_COMPACT_ASCII(obj)) {
+			// ASCII is its own UTF-8 encoding
+			view->data = PyUnicode_DATA(obj);
+			view->len = PyUnicode_GET_LENGTH(obj);
+			return true;
+		}
+
+		view->tmp = PyUnicode_AsUTF8String(obj);
+		if (view->tmp == NULL) {
+			return false;
+		}
+		view->data = PyBytes_AS_STRING(view->tmp);
+		view->len = PyBytes_GET_SIZE(view->tmp);
+		return true;
+	}
+
+	if (PyObject_GetBuffer(obj, &view->buf, PyBUF_SIMPLE) < 0) {
+		return false;
+	}
+	view->data = view->buf.buf;
+	view->len = view->buf.len;
+	return true;
+}
+
+void
+tnpam_secret_view_release(tnpam_secret_view_t *view)
+{
+	if (view->tmp != NULL) {
+		// Fresh object only referenced here
+		explicit_bzero(PyBytes_AS_STRING(view->tmp),
+			       PyBytes_GET_SIZE(view->tmp));
+		Py_CLEAR(view->tmp);
+	}
+
+	if (view->buf.obj != NULL) {
+		PyBuffer_Release(&view->buf);
+	}
+
+	view->data = NULL;
+	view->len = 0;
+}
+
+/*
+ * Copy a str or bytes-like secret into the arena as a NUL-terminated
+ * string. what names the value in exceptions. GIL must be held.
+ */
+char *
+tnpam_secret_copy(PyObject *obj, const char *what, size_t *len_out)
+{
+	tnpam_secret_view_t view;
+	char *out = NULL;
+
+	if (!tnpam_secret_check(obj)) {
+		PyErr_Format(PyExc_TypeError,
+			     "%s: %s must be str or a bytes-like object",
+			     Py_TYPE(obj)->tp_name, what);
+		return NULL;
+	}
+
+	if (!tnpam_secret_view(obj, &view)) {
+		return NULL;
+	}
+
+	if (memchr(view.data, '\0', view.len) != NULL) {
+		PyErr_Format(PyExc_ValueError,
+			     "%s may not contain embedded null characters", what);
+		goto out;
+	}
+
+	out = tnpam_secret_alloc(view.len + 1);
+	if (out == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	memcpy(out, view.data, view.len);
+	*len_out = view.len;
+
+out:
+	tnpam_secret_view_release(&view);
+	return out;
+}
@@ -1,19 +1,32 @@
 // SPDX-License-Identifier: LGPL-3.0-or-later
 #define PY_SSIZE_T_CLEAN
+#include <math.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "truenas_pypam.h"
 
-PyObject *
-py_tnpam_open_session(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+/*
+ * Parse arguments for open_session() / open_session_async() into PAM flags
+ * and a deadline, validate the context state and emit the audit event for the session opening.
+ */
+static bool
+open_session_prepare(tnpam_ctx_t *self, PyObject *const *args,
+		     Py_ssize_t nargs, PyObject *kwnames, int *flags_out,
+		     uint64_t *deadline_out)
 {
-	static char *kwlist[] = { "silent", NULL };
+	static char *kwlist[] = { "silent", "timeout", NULL };
 	boolean_t silent = B_FALSE;
+	PyObject *py_timeout = NULL;
 	int flags = 0;
-	pamcode_t ret;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$p", kwlist,
-					 &silent)) {
-		return NULL;
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$pO", kwlist,
+			      &silent, &py_timeout)) {
+		return false;
+	}
+
+	if (!tnpam_op_deadline(self, py_timeout, deadline_out)) {
+		return false;
 	}
 
 	if (silent) {
@@ -24,48 +37,45 @@ py_tnpam_open_session(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 		PyErr_SetString(PyExc_ValueError,
 				"pam_authenticate has not been successfully "
 				"called on pam handle.");
-		return NULL;
+		return false;
 	}
 
 	if (self->session_opened) {
 		PyErr_SetString(PyExc_ValueError,
 				"session is already opened for this handle.");
-		return NULL;
+		return false;
 	}
 
 	// Audit the session opening
 	if (PySys_Audit(MODULE_NAME ".open_session", "O", self->user) < 0) {
-		return NULL;
-	}
-
-	PYPAM_LOCK(self);
-	ret = pam_open_session(self->hdl, flags);
-	self->last_pam_result = ret;
-	PYPAM_UNLOCK(self);
-
-	if (ret != PAM_SUCCESS) {
-		if (!PyErr_Occurred()) {
-			set_pam_exc(ret, "pam_open_session() failed");
-		}
-		return NULL;
+		return false;
 	}
 
-	self->session_opened = B_TRUE;
-
-	Py_RETURN_NONE;
+	*flags_out = flags;
+	return true;
 }
 
-PyObject *
-py_tnpam_close_session(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
+/*
+ * Parse arguments for close_session() / close_session_async() into PAM flags
+ * and a deadline, validate the context state and emit the audit event for the session closing.
+ */
+static bool
+close_session_prepare(tnpam_ctx_t *self, PyObject *const *args,
+		      Py_ssize_t nargs, PyObject *kwnames, int *flags_out,
+		      uint64_t *deadline_out)
 {
-	static char *kwlist[] = { "silent", NULL };
+	static char *kwlist[] = { "silent", "timeout", NULL };
 	boolean_t silent = B_FALSE;
+	PyObject *py_timeout = NULL;
 	int flags = 0;
-	pamcode_t ret;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$p", kwlist,
-					 &silent)) {
-		return NULL;
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$pO", kwlist,
+			      &silent, &py_timeout)) {
+		return false;
+	}
+
+	if (!tnpam_op_deadline(self, py_timeout, deadline_out)) {
+		return false;
 	}
 
 	if (silent) {
@@ -75,27 +85,566 @@ py_tnpam_close_session(tnpam_ctx_t *self, PyObject *args, PyObject *kwds)
 	if (!self->session_opened) {
 		PyErr_SetString(PyExc_ValueError,
 				"session is not opened for this handle.");
-		return NULL;
+		return false;
 	}
 
 	// Audit the session closing
 	if (PySys_Audit(MODULE_NAME ".close_session", "O", self->user) < 0) {
+		return false;
+	}
+
+	*flags_out = flags;
+	return true;
+}
+
+PyObject *
+py_tnpam_open_session(tnpam_ctx_t *self, PyObject *const *args,
+		      Py_ssize_t nargs, PyObject *kwnames)
+{
+	uint64_t deadline;
+	int flags;
+
+	if (!open_session_prepare(self, args, nargs, kwnames, &flags, &deadline)) {
+		return NULL;
+	}
+
+	return tnpam_op_run(self, TNPAM_OP_OPEN_SESSION, flags, deadline);
+}
+
+PyObject *
+py_tnpam_open_session_async(tnpam_ctx_t *self, PyObject *const *args,
+			    Py_ssize_t nargs, PyObject *kwnames)
+{
+	uint64_t deadline;
+	int flags;
+
+	if (!open_session_prepare(self, args, nargs, kwnames, &flags, &deadline)) {
+		return NULL;
+	}
+
+	return tnpam_op_submit(self, TNPAM_OP_OPEN_SESSION, flags, deadline);
+}
+
+PyObject *
+py_tnpam_close_session(tnpam_ctx_t *self, PyObject *const *args,
+		       Py_ssize_t nargs, PyObject *kwnames)
+{
+	uint64_t deadline;
+	int flags;
+
+	if (!close_session_prepare(self, args, nargs, kwnames, &flags, &deadline)) {
 		return NULL;
 	}
 
-	PYPAM_LOCK(self);
-	ret = pam_close_session(self->hdl, flags);
-	self->last_pam_result = ret;
-	PYPAM_UNLOCK(self);
+	return tnpam_op_run(self, TNPAM_OP_CLOSE_SESSION, flags, deadline);
+}
+
+PyObject *
+py_tnpam_close_session_async(tnpam_ctx_t *self, PyObject *const *args,
+			     Py_ssize_t nargs, PyObject *kwnames)
+{
+	uint64_t deadline;
+	int flags;
+
+	if (!close_session_prepare(self, args, nargs, kwnames, &flags, &deadline)) {
+		return NULL;
+	}
+
+	return tnpam_op_submit(self, TNPAM_OP_CLOSE_SESSION, flags, deadline);
+}
+
+/*
+ * Session registry and close_all_sessions().
+ *
+ * tnpam_op_call() links contexts into the registry of their interpreter when
+ * pam_open_session() succeeds and unlinks them when pam_close_session()
+ * does. close_all_sessions() claims every listed context and tears the
+ * sessions down on native threads. Claimed contexts may lose their last
+ * reference meanwhile; their dealloc waits in tnpam_session_forget() until
+ * the claim is released so that the teardown never touches freed memory.
+ */
+
+#define TNPAM_CLOSE_ALL_DEFAULT_CONCURRENCY 8
+
+typedef struct {
+	tnpam_ctx_t *ctx;
+	PyObject *user;
+	pamcode_t result;
+	boolean_t skipped;
+} tnpam_close_item_t;
+
+typedef struct {
+	tnpam_close_item_t *items;
+	size_t count;
+	boolean_t has_deadline;
+	struct timespec deadline;	/* CLOCK_MONOTONIC */
+	struct timespec lock_deadline;	/* CLOCK_REALTIME for timedlock */
+	atomic_size_t next;	/* index of next item to process */
+} tnpam_close_all_t;
+
+/* Registry lock must be held */
+static void
+registry_link(tnpam_session_registry_t *registry, tnpam_ctx_t *ctx)
+{
+	ctx->session_prev = NULL;
+	ctx->session_next = registry->head;
+	if (registry->head != NULL) {
+		registry->head->session_prev = ctx;
+	}
+	registry->head = ctx;
+	registry->count++;
+	ctx->session_reg = TNPAM_SESSION_LISTED;
+}
+
+/* Registry lock must be held */
+static void
+registry_unlink(tnpam_session_registry_t *registry, tnpam_ctx_t *ctx)
+{
+	if (ctx->session_prev != NULL) {
+		ctx->session_prev->session_next = ctx->session_next;
+	} else {
+		registry->head = ctx->session_next;
+	}
+	if (ctx->session_next != NULL) {
+		ctx->session_next->session_prev = ctx->session_prev;
+	}
+	ctx->session_prev = ctx->session_next = NULL;
+	registry->count--;
+	ctx->session_reg = TNPAM_SESSION_UNLISTED;
+}
+
+/*
+ * Update session_opened and registry membership after a successful
+ * pam_open_session() / pam_close_session(). Called by tnpam_op_call() with
+ * the handle lock held and without the GIL. A claimed context stays
+ * claimed; close_all_sessions() re-lists it if it is skipped and the
+ * session is still open.
+ */
+void
+tnpam_session_set_opened(tnpam_ctx_t *ctx, boolean_t opened)
+{
+	tnpam_session_registry_t *registry = ctx->registry;
 
-	if (ret != PAM_SUCCESS) {
-		if (!PyErr_Occurred()) {
-			set_pam_exc(ret, "pam_close_session() failed");
+	pthread_mutex_lock(&registry->lock);
+	if (ctx->session_opened != opened) {
+		tnpam_mem_add(TNPAM_MEM_OPEN_SESSIONS, opened ? 1 : -1);
+	}
+	ctx->session_opened = opened;
+	if (opened && (ctx->session_reg == TNPAM_SESSION_UNLISTED)) {
+		registry_link(registry, ctx);
+	} else if (!opened && (ctx->session_reg == TNPAM_SESSION_LISTED)) {
+		registry_unlink(registry, ctx);
+	}
+	pthread_mutex_unlock(&registry->lock);
+}
+
+/*
+ * Remove a context that is being deallocated from the registry. Called with
+ * the GIL held, which is released while waiting for close_all_sessions() to
+ * release the context.
+ */
+void
+tnpam_session_forget(tnpam_ctx_t *ctx)
+{
+	tnpam_session_registry_t *registry = ctx->registry;
+
+	if (registry == NULL) {
+		// context was never set up
+		return;
+	}
+
+	pthread_mutex_lock(&registry->lock);
+	if (ctx->session_reg == TNPAM_SESSION_CLAIMED) {
+		Py_BEGIN_ALLOW_THREADS
+		while (ctx->session_reg == TNPAM_SESSION_CLAIMED) {
+			pthread_cond_wait(&registry->cv, &registry->lock);
 		}
+		Py_END_ALLOW_THREADS
+	}
+	if (ctx->session_reg == TNPAM_SESSION_LISTED) {
+		registry_unlink(registry, ctx);
+	}
+	if (ctx->session_opened) {
+		// pam_end() in dealloc takes the session down with the handle
+		tnpam_mem_add(TNPAM_MEM_OPEN_SESSIONS, -1);
+	}
+	pthread_mutex_unlock(&registry->lock);
+}
+
+static void
+timespec_add(struct timespec *ts, double seconds)
+{
+	ts->tv_sec += (time_t)seconds;
+	ts->tv_nsec += (long)((seconds - floor(seconds)) * 1e9);
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static bool
+close_all_expired(tnpam_close_all_t *job)
+{
+	struct timespec now;
+
+	if (!job->has_deadline) {
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec > job->deadline.tv_sec) ||
+	       ((now.tv_sec == job->deadline.tv_sec) &&
+		(now.tv_nsec >= job->deadline.tv_nsec));
+}
+
+static int
+close_all_lock(tnpam_close_all_t *job, pthread_mutex_t *lock)
+{
+	if (!job->has_deadline) {
+		return pthread_mutex_lock(lock);
+	}
+
+	return pthread_mutex_timedlock(lock, &job->lock_deadline);
+}
+
+/*
+ * libpam refuses pam_close_session() and pam_end() from inside a running
+ * pam_authenticate(), which a resumable operation may be parked in.
+ */
+static bool
+close_all_resuming(tnpam_ctx_t *ctx)
+{
+	bool resuming;
+
+	pthread_mutex_lock(&ctx->resume.lock);
+	resuming = ctx->resume.state != TNPAM_RESUME_IDLE;
+	pthread_mutex_unlock(&ctx->resume.lock);
+
+	return resuming;
+}
+
+/*
+ * Close the session of a claimed context and end its handle. Runs without
+ * the GIL. Returns false if the deadline passed before the handle could be
+ * locked or if a resumable operation is in progress on the context.
+ */
+static bool
+close_all_teardown(tnpam_close_all_t *job, tnpam_close_item_t *item)
+{
+	tnpam_ctx_t *ctx = item->ctx;
+	pamcode_t ret;
+
+	// The parked worker holds the handle lock, don't wait for it
+	if (close_all_expired(job) || close_all_resuming(ctx)) {
+		return false;
+	}
+
+	if ((ctx->lock_domain != NULL) &&
+	    (close_all_lock(job, &ctx->lock_domain->lock) != 0)) {
+		return false;
+	}
+
+	if (close_all_lock(job, &ctx->pam_hdl_lock) != 0) {
+		TNPAM_DOMAIN_UNLOCK(ctx)
+		return false;
+	}
+
+	// auth_begin() may have started while we waited for the locks
+	if (close_all_resuming(ctx)) {
+		pthread_mutex_unlock(&ctx->pam_hdl_lock);
+		TNPAM_DOMAIN_UNLOCK(ctx)
+		return false;
+	}
+
+	// The python conversation function needs the GIL and the context
+	// may no longer have any references.
+	pam_set_item(ctx->hdl, PAM_CONV, &tnpam_idle_conv);
+
+	ret = tnpam_op_call(ctx, TNPAM_OP_CLOSE_SESSION, PAM_SILENT, 0);
+	if (ret == TNPAM_OP_BAD_STATE) {
+		// closed by another thread after it was claimed
+		ret = PAM_SUCCESS;
+	} else if (ret == TNPAM_OP_WORKER_LOST) {
+		ret = PAM_SYSTEM_ERR;
+	}
+
+	tnpam_proc_detach(ctx, ret);
+	pam_end(ctx->hdl, ret);
+	ctx->hdl = NULL;
+	item->result = ret;
+
+	pthread_mutex_unlock(&ctx->pam_hdl_lock);
+	TNPAM_DOMAIN_UNLOCK(ctx)
+	return true;
+}
+
+/*
+ * Hand a claimed context back. Skipped contexts whose session is still open
+ * are listed again.
+ */
+static void
+close_all_release(tnpam_close_item_t *item)
+{
+	tnpam_ctx_t *ctx = item->ctx;
+	tnpam_session_registry_t *registry = ctx->registry;
+
+	pthread_mutex_lock(&registry->lock);
+	ctx->session_reg = TNPAM_SESSION_UNLISTED;
+	if (item->skipped && ctx->session_opened) {
+		registry_link(registry, ctx);
+	}
+	pthread_cond_broadcast(&registry->cv);
+	pthread_mutex_unlock(&registry->lock);
+}
+
+static void *
+close_all_worker(void *arg)
+{
+	tnpam_close_all_t *job = (tnpam_close_all_t *)arg;
+	size_t idx;
+
+	while ((idx = atomic_fetch_add(&job->next, 1)) < job->count) {
+		tnpam_close_item_t *item = &job->items[idx];
+
+		item->skipped = !close_all_teardown(job, item);
+		close_all_release(item);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run the teardown on up to concurrency threads including the calling
+ * thread. Called without the GIL. Failure to create extra threads only
+ * reduces concurrency.
+ */
+static void
+close_all_run(tnpam_close_all_t *job, size_t concurrency)
+{
+	pthread_t *threads = NULL;
+	size_t nthreads = 0, i;
+
+	if (concurrency > job->count) {
+		concurrency = job->count;
+	}
+
+	if (concurrency > 1) {
+		threads = calloc(concurrency - 1, sizeof(pthread_t));
+	}
+
+	if (threads != NULL) {
+		for (i = 0; i < concurrency - 1; i++) {
+			if (pthread_create(&threads[i], NULL, close_all_worker,
+					   job) != 0) {
+				break;
+			}
+			nthreads++;
+		}
+	}
+
+	close_all_worker(job);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+}
+
+/*
+ * Claim every listed context. The users are referenced so that results can
+ * be reported after the contexts have been released. GIL must be held.
+ */
+static bool
+close_all_claim(tnpam_session_registry_t *registry, tnpam_close_all_t *job)
+{
+	tnpam_ctx_t *ctx, *next;
+	size_t i = 0;
+
+	pthread_mutex_lock(&registry->lock);
+	if (registry->count == 0) {
+		pthread_mutex_unlock(&registry->lock);
+		return true;
+	}
+
+	job->items = PyMem_Calloc(registry->count, sizeof(tnpam_close_item_t));
+	if (job->items == NULL) {
+		pthread_mutex_unlock(&registry->lock);
+		PyErr_NoMemory();
+		return false;
+	}
+
+	for (ctx = registry->head; ctx != NULL; ctx = next) {
+		next = ctx->session_next;
+		registry_unlink(registry, ctx);
+		ctx->session_reg = TNPAM_SESSION_CLAIMED;
+		job->items[i].ctx = ctx;
+		job->items[i].user = Py_NewRef(ctx->user);
+		i++;
+	}
+	job->count = i;
+	pthread_mutex_unlock(&registry->lock);
+
+	return true;
+}
+
+static PyObject *
+close_all_results(tnpam_state_t *state, tnpam_close_all_t *job)
+{
+	PyObject *out = NULL;
+	size_t i;
+
+	out = PyTuple_New(job->count);
+	if (out == NULL) {
 		return NULL;
 	}
 
-	self->session_opened = B_FALSE;
+	for (i = 0; i < job->count; i++) {
+		tnpam_close_item_t *item = &job->items[i];
+		PyObject *entry = NULL;
+		PyObject *code = NULL;
 
-	Py_RETURN_NONE;
+		if (item->skipped) {
+			code = Py_NewRef(Py_None);
+		} else if ((item->result >= 0) &&
+			   (item->result < _PAM_RETURN_VALUES)) {
+			code = tnpam_enum_member(state, TNPAM_ENUM_PAM_CODE,
+						 item->result);
+		} else {
+			code = PyLong_FromLong(item->result);
+		}
+		if (code == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		entry = PyTuple_Pack(2, item->user, code);
+		Py_DECREF(code);
+		if (entry == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		PyTuple_SET_ITEM(out, i, entry);
+	}
+
+	return out;
+}
+
+PyObject *
+py_tnpam_close_all_sessions(PyObject *self, PyObject *const *args,
+			    Py_ssize_t nargs, PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"concurrency",
+		"deadline",
+		NULL
+	};
+	tnpam_state_t *state = py_get_pam_state(self);
+	Py_ssize_t concurrency = TNPAM_CLOSE_ALL_DEFAULT_CONCURRENCY;
+	PyObject *py_deadline = NULL;
+	tnpam_close_all_t job = { 0 };
+	PyObject *out = NULL;
+	double deadline;
+	size_t i;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$nO", kwlist,
+			      &concurrency,
+			      &py_deadline)) {
+		return NULL;
+	}
+
+	if (concurrency < 1) {
+		PyErr_SetString(PyExc_ValueError, "concurrency must be at least 1");
+		return NULL;
+	}
+
+	if (!tnpam_parse_timeout(py_deadline, &deadline)) {
+		return NULL;
+	}
+
+	if (deadline >= 0) {
+		job.has_deadline = B_TRUE;
+		clock_gettime(CLOCK_MONOTONIC, &job.deadline);
+		clock_gettime(CLOCK_REALTIME, &job.lock_deadline);
+		timespec_add(&job.deadline, deadline);
+		timespec_add(&job.lock_deadline, deadline);
+	}
+
+	if (!close_all_claim(&state->sessions, &job)) {
+		return NULL;
+	}
+
+	// Audit every session before any is closed. If a hook refuses, hand
+	// all of them back untouched.
+	for (i = 0; i < job.count; i++) {
+		if (PySys_Audit(MODULE_NAME ".close_session", "O",
+				job.items[i].user) < 0) {
+			break;
+		}
+	}
+
+	if (i < job.count) {
+		for (i = 0; i < job.count; i++) {
+			job.items[i].skipped = B_TRUE;
+			close_all_release(&job.items[i]);
+		}
+		goto cleanup;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	close_all_run(&job, (size_t)concurrency);
+	Py_END_ALLOW_THREADS
+
+	out = close_all_results(state, &job);
+
+cleanup:
+	for (i = 0; i < job.count; i++) {
+		Py_DECREF(job.items[i].user);
+	}
+	PyMem_Free(job.items);
+	return out;
+}
+
+PyObject *
+py_tnpam_open_session_count(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+	tnpam_session_registry_t *registry = &py_get_pam_state(self)->sessions;
+	size_t count;
+
+	pthread_mutex_lock(&registry->lock);
+	count = registry->count;
+	pthread_mutex_unlock(&registry->lock);
+
+	return PyLong_FromSize_t(count);
+}
+
+bool
+init_session_registry(PyObject *module_ref)
+{
+	tnpam_session_registry_t *registry = &py_get_pam_state(module_ref)->sessions;
+
+	if (pthread_mutex_init(&registry->lock, NULL) != 0) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"failed to initialize session registry");
+		return false;
+	}
+
+	if (pthread_cond_init(&registry->cv, NULL) != 0) {
+		pthread_mutex_destroy(&registry->lock);
+		PyErr_SetString(PyExc_RuntimeError,
+				"failed to initialize session registry");
+		return false;
+	}
+
+	registry->head = NULL;
+	registry->count = 0;
+	return true;
+}
+
+void
+tnpam_session_registry_destroy(tnpam_session_registry_t *registry)
+{
+	pthread_cond_destroy(&registry->cv);
+	pthread_mutex_destroy(&registry->lock);
 }
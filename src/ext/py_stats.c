@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#define PY_SSIZE_T_CLEAN
+#include <string.h>
+#include "truenas_pypam.h"
+
+/*
+ * Latency histograms for PAM calls, handle lock waits and python
+ * conversation callbacks.
+ *
+ * Every sample is recorded twice: in the histograms of the context it
+ * belongs to (if any) and in the process-wide histograms shared by all
+ * interpreters. Counters are updated with relaxed atomics so recording is
+ * safe from native threads without the GIL and costs a few uncontended
+ * atomic adds. Snapshots are not taken atomically across counters.
+ *
+ * Bucket i counts samples of at least 2^(i-1) and less than 2^i
+ * nanoseconds (bucket 0 counts zero-length samples). The last bucket also
+ * counts everything longer.
+ */
+
+static const char *stat_names[] = {
+	[TNPAM_STAT_AUTHENTICATE] = "pam_authenticate",
+	[TNPAM_STAT_ACCT_MGMT] = "pam_acct_mgmt",
+	[TNPAM_STAT_SETCRED] = "pam_setcred",
+	[TNPAM_STAT_OPEN_SESSION] = "pam_open_session",
+	[TNPAM_STAT_CLOSE_SESSION] = "pam_close_session",
+	[TNPAM_STAT_CHAUTHTOK] = "pam_chauthtok",
+	[TNPAM_STAT_START] = "pam_start",
+	[TNPAM_STAT_LOCK_WAIT] = "lock_wait",
+	[TNPAM_STAT_CONVERSATION] = "conversation",
+};
+
+_Static_assert(
+	TNPAM_STAT_COUNT == ARRAY_SIZE(stat_names),
+	"stats name table needs updating"
+);
+
+static tnpam_stats_t global_stats;
+
+#ifdef TNPAM_HAVE_PROBES
+/* USDT probe semaphores, incremented by tracers when they attach */
+TNPAM_PROBE_SEMAPHORE(op__entry);
+TNPAM_PROBE_SEMAPHORE(op__return);
+TNPAM_PROBE_SEMAPHORE(start__return);
+TNPAM_PROBE_SEMAPHORE(conv__entry);
+TNPAM_PROBE_SEMAPHORE(conv__return);
+TNPAM_PROBE_SEMAPHORE(batch__return);
+#endif
+
+static void
+hist_record(tnpam_hist_t *hist, uint64_t ns)
+{
+	uint64_t max;
+	size_t idx;
+
+	idx = ns ? (size_t)(64 - __builtin_clzll(ns)) : 0;
+	if (idx >= TNPAM_HIST_BUCKETS) {
+		idx = TNPAM_HIST_BUCKETS - 1;
+	}
+
+	atomic_fetch_add_explicit(&hist->buckets[idx], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->total_ns, ns, memory_order_relaxed);
+
+	max = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+	while ((ns > max) &&
+	       !atomic_compare_exchange_weak_explicit(&hist->max_ns, &max, ns,
+						      memory_order_relaxed,
+						      memory_order_relaxed)) {
+		;
+	}
+}
+
+/*
+ * Record a sample for stats (may be NULL for calls that don't belong to a
+ * context) and in the process-wide stats. May be called without the GIL.
+ */
+void
+tnpam_stats_record(tnpam_stats_t *stats, tnpam_stat_t stat, uint64_t ns)
+{
+	if (stats != NULL) {
+		hist_record(&stats->hist[stat], ns);
+	}
+
+	hist_record(&global_stats.hist[stat], ns);
+}
+
+static uint64_t
+hist_read(_Atomic uint64_t *val, bool reset)
+{
+	if (reset) {
+		return atomic_exchange_explicit(val, 0, memory_order_relaxed);
+	}
+
+	return atomic_load_explicit(val, memory_order_relaxed);
+}
+
+static PyObject *
+hist_dict(tnpam_hist_t *hist, bool reset)
+{
+	PyObject *out = NULL;
+	PyObject *buckets = NULL;
+	uint64_t count, total, max;
+	size_t i;
+
+	buckets = PyTuple_New(TNPAM_HIST_BUCKETS);
+	if (buckets == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TNPAM_HIST_BUCKETS; i++) {
+		PyObject *val = PyLong_FromUnsignedLongLong(hist_read(&hist->buckets[i],
+								      reset));
+		if (val == NULL) {
+			Py_DECREF(buckets);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(buckets, i, val);
+	}
+
+	count = hist_read(&hist->count, reset);
+	total = hist_read(&hist->total_ns, reset);
+	max = hist_read(&hist->max_ns, reset);
+
+	out = Py_BuildValue("{s:K,s:K,s:K,s:N}",
+			    "count", (unsigned long long)count,
+			    "total_ns", (unsigned long long)total,
+			    "max_ns", (unsigned long long)max,
+			    "buckets", buckets);
+	return out;
+}
+
+/*
+ * Build the python representation of stats, optionally resetting the
+ * counters as they are read. GIL must be held.
+ */
+PyObject *
+tnpam_stats_dict(tnpam_stats_t *stats, bool reset)
+{
+	PyObject *out = NULL;
+	size_t i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < TNPAM_STAT_COUNT; i++) {
+		PyObject *entry = hist_dict(&stats->hist[i], reset);
+		if (entry == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		if (PyDict_SetItemString(out, stat_names[i], entry) < 0) {
+			Py_DECREF(entry);
+			Py_DECREF(out);
+			return NULL;
+		}
+		Py_DECREF(entry);
+	}
+
+	return out;
+}
+
+PyObject *
+py_tnpam_stats(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+	       PyObject *kwnames)
+{
+	static char *kwlist[] = {
+		"reset",
+		NULL
+	};
+	boolean_t reset = B_FALSE;
+
+	if (!tnpam_parse_args(args, nargs, kwnames, "|$p", kwlist, &reset)) {
+		return NULL;
+	}
+
+	return tnpam_stats_dict(&global_stats, reset);
+}
@@ -4,9 +4,13 @@
 #include "truenas_pypam.h"
 
 PyDoc_STRVAR(tnpam_get_context__doc__,
-"get_context(service_name='login', *, user, conversation_function,\n"
+"get_context(service_name='login', *, user, conversation_function=None,\n"
 "            conversation_private_data=None, confdir=None, rhost=None,\n"
-"            ruser=None, fail_delay=0) -> PamContext\n"
+"            ruser=None, fail_delay=0, conversation_responses=None,\n"
+"            message_history_size=64, lock_policy=None,\n"
+"            lock_group=None, defer_fail_delay=False,\n"
+"            pam_env=None, auth_cache=False,\n"
+"            timeout=None) -> PamContext\n"
 "-------------------------------------------------------------------\n\n"
 "Create a new PAM context for user authentication and session management.\n\n"
 "This function creates a PAM context by calling pam_start_confdir(3) and\n"
@@ -24,7 +28,10 @@ PyDoc_STRVAR(tnpam_get_context__doc__,
 "conversation_function : callable\n"
 "    Callback function for PAM conversation mechanism. Must accept\n"
 "    (context, messages, private_data) arguments and return a sequence\n"
-"    of responses. See pam_conv(3).\n"
+"    of responses (str, bytes-like object or None, one per message).\n"
+"    Each response is copied once for the PAM stack and str responses are\n"
+"    not left with a cached UTF-8 copy. See pam_conv(3). Required unless\n"
+"    conversation_responses is given.\n"
 "conversation_private_data : object, optional\n"
 "    Private data passed to the conversation function (default=None)\n"
 "confdir : str, optional\n"
@@ -39,7 +46,53 @@ PyDoc_STRVAR(tnpam_get_context__doc__,
 "fail_delay : int, optional\n"
 "    Delay in microseconds on authentication failure (default=0).\n"
 "    Note that PAM modules may enforce their own default fail delay\n"
-"    regardless of this setting. See pam_fail_delay(3).\n\n"
+"    regardless of this setting. See pam_fail_delay(3).\n"
+"conversation_responses : Mapping[MSGStyle, str | Buffer | None], optional\n"
+"    Static responses keyed by message style, for example\n"
+"    {MSGStyle.PAM_PROMPT_ECHO_OFF: password,\n"
+"    MSGStyle.PAM_PROMPT_ECHO_ON: username}. Conversations in which every\n"
+"    prompt has a declared response are answered directly by the extension\n"
+"    without acquiring the GIL or calling conversation_function.\n"
+"    PAM_ERROR_MSG and PAM_TEXT_INFO messages receive no response unless\n"
+"    specified. If a prompt has no declared response the whole\n"
+"    conversation is passed to conversation_function, or fails with\n"
+"    PAM_CONV_ERR if there is none. The values are copied when the context\n"
+"    is created into memory locked with mlock(2) (where permitted) and\n"
+"    zeroed when it is destroyed. Messages answered this way\n"
+"    are still recorded in messages() (default=None).\n"
+"message_history_size : int, optional\n"
+"    Maximum number of conversations retained for messages() and\n"
+"    message_history. Once reached the oldest conversation is discarded.\n"
+"    0 disables the history (default=64).\n"
+"lock_policy : LockPolicy, optional\n"
+"    Serialize PAM calls on this context with those of other contexts in\n"
+"    the same lock domain, for PAM stacks containing modules that are not\n"
+"    thread-safe. The domain lock is held without the GIL for the whole\n"
+"    PAM call. See set_lock_policy() (default=None for the policy set for\n"
+"    service_name, normally LockPolicy.HANDLE).\n"
+"lock_group : str, optional\n"
+"    Name of the lock domain for LockPolicy.GROUP (default=None).\n"
+"defer_fail_delay : bool, optional\n"
+"    Do not sleep inside pam_authenticate(3) after a failure. A\n"
+"    PAM_FAIL_DELAY callback records the delay requested by fail_delay and\n"
+"    by PAM modules instead and it is available as last_fail_delay. The\n"
+"    caller is then responsible for enforcing it. authenticate_async()\n"
+"    applies it with an event loop timer before raising (default=False).\n"
+"pam_env : Mapping[str, str], optional\n"
+"    Initial PAM environment, applied as by update_env() while the handle\n"
+"    is set up so that no separate call is needed (default=None).\n"
+"auth_cache : bool, optional\n"
+"    Let authentication use the credential cache enabled with\n"
+"    set_auth_cache(). Requires conversation_responses and no\n"
+"    conversation_function (default=False).\n"
+"timeout : float, optional\n"
+"    Default time limit in seconds of each PAM operation on the context.\n"
+"    Once it has passed, conversations fail with PAM_CONV_ERR without\n"
+"    calling conversation_function and the operation raises TimeoutError.\n"
+"    Individual operations may override it with their own timeout\n"
+"    argument. For auth_begin() it bounds the whole operation including\n"
+"    the time spent waiting for auth_resume() (default=None for no\n"
+"    limit).\n\n"
 "Returns\n"
 "-------\n"
 "PamContext\n"
@@ -50,24 +103,222 @@ PyDoc_STRVAR(tnpam_get_context__doc__,
 "PAMError\n"
 "    If PAM initialization fails or invalid parameters are provided\n"
 "ValueError\n"
-"    If required parameters are missing or conversation_function is not\n"
-"    callable\n"
+"    If required parameters are missing, neither conversation_function\n"
+"    nor conversation_responses is given, or conversation_responses has\n"
+"    a key that is not a valid MSGStyle, or message_history_size is\n"
+"    negative, or lock_group does not match lock_policy, or auth_cache\n"
+"    is used with a conversation_function, or timeout is negative or NaN\n"
 "TypeError\n"
-"    If parameters are not of the expected types\n"
+"    If parameters are not of the expected types, conversation_function\n"
+"    is not callable or lock_policy is not a LockPolicy\n"
 );
 
-static PyObject *tnpam_get_context(PyObject *self, PyObject *args, PyObject *kwds)
+static PyObject *tnpam_get_context(PyObject *self, PyObject *const *args,
+				   Py_ssize_t nargs, PyObject *kwnames)
 {
-	return PyObject_Call((PyObject *)&PyPamCtx_Type, args, kwds);
+	return tnpam_ctx_vectorcall((PyObject *)py_get_pam_state(self)->ctx_type,
+				    args, (size_t)nargs, kwnames);
+}
+
+PyDoc_STRVAR(tnpam_get_context_pool__doc__,
+"get_context_pool(*, service_name='login', confdir=None, maxsize=8)\n"
+"                 -> PamContextPool\n"
+"-------------------------------------------------------------------\n\n"
+"Create a pool of reusable PAM handles.\n\n"
+"PamContext objects created through the pool's get_context() method take\n"
+"an idle handle from the pool instead of calling pam_start_confdir(3),\n"
+"which avoids re-reading the PAM configuration and reloading the service\n"
+"modules for every transaction. Handles are returned to the pool with\n"
+"their items and environment reset when the context is deallocated.\n\n"
+"Parameters\n"
+"----------\n"
+"service_name : str, optional\n"
+"    Name of the PAM service (default='login').\n"
+"confdir : str, optional\n"
+"    Path to directory containing PAM configuration files (default=None\n"
+"    for /etc/pam.d).\n"
+"maxsize : int, optional\n"
+"    Maximum number of idle handles kept by the pool (default=8). Handles\n"
+"    offered back to a full pool are ended.\n\n"
+"Returns\n"
+"-------\n"
+"PamContextPool\n\n"
+"Raises\n"
+"------\n"
+"ValueError\n"
+"    If maxsize is less than 1\n"
+);
+
+static PyObject *tnpam_get_context_pool(PyObject *self, PyObject *const *args,
+					Py_ssize_t nargs, PyObject *kwnames)
+{
+	return PyObject_Vectorcall((PyObject *)py_get_pam_state(self)->pool_type,
+				   args, (size_t)nargs, kwnames);
+}
+
+PyDoc_STRVAR(tnpam_get_process_pool__doc__,
+"get_process_pool(*, workers=2, max_requests=0) -> PamProcessPool\n"
+"-----------------------------------------------------------------\n\n"
+"Create a pool of worker processes that run PAM calls.\n\n"
+"PamContext objects created through the pool's get_context() method keep\n"
+"their PAM handle in a worker process instead of the application. This\n"
+"lets services whose modules are not thread-safe or leak memory run in\n"
+"parallel, and contains crashes of the modules. Conversation callbacks\n"
+"still run in the application.\n\n"
+"Parameters\n"
+"----------\n"
+"workers : int, optional\n"
+"    Maximum number of worker processes (default=2). Workers are started\n"
+"    when contexts need them.\n"
+"max_requests : int, optional\n"
+"    Number of PAM calls after which a worker is replaced: it takes no new\n"
+"    contexts and exits when its last context is deallocated (default=0 to\n"
+"    keep workers).\n\n"
+"Returns\n"
+"-------\n"
+"PamProcessPool\n\n"
+"Raises\n"
+"------\n"
+"ValueError\n"
+"    If workers is not between 1 and 256 or max_requests is negative\n"
+"OSError\n"
+"    If the fork server can't be started\n"
+);
+
+static PyObject *tnpam_get_process_pool(PyObject *self, PyObject *const *args,
+					Py_ssize_t nargs, PyObject *kwnames)
+{
+	return PyObject_Vectorcall((PyObject *)py_get_pam_state(self)->proc_pool_type,
+				   args, (size_t)nargs, kwnames);
 }
 
 static PyMethodDef tnpam_methods[] = {
 	{
 		.ml_name = "get_context",
-		.ml_meth = (PyCFunction)tnpam_get_context,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_meth = (PyCFunction)(void(*)(void))tnpam_get_context,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = tnpam_get_context__doc__
 	},
+	{
+		.ml_name = "authenticate_many",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_authenticate_many,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_authenticate_many__doc__
+	},
+	{
+		.ml_name = "get_context_pool",
+		.ml_meth = (PyCFunction)(void(*)(void))tnpam_get_context_pool,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = tnpam_get_context_pool__doc__
+	},
+	{
+		.ml_name = "get_process_pool",
+		.ml_meth = (PyCFunction)(void(*)(void))tnpam_get_process_pool,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = tnpam_get_process_pool__doc__
+	},
+	{
+		.ml_name = "set_async_workers",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_set_async_workers,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_set_async_workers__doc__
+	},
+	{
+		.ml_name = "set_lock_policy",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_set_lock_policy,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_set_lock_policy__doc__
+	},
+	{
+		.ml_name = "set_auth_rate_limit",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_set_auth_rate_limit,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_set_auth_rate_limit__doc__
+	},
+	{
+		.ml_name = "get_auth_rate_limit",
+		.ml_meth = (PyCFunction)py_tnpam_get_auth_rate_limit,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_get_auth_rate_limit__doc__
+	},
+	{
+		.ml_name = "set_auth_cache",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_set_auth_cache,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_set_auth_cache__doc__
+	},
+	{
+		.ml_name = "get_auth_cache",
+		.ml_meth = (PyCFunction)py_tnpam_get_auth_cache,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_get_auth_cache__doc__
+	},
+	{
+		.ml_name = "invalidate_auth_cache",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_invalidate_auth_cache,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_invalidate_auth_cache__doc__
+	},
+	{
+		.ml_name = "set_event_buffer",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_set_event_buffer,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_set_event_buffer__doc__
+	},
+	{
+		.ml_name = "get_event_buffer",
+		.ml_meth = (PyCFunction)py_tnpam_get_event_buffer,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_get_event_buffer__doc__
+	},
+	{
+		.ml_name = "drain_events",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_drain_events,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_drain_events__doc__
+	},
+	{
+		.ml_name = "event_fd",
+		.ml_meth = (PyCFunction)py_tnpam_event_fd,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_event_fd__doc__
+	},
+	{
+		.ml_name = "close_all_sessions",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_close_all_sessions,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_close_all_sessions__doc__
+	},
+	{
+		.ml_name = "open_session_count",
+		.ml_meth = (PyCFunction)py_tnpam_open_session_count,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_open_session_count__doc__
+	},
+	{
+		.ml_name = "stats",
+		.ml_meth = (PyCFunction)(void(*)(void))py_tnpam_stats,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = py_tnpam_stats__doc__
+	},
+	{
+		.ml_name = "memory_stats",
+		.ml_meth = (PyCFunction)py_tnpam_memory_stats,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_memory_stats__doc__
+	},
+	{
+		.ml_name = "__getattr__",
+		.ml_meth = (PyCFunction)py_tnpam_module_getattr,
+		.ml_flags = METH_O,
+		.ml_doc = py_tnpam_module_getattr__doc__
+	},
+	{
+		.ml_name = "__dir__",
+		.ml_meth = (PyCFunction)py_tnpam_module_dir,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_tnpam_module_dir__doc__
+	},
 	{NULL, NULL, 0, NULL}
 };
 
@@ -76,10 +327,27 @@ tnpam_module_clear(PyObject *m)
 {
 	tnpam_state_t *state = (tnpam_state_t *)PyModule_GetState(m);
 	Py_CLEAR(state->pam_error);
-	Py_CLEAR(state->pam_code_enum);
-	Py_CLEAR(state->msg_style_enum);
+	Py_CLEAR(state->rate_limited_error);
 	Py_CLEAR(state->struct_pam_msg_type);
-	Py_CLEAR(state->cred_op_enum);
+	Py_CLEAR(state->get_running_loop);
+	Py_CLEAR(state->async_complete);
+	Py_CLEAR(state->ctx_type);
+	Py_CLEAR(state->pool_type);
+	Py_CLEAR(state->proc_pool_type);
+	Py_CLEAR(state->history_type);
+	Py_CLEAR(state->env_type);
+	Py_CLEAR(state->login_result_type);
+	Py_CLEAR(state->auth_event_type);
+	for (size_t i = 0; i < TNPAM_ENUM_COUNT; i++) {
+		Py_CLEAR(state->enums[i]);
+		for (size_t j = 0; j < TNPAM_ENUM_MAX_VALUES; j++) {
+			Py_CLEAR(state->enum_members[i][j]);
+		}
+	}
+	for (size_t i = 0; i < _PAM_RETURN_VALUES; i++) {
+		Py_CLEAR(state->pam_code_names[i]);
+		Py_CLEAR(state->pam_err_strs[i]);
+	}
 	return 0;
 }
 
@@ -88,17 +356,34 @@ tnpam_module_traverse(PyObject *m, visitproc visit, void *arg)
 {
 	tnpam_state_t *state = (tnpam_state_t *)PyModule_GetState(m);
 	Py_VISIT(state->pam_error);
-	Py_VISIT(state->pam_code_enum);
-	Py_VISIT(state->msg_style_enum);
+	Py_VISIT(state->rate_limited_error);
 	Py_VISIT(state->struct_pam_msg_type);
-	Py_VISIT(state->cred_op_enum);
+	Py_VISIT(state->get_running_loop);
+	Py_VISIT(state->async_complete);
+	Py_VISIT(state->ctx_type);
+	Py_VISIT(state->pool_type);
+	Py_VISIT(state->proc_pool_type);
+	Py_VISIT(state->history_type);
+	Py_VISIT(state->env_type);
+	Py_VISIT(state->login_result_type);
+	Py_VISIT(state->auth_event_type);
+	for (size_t i = 0; i < TNPAM_ENUM_COUNT; i++) {
+		Py_VISIT(state->enums[i]);
+		for (size_t j = 0; j < TNPAM_ENUM_MAX_VALUES; j++) {
+			Py_VISIT(state->enum_members[i][j]);
+		}
+	}
 	return 0;
 }
 
 static void
 tnpam_module_free(void *m)
 {
+	tnpam_state_t *state = (tnpam_state_t *)PyModule_GetState((PyObject *)m);
+
 	tnpam_module_clear((PyObject *)m);
+	// Contexts keep the module alive so no session can still be listed
+	tnpam_session_registry_destroy(&state->sessions);
 }
 
 PyDoc_STRVAR(truenas_pypam_module__doc__,
@@ -112,71 +397,158 @@ PyDoc_STRVAR(truenas_pypam_module__doc__,
 "- PAM environment variable management\n"
 "- Comprehensive error handling with PAM-specific exceptions\n\n"
 "Main Functions:\n"
-"- get_context(): Create a new PAM context for authentication\n\n"
+"- get_context(): Create a new PAM context for authentication\n"
+"- get_context_pool(): Create a pool of reusable PAM handles\n"
+"- get_process_pool(): Run PAM calls in a pool of worker processes\n"
+"- authenticate_many(): Check a batch of credentials in parallel\n"
+"- set_async_workers(): Size the worker pool behind the *_async() methods\n"
+"- set_lock_policy(): Serialize PAM services whose modules are not\n"
+"  thread-safe\n"
+"- set_auth_rate_limit(): Throttle authentication per remote host and user\n"
+"- set_auth_cache(): Briefly remember verified credentials such as API keys\n"
+"- set_event_buffer(): Record PAM calls natively for batched drain_events()\n"
+"- stats(): Latency histograms of PAM calls, lock waits and callbacks\n"
+"- memory_stats(): Counters of live contexts, sessions and conversations\n\n"
 "Main Classes:\n"
 "- PamContext: PAM context object with authentication methods\n"
 "- PAMError: Exception class for PAM-related errors\n"
+"- AuthRateLimited: PAMError for attempts refused by set_auth_rate_limit()\n"
 );
 
+/*
+ * Set up a module instance. With multi-phase init this runs once per
+ * interpreter and all types and objects are stored in the module state.
+ */
+static int
+tnpam_module_exec(PyObject *mod)
+{
+	/* Set up the registry of open sessions for close_all_sessions() */
+	if (!init_session_registry(mod)) {
+		return -1;
+	}
+
+	/* Create PamError exception */
+	if (!setup_pam_exception(mod)) {
+		return -1;
+	}
+
+	/* Set up our pam conversation py structs */
+	if (!init_pam_conv_struct(mod)) {
+		return -1;
+	}
+
+	/* Set up the LoginResult struct returned by login() */
+	if (!init_login_result_type(mod)) {
+		return -1;
+	}
+
+	/* Set up the AuthEvent struct returned by drain_events() */
+	if (!init_auth_event_type(mod)) {
+		return -1;
+	}
+
+	/* Set up helpers for the *_async() methods */
+	if (!init_async_state(mod)) {
+		return -1;
+	}
+
+	/* Set up PamContext, PamContextPool, PamProcessPool, MessageHistory and
+	 * PamEnv types */
+	if (!init_ctx_type(mod) || !init_pool_type(mod) ||
+	    !init_proc_pool_type(mod) || !init_history_type(mod) ||
+	    !init_env_type(mod)) {
+		return -1;
+	}
+
+	/* tracemalloc domain of the handle size estimates (see py_memory.c) */
+	if (PyModule_AddIntConstant(mod, "TRACEMALLOC_DOMAIN",
+				    TNPAM_TRACEMALLOC_DOMAIN) < 0) {
+		return -1;
+	}
+
+	/* Enums are created on first access, see py_enum.c */
+	if (!init_enum_names(mod)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static PyModuleDef_Slot tnpam_module_slots[] = {
+	{Py_mod_exec, tnpam_module_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+	/*
+	 * Nothing is shared between module instances except the native
+	 * *_async() worker threads, which attach to the interpreter of each job,
+	 * and the lock domains and stats, which are plain C state.
+	 */
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+	/*
+	 * Handle state is serialized by pam_hdl_lock and python-visible state
+	 * by critical sections, so don't re-enable the GIL on import.
+	 */
+	{Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+	{0, NULL}
+};
+
 PyModuleDef truenas_pypam_module = {
 	PyModuleDef_HEAD_INIT,
 	.m_name = MODULE_NAME,
 	.m_doc = truenas_pypam_module__doc__,
 	.m_size = sizeof(tnpam_state_t),
 	.m_methods = tnpam_methods,
+	.m_slots = tnpam_module_slots,
 	.m_clear = tnpam_module_clear,
 	.m_free = tnpam_module_free,
 	.m_traverse = tnpam_module_traverse,
 };
 
-// Generic function to get module state. NULL for module_in is OK
+// Get module state of a module object. module_in must not be NULL
 tnpam_state_t *py_get_pam_state(PyObject *module_in)
 {
-	PyObject *modref = module_in;
 	tnpam_state_t *state = NULL;
 
-	if (modref == NULL) {
-		// this is a borrowed referece. does not need decref
-		modref = PyState_FindModule(&truenas_pypam_module);
-		PYPAM_ASSERT((modref != NULL), "Failed to get module");
-	}
-
-	state = (tnpam_state_t *)PyModule_GetState(modref);
+	PYPAM_ASSERT((module_in != NULL), "Failed to get module");
+	state = (tnpam_state_t *)PyModule_GetState(module_in);
 	PYPAM_ASSERT((state != NULL), "Failed to get module state");
 	return state;
 }
 
-PyMODINIT_FUNC
-PyInit_truenas_pypam(void)
+tnpam_state_t *py_get_pam_state_from_type(PyTypeObject *type)
 {
-	PyObject *mod = NULL;
-
-	if (PyType_Ready(&PyPamCtx_Type) < 0) {
-		return NULL;
-	}
+	PyObject *modref = NULL;
 
-	mod = PyModule_Create(&truenas_pypam_module);
-	if (mod == NULL) {
-		return NULL;
-	}
+#if PY_VERSION_HEX >= 0x030B0000
+	// borrowed reference
+	modref = PyType_GetModuleByDef(type, &truenas_pypam_module);
+#else
+	PyObject *mro = type->tp_mro;
+	Py_ssize_t i;
 
-	/* Create PamError exception */
-	if (!setup_pam_exception(mod)) {
-		Py_DECREF(mod);
-		return NULL;
-	}
+	for (i = 0; (mro != NULL) && (i < PyTuple_GET_SIZE(mro)); i++) {
+		PyTypeObject *base = (PyTypeObject *)PyTuple_GET_ITEM(mro, i);
+		PyObject *mod;
 
-	/* Set up our pam conversation py structs */
-	if (!init_pam_conv_struct(mod)) {
-		Py_DECREF(mod);
-		return NULL;
-	}
+		if (!PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE)) {
+			continue;
+		}
 
-	/* Set up CredOp enum */
-	if (!setup_cred_op_enum(mod)) {
-		Py_DECREF(mod);
-		return NULL;
+		mod = ((PyHeapTypeObject *)base)->ht_module;
+		if ((mod != NULL) && (PyModule_GetDef(mod) == &truenas_pypam_module)) {
+			modref = mod;
+			break;
+		}
 	}
+#endif
+	PYPAM_ASSERT((modref != NULL), "Failed to get module");
+	return py_get_pam_state(modref);
+}
 
-	return mod;
+PyMODINIT_FUNC
+PyInit_truenas_pypam(void)
+{
+	return PyModuleDef_Init(&truenas_pypam_module);
 }
@@ -5,6 +5,9 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <security/pam_appl.h>
 #include <security/pam_misc.h>
 
@@ -36,17 +39,158 @@ typedef int boolean_t;
 
 /*
  * Macros to handle taking lock and dropping GIL
+ *
+ * The GIL (or on free-threaded builds the attached thread state) is released
+ * before blocking on the handle lock. Otherwise a thread waiting for the
+ * handle would deadlock against the holder reacquiring the GIL for a python
+ * conversation callback, or would stall stop-the-world pauses.
+ *
+ * If the context belongs to a lock domain (see set_lock_policy()) the domain
+ * lock is taken first and released last. The time spent waiting for both is
+ * recorded as TNPAM_STAT_LOCK_WAIT.
  */
+#define TNPAM_DOMAIN_LOCK(ctx) do { \
+	if (ctx->lock_domain != NULL) { \
+		pthread_mutex_lock(&ctx->lock_domain->lock); \
+	} \
+} while (0);
+
+#define TNPAM_DOMAIN_UNLOCK(ctx) do { \
+	if (ctx->lock_domain != NULL) { \
+		pthread_mutex_unlock(&ctx->lock_domain->lock); \
+	} \
+} while (0);
+
 #define PYPAM_LOCK(ctx) do { \
+	PyThreadState *__pypam_ts = PyEval_SaveThread(); \
+	uint64_t __pypam_t0 = tnpam_now_ns(); \
+	TNPAM_DOMAIN_LOCK(ctx) \
 	pthread_mutex_lock(&ctx->pam_hdl_lock); \
-	ctx->_save = PyEval_SaveThread(); \
+	tnpam_stats_record(&ctx->stats, TNPAM_STAT_LOCK_WAIT, \
+			   tnpam_now_ns() - __pypam_t0); \
+	ctx->_save = __pypam_ts; \
 } while (0);
 
 #define PYPAM_UNLOCK(ctx) do { \
-	PyEval_RestoreThread(ctx->_save); \
+	PyThreadState *__pypam_ts = ctx->_save; \
 	pthread_mutex_unlock(&ctx->pam_hdl_lock); \
+	TNPAM_DOMAIN_UNLOCK(ctx) \
+	PyEval_RestoreThread(__pypam_ts); \
 } while (0);
 
+/*
+ * Critical sections serialize access to python-visible state of an object
+ * on free-threaded (PEP 703) builds and are no-ops otherwise. Provide them
+ * for python versions that predate them.
+ */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+/*
+ * USDT (systemtap / bpftrace) probes, provider truenas_pypam. These compile
+ * to a nop and the probe arguments are only gathered when a tracer has
+ * attached (TNPAM_PROBE_ENABLED() checks the probe semaphore). Without
+ * <sys/sdt.h> at build time, or with TNPAM_DISABLE_PROBES defined, they are
+ * compiled out. Probes and their arguments:
+ *
+ * op__entry(ctx, op, service, user, rhost)
+ * op__return(ctx, op, pam_result, duration_ns)
+ *	PAM call of a PamContext operation on any thread (sync, *_async()
+ *	workers, auth_begin()). op is the PAM function name.
+ * start__return(ctx, service, user, pam_result, duration_ns)
+ *	pam_start_confdir() for a new context.
+ * conv__entry(ctx, num_msg, style_mask)
+ * conv__return(ctx, pam_result, callback_ns)
+ *	One conversation round. Bit (1 << msg_style) of style_mask is set for
+ *	each message style present. callback_ns is 0 if the python callback
+ *	was not called.
+ * batch__return(service, user, rhost, pam_result, duration_ns)
+ *	One authenticate_many() transaction.
+ */
+#if !defined(TNPAM_DISABLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TNPAM_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef TNPAM_HAVE_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TNPAM_PROBE_SEMAPHORE(name) \
+	unsigned short truenas_pypam_##name##_semaphore \
+	__attribute__((unused)) __attribute__((section(".probes")))
+
+extern TNPAM_PROBE_SEMAPHORE(op__entry);
+extern TNPAM_PROBE_SEMAPHORE(op__return);
+extern TNPAM_PROBE_SEMAPHORE(start__return);
+extern TNPAM_PROBE_SEMAPHORE(conv__entry);
+extern TNPAM_PROBE_SEMAPHORE(conv__return);
+extern TNPAM_PROBE_SEMAPHORE(batch__return);
+
+#define TNPAM_PROBE_ENABLED(name) \
+	__builtin_expect(truenas_pypam_##name##_semaphore, 0)
+#define TNPAM_PROBE(name, ...) STAP_PROBEV(truenas_pypam, name, __VA_ARGS__)
+#else
+#define TNPAM_PROBE_ENABLED(name) 0
+#define TNPAM_PROBE(name, ...) do { } while (0)
+#endif
+
+
+struct tnpam_ctx;
+
+/**
+ * @brief Contexts of an interpreter that have an open PAM session
+ *
+ * Contexts are linked in by tnpam_op_call() while session_opened is set so
+ * that close_all_sessions() can find them. The list does not hold
+ * references: contexts unlink themselves when deallocated and first wait for
+ * close_all_sessions() to release them if it has claimed them.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;	/* signalled when a claimed context is released */
+	struct tnpam_ctx *head;
+	size_t count;
+} tnpam_session_registry_t;
+
+/**
+ * @brief Highest struct pam_message msg_style understood by MSGStyle
+ */
+#define TNPAM_MSG_STYLE_MAX PAM_TEXT_INFO
+
+/**
+ * @brief IntEnum classes of the module, created on first use (py_enum.c)
+ */
+typedef enum {
+	TNPAM_ENUM_PAM_CODE = 0,	/* PAMCode */
+	TNPAM_ENUM_MSG_STYLE,	/* MSGStyle */
+	TNPAM_ENUM_CRED_OP,	/* CredOp */
+	TNPAM_ENUM_LOCK_POLICY,	/* LockPolicy */
+	TNPAM_ENUM_COUNT
+} tnpam_enum_t;
+
+/**
+ * @brief Members of every enum have values below this (PAM return values
+ * are the largest range)
+ */
+#define TNPAM_ENUM_MAX_VALUES _PAM_RETURN_VALUES
+
+typedef struct {
+	int value;
+	const char *name;
+} tnpam_enum_entry_t;
+
+/**
+ * @brief Name and members of an IntEnum, provided by the file that uses it
+ */
+typedef struct {
+	const char *name;	/* module attribute, e.g. "PAMCode" */
+	const tnpam_enum_entry_t *entries;
+	size_t count;
+} tnpam_enum_spec_t;
 
 /**
  * @brief Module state for the truenas_pypam Python extension
@@ -57,12 +201,209 @@ typedef int boolean_t;
  */
 typedef struct {
 	PyObject *pam_error;  /**< Custom exception object for PAM errors */
+	PyObject *rate_limited_error;  /**< AuthRateLimited(PAMError) */
 	PyTypeObject *struct_pam_msg_type;
-	PyObject *pam_code_enum;  /**< PAMCode IntEnum */
-	PyObject *msg_style_enum;  /**< MSGStyle IntEnum */
-	PyObject *cred_op_enum;  /**< CredOp IntEnum */
+	PyObject *enums[TNPAM_ENUM_COUNT];  /**< IntEnum classes (lazy) */
+	PyObject *get_running_loop;  /**< asyncio.get_running_loop (lazy) */
+	PyObject *async_complete;  /**< loop callback that completes futures */
+	size_t async_jobs;  /**< jobs of a subinterpreter in the async pool */
+	PyTypeObject *ctx_type;  /**< PamContext */
+	PyTypeObject *pool_type;  /**< PamContextPool */
+	PyTypeObject *proc_pool_type;  /**< PamProcessPool */
+	PyTypeObject *history_type;  /**< MessageHistory */
+	PyTypeObject *env_type;  /**< PamEnv */
+	PyTypeObject *login_result_type;  /**< LoginResult */
+	PyTypeObject *auth_event_type;  /**< AuthEvent */
+	/* Members of each enum by value, set when the class is created */
+	PyObject *enum_members[TNPAM_ENUM_COUNT][TNPAM_ENUM_MAX_VALUES];
+	/* Prebuilt per-code values for raising PAMError, indexed by PAM code */
+	PyObject *pam_code_names[_PAM_RETURN_VALUES];  /**< interned names */
+	PyObject *pam_err_strs[_PAM_RETURN_VALUES];  /**< interned pam_strerror() */
+	tnpam_session_registry_t sessions;  /**< contexts with open sessions */
 } tnpam_state_t;
 
+/**
+ * @brief Policies for serializing PAM calls beyond the handle lock
+ */
+typedef enum {
+	TNPAM_LOCK_HANDLE = 0,	/* only the per-handle lock (default) */
+	TNPAM_LOCK_SERVICE,	/* one lock per PAM service name */
+	TNPAM_LOCK_GROUP,	/* one lock per application-chosen group name */
+	TNPAM_LOCK_GLOBAL,	/* one lock for the whole process */
+} tnpam_lock_policy_t;
+
+/**
+ * @brief Lock shared by all contexts of a lock domain
+ *
+ * Domains are process-wide (shared by all interpreters) and are never freed.
+ * The mutex is recursive since python conversation callbacks run with it
+ * held and may use other contexts of the same domain.
+ */
+typedef struct tnpam_lock_domain {
+	struct tnpam_lock_domain *next;
+	tnpam_lock_policy_t policy;
+	char *name;		/* service or group name, NULL for global */
+	pthread_mutex_t lock;
+} tnpam_lock_domain_t;
+
+/**
+ * @brief PAM application calls wrapped by PamContext methods
+ *
+ * All of these have the signature int (*)(pam_handle_t *, int flags) and so
+ * they can be dispatched uniformly from both the synchronous methods and the
+ * native worker pool backing the *_async() methods.
+ */
+typedef enum {
+	TNPAM_OP_AUTHENTICATE = 0,
+	TNPAM_OP_ACCT_MGMT,
+	TNPAM_OP_SETCRED,
+	TNPAM_OP_OPEN_SESSION,
+	TNPAM_OP_CLOSE_SESSION,
+	TNPAM_OP_CHAUTHTOK,
+	TNPAM_OP_COUNT
+} tnpam_op_t;
+
+/**
+ * @brief Latency histograms kept by the extension
+ *
+ * The PAM calls share their index with tnpam_op_t so that tnpam_op_call()
+ * can record them directly.
+ */
+typedef enum {
+	TNPAM_STAT_AUTHENTICATE = TNPAM_OP_AUTHENTICATE,
+	TNPAM_STAT_ACCT_MGMT = TNPAM_OP_ACCT_MGMT,
+	TNPAM_STAT_SETCRED = TNPAM_OP_SETCRED,
+	TNPAM_STAT_OPEN_SESSION = TNPAM_OP_OPEN_SESSION,
+	TNPAM_STAT_CLOSE_SESSION = TNPAM_OP_CLOSE_SESSION,
+	TNPAM_STAT_CHAUTHTOK = TNPAM_OP_CHAUTHTOK,
+	TNPAM_STAT_START = TNPAM_OP_COUNT,	/* pam_start_confdir() */
+	TNPAM_STAT_LOCK_WAIT,	/* waiting for the handle / domain lock */
+	TNPAM_STAT_CONVERSATION,	/* python conversation callback */
+	TNPAM_STAT_COUNT
+} tnpam_stat_t;
+
+#define TNPAM_HIST_BUCKETS 40
+
+/**
+ * @brief Log2-bucketed latency histogram in nanoseconds (see py_stats.c)
+ */
+typedef struct {
+	_Atomic uint64_t count;
+	_Atomic uint64_t total_ns;
+	_Atomic uint64_t max_ns;
+	_Atomic uint64_t buckets[TNPAM_HIST_BUCKETS];
+} tnpam_hist_t;
+
+typedef struct {
+	tnpam_hist_t hist[TNPAM_STAT_COUNT];
+} tnpam_stats_t;
+
+/**
+ * @brief Process-wide memory accounting counters (see py_memory.c)
+ */
+typedef enum {
+	TNPAM_MEM_CONTEXTS = 0,	/* live PamContext objects */
+	TNPAM_MEM_OPEN_SESSIONS,	/* contexts with an open session */
+	TNPAM_MEM_CONVERSATIONS,	/* conversations in progress */
+	TNPAM_MEM_HANDLE_BYTES,	/* estimated heap used by live handles */
+	TNPAM_MEM_RESPONSES,	/* response arrays handed to PAM modules */
+	TNPAM_MEM_RESPONSE_BYTES,	/* bytes of those response arrays */
+	TNPAM_MEM_SECRET_BYTES,	/* secrets held by the extension */
+	TNPAM_MEM_COUNT
+} tnpam_mem_counter_t;
+
+/**
+ * @brief tracemalloc domain of allocations made outside the python allocators
+ */
+#define TNPAM_TRACEMALLOC_DOMAIN 0x7470616dU
+
+static inline uint64_t
+tnpam_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Declarative response for a single message style
+ *
+ * @note value may contain a secret (password) and is zeroed before being
+ * freed.
+ */
+typedef struct {
+	boolean_t present;	/* style was specified in conversation_responses */
+	char *value;		/* NULL means respond with no text, else in the secret arena */
+	size_t len;
+} tnpam_resp_entry_t;
+
+/**
+ * @brief Bytes of a str or bytes-like secret (see tnpam_secret_view())
+ */
+typedef struct {
+	Py_buffer buf;		/* buf.obj is NULL unless a buffer was acquired */
+	PyObject *tmp;		/* UTF-8 encoding of a non-ASCII str */
+	const char *data;	/* not NUL terminated */
+	Py_ssize_t len;
+} tnpam_secret_view_t;
+
+/**
+ * @brief Native conversation responder built from conversation_responses
+ *
+ * Allows truenas_pam_conv to answer a conversation without taking the GIL.
+ * Immutable after creation, so it may be read without any lock.
+ */
+typedef struct {
+	tnpam_resp_entry_t styles[TNPAM_MSG_STYLE_MAX + 1];	/* indexed by msg_style */
+} tnpam_responder_t;
+
+/**
+ * @brief Identity of a context or batch in the credential cache
+ *
+ * Set up by tnpam_authcache_scope_init() for contexts created with
+ * auth_cache=True. enabled is false for every other context.
+ */
+typedef struct {
+	boolean_t enabled;
+	uint64_t service_h;	/* keyed hash of the service name */
+	uint64_t scope_h;	/* keyed hash of service and confdir */
+} tnpam_authcache_scope_t;
+
+/**
+ * @brief Credential cache key of one authentication attempt
+ */
+typedef struct {
+	uint64_t service_h;
+	uint64_t user_h;
+	uint64_t tag[2];	/* keyed hash of everything the stack sees */
+} tnpam_authcache_key_t;
+
+/**
+ * @brief Copy of a message answered natively that is not yet in the history
+ */
+typedef struct tnpam_msg_entry {
+	struct tnpam_msg_entry *next;
+	int msg_style;
+	char *msg;
+} tnpam_msg_entry_t;
+
+/**
+ * @brief Bounded history of conversations (tuples of struct_pam_message)
+ *
+ * Fixed-size ring of strong references. Once capacity entries are stored
+ * the oldest is released for each new conversation. Only accessed with
+ * the GIL held.
+ */
+typedef struct {
+	PyObject **items;
+	Py_ssize_t capacity;	/* 0 disables history */
+	Py_ssize_t start;	/* index of oldest entry */
+	Py_ssize_t len;
+} tnpam_history_t;
+
+#define TNPAM_MESSAGE_HISTORY_DEFAULT 64
+
 /**
  * @brief Library appdata type to pass as part of struct pam_conv
  *
@@ -70,16 +411,70 @@ typedef struct {
  * PAM modules. It provides a pointer to a python callable provided by
  * library user and private data also provided by the library user.
  * Messages received from the server (which are not sensitive) are stored
- * as a list here.
+ * in a bounded ring here.
  *
  * @note This is not a python structure
  */
 typedef struct {
+	// callback_fn / private_data and messages are protected by a critical
+	// section on the owning context.
 	PyObject *callback_fn;
 	PyObject *private_data;
-	PyObject *messages;
+	tnpam_history_t messages;
+	tnpam_responder_t *responder;
+	// Messages answered by the responder are queued here without the GIL
+	// and moved to the messages list the next time it is accessed.
+	pthread_mutex_t pending_lock;
+	tnpam_msg_entry_t *pending_head;
+	tnpam_msg_entry_t **pending_tail;
 } tnpam_conv_t;
 
+/**
+ * @brief States of a resumable (auth_begin / auth_resume) PAM operation
+ */
+typedef enum {
+	TNPAM_RESUME_IDLE = 0,	/* no resumable operation in progress */
+	TNPAM_RESUME_RUNNING,	/* worker thread is inside the PAM call */
+	TNPAM_RESUME_PENDING,	/* worker is parked in conversation awaiting responses */
+	TNPAM_RESUME_DONE,	/* PAM call returned, result not yet collected */
+} tnpam_resume_state_t;
+
+/**
+ * @brief Rendezvous between a resumable PAM operation and its caller
+ *
+ * The PAM call runs on a dedicated native thread that never takes the GIL.
+ * When a PAM module starts a conversation the thread publishes the messages
+ * here and waits on the condition variable until responses are handed over
+ * by auth_resume() or the operation is aborted.
+ *
+ * @note msg is only valid while state is TNPAM_RESUME_PENDING and must only
+ * be read while holding lock.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;	/* CLOCK_MONOTONIC */
+	pthread_t thread;
+	tnpam_resume_state_t state;
+	tnpam_op_t op;
+	int flags;
+	uint64_t deadline_ns;	/* of the whole operation, 0 for none */
+	int num_msg;
+	const struct pam_message **msg;
+	struct pam_response *resp;
+	boolean_t aborted;	/* conversation should fail with PAM_CONV_ERR */
+	boolean_t expired;	/* caller gave up waiting */
+	pamcode_t result;
+} tnpam_resume_t;
+
+/**
+ * @brief Session registry membership of a context
+ */
+typedef enum {
+	TNPAM_SESSION_UNLISTED = 0,	/* no open session */
+	TNPAM_SESSION_LISTED,	/* session open, linked into the registry */
+	TNPAM_SESSION_CLAIMED,	/* being torn down by close_all_sessions() */
+} tnpam_session_reg_t;
+
 /**
  * @brief Primary python type that wraps around a PAM application (client) handle
  *
@@ -88,17 +483,28 @@ typedef struct {
  * and then use it to authenticate, open a session, close session, and maybe change
  * password.
  */
-typedef struct {
+/* passwd entry of a user, see py_passwd.c */
+typedef struct tnpam_passwd tnpam_passwd_t;
+/* PamProcessPool and its worker processes, see py_procpool.c */
+typedef struct tnpam_proc_pool tnpam_proc_pool_t;
+typedef struct tnpam_proc_worker tnpam_proc_worker_t;
+
+typedef struct tnpam_ctx {
 	PyObject_HEAD
 	// PAM handles are not thread-safe and so we need to hold mutex
 	// while doing ops using them.
 	//
 	// WARNING: it's possible that the PAM module itself is not thread-safe
-	// in which case the library consumer will need to use a global lock for
-	// all PAM contexts.
+	// in which case contexts using it should share a lock domain (see
+	// lock_domain below and set_lock_policy()).
 	//
 	// Generally, it's a good idea to avoid putting such modules in the PAM config.
+	//
+	// The lock is held for the whole PAM call including python conversation
+	// callbacks and is recursive so that callbacks may use the context.
 	pthread_mutex_t pam_hdl_lock;
+	// Taken before pam_hdl_lock. NULL for LockPolicy.HANDLE.
+	tnpam_lock_domain_t *lock_domain;
 	// Store thread state in handle since we have conversation callbacks where
 	// we need to reacquire the GIL
 	PyThreadState *_save;
@@ -106,31 +512,144 @@ typedef struct {
 	tnpam_conv_t conv_data;
 	struct pam_conv conv;
 	PyObject *user;
+	// Only written by tnpam_op_call() under pam_hdl_lock
 	boolean_t authenticated;
 	boolean_t session_opened;
 	pamcode_t last_pam_result;
+	tnpam_resume_t resume;
+	// PamContextPool the handle came from (if any) and whether it may be
+	// returned to it. Set under the handle lock by tnpam_op_call().
+	PyObject *pool;
+	boolean_t pool_unsafe;
+	// Latency histograms of this context. Updated without the GIL.
+	tnpam_stats_t stats;
+	// PAM_FAIL_DELAY callback is registered instead of letting libpam
+	// sleep. fail_delay_usec is written by the callback during the PAM call.
+	boolean_t defer_fail_delay;
+	_Atomic uint32_t fail_delay_usec;
+	// Membership of the session registry of the interpreter. Protected by
+	// registry->lock, as is session_opened once the context is set up.
+	tnpam_session_registry_t *registry;
+	struct tnpam_ctx *session_prev;
+	struct tnpam_ctx *session_next;
+	tnpam_session_reg_t session_reg;
+	// Estimated heap usage of the PAM handle and module data, measured
+	// on the first start of the service and confdir (see py_memory.c).
+	size_t hdl_bytes;
+	// Set by get_context(auth_cache=True), immutable afterwards
+	tnpam_authcache_scope_t auth_cache;
+	// Cached passwd entry of PAM_USER. Protected by pam_hdl_lock.
+	tnpam_passwd_t *passwd;
+	// Default time limit of operations (0 for none) from
+	// get_context(timeout=). Immutable after setup.
+	uint64_t op_timeout_ns;
+	// Deadline (tnpam_now_ns()) of the PAM call in progress or 0, and
+	// whether the conversation was failed because it passed. Only written
+	// by tnpam_op_call() and the conversation under pam_hdl_lock.
+	uint64_t deadline_ns;
+	boolean_t deadline_hit;
+	// PamProcessPool running the PAM calls (hdl then only holds items,
+	// environment and PAM_CONV), the worker of the context and its id
+	// there. proc is cleared under the handle lock when the worker side is
+	// ended.
+	tnpam_proc_pool_t *proc_pool;
+	tnpam_proc_worker_t *proc;
+	uint32_t proc_id;
 } tnpam_ctx_t;
 
 /**
- * @brief External Python type object declarations
+ * @brief Pool of warmed PAM handles for one service / confdir
+ *
+ * Handles are started once and then reused by PamContext objects created
+ * through the pool so that the PAM configuration is not re-parsed and the
+ * module stack is not reloaded for every transaction. Idle handles have all
+ * application-visible state (items, environment, conversation) reset. Only
+ * accessed with the GIL held.
  */
-extern PyTypeObject PyPamCtx_Type;
+typedef struct {
+	PyObject_HEAD
+	char *service;
+	char *confdir;
+	Py_ssize_t maxsize;	/* maximum number of idle handles kept */
+	Py_ssize_t nidle;
+	pam_handle_t **idle;
+	uint64_t started;	/* handles created with pam_start_confdir() */
+	uint64_t reused;	/* contexts served from an idle handle */
+	size_t hdl_bytes;	/* last estimated heap usage of a handle */
+} tnpam_pool_t;
 
+/**
+ * @brief PAM environment variables to apply without the GIL
+ *
+ * Built by tnpam_env_prepare(). names and values are borrowed from the str
+ * objects in items. A NULL value removes the variable.
+ */
+typedef struct {
+	PyObject *items;	/* list of (name, value) from the mapping */
+	Py_ssize_t count;
+	const char **names;
+	const char **values;
+} tnpam_env_t;
+
+/**
+ * @brief Parsed get_context() arguments
+ */
+typedef struct {
+	const char *service;
+	const char *user;
+	const char *cdir;
+	PyObject *conv_fn;
+	PyObject *conv_responses;
+	PyObject *private_data;
+	const char *ruser;
+	const char *rhost;
+	uint32_t fail_delay;
+	Py_ssize_t history_size;
+	tnpam_pool_t *pool;	/* take handle from this pool if possible */
+	PyObject *lock_policy;	/* LockPolicy or NULL for the service default */
+	const char *lock_group;
+	boolean_t defer_fail_delay;	/* register PAM_FAIL_DELAY callback */
+	PyObject *pam_env;	/* mapping of initial PAM environment or NULL */
+	boolean_t auth_cache;	/* use the credential cache */
+	PyObject *timeout;	/* default operation time limit or NULL */
+	tnpam_proc_pool_t *proc_pool;	/* run PAM calls in this pool */
+} tnpam_cfg_t;
 
 /**
  * function definitions
  */
 /* provided by truenas_pypam.c */
+extern PyModuleDef truenas_pypam_module;
 
 /**
- * @brief get a borrowed reference to the current module state
+ * @brief get a borrowed reference to the state of the module
  */
 extern tnpam_state_t *py_get_pam_state(PyObject *module_in);
 
+/**
+ * @brief get the module state from (a subclass of) one of the module types
+ *
+ * Types are heap types created per module instance (and so per interpreter),
+ * which lets this work in subinterpreters unlike PyState_FindModule().
+ */
+extern tnpam_state_t *py_get_pam_state_from_type(PyTypeObject *type);
+#define tnpam_ctx_state(ctx) py_get_pam_state_from_type(Py_TYPE(ctx))
+
+/* provided by py_args.c */
+/**
+ * @brief PyArg_ParseTupleAndKeywords() for METH_FASTCALL | METH_KEYWORDS
+ *
+ * Supports the format units s, z, O, p, n, I, | and $. See py_args.c.
+ */
+extern bool tnpam_parse_args(PyObject *const *args, Py_ssize_t nargs,
+			     PyObject *kwnames, const char *format,
+			     char **kwlist, ...);
+
 /* provided by py_auth.c */
 PyDoc_STRVAR(py_tnpam_authenticate__doc__,
-"authenticate(*, silent=False, disallow_null_authtok=False) -> None\n"
-"------------------------------------------------------------------\n\n"
+"authenticate(*, silent=False, disallow_null_authtok=False, timeout=None)\n"
+"    -> None\n"
+"------------------------------------------------------------------------\n\n"
 "Authenticate the user using the configured PAM modules.\n\n"
 "This method wraps pam_authenticate(3) and performs user authentication\n"
 "according to the PAM service configuration. Multi-step authentication\n"
@@ -147,9 +666,18 @@ PyDoc_STRVAR(py_tnpam_authenticate__doc__,
 "disallow_null_authtok : bool, optional\n"
 "    Return PAM_AUTH_ERR if the user does not have a registered\n"
 "    authentication token (default=False). Maps to PAM_DISALLOW_NULL_AUTHTOK\n"
-"    flag. See pam_authenticate(3).\n\n"
+"    flag. See pam_authenticate(3).\n"
+"timeout : float, optional\n"
+"    Seconds the operation may take, including the time spent waiting for\n"
+"    the handle lock (default=None for the timeout of the context). Once\n"
+"    it has passed, further conversation requests of PAM modules fail with\n"
+"    PAM_CONV_ERR without calling the conversation_function. A call in\n"
+"    progress is not interrupted, so the deadline is only enforced at the\n"
+"    next conversation or once the PAM call returns.\n\n"
 "Raises\n"
 "------\n"
+"TimeoutError\n"
+"    The operation failed because its deadline passed.\n"
 "PAMError\n"
 "    Authentication failed. The error code attribute contains the PAM return\n"
 "    value from pam_authenticate(3):\n"
@@ -163,7 +691,134 @@ PyDoc_STRVAR(py_tnpam_authenticate__doc__,
 "      its limit of tries authenticating the user\n"
 "    * PAM_USER_UNKNOWN - User unknown to authentication service\n"
 );
-extern PyObject *py_tnpam_authenticate(tnpam_ctx_t *self, PyObject *args, PyObject *kwds);
+extern PyObject *py_tnpam_authenticate(tnpam_ctx_t *self, PyObject *const *args,
+				       Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_authenticate_async__doc__,
+"authenticate_async(*, silent=False, disallow_null_authtok=False,\n"
+"                   timeout=None) -> Future\n"
+"-----------------------------------------------------------------\n\n"
+"Awaitable variant of authenticate().\n\n"
+"Must be called from a coroutine running in an asyncio event loop. The\n"
+"pam_authenticate(3) call is performed on a native worker thread owned by\n"
+"this module and the returned future is completed on the calling event\n"
+"loop. Parameters, audit events and exceptions are identical to\n"
+"authenticate().\n\n"
+"The conversation_function is called from the worker thread and must not\n"
+"block on the event loop it was started from.\n\n"
+"If the context was created with defer_fail_delay=True, a failure is\n"
+"delivered after last_fail_delay microseconds using an event loop timer\n"
+"instead of libpam sleeping in the worker thread.\n\n"
+"Cancelling the future does not interrupt the PAM call; the result is\n"
+"discarded when it completes. The timeout starts when the call is queued,\n"
+"so time spent waiting for a free worker counts against it.\n\n"
+"Raises\n"
+"------\n"
+"RuntimeError\n"
+"    If there is no running event loop\n"
+);
+extern PyObject *py_tnpam_authenticate_async(tnpam_ctx_t *self,
+					     PyObject *const *args,
+					     Py_ssize_t nargs,
+					     PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_auth_begin__doc__,
+"auth_begin(*, silent=False, disallow_null_authtok=False, timeout=None)\n"
+"    -> tuple[struct_pam_message, ...] | None\n"
+"----------------------------------------------------------------------\n\n"
+"Start a resumable pam_authenticate(3) call.\n\n"
+"Unlike authenticate(), the conversation_function is not used. The PAM call\n"
+"runs on a native thread and, when a PAM module starts a conversation,\n"
+"the thread is parked and the messages are returned to the caller. The\n"
+"responses are supplied through auth_resume(), which wakes the parked\n"
+"thread immediately. No python thread is occupied while the caller is\n"
+"gathering responses (for example from a remote client).\n\n"
+"The handle and the lock domain of the context stay locked while the thread\n"
+"is parked: PAM items and environment can't be used and other contexts of\n"
+"the domain wait until the operation completes.\n\n"
+"Messages are appended to the history returned by messages().\n\n"
+"Parameters\n"
+"----------\n"
+"silent : bool, optional\n"
+"    Same as for authenticate().\n"
+"disallow_null_authtok : bool, optional\n"
+"    Same as for authenticate().\n"
+"timeout : float, optional\n"
+"    Maximum number of seconds to wait for the next conversation or for the\n"
+"    PAM call to complete (default=None, wait indefinitely).\n\n"
+"If the context was created with a timeout, it bounds the whole operation:\n"
+"once it has passed, the parked thread fails the pending conversation with\n"
+"PAM_CONV_ERR by itself and the next auth_resume() raises TimeoutError\n"
+"without auth_abort() being needed.\n\n"
+"Returns\n"
+"-------\n"
+"tuple[struct_pam_message, ...]\n"
+"    Messages awaiting responses through auth_resume()\n"
+"None\n"
+"    Authentication succeeded without further conversation\n\n"
+"Raises\n"
+"------\n"
+"PAMError\n"
+"    Authentication failed. See authenticate() for error codes.\n"
+"TimeoutError\n"
+"    The timeout expired. The operation must be ended with auth_abort().\n"
+"RuntimeError\n"
+"    A resumable operation is already in progress on this context.\n"
+);
+extern PyObject *py_tnpam_auth_begin(tnpam_ctx_t *self, PyObject *const *args,
+				     Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_auth_resume__doc__,
+"auth_resume(*, responses, timeout=None)\n"
+"    -> tuple[struct_pam_message, ...] | None\n"
+"---------------------------------------\n\n"
+"Supply responses to the pending conversation and continue authentication.\n\n"
+"Parameters\n"
+"----------\n"
+"responses : iterable\n"
+"    One response (str, bytes-like object or None) per message returned\n"
+"    by the previous auth_begin() or auth_resume() call, in the same order.\n"
+"timeout : float, optional\n"
+"    See auth_begin().\n\n"
+"Returns\n"
+"-------\n"
+"Same as auth_begin().\n\n"
+"Raises\n"
+"------\n"
+"PAMError\n"
+"    Authentication failed. See authenticate() for error codes.\n"
+"TimeoutError\n"
+"    The timeout expired. The operation must be ended with auth_abort().\n"
+"ValueError\n"
+"    The number of responses does not match the number of messages. The\n"
+"    conversation remains pending.\n"
+"RuntimeError\n"
+"    No conversation is pending.\n"
+);
+extern PyObject *py_tnpam_auth_resume(tnpam_ctx_t *self, PyObject *const *args,
+				      Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_auth_abort__doc__,
+"auth_abort(*, timeout=None) -> None\n"
+"-----------------------------------\n\n"
+"Abort a resumable operation started by auth_begin().\n\n"
+"Any pending or future conversation fails with PAM_CONV_ERR and this\n"
+"method waits for the PAM call to return. It is a no-op if no resumable\n"
+"operation is in progress.\n\n"
+"Parameters\n"
+"----------\n"
+"timeout : float, optional\n"
+"    Maximum number of seconds to wait for the PAM call to return\n"
+"    (default=None, wait indefinitely).\n\n"
+"Raises\n"
+"------\n"
+"TimeoutError\n"
+"    If the PAM call did not return in time, for instance because a module\n"
+"    is blocked on a network service. The operation stays aborted and\n"
+"    auth_abort() must be called again once it has returned.\n"
+);
+extern PyObject *py_tnpam_auth_abort(tnpam_ctx_t *self, PyObject *const *args,
+				     Py_ssize_t nargs, PyObject *kwnames);
 
 /* provided by py_env.c */
 PyDoc_STRVAR(py_tnpam_getenv__doc__,
@@ -190,7 +845,8 @@ PyDoc_STRVAR(py_tnpam_getenv__doc__,
 "FileNotFoundError\n"
 "    If the environment variable is not set\n"
 );
-extern PyObject *py_tnpam_getenv(tnpam_ctx_t *self, PyObject *args, PyObject *kwds);
+extern PyObject *py_tnpam_getenv(tnpam_ctx_t *self, PyObject *const *args,
+				 Py_ssize_t nargs, PyObject *kwnames);
 
 PyDoc_STRVAR(py_tnpam_setenv__doc__,
 "set_env(*, name, value=None, readonly=False) -> None\n"
@@ -219,7 +875,41 @@ PyDoc_STRVAR(py_tnpam_setenv__doc__,
 "ValueError\n"
 "    If name parameter is missing\n"
 );
-extern PyObject *py_tnpam_setenv(tnpam_ctx_t *self, PyObject *args, PyObject *kwds);
+extern PyObject *py_tnpam_setenv(tnpam_ctx_t *self, PyObject *const *args,
+				 Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_update_env__doc__,
+"update_env(env, *, readonly=False) -> None\n"
+"-------------------------------------------\n\n"
+"Set or remove several PAM environment variables at once.\n\n"
+"Equivalent to calling set_env() for each item of env, in iteration order,\n"
+"but the handle lock is only taken once and the GIL is released for the\n"
+"whole update.\n\n"
+"Parameters\n"
+"----------\n"
+"env : Mapping[str, str | None]\n"
+"    Variables to set. A value of None removes the variable.\n"
+"readonly : bool, optional\n"
+"    Set variables as read-only (default=False)\n\n"
+"Raises\n"
+"------\n"
+"PAMError\n"
+"    If setting or removing a variable fails. The message names the\n"
+"    variable; those before it in env remain applied. See set_env().\n"
+"TypeError\n"
+"    If env is not a mapping or a name or value has the wrong type\n"
+"ValueError\n"
+"    If a name is empty or contains '=' or a string contains a null\n"
+"    character. No variables are applied in this case.\n"
+);
+extern PyObject *py_tnpam_update_env(tnpam_ctx_t *self, PyObject *const *args,
+				     Py_ssize_t nargs, PyObject *kwnames);
+extern bool tnpam_env_prepare(PyObject *mapping, tnpam_env_t *env);
+extern void tnpam_env_release(tnpam_env_t *env);
+extern pamcode_t tnpam_env_apply(pam_handle_t *hdl, const tnpam_env_t *env,
+				 boolean_t ro, Py_ssize_t *failed);
+extern void tnpam_env_set_exc(tnpam_state_t *state, const tnpam_env_t *env,
+			      pamcode_t ret, Py_ssize_t failed);
 
 PyDoc_STRVAR(py_tnpam_envlist__doc__,
 "env_dict() -> dict[str, str]\n"
@@ -228,7 +918,8 @@ PyDoc_STRVAR(py_tnpam_envlist__doc__,
 "This method wraps pam_getenvlist(3) and returns a complete copy\n"
 "of the PAM environment. The PAM environment variables are stored\n"
 "in the PAM handle and managed separately from the system\n"
-"environment.\n\n"
+"environment. Use the env attribute to look up individual variables\n"
+"without copying the whole environment.\n\n"
 "WARNING: PAM environment variables should not be used to store\n"
 "sensitive information since some PAM applications may copy them\n"
 "to regular session environment variables.\n\n"
@@ -243,11 +934,14 @@ PyDoc_STRVAR(py_tnpam_envlist__doc__,
 "    If memory allocation fails\n"
 );
 extern PyObject *py_tnpam_envlist(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored));
+extern bool init_env_type(PyObject *module_ref);
+extern PyObject *tnpam_env_view_new(tnpam_ctx_t *ctx);
 
 /* provided by py_acct_mgmt.c */
 PyDoc_STRVAR(py_tnpam_acct_mgmt__doc__,
-"acct_mgmt(*, silent=False, disallow_null_authtok=False) -> None\n"
-"----------------------------------------------------------------\n\n"
+"acct_mgmt(*, silent=False, disallow_null_authtok=False, timeout=None)\n"
+"    -> None\n"
+"---------------------------------------------------------------------\n\n"
 "Verify that the authenticated user account is valid and active.\n\n"
 "This method wraps pam_acct_mgmt(3) and performs account validation\n"
 "checks. It verifies that the user account is valid and active according\n"
@@ -266,9 +960,13 @@ PyDoc_STRVAR(py_tnpam_acct_mgmt__doc__,
 "disallow_null_authtok : bool, optional\n"
 "    Return PAM_NEW_AUTHTOK_REQD if the user does not have a registered\n"
 "    authentication token (default=False). Maps to PAM_DISALLOW_NULL_AUTHTOK\n"
-"    flag. See pam_acct_mgmt(3).\n\n"
+"    flag. See pam_acct_mgmt(3).\n"
+"timeout : float, optional\n"
+"    Same as for authenticate().\n\n"
 "Raises\n"
 "------\n"
+"TimeoutError\n"
+"    The deadline of the operation passed. See authenticate().\n"
 "PAMError\n"
 "    Account validation failed. The error code attribute contains the PAM\n"
 "    return value from pam_acct_mgmt(3):\n"
@@ -286,12 +984,25 @@ PyDoc_STRVAR(py_tnpam_acct_mgmt__doc__,
 "----------\n"
 "pam_acct_mgmt(3) - PAM manual page for account management\n"
 );
-extern PyObject *py_tnpam_acct_mgmt(tnpam_ctx_t *self, PyObject *args, PyObject *kwds);
+extern PyObject *py_tnpam_acct_mgmt(tnpam_ctx_t *self, PyObject *const *args,
+				    Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_acct_mgmt_async__doc__,
+"acct_mgmt_async(*, silent=False, disallow_null_authtok=False,\n"
+"                timeout=None) -> Future\n"
+"--------------------------------------------------------------\n\n"
+"Awaitable variant of acct_mgmt(). See authenticate_async() for details\n"
+"on how the call is executed.\n"
+);
+extern PyObject *py_tnpam_acct_mgmt_async(tnpam_ctx_t *self,
+					  PyObject *const *args,
+					  Py_ssize_t nargs, PyObject *kwnames);
 
 /* provided by py_chauthtok.c */
 PyDoc_STRVAR(py_tnpam_chauthtok__doc__,
-"chauthtok(*, silent=False, change_expired_authtok=False) -> None\n"
-"-----------------------------------------------------------------\n\n"
+"chauthtok(*, silent=False, change_expired_authtok=False, timeout=None)\n"
+"    -> None\n"
+"----------------------------------------------------------------------\n\n"
 "Update the authentication token (password) for the user.\n\n"
 "This method wraps pam_chauthtok(3) and is used to change the user's\n"
 "authentication token (typically a password). The PAM framework will\n"
@@ -310,9 +1021,13 @@ PyDoc_STRVAR(py_tnpam_chauthtok__doc__,
 "    Only change the password if it has expired (default=False).\n"
 "    If set, the password will only be changed if the account management\n"
 "    module returned PAM_NEW_AUTHTOK_REQD during pam_acct_mgmt().\n"
-"    Maps to PAM_CHANGE_EXPIRED_AUTHTOK flag.\n\n"
+"    Maps to PAM_CHANGE_EXPIRED_AUTHTOK flag.\n"
+"timeout : float, optional\n"
+"    Same as for authenticate().\n\n"
 "Raises\n"
 "------\n"
+"TimeoutError\n"
+"    The deadline of the operation passed. See authenticate().\n"
 "PAMError\n"
 "    Password change failed. Common error codes:\n"
 "    \n"
@@ -333,19 +1048,33 @@ PyDoc_STRVAR(py_tnpam_chauthtok__doc__,
 "----------\n"
 "pam_chauthtok(3) - PAM manual page for password management\n"
 );
-extern PyObject *py_tnpam_chauthtok(tnpam_ctx_t *self, PyObject *args, PyObject *kwds);
+extern PyObject *py_tnpam_chauthtok(tnpam_ctx_t *self, PyObject *const *args,
+				    Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_chauthtok_async__doc__,
+"chauthtok_async(*, silent=False, change_expired_authtok=False,\n"
+"                timeout=None) -> Future\n"
+"--------------------------------------------------------------\n\n"
+"Awaitable variant of chauthtok(). See authenticate_async() for details\n"
+"on how the call is executed.\n"
+);
+extern PyObject *py_tnpam_chauthtok_async(tnpam_ctx_t *self,
+					  PyObject *const *args,
+					  Py_ssize_t nargs, PyObject *kwnames);
 
 /* provided by py_session.c */
 PyDoc_STRVAR(py_tnpam_open_session__doc__,
-"open_session(*, silent=False) -> None\n\n"
+"open_session(*, silent=False, timeout=None) -> None\n\n"
 "Open a PAM session for the authenticated user.\n\n"
 "This method wraps pam_open_session(3) and should be called after\n"
 "successful authentication. It notifies all loaded modules that a\n"
 "new session has been initiated.\n\n"
 "Args:\n"
 "  silent (bool, optional): If True, suppress informational messages.\n"
-"    Maps to PAM_SILENT flag. See pam_open_session(3).\n\n"
+"    Maps to PAM_SILENT flag. See pam_open_session(3).\n"
+"  timeout (float, optional): Same as for authenticate().\n\n"
 "Raises:\n"
+"  TimeoutError: If the deadline of the operation passed.\n"
 "  PAMError: If session opening fails. The exception's code attribute\n"
 "    will contain the specific PAMCode enum member indicating the error\n"
 "    type from pam_open_session(3).\n\n"
@@ -355,18 +1084,31 @@ PyDoc_STRVAR(py_tnpam_open_session__doc__,
 "References:\n"
 "  pam_open_session(3) - PAM manual page for session management"
 );
-extern PyObject *py_tnpam_open_session(tnpam_ctx_t *self, PyObject *args, PyObject *kwds);
+extern PyObject *py_tnpam_open_session(tnpam_ctx_t *self, PyObject *const *args,
+				       Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_open_session_async__doc__,
+"open_session_async(*, silent=False, timeout=None) -> Future\n\n"
+"Awaitable variant of open_session(). See authenticate_async() for\n"
+"details on how the call is executed."
+);
+extern PyObject *py_tnpam_open_session_async(tnpam_ctx_t *self,
+					     PyObject *const *args,
+					     Py_ssize_t nargs,
+					     PyObject *kwnames);
 
 PyDoc_STRVAR(py_tnpam_close_session__doc__,
-"close_session(*, silent=False) -> None\n\n"
+"close_session(*, silent=False, timeout=None) -> None\n\n"
 "Close a PAM session for the authenticated user.\n\n"
 "This method wraps pam_close_session(3) and should be called to\n"
 "properly terminate a session that was opened with open_session().\n"
 "It notifies all loaded modules that the session is being terminated.\n\n"
 "Args:\n"
 "  silent (bool, optional): If True, suppress informational messages.\n"
-"    Maps to PAM_SILENT flag. See pam_close_session(3).\n\n"
+"    Maps to PAM_SILENT flag. See pam_close_session(3).\n"
+"  timeout (float, optional): Same as for authenticate().\n\n"
 "Raises:\n"
+"  TimeoutError: If the deadline of the operation passed.\n"
 "  PAMError: If session closing fails. The exception's code attribute\n"
 "    will contain the specific PAMCode enum member indicating the error\n"
 "    type from pam_close_session(3).\n\n"
@@ -376,31 +1118,738 @@ PyDoc_STRVAR(py_tnpam_close_session__doc__,
 "References:\n"
 "  pam_close_session(3) - PAM manual page for session management"
 );
-extern PyObject *py_tnpam_close_session(tnpam_ctx_t *self, PyObject *args, PyObject *kwds);
+extern PyObject *py_tnpam_close_session(tnpam_ctx_t *self,
+					PyObject *const *args, Py_ssize_t nargs,
+					PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_close_session_async__doc__,
+"close_session_async(*, silent=False, timeout=None) -> Future\n\n"
+"Awaitable variant of close_session(). See authenticate_async() for\n"
+"details on how the call is executed."
+);
+extern PyObject *py_tnpam_close_session_async(tnpam_ctx_t *self,
+					      PyObject *const *args,
+					      Py_ssize_t nargs,
+					      PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_close_all_sessions__doc__,
+"close_all_sessions(*, concurrency=8, deadline=None) -> tuple\n"
+"-------------------------------------------------------------\n\n"
+"Close every open PAM session of this interpreter in parallel.\n\n"
+"Every PamContext with a session opened by open_session() or login() and\n"
+"not yet closed is torn down on one of up to concurrency native threads:\n"
+"pam_close_session(3) is called with PAM_SILENT and the handle is then\n"
+"released with pam_end(3). The GIL is released while this happens and no\n"
+"python code runs; conversation requests from session modules fail with\n"
+"PAM_CONV_ERR. A truenas_pypam.close_session audit event is raised for\n"
+"every session before teardown starts.\n\n"
+"Afterwards the contexts remain valid python objects but PAM operations\n"
+"on them raise ValueError. This is intended for process shutdown or\n"
+"failover.\n\n"
+"Parameters\n"
+"----------\n"
+"concurrency : int, optional\n"
+"    Maximum number of threads used, including the calling thread\n"
+"    (default=8).\n"
+"deadline : float, optional\n"
+"    Seconds after which no further sessions are started. Sessions not\n"
+"    started by then, for instance because another thread holds the handle\n"
+"    lock, are left open. A PAM call that is already in progress is not\n"
+"    interrupted (default=None for no limit).\n\n"
+"Returns\n"
+"-------\n"
+"tuple[tuple[str, PAMCode | None]]\n"
+"    (user, result of pam_close_session()) for every session, with None\n"
+"    as the result for sessions skipped because of the deadline or because\n"
+"    an auth_begin() operation is in progress on the context. Skipped\n"
+"    sessions stay open.\n\n"
+"Raises\n"
+"------\n"
+"ValueError\n"
+"    If concurrency is less than 1 or deadline is negative\n"
+);
+extern PyObject *py_tnpam_close_all_sessions(PyObject *self,
+					     PyObject *const *args,
+					     Py_ssize_t nargs,
+					     PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_open_session_count__doc__,
+"open_session_count() -> int\n"
+"---------------------------\n\n"
+"Number of PamContext objects of this interpreter with an open session,\n"
+"i.e. the sessions close_all_sessions() would close.\n"
+);
+extern PyObject *py_tnpam_open_session_count(PyObject *self,
+					     PyObject *Py_UNUSED(ignored));
+extern bool init_session_registry(PyObject *module_ref);
+extern void tnpam_session_registry_destroy(tnpam_session_registry_t *registry);
+extern void tnpam_session_set_opened(tnpam_ctx_t *ctx, boolean_t opened);
+extern void tnpam_session_forget(tnpam_ctx_t *ctx);
+
+/* provided by py_login.c */
+PyDoc_STRVAR(py_tnpam_login__doc__,
+"login(*, steps=None, silent=False, disallow_null_authtok=False,\n"
+"      timeout=None) -> LoginResult\n"
+"--------------------------------------------------------------\n\n"
+"Run the steps of a login in one call.\n\n"
+"The steps are performed in order with the handle lock taken once and the\n"
+"GIL released for the whole sequence, stopping at the first failure. Each\n"
+"step behaves like the method of the same name: the same audit events are\n"
+"raised (all of them before the first step runs) and the authenticated\n"
+"and session state of the context is updated the same way.\n\n"
+"Parameters\n"
+"----------\n"
+"steps : Sequence[str], optional\n"
+"    Steps to run, each at most once, from 'authenticate', 'acct_mgmt',\n"
+"    'setcred' (with CredOp.PAM_ESTABLISH_CRED) and 'open_session'.\n"
+"    Default is all four in that order.\n"
+"silent : bool, optional\n"
+"    Pass PAM_SILENT to every step (default=False)\n"
+"disallow_null_authtok : bool, optional\n"
+"    Pass PAM_DISALLOW_NULL_AUTHTOK to authenticate and acct_mgmt\n"
+"    (default=False)\n"
+"timeout : float, optional\n"
+"    Seconds all steps together may take (default=None for the timeout of\n"
+"    the context). See authenticate().\n\n"
+"Returns\n"
+"-------\n"
+"LoginResult\n"
+"    Named tuple (code, step, completed). code is the PAMCode of the step\n"
+"    that failed (or PAM_SUCCESS), step its name (or None) and completed\n"
+"    the names of the steps that succeeded.\n\n"
+"Raises\n"
+"------\n"
+"TypeError, ValueError\n"
+"    If steps is invalid, or open_session is requested without\n"
+"    authentication or with a session already open\n"
+"RuntimeError\n"
+"    If a resumable operation is in progress on this context\n"
+"TimeoutError\n"
+"    If a step failed because the deadline passed\n"
+"Exception\n"
+"    Exceptions raised by the conversation function are propagated\n"
+"    instead of returning a result.\n"
+);
+extern PyObject *py_tnpam_login(tnpam_ctx_t *self, PyObject *const *args,
+				Py_ssize_t nargs, PyObject *kwnames);
+extern bool init_login_result_type(PyObject *module_ref);
 
 /* provided by py_conv.c */
 extern int truenas_pam_conv(int num_msg, const struct pam_message **msg,
 			    struct pam_response **resp, void *appdata_ptr);
+extern PyObject *py_pam_messages_parse(tnpam_state_t *state, int num_msg,
+					const struct pam_message **msg);
+extern bool parse_py_pam_resp(int num_msg, struct pam_response **resp, PyObject *pyresp);
+extern void free_pam_resp(int num_msg, struct pam_response *reply_array);
 extern bool init_pam_conv_struct(PyObject *module_ref);
+extern const tnpam_enum_spec_t tnpam_msg_style_enum_spec;
+
+/* provided by py_message.c */
+extern PyObject *tnpam_msg_new(tnpam_state_t *state, const struct pam_message *msg);
+extern bool init_message_type(PyObject *module_ref);
+
+/* provided by py_responder.c */
+#define TNPAM_CONV_FALLBACK -1
+extern tnpam_responder_t *tnpam_responder_new(PyObject *mapping);
+extern void tnpam_responder_free(tnpam_responder_t *responder);
+extern int tnpam_responder_conv(tnpam_ctx_t *ctx, int num_msg,
+				const struct pam_message **msg,
+				struct pam_response **resp);
+extern bool tnpam_conv_flush_pending(tnpam_ctx_t *ctx);
+extern void tnpam_conv_clear_pending(tnpam_ctx_t *ctx);
+
+/* provided by py_pool.c */
+extern const struct pam_conv tnpam_idle_conv;
+extern bool init_pool_type(PyObject *module_ref);
+extern pam_handle_t *tnpam_pool_take(tnpam_pool_t *pool, size_t *hdl_bytes);
+extern bool tnpam_pool_put(tnpam_pool_t *pool, pam_handle_t *hdl,
+			   size_t hdl_bytes);
+
+/* provided by py_procpool.c */
+extern bool init_proc_pool_type(PyObject *module_ref);
+extern pamcode_t tnpam_proc_attach(tnpam_ctx_t *ctx, const tnpam_cfg_t *cfg);
+extern void tnpam_proc_detach(tnpam_ctx_t *ctx, pamcode_t code);
+extern pamcode_t tnpam_proc_op(tnpam_ctx_t *ctx, tnpam_op_t op, int flags);
+
+/* provided by py_history.c */
+extern bool init_history_type(PyObject *module_ref);
+extern int tnpam_history_init(tnpam_history_t *hist, Py_ssize_t capacity);
+extern void tnpam_history_clear(tnpam_history_t *hist);
+extern void tnpam_history_append(tnpam_ctx_t *ctx, PyObject *item);
+extern PyObject *tnpam_history_tuple(tnpam_ctx_t *ctx);
+extern PyObject *tnpam_history_view_new(tnpam_ctx_t *ctx);
+
+/* provided by py_lock.c */
+PyDoc_STRVAR(py_tnpam_set_lock_policy__doc__,
+"set_lock_policy(lock_policy, *, service_name=None, lock_group=None) -> None\n"
+"--------------------------------------------------------------------------\n\n"
+"Set the default lock policy of contexts created for a PAM service.\n\n"
+"PAM handles are always serialized individually. Some PAM modules are not\n"
+"thread-safe however, and contexts whose stacks contain them must not run\n"
+"PAM calls concurrently. A lock policy places contexts in a shared lock\n"
+"domain which is held (without the GIL) for the duration of every PAM call\n"
+"on them, including python conversation callbacks. Contexts of other\n"
+"domains and of LockPolicy.HANDLE are unaffected and run in parallel.\n\n"
+"The default applies to get_context(), PamContextPool.get_context() and\n"
+"authenticate_many() when no lock_policy is passed explicitly, and only to\n"
+"contexts created after this call. The setting is process-wide and is\n"
+"shared by all interpreters.\n\n"
+"Parameters\n"
+"----------\n"
+"lock_policy : LockPolicy or None\n"
+"    LockPolicy.HANDLE: only serialize use of each handle (default)\n"
+"    LockPolicy.SERVICE: serialize all contexts of the PAM service name\n"
+"    LockPolicy.GROUP: serialize all contexts of the named lock_group\n"
+"    LockPolicy.GLOBAL: serialize all contexts using a global lock\n"
+"    None removes the setting for service_name, or if service_name is None\n"
+"    restores LockPolicy.HANDLE as the default of all services.\n"
+"service_name : str, optional\n"
+"    PAM service the policy applies to. If None the policy is the default\n"
+"    for services without a policy of their own (default=None).\n"
+"lock_group : str, optional\n"
+"    Name of the lock domain. Required for, and only valid with,\n"
+"    LockPolicy.GROUP (default=None).\n\n"
+"Raises\n"
+"------\n"
+"TypeError\n"
+"    If lock_policy is not a LockPolicy or None\n"
+"ValueError\n"
+"    If lock_group is missing for LockPolicy.GROUP or given for another\n"
+"    policy\n"
+);
+extern PyObject *py_tnpam_set_lock_policy(PyObject *self, PyObject *const *args,
+					  Py_ssize_t nargs, PyObject *kwnames);
+extern int tnpam_lock_resolve(tnpam_state_t *state, const char *service,
+			      PyObject *policy, const char *group,
+			      tnpam_lock_domain_t **out);
+extern PyObject *tnpam_lock_policy_member(tnpam_state_t *state,
+					  tnpam_lock_domain_t *dom);
+extern const tnpam_enum_spec_t tnpam_lock_policy_enum_spec;
+
+/* provided by py_ratelimit.c */
+PyDoc_STRVAR(py_tnpam_set_auth_rate_limit__doc__,
+"set_auth_rate_limit(*, rhost_rate=0.0, rhost_burst=0, user_rate=0.0,\n"
+"                    user_burst=0) -> None\n"
+"--------------------------------------------------------------------\n\n"
+"Limit the rate of authentication attempts per remote host and per user.\n\n"
+"Each attempt takes a token from a bucket for its PAM_RHOST and one for\n"
+"its PAM_USER. Buckets hold up to burst tokens and refill at rate tokens\n"
+"per second. Once a bucket is empty, attempts for its key fail with\n"
+"AuthRateLimited without calling pam_authenticate(3), so that an attacker\n"
+"can't tie up slow authentication backends. Every attempt counts whether\n"
+"or not it succeeds. Attempts without a remote host, or without a user\n"
+"before the conversation, are not limited by that key. Attempts answered\n"
+"by the credential cache (see set_auth_cache()) take no token.\n\n"
+"The limits apply to authenticate(), authenticate_async(), auth_begin(),\n"
+"login() and authenticate_many(), where a refused credential has the\n"
+"result PAMCode.PAM_MAXTRIES. They are process-wide and shared by all\n"
+"interpreters. Calling this function replaces the previous limits and\n"
+"refills all buckets.\n\n"
+"Parameters\n"
+"----------\n"
+"rhost_rate : float, optional\n"
+"    Attempts per second allowed per remote host, or 0 for no limit\n"
+"    (default=0.0).\n"
+"rhost_burst : int, optional\n"
+"    Attempts a remote host may make at once. Required with rhost_rate\n"
+"    (default=0).\n"
+"user_rate : float, optional\n"
+"    Attempts per second allowed per user, or 0 for no limit\n"
+"    (default=0.0).\n"
+"user_burst : int, optional\n"
+"    Attempts that may be made for a user at once. Required with\n"
+"    user_rate (default=0).\n\n"
+"Raises\n"
+"------\n"
+"ValueError\n"
+"    If a rate is negative or not finite, or a burst is less than 1 for a\n"
+"    non-zero rate\n"
+);
+extern PyObject *py_tnpam_set_auth_rate_limit(PyObject *self,
+					      PyObject *const *args,
+					      Py_ssize_t nargs,
+					      PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_get_auth_rate_limit__doc__,
+"get_auth_rate_limit() -> dict\n"
+"-----------------------------\n\n"
+"Return the limits set with set_auth_rate_limit().\n\n"
+"Returns\n"
+"-------\n"
+"dict\n"
+"    Maps 'rhost' and 'user' to a dict with the keys rate, burst, and\n"
+"    rejected, the number of attempts refused for that key since the\n"
+"    process started.\n"
+);
+extern PyObject *py_tnpam_get_auth_rate_limit(PyObject *self,
+					      PyObject *Py_UNUSED(ignored));
+extern bool tnpam_ratelimit_admit(const char *rhost, const char *user);
+
+/* provided by py_authcache.c */
+PyDoc_STRVAR(py_tnpam_set_auth_cache__doc__,
+"set_auth_cache(*, ttl=0.0, maxsize=1024) -> None\n"
+"------------------------------------------------\n\n"
+"Cache successful authentications for a short time.\n\n"
+"Contexts created with get_context(auth_cache=True) and\n"
+"authenticate_many(auth_cache=True) calls remember a successful\n"
+"pam_authenticate(3) for ttl seconds. Another attempt with the same\n"
+"service, confdir, user, ruser, rhost and conversation responses within\n"
+"that time succeeds without calling into PAM. This is meant for API keys\n"
+"that clients present on every request. A cached attempt doesn't run the\n"
+"module stack, so it leaves no module state such as PAM_AUTHTOK behind\n"
+"and must not be used with stacks that expect one-time codes.\n\n"
+"The cache stores neither secrets nor names, only keyed hashes of them.\n"
+"Entries are never extended by a hit and are dropped by a successful\n"
+"chauthtok() of their user and by invalidate_auth_cache(). The cache is\n"
+"process-wide and shared by all interpreters. Calling this function\n"
+"empties the cache.\n\n"
+"Parameters\n"
+"----------\n"
+"ttl : float, optional\n"
+"    Seconds a successful authentication is remembered, or 0 to disable\n"
+"    the cache (default=0.0).\n"
+"maxsize : int, optional\n"
+"    Maximum number of remembered authentications. Once full, the entries\n"
+"    closest to expiry are replaced (default=1024).\n\n"
+"Raises\n"
+"------\n"
+"ValueError\n"
+"    If ttl is negative or not finite, or maxsize is less than 1\n"
+);
+extern PyObject *py_tnpam_set_auth_cache(PyObject *self, PyObject *const *args,
+					 Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_get_auth_cache__doc__,
+"get_auth_cache() -> dict\n"
+"------------------------\n\n"
+"Return the settings and state of the credential cache.\n\n"
+"Returns\n"
+"-------\n"
+"dict\n"
+"    ttl and maxsize as set with set_auth_cache() (maxsize is 0 while the\n"
+"    cache is disabled), entries, the number of unexpired entries, and\n"
+"    hits and misses, the number of lookups since the process started.\n"
+);
+extern PyObject *py_tnpam_get_auth_cache(PyObject *self,
+					 PyObject *Py_UNUSED(ignored));
+
+PyDoc_STRVAR(py_tnpam_invalidate_auth_cache__doc__,
+"invalidate_auth_cache(*, user=None, service_name=None) -> int\n"
+"-------------------------------------------------------------\n\n"
+"Drop cached authentications, e.g. after revoking an API key.\n\n"
+"Parameters\n"
+"----------\n"
+"user : str, optional\n"
+"    Only drop authentications of this user.\n"
+"service_name : str, optional\n"
+"    Only drop authentications for this PAM service.\n\n"
+"Returns\n"
+"-------\n"
+"int\n"
+"    Number of unexpired authentications dropped.\n"
+);
+extern PyObject *py_tnpam_invalidate_auth_cache(PyObject *self,
+						PyObject *const *args,
+						Py_ssize_t nargs,
+						PyObject *kwnames);
+extern void tnpam_authcache_scope_init(tnpam_authcache_scope_t *scope,
+				       const char *service,
+				       const char *confdir);
+extern bool tnpam_authcache_key(const tnpam_authcache_scope_t *scope,
+				const char *user, const char *ruser,
+				const char *rhost,
+				const tnpam_responder_t *responder,
+				int flags, tnpam_authcache_key_t *key);
+extern bool tnpam_authcache_lookup(const tnpam_authcache_key_t *key);
+extern void tnpam_authcache_store(const tnpam_authcache_key_t *key);
+extern size_t tnpam_authcache_invalidate(const char *user,
+					 const char *service);
+
+/* provided by py_events.c */
+PyDoc_STRVAR(py_tnpam_set_event_buffer__doc__,
+"set_event_buffer(*, size=0) -> None\n"
+"-----------------------------------\n\n"
+"Record PAM calls in a native buffer for drain_events().\n\n"
+"While enabled, every PAM call made by a PamContext (including\n"
+"authentications answered by the credential cache and attempts refused by\n"
+"set_auth_rate_limit(), reported as PAM_MAXTRIES) and every credential of\n"
+"authenticate_many() is recorded as an AuthEvent. Recording copies a few\n"
+"strings into a preallocated slot without the GIL and creates no python\n"
+"objects, so accounting can be moved off the request path. Audit events\n"
+"are raised as before.\n\n"
+"The buffer is process-wide and shared by all interpreters. Events that\n"
+"don't fit because the consumer fell behind are dropped and counted as\n"
+"lost by get_event_buffer(). Calling this function discards pending\n"
+"events.\n\n"
+"Parameters\n"
+"----------\n"
+"size : int, optional\n"
+"    Number of events the buffer holds, or 0 to disable it (default=0).\n\n"
+"Raises\n"
+"------\n"
+"ValueError\n"
+"    If size is negative or greater than 1048576\n"
+);
+extern PyObject *py_tnpam_set_event_buffer(PyObject *self,
+					   PyObject *const *args,
+					   Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_get_event_buffer__doc__,
+"get_event_buffer() -> dict\n"
+"--------------------------\n\n"
+"Return the state of the event buffer.\n\n"
+"Returns\n"
+"-------\n"
+"dict\n"
+"    size as set with set_event_buffer(), pending, the number of events\n"
+"    waiting for drain_events(), and recorded and lost, the number of\n"
+"    events stored and dropped since the process started.\n"
+);
+extern PyObject *py_tnpam_get_event_buffer(PyObject *self,
+					   PyObject *Py_UNUSED(ignored));
+
+PyDoc_STRVAR(py_tnpam_drain_events__doc__,
+"drain_events(*, max=None) -> tuple[AuthEvent, ...]\n"
+"---------------------------------------------------\n\n"
+"Remove and return the oldest pending events, oldest first.\n\n"
+"An AuthEvent has the fields timestamp (seconds since the epoch),\n"
+"operation (name of the PAM call, e.g. pam_authenticate), service_name,\n"
+"user, rhost (None if not set), code (PAMCode) and latency_ns (duration of\n"
+"the call). user, service_name and rhost are truncated to 255, 63 and 255\n"
+"bytes.\n\n"
+"Parameters\n"
+"----------\n"
+"max : int, optional\n"
+"    Return at most this many events (default=None for all pending).\n\n"
+"Raises\n"
+"------\n"
+"ValueError\n"
+"    If max is negative\n"
+);
+extern PyObject *py_tnpam_drain_events(PyObject *self, PyObject *const *args,
+				       Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_event_fd__doc__,
+"event_fd() -> int\n"
+"-----------------\n\n"
+"Return an eventfd(2) that is readable while events are pending.\n\n"
+"The descriptor is meant for select(), poll() or loop.add_reader(): once\n"
+"it is readable, call drain_events() until it returns an empty tuple. It\n"
+"must not be read from or closed by the caller. The same descriptor is\n"
+"returned by every call and stays open for the life of the process.\n\n"
+"Raises\n"
+"------\n"
+"OSError\n"
+"    If the eventfd can't be created\n"
+);
+extern PyObject *py_tnpam_event_fd(PyObject *self, PyObject *Py_UNUSED(ignored));
+extern bool tnpam_events_enabled(void);
+extern void tnpam_events_record(tnpam_op_t op, pamcode_t code,
+				const char *service, const char *user,
+				const char *rhost, uint64_t latency_ns);
+extern bool init_auth_event_type(PyObject *module_ref);
+
+/* provided by py_passwd.c */
+PyDoc_STRVAR(py_tnpam_ctx_passwd__doc__,
+"dict or None: passwd entry of the PAM user (PAM_USER).\n\n"
+"Keys are pw_name, pw_uid, pw_gid, pw_gecos, pw_dir and pw_shell as in\n"
+"pwd.struct_passwd, and grouplist, a tuple of the gids the user is a\n"
+"member of (see os.getgrouplist()). None if there is no such user.\n\n"
+"The entry is looked up with getpwnam_r(3) and getgrouplist(3) without\n"
+"holding the GIL after a successful acct_mgmt(), or on first access, and\n"
+"cached for the context until PAM_USER changes. This saves a second NSS\n"
+"lookup through a slow directory service.\n\n"
+"Raises\n"
+"------\n"
+"OSError\n"
+"    If the lookup fails other than by the user not existing.\n"
+);
+extern PyObject *py_tnpam_ctx_get_passwd(tnpam_ctx_t *self, void *closure);
+extern int tnpam_passwd_lookup(const char *user, tnpam_passwd_t **out);
+extern int tnpam_passwd_refresh(tnpam_ctx_t *ctx);
+extern void tnpam_passwd_release(tnpam_passwd_t *entry);
+
+/* provided by py_stats.c */
+PyDoc_STRVAR(py_tnpam_stats__doc__,
+"stats(*, reset=False) -> dict\n"
+"-----------------------------\n\n"
+"Return process-wide latency histograms of PAM calls made by the extension.\n\n"
+"Samples from every context, PamContextPool and authenticate_many() call\n"
+"in the process (including other interpreters) are aggregated. See\n"
+"PamContext.stats() for the per-context equivalent.\n\n"
+"The result maps a name to a dict with the keys count, total_ns, max_ns\n"
+"and buckets. buckets is a tuple of 40 sample counts where bucket i holds\n"
+"samples of at least 2**(i - 1) and less than 2**i nanoseconds (bucket 0\n"
+"holds zero-length samples and the last bucket everything longer).\n"
+"The names are:\n"
+"    pam_start, pam_authenticate, pam_acct_mgmt, pam_setcred,\n"
+"    pam_open_session, pam_close_session, pam_chauthtok: duration of the\n"
+"        PAM library call, including any conversation\n"
+"    lock_wait: time spent waiting for the handle lock (and the lock\n"
+"        domain, see set_lock_policy()) before using a handle\n"
+"    conversation: duration of calls to python conversation functions\n\n"
+"Parameters\n"
+"----------\n"
+"reset : bool, optional\n"
+"    Reset the counters to zero as they are read (default=False).\n\n"
+"Returns\n"
+"-------\n"
+"dict\n"
+"    Histogram for each name\n"
+);
+extern PyObject *py_tnpam_stats(PyObject *self, PyObject *const *args,
+				Py_ssize_t nargs, PyObject *kwnames);
+extern void tnpam_stats_record(tnpam_stats_t *stats, tnpam_stat_t stat,
+			       uint64_t ns);
+extern PyObject *tnpam_stats_dict(tnpam_stats_t *stats, bool reset);
+
+/* provided by py_memory.c */
+PyDoc_STRVAR(py_tnpam_memory_stats__doc__,
+"memory_stats() -> dict\n"
+"----------------------\n\n"
+"Return process-wide memory accounting counters of the extension.\n\n"
+"Counters are shared by all interpreters. The keys are:\n"
+"    contexts: number of live PamContext objects\n"
+"    open_sessions: number of contexts with an open PAM session\n"
+"    pending_conversations: number of conversations in progress, including\n"
+"        resumable operations waiting for auth_resume()\n"
+"    handle_bytes: estimated heap usage of the PAM handles (and data of\n"
+"        the modules loaded by them) of live contexts\n"
+"    responses: number of conversation response arrays handed to PAM\n"
+"        modules since the module was loaded\n"
+"    response_bytes: total size of those response arrays\n"
+"    secret_bytes: size of secrets (conversation_responses values and\n"
+"        authenticate_many() credentials) held by the extension\n"
+"    secret_locked_bytes: size of the secret arena locked in memory with\n"
+"        mlock(2), 0 if it could not be locked or is not yet in use\n\n"
+"Handle sizes are estimated from the growth of the C heap while the\n"
+"first pam_start_confdir(3) of each service and confdir runs; later\n"
+"handles of the same stack reuse that estimate. It is approximate if\n"
+"other threads allocate meanwhile, and 0 where mallinfo2(3) is not\n"
+"available.\n"
+"The estimate of each live context is also traced by tracemalloc in\n"
+"domain TRACEMALLOC_DOMAIN, attributed to where the context was created.\n\n"
+"Response arrays are freed by the PAM modules and so are counted\n"
+"cumulatively rather than traced.\n"
+);
+extern PyObject *py_tnpam_memory_stats(PyObject *self, PyObject *Py_UNUSED(ignored));
+
+PyDoc_STRVAR(py_tnpam_ctx_sizeof__doc__,
+"__sizeof__() -> int\n"
+"-------------------\n\n"
+"Size of the context in bytes, including memory allocated by the\n"
+"extension for it: the message history ring, conversation_responses\n"
+"and copies of messages not yet added to the history. Referenced python\n"
+"objects and the PAM handle are not included. See memory_usage().\n"
+);
+extern PyObject *py_tnpam_ctx_sizeof(tnpam_ctx_t *self, PyObject *Py_UNUSED(ignored));
+
+PyDoc_STRVAR(py_tnpam_ctx_memory_usage__doc__,
+"memory_usage() -> dict\n"
+"----------------------\n\n"
+"Return the approximate memory cost of this context in bytes.\n\n"
+"The keys are:\n"
+"    object: __sizeof__() of the context\n"
+"    messages: size of the conversation tuples held in the message\n"
+"        history, including the struct_pam_message items and their text\n"
+"    handle: estimated heap usage of the PAM handle and module data\n"
+"        (see truenas_pypam.memory_stats())\n"
+"    total: sum of the above\n"
+);
+extern PyObject *py_tnpam_ctx_memory_usage(tnpam_ctx_t *self,
+					   PyObject *Py_UNUSED(ignored));
+extern void tnpam_mem_add(tnpam_mem_counter_t counter, int64_t delta);
+extern pamcode_t tnpam_mem_start(const char *service, const char *user,
+				 const struct pam_conv *conv,
+				 const char *confdir, pam_handle_t **hdl,
+				 size_t *hdl_bytes);
+extern void tnpam_mem_ctx_created(tnpam_ctx_t *ctx);
+extern void tnpam_mem_ctx_destroyed(tnpam_ctx_t *ctx);
+extern void tnpam_mem_count_resp(int num_msg, const struct pam_response *resp);
+
+/* provided by py_secret.c */
+extern char *tnpam_secret_alloc(size_t size);
+extern void tnpam_secret_free(char *secret, size_t size);
+extern size_t tnpam_secret_locked_bytes(void);
+extern bool tnpam_secret_check(PyObject *obj);
+extern bool tnpam_secret_view(PyObject *obj, tnpam_secret_view_t *view);
+extern void tnpam_secret_view_release(tnpam_secret_view_t *view);
+extern char *tnpam_secret_copy(PyObject *obj, const char *what,
+			       size_t *len_out);
 
 /* provided by py_error.c */
 extern bool setup_pam_exception(PyObject *module_ref);
+extern const tnpam_enum_spec_t tnpam_pam_code_enum_spec;
 extern PyObject *py_pamcode_dict(void);
-extern void _set_pam_exc(int code, const char *additional_info, const char *location);
+extern void _set_pam_exc(tnpam_state_t *state, int code,
+			 const char *additional_info, const char *location);
+extern void _set_pam_exc_fmt(tnpam_state_t *state, int code,
+			     const char *location, const char *format, ...);
+extern void _set_rate_limited_exc(tnpam_state_t *state,
+				  const char *additional_info,
+				  const char *location);
 
 #define __stringify(x) #x
 #define __stringify2(x) __stringify(x)
 #define __location__ __FILE__ ":" __stringify2(__LINE__)
 
-#define set_pam_exc(code, additional_info) \
-	_set_pam_exc(code, additional_info, __location__)
+/*
+ * additional_info must have static storage duration (normally a string
+ * literal) since the exception refers to it rather than making a copy.
+ * state is the module state of the caller (see py_get_pam_state_from_type()).
+ */
+#define set_pam_exc(state, code, additional_info) \
+	_set_pam_exc(state, code, additional_info, __location__)
+
+/*
+ * Same as set_pam_exc() with a message formatted by PyUnicode_FromFormat(),
+ * for errors that need to name the offending object. format must be a literal.
+ */
+#define set_pam_exc_fmt(state, code, format, ...) \
+	_set_pam_exc_fmt(state, code, __location__, format, __VA_ARGS__)
+
+/*
+ * Raise AuthRateLimited, the PAMError subclass for attempts refused by
+ * set_auth_rate_limit(). Same rules for additional_info as set_pam_exc().
+ */
+#define set_rate_limited_exc(state, additional_info) \
+	_set_rate_limited_exc(state, additional_info, __location__)
+
+/* provided by py_op.c */
+// Returned by tnpam_op_call() when the context state no longer permits the
+// operation, e.g. another thread opened the session first.
+#define TNPAM_OP_BAD_STATE -1
+#define TNPAM_OP_ENDED -2	/* handle ended by close_all_sessions() */
+#define TNPAM_OP_RATE_LIMITED -3	/* refused by set_auth_rate_limit() */
+#define TNPAM_OP_TIMED_OUT -4	/* deadline passed */
+#define TNPAM_OP_WORKER_LOST -5	/* PamProcessPool worker exited */
+#define TNPAM_OP_WORKER_BUSY -6	/* worker is in this thread's conversation */
+extern const char *tnpam_op_name(tnpam_op_t op);
+extern pamcode_t tnpam_op_pam(pam_handle_t *hdl, tnpam_op_t op, int flags);
+extern bool tnpam_ctx_set_timeout(tnpam_ctx_t *ctx, PyObject *timeout);
+extern bool tnpam_op_deadline(tnpam_ctx_t *ctx, PyObject *timeout,
+			      uint64_t *deadline_out);
+extern bool tnpam_deadline_passed(uint64_t deadline_ns);
+extern pamcode_t tnpam_op_call(tnpam_ctx_t *ctx, tnpam_op_t op, int flags,
+			       uint64_t deadline_ns);
+extern PyObject *tnpam_op_result(tnpam_ctx_t *ctx, tnpam_op_t op, pamcode_t ret);
+extern PyObject *tnpam_op_run(tnpam_ctx_t *ctx, tnpam_op_t op, int flags,
+			      uint64_t deadline_ns);
+
+/* provided by py_resume.c */
+extern int tnpam_resume_init(tnpam_resume_t *resume);
+extern void tnpam_resume_destroy(tnpam_ctx_t *ctx);
+extern bool tnpam_resume_busy(tnpam_ctx_t *ctx);
+extern bool tnpam_resume_current(tnpam_ctx_t *ctx);
+extern int tnpam_resume_conv(tnpam_ctx_t *ctx, int num_msg,
+			     const struct pam_message **msg,
+			     struct pam_response **resp);
+extern bool tnpam_parse_timeout(PyObject *obj, double *timeout_out);
+extern PyObject *tnpam_resume_begin(tnpam_ctx_t *ctx, tnpam_op_t op, int flags,
+				    uint64_t deadline_ns, double timeout);
+extern PyObject *tnpam_resume_continue(tnpam_ctx_t *ctx, PyObject *pyresp,
+				       double timeout);
+extern PyObject *tnpam_resume_abort(tnpam_ctx_t *ctx, double timeout);
+
+/* provided by py_async.c */
+extern PyObject *tnpam_op_submit(tnpam_ctx_t *ctx, tnpam_op_t op, int flags,
+				 uint64_t deadline_ns);
+extern bool init_async_state(PyObject *module_ref);
+
+PyDoc_STRVAR(py_tnpam_set_async_workers__doc__,
+"set_async_workers(max_workers) -> int\n"
+"-------------------------------------\n\n"
+"Set the maximum number of native worker threads used to service the\n"
+"PamContext *_async() methods (default=16).\n\n"
+"Worker threads are created on demand and reused for the life of the\n"
+"process. Lowering the limit does not stop threads that already exist.\n"
+"Note that a worker is occupied for the full duration of a PAM call,\n"
+"including any time spent in the conversation function.\n\n"
+"Parameters\n"
+"----------\n"
+"max_workers : int\n"
+"    Maximum number of worker threads. Must be positive.\n\n"
+"Returns\n"
+"-------\n"
+"int\n"
+"    The previous maximum\n"
+);
+extern PyObject *py_tnpam_set_async_workers(PyObject *self,
+					    PyObject *const *args,
+					    Py_ssize_t nargs,
+					    PyObject *kwnames);
+
+/* provided by py_batch.c */
+PyDoc_STRVAR(py_tnpam_authenticate_many__doc__,
+"authenticate_many(service_name, credentials, *, concurrency=8,\n"
+"                  confdir=None, silent=False,\n"
+"                  disallow_null_authtok=False, lock_policy=None,\n"
+"                  lock_group=None, auth_cache=False) -> tuple\n"
+"-------------------------------------------------------------\n\n"
+"Authenticate a batch of credentials in parallel using pam_authenticate(3).\n\n"
+"Each credential is checked in its own PAM transaction on one of up to\n"
+"concurrency native threads. The GIL is released for the whole batch.\n"
+"Password (PAM_PROMPT_ECHO_OFF) prompts are answered with the secret and\n"
+"PAM_PROMPT_ECHO_ON prompts with the username. Informational messages are\n"
+"discarded. No python code runs during the PAM calls.\n\n"
+"A truenas_pypam.authenticate audit event is raised for every credential\n"
+"before the batch starts.\n\n"
+"Parameters\n"
+"----------\n"
+"service_name : str\n"
+"    Name of the PAM service.\n"
+"credentials : Sequence[tuple]\n"
+"    Sequence of (user, secret) or (user, secret, rhost) tuples. secret\n"
+"    may be str or a bytes-like object. rhost may be None.\n"
+"concurrency : int, optional\n"
+"    Maximum number of threads used, including the calling thread\n"
+"    (default=8).\n"
+"confdir : str, optional\n"
+"    Path to directory containing PAM configuration files (default=None\n"
+"    for /etc/pam.d).\n"
+"silent : bool, optional\n"
+"    Pass PAM_SILENT to pam_authenticate() (default=False).\n"
+"disallow_null_authtok : bool, optional\n"
+"    Pass PAM_DISALLOW_NULL_AUTHTOK to pam_authenticate() (default=False).\n"
+"lock_policy : LockPolicy, optional\n"
+"    Lock domain each transaction runs in. See get_context() and\n"
+"    set_lock_policy() (default=None for the policy set for service_name).\n"
+"lock_group : str, optional\n"
+"    Name of the lock domain for LockPolicy.GROUP (default=None).\n"
+"auth_cache : bool, optional\n"
+"    Look up and remember credentials in the cache enabled with\n"
+"    set_auth_cache() (default=False).\n\n"
+"Returns\n"
+"-------\n"
+"tuple[PAMCode]\n"
+"    Result of pam_authenticate() (or of pam_start_confdir() if that\n"
+"    failed) for each credential, in input order.\n\n"
+"Raises\n"
+"------\n"
+"TypeError\n"
+"    If credentials is not a sequence of tuples of strings or\n"
+"    lock_policy is not a LockPolicy\n"
+"ValueError\n"
+"    If concurrency is less than 1, a value contains a null character or\n"
+"    lock_group does not match lock_policy\n"
+);
+extern PyObject *py_tnpam_authenticate_many(PyObject *self,
+					    PyObject *const *args,
+					    Py_ssize_t nargs,
+					    PyObject *kwnames);
 
 /* provided by py_ctx.c */
+extern bool init_ctx_type(PyObject *module_ref);
+extern int tnpam_ctx_parse_cfg(PyObject *const *args, Py_ssize_t nargs,
+			       PyObject *kwnames, tnpam_cfg_t *cfg);
+extern PyObject *tnpam_ctx_vectorcall(PyObject *type, PyObject *const *args,
+				      size_t nargsf, PyObject *kwnames);
+extern int tnpam_ctx_setup(tnpam_ctx_t *self, const tnpam_cfg_t *cfg);
 
 /* provided by py_cred.c */
 PyDoc_STRVAR(py_tnpam_setcred__doc__,
-"setcred(*, operation, silent=False) -> None\n"
-"--------------------------------------------\n\n"
+"setcred(*, operation, silent=False, timeout=None) -> None\n"
+"---------------------------------------------------------\n\n"
 "Establish, maintain, or delete user credentials using pam_setcred(3).\n\n"
 "This function is used to establish, maintain and delete the credentials\n"
 "of a user. It should be called to set the credentials after a user has\n"
@@ -421,9 +1870,13 @@ PyDoc_STRVAR(py_tnpam_setcred__doc__,
 "    - CredOp.PAM_REFRESH_CRED: Extend lifetime of existing credentials\n"
 "silent : bool, optional\n"
 "    If True, PAM modules should not emit informational messages\n"
-"    (default=False)\n\n"
+"    (default=False)\n"
+"timeout : float, optional\n"
+"    Same as for authenticate().\n\n"
 "Raises\n"
 "------\n"
+"TimeoutError\n"
+"    The deadline of the operation passed. See authenticate().\n"
 "PAMError\n"
 "    If the credential operation fails. Common error codes:\n"
 "    - PAM_BUF_ERR: Memory buffer error\n"
@@ -436,7 +1889,40 @@ PyDoc_STRVAR(py_tnpam_setcred__doc__,
 "--------\n"
 "pam_setcred(3)\n"
 );
-extern PyObject *py_tnpam_setcred(tnpam_ctx_t *self, PyObject *args, PyObject *kwds);
-extern bool setup_cred_op_enum(PyObject *module_ref);
+extern PyObject *py_tnpam_setcred(tnpam_ctx_t *self, PyObject *const *args,
+				  Py_ssize_t nargs, PyObject *kwnames);
+
+PyDoc_STRVAR(py_tnpam_setcred_async__doc__,
+"setcred_async(*, operation, silent=False, timeout=None) -> Future\n"
+"-----------------------------------------------------------------\n\n"
+"Awaitable variant of setcred(). See authenticate_async() for details\n"
+"on how the call is executed.\n"
+);
+extern PyObject *py_tnpam_setcred_async(tnpam_ctx_t *self,
+					PyObject *const *args, Py_ssize_t nargs,
+					PyObject *kwnames);
+extern const tnpam_enum_spec_t tnpam_cred_op_enum_spec;
+
+/* provided by py_enum.c */
+PyDoc_STRVAR(py_tnpam_module_getattr__doc__,
+"__getattr__(name) -> object\n"
+"---------------------------\n\n"
+"Create the PAMCode, MSGStyle, CredOp and LockPolicy enums on first\n"
+"access so that importing the module doesn't import enum.\n"
+);
+extern PyObject *py_tnpam_module_getattr(PyObject *self, PyObject *name);
+
+PyDoc_STRVAR(py_tnpam_module_dir__doc__,
+"__dir__() -> list\n"
+"-----------------\n\n"
+"Names of the module including enums that weren't created yet.\n"
+);
+extern PyObject *py_tnpam_module_dir(PyObject *self, PyObject *ignored);
+extern PyObject *tnpam_enum_type(tnpam_state_t *state, tnpam_enum_t which);
+extern PyObject *tnpam_enum_member(tnpam_state_t *state, tnpam_enum_t which,
+				   int value);
+extern int tnpam_enum_value(tnpam_state_t *state, tnpam_enum_t which,
+			    PyObject *obj, int *value_out);
+extern bool init_enum_names(PyObject *module_ref);
 
 #endif
@@ -0,0 +1,543 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/*
+ * pam_tnpam_test: synthetic PAM module for tests and benchmarks.
+ *
+ * Built and installed next to the truenas_pypam extension so that the test
+ * suite and benchmarks/bench_pam.py can drive the conversation, locking and
+ * error paths without depending on pam_unix and the users of the host. Use
+ * it with an absolute path in a confdir stack:
+ *
+ *   auth required /path/to/pam_tnpam_test.so rounds=2 password=secret
+ *
+ * Every management group (auth, account, session, password) is supported
+ * and takes the same arguments:
+ *
+ *   delay_us=N         sleep N microseconds in every call
+ *   rounds=N           conversation rounds of pam_authenticate() and
+ *                      pam_chauthtok() (default 1)
+ *   style=S[,S...]     messages of every round, each one of echo_off,
+ *                      echo_on, error or info (default echo_off)
+ *   password=S         answer required to echo_off prompts (default any)
+ *   fail_every=N       fail every Nth call of the module in the process
+ *   fail_rate=P        fail calls with probability P (0 to 1)
+ *   seed=N             seed of fail_rate, so that a sequence of calls gets
+ *                      the same failures on every run (default 1)
+ *   result=S           code of failures: auth_err (default), user_unknown,
+ *                      cred_insufficient, authinfo_unavail, maxtries,
+ *                      perm_denied, acct_expired, new_authtok_reqd,
+ *                      system_err, buf_err or abort
+ *   incomplete=N       return PAM_INCOMPLETE from the first N calls of each
+ *                      handle, as a module waiting for a backend would
+ *   incomplete_round=K return PAM_INCOMPLETE once after round K was
+ *                      answered and resume at round K + 1 on the next call.
+ *                      A conversation returning PAM_CONV_AGAIN is treated
+ *                      the same way for the round it was asked.
+ *   export             publish TNPAM_TEST_CALLS (calls of the group on this
+ *                      handle) and TNPAM_TEST_ROUNDS (rounds answered) in
+ *                      the PAM environment
+ *
+ * The module is linked with -z nodelete so that the call counter used by
+ * fail_every and fail_rate persists when libpam unloads its modules at
+ * pam_end(). Unknown arguments fail the call with PAM_SERVICE_ERR so that
+ * typos in a benchmark stack don't go unnoticed. The module is not meant to
+ * be used in a real PAM configuration.
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <security/pam_modules.h>
+
+#define TT_DATA "pam_tnpam_test"
+#define TT_MAX_STYLES 8
+
+typedef enum {
+	TT_AUTH = 0,
+	TT_SETCRED,
+	TT_ACCOUNT,
+	TT_OPEN_SESSION,
+	TT_CLOSE_SESSION,
+	TT_CHAUTHTOK,
+	TT_GROUP_COUNT
+} tt_group_t;
+
+typedef struct {
+	unsigned long delay_us;
+	unsigned rounds;
+	int styles[TT_MAX_STYLES];
+	unsigned nstyles;
+	const char *password;
+	unsigned long fail_every;
+	double fail_rate;
+	uint64_t seed;
+	int result;
+	unsigned incomplete;
+	unsigned incomplete_round;	/* 0 for none */
+	bool exported;
+} tt_args_t;
+
+/* Module data of a handle, per group */
+typedef struct {
+	unsigned calls[TT_GROUP_COUNT];
+	unsigned incomplete[TT_GROUP_COUNT];	/* PAM_INCOMPLETE returned */
+	unsigned next_round[TT_GROUP_COUNT];	/* resume point */
+	bool resumed[TT_GROUP_COUNT];	/* incomplete_round was reported */
+	unsigned rounds;	/* rounds answered on the handle */
+} tt_data_t;
+
+/* Calls of the module in the process, for fail_every and fail_rate */
+static _Atomic uint64_t tt_calls = 0;
+
+static const struct {
+	const char *name;
+	int style;
+} tt_styles[] = {
+	{ "echo_off", PAM_PROMPT_ECHO_OFF },
+	{ "echo_on", PAM_PROMPT_ECHO_ON },
+	{ "error", PAM_ERROR_MSG },
+	{ "info", PAM_TEXT_INFO },
+};
+
+static const struct {
+	const char *name;
+	int code;
+} tt_results[] = {
+	{ "auth_err", PAM_AUTH_ERR },
+	{ "user_unknown", PAM_USER_UNKNOWN },
+	{ "cred_insufficient", PAM_CRED_INSUFFICIENT },
+	{ "authinfo_unavail", PAM_AUTHINFO_UNAVAIL },
+	{ "maxtries", PAM_MAXTRIES },
+	{ "perm_denied", PAM_PERM_DENIED },
+	{ "acct_expired", PAM_ACCT_EXPIRED },
+	{ "new_authtok_reqd", PAM_NEW_AUTHTOK_REQD },
+	{ "system_err", PAM_SYSTEM_ERR },
+	{ "buf_err", PAM_BUF_ERR },
+	{ "abort", PAM_ABORT },
+};
+
+#define TT_ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+static bool
+tt_parse_ulong(const char *val, unsigned long *out)
+{
+	char *end = NULL;
+
+	if ((*val == '\0') || (*val == '-')) {
+		return false;
+	}
+
+	errno = 0;
+	*out = strtoul(val, &end, 10);
+	return (errno == 0) && (*end == '\0');
+}
+
+static bool
+tt_parse_styles(const char *val, tt_args_t *args)
+{
+	args->nstyles = 0;
+
+	while (*val != '\0') {
+		size_t len = strcspn(val, ","), i;
+		bool found = false;
+
+		for (i = 0; i < TT_ARRAY_SIZE(tt_styles); i++) {
+			if ((strlen(tt_styles[i].name) == len) &&
+			    (strncmp(val, tt_styles[i].name, len) == 0)) {
+				found = true;
+				break;
+			}
+		}
+
+		if (!found || (args->nstyles == TT_MAX_STYLES)) {
+			return false;
+		}
+
+		args->styles[args->nstyles++] = tt_styles[i].style;
+		val += len;
+		if (*val == ',') {
+			val++;
+		}
+	}
+
+	return args->nstyles > 0;
+}
+
+static bool
+tt_parse_result(const char *val, tt_args_t *args)
+{
+	size_t i;
+
+	for (i = 0; i < TT_ARRAY_SIZE(tt_results); i++) {
+		if (strcmp(val, tt_results[i].name) == 0) {
+			args->result = tt_results[i].code;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+tt_parse_args(int argc, const char **argv, tt_args_t *args)
+{
+	unsigned long num;
+	int i;
+
+	*args = (tt_args_t) {
+		.rounds = 1,
+		.styles = { PAM_PROMPT_ECHO_OFF },
+		.nstyles = 1,
+		.seed = 1,
+		.result = PAM_AUTH_ERR,
+	};
+
+	for (i = 0; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *val = strchr(arg, '=');
+		size_t len = val ? (size_t)(val - arg) : strlen(arg);
+		bool ok;
+
+		if (val != NULL) {
+			val++;
+		}
+
+#define TT_IS(name) ((len == strlen(name)) && (strncmp(arg, name, len) == 0))
+		if (TT_IS("export") && (val == NULL)) {
+			args->exported = true;
+			continue;
+		} else if (val == NULL) {
+			return false;
+		} else if (TT_IS("delay_us")) {
+			ok = tt_parse_ulong(val, &args->delay_us);
+		} else if (TT_IS("rounds")) {
+			ok = tt_parse_ulong(val, &num) && (num <= 1000);
+			args->rounds = (unsigned)num;
+		} else if (TT_IS("style")) {
+			ok = tt_parse_styles(val, args);
+		} else if (TT_IS("password")) {
+			args->password = val;
+			ok = true;
+		} else if (TT_IS("fail_every")) {
+			ok = tt_parse_ulong(val, &args->fail_every);
+		} else if (TT_IS("fail_rate")) {
+			char *end = NULL;
+
+			args->fail_rate = strtod(val, &end);
+			ok = (*end == '\0') && (args->fail_rate >= 0) &&
+			     (args->fail_rate <= 1);
+		} else if (TT_IS("seed")) {
+			ok = tt_parse_ulong(val, &num);
+			args->seed = num;
+		} else if (TT_IS("result")) {
+			ok = tt_parse_result(val, args);
+		} else if (TT_IS("incomplete")) {
+			ok = tt_parse_ulong(val, &num) && (num <= 1000);
+			args->incomplete = (unsigned)num;
+		} else if (TT_IS("incomplete_round")) {
+			ok = tt_parse_ulong(val, &num) && (num >= 1) && (num <= 1000);
+			args->incomplete_round = (unsigned)num;
+		} else {
+			ok = false;
+		}
+#undef TT_IS
+
+		if (!ok) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+tt_cleanup(pam_handle_t *pamh, void *data, int error_status)
+{
+	free(data);
+}
+
+static tt_data_t *
+tt_get_data(pam_handle_t *pamh)
+{
+	const void *data = NULL;
+	tt_data_t *new;
+
+	if ((pam_get_data(pamh, TT_DATA, &data) == PAM_SUCCESS) &&
+	    (data != NULL)) {
+		return (tt_data_t *)data;
+	}
+
+	new = calloc(1, sizeof(tt_data_t));
+	if ((new == NULL) ||
+	    (pam_set_data(pamh, TT_DATA, new, tt_cleanup) != PAM_SUCCESS)) {
+		free(new);
+		return NULL;
+	}
+
+	return new;
+}
+
+static void
+tt_sleep(unsigned long usec)
+{
+	struct timespec ts = {
+		.tv_sec = usec / 1000000,
+		.tv_nsec = (usec % 1000000) * 1000,
+	};
+
+	while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR)) {
+		;
+	}
+}
+
+/* splitmix64: cheap and reproducible for a given seed and call number */
+static uint64_t
+tt_mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static bool
+tt_should_fail(const tt_args_t *args)
+{
+	uint64_t n = atomic_fetch_add_explicit(&tt_calls, 1,
+					       memory_order_relaxed) + 1;
+
+	if ((args->fail_every != 0) && ((n % args->fail_every) == 0)) {
+		return true;
+	}
+
+	if (args->fail_rate > 0) {
+		double x = (double)(tt_mix(args->seed ^ n) >> 11) * 0x1.0p-53;
+
+		return x < args->fail_rate;
+	}
+
+	return false;
+}
+
+static void
+tt_free_resp(int num, struct pam_response *resp)
+{
+	int i;
+
+	if (resp == NULL) {
+		return;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (resp[i].resp != NULL) {
+			explicit_bzero(resp[i].resp, strlen(resp[i].resp));
+			free(resp[i].resp);
+		}
+	}
+
+	free(resp);
+}
+
+/*
+ * Ask one round of messages. Returns PAM_SUCCESS, PAM_CONV_AGAIN if the
+ * application asked to be called again, or the failure of the round.
+ */
+static int
+tt_round(pam_handle_t *pamh, const tt_args_t *args, unsigned round)
+{
+	struct pam_message msgs[TT_MAX_STYLES];
+	const struct pam_message *msgp[TT_MAX_STYLES];
+	char text[TT_MAX_STYLES][64];
+	struct pam_response *resp = NULL;
+	const struct pam_conv *conv = NULL;
+	int ret;
+	unsigned i;
+
+	ret = pam_get_item(pamh, PAM_CONV, (const void **)&conv);
+	if ((ret != PAM_SUCCESS) || (conv == NULL) || (conv->conv == NULL)) {
+		return PAM_CONV_ERR;
+	}
+
+	for (i = 0; i < args->nstyles; i++) {
+		const char *kind;
+
+		switch (args->styles[i]) {
+		case PAM_PROMPT_ECHO_OFF:
+			kind = "Password";
+			break;
+		case PAM_PROMPT_ECHO_ON:
+			kind = "Code";
+			break;
+		case PAM_ERROR_MSG:
+			kind = "Error";
+			break;
+		default:
+			kind = "Info";
+			break;
+		}
+
+		snprintf(text[i], sizeof(text[i]), "%s %u.%u: ", kind, round, i);
+		msgs[i].msg_style = args->styles[i];
+		msgs[i].msg = text[i];
+		msgp[i] = &msgs[i];
+	}
+
+	ret = conv->conv((int)args->nstyles, msgp, &resp, conv->appdata_ptr);
+	if (ret == PAM_CONV_AGAIN) {
+		tt_free_resp((int)args->nstyles, resp);
+		return PAM_CONV_AGAIN;
+	}
+
+	if (ret != PAM_SUCCESS) {
+		tt_free_resp((int)args->nstyles, resp);
+		return PAM_CONV_ERR;
+	}
+
+	for (i = 0; ret == PAM_SUCCESS && i < args->nstyles; i++) {
+		const char *answer = (resp != NULL) ? resp[i].resp : NULL;
+
+		switch (args->styles[i]) {
+		case PAM_PROMPT_ECHO_OFF:
+			if (answer == NULL) {
+				ret = PAM_CONV_ERR;
+			} else if ((args->password != NULL) &&
+				   (strcmp(answer, args->password) != 0)) {
+				ret = PAM_AUTH_ERR;
+			} else {
+				ret = pam_set_item(pamh, PAM_AUTHTOK, answer);
+			}
+			break;
+		case PAM_PROMPT_ECHO_ON:
+			if (answer == NULL) {
+				ret = PAM_CONV_ERR;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	tt_free_resp((int)args->nstyles, resp);
+	return ret;
+}
+
+static void
+tt_export(pam_handle_t *pamh, const tt_data_t *data, tt_group_t group)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "TNPAM_TEST_CALLS=%u", data->calls[group]);
+	pam_putenv(pamh, buf);
+	snprintf(buf, sizeof(buf), "TNPAM_TEST_ROUNDS=%u", data->rounds);
+	pam_putenv(pamh, buf);
+}
+
+static int
+tt_run(pam_handle_t *pamh, tt_group_t group, bool converse, int argc,
+       const char **argv)
+{
+	tt_args_t args;
+	tt_data_t *data;
+	int ret = PAM_SUCCESS;
+
+	if (!tt_parse_args(argc, argv, &args)) {
+		return PAM_SERVICE_ERR;
+	}
+
+	data = tt_get_data(pamh);
+	if (data == NULL) {
+		return PAM_BUF_ERR;
+	}
+
+	data->calls[group]++;
+	if (data->incomplete[group] < args.incomplete) {
+		data->incomplete[group]++;
+		return PAM_INCOMPLETE;
+	}
+
+	if (args.delay_us != 0) {
+		tt_sleep(args.delay_us);
+	}
+
+	while (converse && (data->next_round[group] < args.rounds)) {
+		unsigned round = data->next_round[group] + 1;
+
+		ret = tt_round(pamh, &args, round);
+		if (ret == PAM_CONV_AGAIN) {
+			// Asked again on the next call
+			return PAM_INCOMPLETE;
+		}
+
+		if (ret != PAM_SUCCESS) {
+			data->next_round[group] = 0;
+			break;
+		}
+
+		data->next_round[group] = round;
+		data->rounds++;
+		if ((round == args.incomplete_round) && !data->resumed[group]) {
+			data->resumed[group] = true;
+			return PAM_INCOMPLETE;
+		}
+	}
+
+	if (ret == PAM_SUCCESS) {
+		// The transaction is complete, the next one asks every round
+		data->next_round[group] = 0;
+		data->resumed[group] = false;
+		data->incomplete[group] = 0;
+		if (tt_should_fail(&args)) {
+			ret = args.result;
+		}
+	}
+
+	if (args.exported) {
+		tt_export(pamh, data, group);
+	}
+
+	return ret;
+}
+
+PAM_EXTERN int
+pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	return tt_run(pamh, TT_AUTH, true, argc, argv);
+}
+
+PAM_EXTERN int
+pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	return tt_run(pamh, TT_SETCRED, false, argc, argv);
+}
+
+PAM_EXTERN int
+pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	return tt_run(pamh, TT_ACCOUNT, false, argc, argv);
+}
+
+PAM_EXTERN int
+pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	return tt_run(pamh, TT_OPEN_SESSION, false, argc, argv);
+}
+
+PAM_EXTERN int
+pam_sm_close_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	return tt_run(pamh, TT_CLOSE_SESSION, false, argc, argv);
+}
+
+PAM_EXTERN int
+pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	// The first pass only checks that the module is ready
+	if (flags & PAM_PRELIM_CHECK) {
+		return PAM_SUCCESS;
+	}
+
+	return tt_run(pamh, TT_CHAUTHTOK, true, argc, argv);
+}
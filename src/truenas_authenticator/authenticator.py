@@ -5,13 +5,11 @@
 # work on pam_truenas.
 
 import enum
-import queue
 import threading
-import time
 import truenas_pypam
 from dataclasses import dataclass
 from datetime import datetime, UTC
-from typing import Optional, List, Any, Callable
+from typing import Optional, List, Any
 
 
 class AuthenticatorStage(enum.StrEnum):
@@ -49,117 +47,45 @@ class AuthenticatorResponse:
     user_info: dict | None = None
 
 
-@dataclass(slots=True)
-class ConversationThreadState:
-    """State passed to conversation callback thread"""
-    # Thread synchronization
-    main_thread_id: int
-    input_queue: queue.Queue
-    output_queue: queue.Queue
-    done_event: threading.Event
-
-    # PAM context parameters (kwargs for truenas_pypam.get_context)
-    service_name: str = 'login'  # First positional arg
-    user: str = None  # Required kwarg
-    conversation_function: Optional[Callable] = None
-    # Will be set to self
-    conversation_private_data: Any = None
-    confdir: Optional[str] = None  # Config directory
-    rhost: Optional[str] = None  # Remote host
-    ruser: Optional[str] = None  # Remote user
-    fail_delay: int = 0  # Fail delay in microseconds
-    pam_env: dict[str, str] = None  # PAM environment variables to set
-
-    # Results
-    exception: Optional[Exception] = None
-    pam_context: Optional[Any] = None  # PAM context on success
-
-
-def _auth_thread_worker(thread_state: ConversationThreadState):
+def _conv_callback_none(ctx, messages, private_data):
     """
-    Worker thread that performs PAM authentication.
-    This is a module-level function to prevent access to instance variables.
+    Fallback conversation for operations after authentication. The
+    authentication conversation itself is driven through auth_begin() and
+    auth_resume() and never reaches this callback.
     """
-    try:
-        # Build kwargs dict for get_context
-        kwargs = {
-            'user': thread_state.user,
-            'conversation_function': thread_state.conversation_function,
-            # Pass thread_state as private data
-            'conversation_private_data': thread_state
-        }
-
-        # Add optional parameters if provided
-        if thread_state.confdir is not None:
-            kwargs['confdir'] = thread_state.confdir
-        if thread_state.rhost is not None:
-            kwargs['rhost'] = thread_state.rhost
-        if thread_state.ruser is not None:
-            kwargs['ruser'] = thread_state.ruser
-        if thread_state.fail_delay != 0:
-            kwargs['fail_delay'] = thread_state.fail_delay
-
-        # Add service_name as keyword argument
-        kwargs['service_name'] = thread_state.service_name
-
-        # Create PAM context (all args are keyword-only)
-        ctx = truenas_pypam.get_context(**kwargs)
-
-        # Set PAM environment variables if provided
-        if thread_state.pam_env:
-            for key, value in thread_state.pam_env.items():
-                ctx.set_env(name=key, value=value)
+    return [None] * len(messages)
 
-        thread_state.pam_context = ctx
-        ctx.authenticate()
 
-    except Exception as e:
-        thread_state.exception = e
-    finally:
-        thread_state.done_event.set()
+# Seconds end() waits for an aborted authentication to return
+ABORT_TIMEOUT = 2.0
 
 
-def _conv_callback(ctx, messages, private_data: ConversationThreadState):
+def _finish_abort(ctx):
     """
-    PAM conversation callback that runs in authentication thread.
-    Communicates with main thread via queues.
-    Module-level function to prevent access to instance variables.
+    Wait for an aborted authentication that didn't return within
+    ABORT_TIMEOUT (e.g. a module blocked on LDAP or Kerberos) and drop the
+    context. Module-level function so that the thread holds no reference to
+    the authenticator.
     """
-    # Verify we're not in the main thread (programming error check)
-    if threading.current_thread().ident == private_data.main_thread_id:
-        raise RuntimeError(
-            "PAM conversation callback called from main thread - "
-            "this should not happen"
-        )
-
-    # Send messages to main thread
-    private_data.output_queue.put(messages)
-
-    # Wait for responses with timeout
-    while not private_data.done_event.is_set():
-        try:
-            responses = private_data.input_queue.get(timeout=1.0)
-            return responses
-        except queue.Empty:
-            continue
-
-    # If done event is set, return empty responses
-    return [None] * len(messages)
+    ctx.auth_abort()
 
 
-def _conv_callback_simple(ctx, messages, private_data):
-    reply = []
-    for m in messages:
-        if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF:
-            resp = private_data['password']
-        elif m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_ON:
-            resp = private_data['username']
-        else:
-            resp = None
+def _get_passwd(ctx) -> dict | None:
+    """
+    passwd entry of the PAM user, looked up by truenas_pypam without holding
+    the GIL and cached on the context. None if NSS doesn't know the user
+    (e.g. API key users) or the lookup failed.
+    """
+    try:
+        return ctx.passwd
+    except OSError:
+        return None
 
-        reply.append(resp)
 
-    return reply
+def _user_info(passwd: dict | None, username: str) -> dict:
+    user_info = dict(passwd) if passwd else {'pw_name': username}
+    user_info['account_attributes'] = []
+    return user_info
 
 
 class UserPamAuthenticator:
@@ -178,7 +104,8 @@ class UserPamAuthenticator:
         rhost: Optional[str] = None,
         ruser: Optional[str] = None,
         fail_delay: Optional[int] = None,
-        pam_env: Optional[dict[str, str]] = None
+        pam_env: Optional[dict[str, str]] = None,
+        confdir: Optional[str] = None
     ):
         self.username = username
         self.authentication_timeout = authentication_timeout
@@ -186,12 +113,13 @@ class UserPamAuthenticator:
         self.ruser = ruser
         self.fail_delay = fail_delay
         self.pam_env = pam_env or {}
+        self.confdir = confdir
         self.state = AuthenticatorState(service=service)
         # truenas_pypam context - only set after successful auth
         self.dbid = 0
         self.ctx = None
-        self._auth_thread = None
-        self._thread_state = None
+        # PAM context with resumable authentication in progress
+        self._auth_ctx = None
 
     def check_stage(self, expected: AuthenticatorStage):
         if self.state.stage is not expected:
@@ -200,60 +128,74 @@ class UserPamAuthenticator:
                 f'Expected: {expected}'
             )
 
-    def _wait_for_auth_result(self) -> AuthenticatorResponse:
-        """
-        Wait for authentication thread to either complete or send conversation request.
-        Common logic for auth_init and auth_continue.
-        """
-        start_time = time.monotonic()
-        while not self._thread_state.done_event.is_set():
-            # Check timeout
-            if time.monotonic() - start_time > self.authentication_timeout:
-                self.end()
-                return AuthenticatorResponse(
-                    AuthenticatorStage.AUTH,
-                    truenas_pypam.PAMCode.PAM_SYSTEM_ERR,
-                    f"Authentication timeout after "
-                    f"{self.authentication_timeout} seconds"
-                )
+    def _get_pam_context(self, username: str):
+        kwargs = {
+            'service_name': self.state.service,
+            'user': username,
+            'conversation_function': _conv_callback_none,
+            # Bounds the whole resumable authentication, so that a login
+            # abandoned after auth_init() releases its thread and locks
+            'timeout': self.authentication_timeout,
+        }
 
-            try:
-                # Check for conversation requests
-                messages = self._thread_state.output_queue.get(timeout=0.1)
-                return AuthenticatorResponse(
-                    AuthenticatorStage.AUTH,
-                    truenas_pypam.PAMCode.PAM_CONV_AGAIN,
-                    messages
-                )
-            except queue.Empty:
-                continue
+        if self.rhost is not None:
+            kwargs['rhost'] = self.rhost
+        if self.ruser is not None:
+            kwargs['ruser'] = self.ruser
+        if self.fail_delay:
+            kwargs['fail_delay'] = self.fail_delay
+        if self.confdir is not None:
+            kwargs['confdir'] = self.confdir
+        if self.pam_env:
+            kwargs['pam_env'] = self.pam_env
 
-        # Authentication completed
-        self._auth_thread.join()
+        return truenas_pypam.get_context(**kwargs)
 
-        if self._thread_state.exception:
-            if isinstance(self._thread_state.exception, truenas_pypam.PAMError):
-                code = self._thread_state.exception.code
-                reason = str(self._thread_state.exception)
+    def _auth_step(self, step, **kwargs) -> AuthenticatorResponse:
+        """
+        Run a single auth_begin() / auth_resume() step. Common logic for
+        auth_init and auth_continue.
+        """
+        try:
+            messages = step(timeout=self.authentication_timeout, **kwargs)
+        except TimeoutError:
+            self.end()
+            return AuthenticatorResponse(
+                AuthenticatorStage.AUTH,
+                truenas_pypam.PAMCode.PAM_SYSTEM_ERR,
+                f"Authentication timeout after "
+                f"{self.authentication_timeout} seconds"
+            )
+        except Exception as exc:
+            if isinstance(exc, truenas_pypam.PAMError):
+                code = exc.code
             else:
                 code = truenas_pypam.PAMCode.PAM_SYSTEM_ERR
-                reason = str(self._thread_state.exception)
+
+            reason = str(exc)
 
             if self.state.otpw_possible:
                 # When this flag is set we want to keep the PAM context around
                 # until cleanup or explicit consumer call of self.end()
-                self.ctx = self._thread_state.pam_context
+                self.ctx = self._auth_ctx
             else:
                 self.end()
 
             return AuthenticatorResponse(AuthenticatorStage.AUTH, code, reason)
 
-        self.ctx = self._thread_state.pam_context
+        if messages is not None:
+            return AuthenticatorResponse(
+                AuthenticatorStage.AUTH,
+                truenas_pypam.PAMCode.PAM_CONV_AGAIN,
+                messages
+            )
+
+        # Authentication completed
+        self.ctx = self._auth_ctx
+        self._auth_ctx = None
         self.state.stage = AuthenticatorStage.LOGIN
-        user_info = {
-            'pw_name': self.username,
-            'account_attributes': []
-        }
+        self.state.passwd = _get_passwd(self.ctx)
+        user_info = _user_info(self.state.passwd, self.username)
         return AuthenticatorResponse(
             AuthenticatorStage.AUTH,
             truenas_pypam.PAMCode.PAM_SUCCESS,
@@ -269,7 +211,7 @@ class UserPamAuthenticator:
         Use auth_continue() to provide responses.
         """
         # Ensure no authentication is already in progress
-        if self._thread_state or self._auth_thread:
+        if self._auth_ctx is not None:
             raise RuntimeError("Authentication already in progress")
 
         self.check_stage(AuthenticatorStage.START)
@@ -281,32 +223,14 @@ class UserPamAuthenticator:
         else:
             username = self.username
 
-        # Create thread communication state with all PAM parameters
-        self._thread_state = ConversationThreadState(
-            main_thread_id=threading.current_thread().ident,
-            input_queue=queue.Queue(),
-            output_queue=queue.Queue(),
-            done_event=threading.Event(),
-            service_name=self.state.service,
-            user=username,
-            conversation_function=_conv_callback,
-            rhost=self.rhost,
-            ruser=self.ruser,
-            fail_delay=self.fail_delay if self.fail_delay is not None else 0,
-            pam_env=self.pam_env
-        )
-
-        # Start authentication thread with module-level worker function
-        self._auth_thread = threading.Thread(
-            target=_auth_thread_worker,
-            args=(self._thread_state,),
-            daemon=True
-        )
-        self._auth_thread.start()
+        try:
+            self._auth_ctx = self._get_pam_context(username)
+        except truenas_pypam.PAMError as exc:
+            return AuthenticatorResponse(AuthenticatorStage.AUTH, exc.code, str(exc))
 
         self.state.stage = AuthenticatorStage.AUTH
 
-        return self._wait_for_auth_result()
+        return self._auth_step(self._auth_ctx.auth_begin)
 
     def auth_continue(self, responses: List[Optional[str]]) -> AuthenticatorResponse:
         """
@@ -319,13 +243,10 @@ class UserPamAuthenticator:
         if self.state.stage != AuthenticatorStage.AUTH:
             raise RuntimeError(f"Not in AUTH stage (current: {self.state.stage})")
 
-        if not self._thread_state or not self._auth_thread:
+        if self._auth_ctx is None:
             raise RuntimeError("No authentication in progress")
 
-        # Send responses to auth thread
-        self._thread_state.input_queue.put(responses)
-
-        return self._wait_for_auth_result()
+        return self._auth_step(self._auth_ctx.auth_resume, responses=responses)
 
     def account_management(self) -> AuthenticatorResponse:
         self.check_stage(AuthenticatorStage.LOGIN)
@@ -335,11 +256,6 @@ class UserPamAuthenticator:
                 "No PAM context available - authentication may not have completed"
             )
 
-        # Swap to simple conversation callback to avoid thread issues
-        # acct_mgmt() typically doesn't need conversation, but if it does,
-        # we don't want to trigger the complex threaded callback
-        self.ctx.set_conversation(conversation_function=_conv_callback_simple)
-
         try:
             self.ctx.acct_mgmt()
             code = truenas_pypam.PAMCode.PAM_SUCCESS
@@ -347,6 +263,9 @@ class UserPamAuthenticator:
         except truenas_pypam.PAMError as e:
             code = e.code
             reason = str(e)
+        else:
+            # Refreshed by acct_mgmt() if the modules changed PAM_USER
+            self.state.passwd = _get_passwd(self.ctx)
 
         # The account management and authentication stages blend together in some
         # modules and so we keep it as same stage
@@ -390,27 +309,25 @@ class UserPamAuthenticator:
 
     def end(self) -> None:
         """Clean up PAM context and reset state."""
-        # Cancel any ongoing authentication
-        if self._thread_state:
-            self._thread_state.done_event.set()
-            if self._auth_thread and self._auth_thread.is_alive():
-                try:
-                    self._auth_thread.join(timeout=2.0)
-                except TypeError:
-                    # possibly TOCTOU on is_alive and thread tearing down
-                    # when thread tears down completely self._auth_thread
-                    # will be None possibly causing TypeError here
-                    pass
-
-            self._thread_state.input_queue.shutdown(immediate=True)
-            self._thread_state.output_queue.shutdown(immediate=True)
-            self._thread_state.pam_context = None
+        # Cancel any ongoing authentication. This fails any pending
+        # conversation and waits a bounded time for pam_authenticate() to
+        # return. A call that is stuck in a module is left to a daemon
+        # thread rather than blocking the caller (the context can't be
+        # freed while it runs).
+        if self._auth_ctx is not None:
+            try:
+                self._auth_ctx.auth_abort(timeout=ABORT_TIMEOUT)
+            except TimeoutError:
+                threading.Thread(
+                    target=_finish_abort,
+                    args=(self._auth_ctx,),
+                    daemon=True
+                ).start()
 
         # Reset state
         self.state = AuthenticatorState(service=self.state.service)
         self.ctx = None
-        self._thread_state = None
-        self._auth_thread = None
+        self._auth_ctx = None
 
     def login(self) -> AuthenticatorResponse:
         """Perform login operations including opening session."""
@@ -471,13 +388,13 @@ class SimpleAuthenticator(UserPamAuthenticator):
         provided in the init method """
         self.check_stage(AuthenticatorStage.START)
 
+        # Prompts are answered natively by truenas_pypam without calling
+        # back into python.
         pam_ctx_args = {
             'user': self.username,
-            'conversation_function': _conv_callback_simple,
-            # Pass thread_state as private data
-            'conversation_private_data': {
-                'username': self.username,
-                'password': self.password
+            'conversation_responses': {
+                truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: self.password,
+                truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_ON: self.username,
             },
             'service_name': self.state.service
         }
@@ -488,15 +405,15 @@ class SimpleAuthenticator(UserPamAuthenticator):
             pam_ctx_args['ruser'] = self.ruser
         if self.fail_delay:
             pam_ctx_args['fail_delay'] = self.fail_delay
+        if self.confdir is not None:
+            pam_ctx_args['confdir'] = self.confdir
+        if self.pam_env:
+            pam_ctx_args['pam_env'] = self.pam_env
 
         ctx = truenas_pypam.get_context(**pam_ctx_args)
 
-        if self.pam_env:
-            for key, value in self.pam_env.items():
-                ctx.set_env(name=key, value=value)
-
         try:
-            ctx.authenticate()
+            ctx.authenticate(timeout=self.authentication_timeout)
         except Exception as exc:
             reason = str(exc)
             if isinstance(exc, truenas_pypam.PAMError):
@@ -510,11 +427,8 @@ class SimpleAuthenticator(UserPamAuthenticator):
 
         self.ctx = ctx
         self.state.stage = AuthenticatorStage.LOGIN
-
-        user_info = {
-            'pw_name': self.username,
-            'account_attributes': []
-        }
+        self.state.passwd = _get_passwd(ctx)
+        user_info = _user_info(self.state.passwd, self.username)
 
         return AuthenticatorResponse(
             stage=AuthenticatorStage.AUTH,
@@ -7,6 +7,7 @@ import os
 import pwd
 import subprocess
 import pytest
+import truenas_pypam
 
 
 TEST_USER = "bob"
@@ -80,4 +81,27 @@ def test_user_credentials():
     return {
         "user": TEST_USER,
         "password": TEST_PASSWORD
-    }
\ No newline at end of file
+    }
+
+
+@pytest.fixture
+def rate_limit():
+    """Remove any authentication rate limits set by the test."""
+    yield truenas_pypam.set_auth_rate_limit
+    truenas_pypam.set_auth_rate_limit()
+
+
+@pytest.fixture
+def auth_cache():
+    """Enable the authentication cache for the test and disable it after."""
+    truenas_pypam.set_auth_cache(ttl=60)
+    yield truenas_pypam.set_auth_cache
+    truenas_pypam.set_auth_cache()
+
+
+@pytest.fixture
+def events():
+    """Enable the auth event buffer for the test and disable it after."""
+    truenas_pypam.set_event_buffer(size=64)
+    yield truenas_pypam.set_event_buffer
+    truenas_pypam.set_event_buffer()
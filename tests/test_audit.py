@@ -197,4 +197,20 @@ def test_multiple_operations_audit(audit_collector):
     # All should have the same user
     for event, args in audit_collector.events:
         if event.startswith('truenas_pypam.') and event != 'truenas_pypam.setcred':
-            assert args == (TEST_USER,)
\ No newline at end of file
+            assert args == (TEST_USER,)
+
+def test_authenticate_many_audit(audit_collector):
+    """Test that authenticate_many audits every credential."""
+    audit_collector.clear()
+
+    truenas_pypam.authenticate_many('login', [
+        (TEST_USER, TEST_PASSWORD),
+        ('otheruser', TEST_PASSWORD),
+    ])
+
+    auth_events = [e for e in audit_collector.events
+                   if e[0] == 'truenas_pypam.authenticate']
+    assert auth_events == [
+        ('truenas_pypam.authenticate', (TEST_USER,)),
+        ('truenas_pypam.authenticate', ('otheruser',)),
+    ]
@@ -1,7 +1,12 @@
 """Tests for truenas_authenticator high-level API."""
 
+import os
+import pwd
+import tempfile
+import time
 import pytest
 import truenas_pypam
+from truenas_authenticator import authenticator
 from truenas_authenticator import (
     UserPamAuthenticator,
     SimpleAuthenticator,
@@ -101,6 +106,7 @@ def test_auth_continue_with_correct_password():
     assert resp.stage == AuthenticatorStage.AUTH
     assert auth.state.stage == AuthenticatorStage.LOGIN
     assert auth.ctx is not None
+    assert resp.user_info['pw_uid'] == pwd.getpwnam(TEST_USER).pw_uid
 
 
 def test_auth_continue_with_wrong_password():
@@ -169,18 +175,104 @@ def test_end_cleanup():
     resp = auth.auth_init()
 
     # Start authentication
-    assert auth._thread_state is not None
-    assert auth._auth_thread is not None
+    assert auth._auth_ctx is not None
 
     # Clean up
     auth.end()
 
     assert auth.ctx is None
-    assert auth._thread_state is None
-    assert auth._auth_thread is None
+    assert auth._auth_ctx is None
     assert auth.state.stage == AuthenticatorStage.START
 
 
+def test_end_bounded_with_hung_module():
+    """Test end() doesn't wait for a PAM call stuck in a module."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'auth-hung'), 'w') as f:
+            f.write('auth requisite pam_exec.so quiet /bin/sleep 3\n')
+            f.write('auth required pam_unix.so\n')
+
+        auth = UserPamAuthenticator(
+            username=TEST_USER, service='auth-hung', confdir=confdir,
+            authentication_timeout=0.2
+        )
+        saved = authenticator.ABORT_TIMEOUT
+        authenticator.ABORT_TIMEOUT = 0.2
+        try:
+            start = time.monotonic()
+            resp = auth.auth_init()
+            elapsed = time.monotonic() - start
+        finally:
+            authenticator.ABORT_TIMEOUT = saved
+
+    assert resp.code == truenas_pypam.PAMCode.PAM_SYSTEM_ERR
+    assert 'timeout' in resp.reason
+    assert elapsed < 2
+    assert auth._auth_ctx is None
+    assert auth.state.stage == AuthenticatorStage.START
+
+
+def test_abandoned_login_released():
+    """Test a login abandoned after auth_init() frees its thread and lock."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'auth-locked'), 'w') as f:
+            f.write('auth required pam_unix.so\n')
+
+        truenas_pypam.set_lock_policy(truenas_pypam.LockPolicy.SERVICE,
+                                      service_name='auth-locked')
+        try:
+            threads = len(os.listdir('/proc/self/task'))
+            auth = UserPamAuthenticator(
+                username=TEST_USER, service='auth-locked', confdir=confdir,
+                authentication_timeout=0.5
+            )
+            resp = auth.auth_init()
+            assert resp.code == truenas_pypam.PAMCode.PAM_CONV_AGAIN
+
+            # Another login of the service gets the domain once the
+            # abandoned one has given up
+            ctx = truenas_pypam.get_context(
+                service_name='auth-locked', confdir=confdir, user=TEST_USER,
+                conversation_responses={
+                    truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+                },
+                timeout=10
+            )
+            ctx.authenticate()
+
+            # The worker exits right after releasing the domain
+            deadline = time.monotonic() + 5
+            while len(os.listdir('/proc/self/task')) > threads:
+                assert time.monotonic() < deadline
+                time.sleep(0.01)
+
+            resp = auth.auth_continue([CORRECT_PASSWORD])
+            assert resp.code != truenas_pypam.PAMCode.PAM_SUCCESS
+        finally:
+            truenas_pypam.set_lock_policy(None, service_name='auth-locked')
+
+
+def test_end_during_conversation():
+    """Test authentication can be restarted after end() aborts it."""
+    auth = UserPamAuthenticator(username=TEST_USER)
+    resp = auth.auth_init()
+    assert resp.code == truenas_pypam.PAMCode.PAM_CONV_AGAIN
+
+    auth.end()
+
+    resp = auth.auth_init()
+    assert resp.code == truenas_pypam.PAMCode.PAM_CONV_AGAIN
+
+    responses = [
+        CORRECT_PASSWORD
+        if msg.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF
+        else None
+        for msg in resp.reason
+    ]
+    resp = auth.auth_continue(responses)
+    assert resp.code == truenas_pypam.PAMCode.PAM_SUCCESS
+
+
 def test_simple_authenticator_init():
     """Test SimpleAuthenticator initialization."""
     auth = SimpleAuthenticator(username=TEST_USER, password=CORRECT_PASSWORD)
@@ -200,6 +292,20 @@ def test_simple_authenticator_authenticate_simple(password, expected):
     assert result == expected
 
 
+def test_simple_authenticator_user_info():
+    """Test a successful authentication returns the passwd entry."""
+    pw = pwd.getpwnam(TEST_USER)
+    auth = SimpleAuthenticator(username=TEST_USER, password=CORRECT_PASSWORD)
+    resp = auth.auth_init()
+
+    assert resp.code == truenas_pypam.PAMCode.PAM_SUCCESS
+    assert resp.user_info['pw_name'] == TEST_USER
+    assert resp.user_info['pw_uid'] == pw.pw_uid
+    assert resp.user_info['pw_gid'] == pw.pw_gid
+    assert resp.user_info['account_attributes'] == []
+    assert auth.state.passwd['pw_dir'] == pw.pw_dir
+
+
 def test_authenticator_response_fields():
     """Test AuthenticatorResponse fields."""
     auth = UserPamAuthenticator(username=TEST_USER)
@@ -268,3 +374,27 @@ def test_login_at_property():
     """Test login_at property."""
     auth = UserPamAuthenticator(username=TEST_USER)
     assert auth.login_at is None  # Not logged in yet
+
+
+@pytest.mark.parametrize("module,expected", [
+    ('pam_permit.so', truenas_pypam.PAMCode.PAM_SUCCESS),
+    ('pam_deny.so', truenas_pypam.PAMCode.PAM_AUTH_ERR),
+])
+def test_authenticator_confdir(module, expected):
+    """Test authenticators use the PAM configuration in confdir."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'auth-test'), 'w') as f:
+            f.write(f'auth required {module}\n')
+
+        auth = UserPamAuthenticator(
+            username=TEST_USER, service='auth-test', confdir=confdir
+        )
+        assert auth.auth_init().code == expected
+        auth.end()
+
+        auth = SimpleAuthenticator(
+            username=TEST_USER, password=WRONG_PASSWORD,
+            service='auth-test', confdir=confdir
+        )
+        assert auth.auth_init().code == expected
+        auth.end()
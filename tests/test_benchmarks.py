@@ -0,0 +1,82 @@
+"""Smoke tests for benchmarks/bench_pam.py."""
+
+import importlib.util
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import pytest
+
+
+BENCH = os.path.join(
+    os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+    'benchmarks', 'bench_pam.py'
+)
+
+
+def run_bench(tmp, *args):
+    output = os.path.join(tmp, 'results.json')
+    proc = subprocess.run(
+        [sys.executable, BENCH, '--duration', '0.05', '--warmup', '0',
+         '--max-threads', '2', '--output', output, *args],
+        capture_output=True, text=True, timeout=300
+    )
+    with open(output) as f:
+        return proc, json.load(f)
+
+
+@pytest.mark.skipif(not os.path.exists(BENCH), reason='benchmarks not available')
+def test_bench_json():
+    """Test the benchmark emits well-formed results for each case."""
+    with tempfile.TemporaryDirectory() as tmp:
+        proc, report = run_bench(tmp, '--suite', 'lifecycle',
+                                 '--suite', 'errors')
+    assert proc.returncode == 0, proc.stderr
+
+    assert report['meta']['threads'] == [1, 2]
+    names = {(r['name'], r['params']['threads']) for r in report['results']}
+    assert ('lifecycle', 2) in names
+    assert ('error_path', 1) in names
+
+    for result in report['results']:
+        assert result['ops'] > 0
+        assert result['ops_per_sec'] > 0
+        lat = result['latency_ns']
+        assert lat['p50'] <= lat['p90'] <= lat['p99'] <= lat['max']
+        assert result['extension_ns']['pam_authenticate']['count'] > 0
+
+
+@pytest.mark.skipif(not os.path.exists(BENCH), reason='benchmarks not available')
+def test_bench_compare():
+    """Test --compare flags cases slower than the baseline."""
+    with tempfile.TemporaryDirectory() as tmp:
+        proc, report = run_bench(tmp, '--suite', 'errors')
+        assert proc.returncode == 0, proc.stderr
+
+        for result in report['results']:
+            result['ops_per_sec'] *= 100
+
+        baseline = os.path.join(tmp, 'baseline.json')
+        with open(baseline, 'w') as f:
+            json.dump(report, f)
+
+        proc, report = run_bench(tmp, '--suite', 'errors',
+                                 '--compare', baseline)
+    assert proc.returncode == 1
+    assert len(report['regressions']) == len(report['results'])
+
+
+@pytest.mark.skipif(not os.path.exists(BENCH), reason='benchmarks not available')
+@pytest.mark.skipif(importlib.util.find_spec('pam_tnpam_test') is None,
+                    reason='pam_tnpam_test not built')
+def test_bench_synthetic():
+    """Test the synthetic suite runs against pam_tnpam_test."""
+    with tempfile.TemporaryDirectory() as tmp:
+        proc, report = run_bench(tmp, '--suite', 'synthetic')
+    assert proc.returncode == 0, proc.stderr
+
+    stacks = {r['params']['stack'] for r in report['results']}
+    assert stacks == {'tt-rounds', 'tt-latency', 'tt-flaky'}
+    for result in report['results']:
+        assert result['ops'] > 0
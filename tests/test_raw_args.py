@@ -0,0 +1,108 @@
+"""Tests for argument parsing of the fastcall / vectorcall entry points."""
+
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+RESPONSES = {truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD}
+
+
+def get_ctx(**kwargs):
+    return truenas_pypam.get_context(
+        user=TEST_USER, conversation_responses=RESPONSES, **kwargs
+    )
+
+
+def test_context_type_call():
+    """Test PamContext can be constructed by calling the type directly."""
+    ctx = type(get_ctx())(user=TEST_USER, conversation_responses=RESPONSES)
+    assert ctx.user == TEST_USER
+    ctx.authenticate()
+
+
+def test_context_reinit():
+    """Test explicit __init__() still parses the same arguments."""
+    ctx = get_ctx()
+    with pytest.raises(TypeError):
+        ctx.__init__(user=TEST_USER, bogus=1)
+
+
+@pytest.mark.parametrize("kwargs,exc", [
+    ({'user': 1}, TypeError),
+    ({'user': 'bo\0b'}, ValueError),
+    ({'service_name': None}, TypeError),
+    ({'rhost': 1}, TypeError),
+    ({'fail_delay': 1.5}, TypeError),
+    ({'fail_delay': 'x'}, TypeError),
+    ({'message_history_size': 1.5}, TypeError),
+    ({'message_history_size': 2 ** 64}, OverflowError),
+    ({'lock_group': 1}, TypeError),
+    ({'bogus': 1}, TypeError),
+])
+def test_get_context_bad_args(kwargs, exc):
+    """Test invalid get_context() arguments are rejected."""
+    args = {'user': TEST_USER, 'conversation_responses': RESPONSES}
+    args.update(kwargs)
+    with pytest.raises(exc):
+        truenas_pypam.get_context(**args)
+
+
+def test_get_context_optional_none():
+    """Test optional string arguments accept None."""
+    ctx = get_ctx(lock_group=None, lock_policy=None)
+    assert ctx.user == TEST_USER
+
+
+def test_get_context_positional():
+    """Test get_context() arguments are keyword-only."""
+    with pytest.raises(TypeError, match='positional'):
+        truenas_pypam.get_context('login', user=TEST_USER,
+                                  conversation_responses=RESPONSES)
+
+
+def test_method_positional():
+    """Test keyword-only method arguments reject positional use."""
+    ctx = get_ctx()
+    with pytest.raises(TypeError, match='positional'):
+        ctx.authenticate(True)
+    with pytest.raises(TypeError, match='positional'):
+        ctx.set_env('A', 'b')
+
+
+def test_method_bool_args():
+    """Test bool arguments accept any object with a truth value."""
+    ctx = get_ctx()
+    ctx.authenticate(silent=1, disallow_null_authtok=[])
+    ctx.acct_mgmt(silent=None)
+
+
+def test_required_positional_or_keyword():
+    """Test arguments that may be given by position or by name."""
+    ctx = get_ctx()
+    ctx.set_env(name='TEST_VAR', value='1')
+    assert ctx.get_env('TEST_VAR') == '1'
+    assert ctx.get_env(name='TEST_VAR') == '1'
+
+    with pytest.raises(TypeError, match='required'):
+        ctx.get_env()
+    with pytest.raises(TypeError, match='given by name'):
+        ctx.get_env('TEST_VAR', name='TEST_VAR')
+    with pytest.raises(TypeError, match='at most 1'):
+        ctx.get_env('TEST_VAR', 'extra')
+
+
+def test_module_function_args():
+    """Test module functions parse positional and keyword arguments."""
+    with pytest.raises(TypeError, match='required'):
+        truenas_pypam.authenticate_many('login')
+    with pytest.raises(TypeError, match='positional'):
+        truenas_pypam.stats(True)
+    with pytest.raises(TypeError, match='invalid keyword'):
+        truenas_pypam.set_async_workers(max_workers=1, extra=1)
+
+    prev = truenas_pypam.set_async_workers(4)
+    assert truenas_pypam.set_async_workers(max_workers=prev) == 4
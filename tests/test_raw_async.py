@@ -0,0 +1,188 @@
+"""Tests for truenas_pypam asyncio (awaitable) API."""
+
+import asyncio
+import os
+import tempfile
+import threading
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+
+def callback_basic_auth(ctx, messages, private_data):
+    """PAM conversation callback function for basic auth."""
+    reply = []
+    for m in messages:
+        rep = None
+        # PAM_PROMPT_ECHO_OFF (1) - typically password prompts
+        if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF:
+            if 'Password' in m.msg:
+                rep = private_data['password']
+        reply.append(rep)
+    return reply
+
+
+def get_ctx(password, **kwargs):
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_basic_auth,
+        conversation_private_data={'password': password},
+        **kwargs
+    )
+
+
+@pytest.fixture
+def session_confdir():
+    """PAM confdir with a session stack that does not depend on the host.
+
+    Several session modules in the stock login stack refuse to run from
+    anything other than the main thread, and async calls always happen on
+    a worker thread.
+    """
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'async-test'), 'w') as f:
+            f.write('auth required pam_unix.so\n')
+            f.write('account required pam_unix.so\n')
+            f.write('session required pam_permit.so\n')
+        yield confdir
+
+
+@pytest.mark.parametrize("method_name", [
+    'authenticate_async',
+    'acct_mgmt_async',
+    'setcred_async',
+    'open_session_async',
+    'close_session_async',
+    'chauthtok_async',
+])
+def test_context_has_async_methods(method_name):
+    """Test that PAM context has expected async methods."""
+    ctx = get_ctx(CORRECT_PASSWORD)
+    assert callable(getattr(ctx, method_name))
+
+
+def test_authenticate_async_requires_running_loop():
+    """Test that authenticate_async fails outside of an event loop."""
+    ctx = get_ctx(CORRECT_PASSWORD)
+    with pytest.raises(RuntimeError):
+        ctx.authenticate_async()
+
+
+def test_authenticate_async_success():
+    """Test awaiting authenticate_async with correct password."""
+    async def run():
+        ctx = get_ctx(CORRECT_PASSWORD)
+        assert await ctx.authenticate_async() is None
+        await ctx.acct_mgmt_async()
+
+    asyncio.run(run())
+
+
+def test_authenticate_async_wrong_password():
+    """Test awaiting authenticate_async with wrong password raises PAMError."""
+    async def run():
+        ctx = get_ctx(WRONG_PASSWORD)
+        await ctx.authenticate_async()
+
+    with pytest.raises(truenas_pypam.PAMError) as exc_info:
+        asyncio.run(run())
+
+    assert exc_info.value.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+    assert exc_info.value.message.startswith('pam_authenticate()')
+
+
+def test_authenticate_async_callback_exception():
+    """Test that exception raised in conversation reaches the awaiter."""
+    def bad_callback(ctx, messages, private_data):
+        raise ValueError('callback failure')
+
+    async def run():
+        ctx = truenas_pypam.get_context(
+            user=TEST_USER,
+            conversation_function=bad_callback
+        )
+        await ctx.authenticate_async()
+
+    with pytest.raises(ValueError, match='callback failure'):
+        asyncio.run(run())
+
+
+def test_authenticate_async_runs_off_loop_thread():
+    """Test that the conversation happens on a worker thread."""
+    threads = []
+
+    def callback(ctx, messages, private_data):
+        threads.append(threading.get_ident())
+        return callback_basic_auth(ctx, messages, private_data)
+
+    async def run():
+        ctx = truenas_pypam.get_context(
+            user=TEST_USER,
+            conversation_function=callback,
+            conversation_private_data={'password': CORRECT_PASSWORD}
+        )
+        await ctx.authenticate_async()
+
+    asyncio.run(run())
+    assert threads
+    assert threading.get_ident() not in threads
+
+
+def test_session_async(session_confdir):
+    """Test open and close session through the async API."""
+    async def run():
+        ctx = get_ctx(
+            CORRECT_PASSWORD,
+            service_name='async-test',
+            confdir=session_confdir
+        )
+        await ctx.authenticate_async()
+        await ctx.setcred_async(
+            operation=truenas_pypam.CredOp.PAM_ESTABLISH_CRED
+        )
+        await ctx.open_session_async()
+        await ctx.close_session_async()
+
+        # state is tracked the same as synchronous calls
+        with pytest.raises(ValueError):
+            ctx.close_session_async()
+
+    asyncio.run(run())
+
+
+def test_open_session_async_without_auth_fails():
+    """Test that state validation happens before the future is created."""
+    async def run():
+        ctx = get_ctx(CORRECT_PASSWORD)
+        ctx.open_session_async()
+
+    with pytest.raises(ValueError):
+        asyncio.run(run())
+
+
+def test_authenticate_async_concurrent():
+    """Test many concurrent authentications complete with correct results."""
+    async def run():
+        good = [get_ctx(CORRECT_PASSWORD) for _ in range(8)]
+        results = await asyncio.gather(
+            *[ctx.authenticate_async() for ctx in good],
+            return_exceptions=True
+        )
+        assert results == [None] * len(good)
+
+    asyncio.run(run())
+
+
+def test_set_async_workers():
+    """Test configuring the async worker pool size."""
+    prev = truenas_pypam.set_async_workers(4)
+    assert isinstance(prev, int)
+    assert truenas_pypam.set_async_workers(prev) == 4
+
+    with pytest.raises(ValueError):
+        truenas_pypam.set_async_workers(0)
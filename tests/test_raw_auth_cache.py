@@ -0,0 +1,333 @@
+"""Tests for the truenas_pypam credential cache."""
+
+import importlib.util
+import os
+import sys
+import tempfile
+import time
+import pytest
+import truenas_pypam
+
+# Test credentials from conftest.py. The auth_cache fixture enables the
+# cache for the test and disables it afterwards.
+from conftest import TEST_USER, TEST_PASSWORD as CORRECT_PASSWORD
+
+
+WRONG_PASSWORD = 'Dogs'
+
+MSGStyle = truenas_pypam.MSGStyle
+
+
+def get_ctx(password=CORRECT_PASSWORD, rhost=None, **kwargs):
+    """Cached context answering the password prompt, fail delay deferred."""
+    kwargs.setdefault('auth_cache', True)
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            MSGStyle.PAM_PROMPT_ECHO_OFF: password
+        },
+        defer_fail_delay=True,
+        **kwargs
+    )
+    if rhost is not None:
+        ctx.rhost = rhost
+    return ctx
+
+
+def lookups():
+    cache = truenas_pypam.get_auth_cache()
+    return cache['hits'], cache['misses']
+
+
+def test_default_disabled():
+    """Test the cache is disabled by default."""
+    cache = truenas_pypam.get_auth_cache()
+    assert cache['ttl'] == 0
+    assert cache['maxsize'] == 0
+    assert cache['entries'] == 0
+
+    hits, misses = lookups()
+    get_ctx().authenticate()
+    get_ctx().authenticate()
+    assert lookups() == (hits, misses)
+
+
+def test_hit(auth_cache):
+    """Test a repeated authentication is answered from the cache."""
+    hits, misses = lookups()
+    get_ctx().authenticate()
+    assert lookups() == (hits, misses + 1)
+    assert truenas_pypam.get_auth_cache()['entries'] == 1
+
+    ctx = get_ctx()
+    ctx.authenticate()
+    assert lookups() == (hits + 1, misses + 1)
+
+    # A cached authentication permits the rest of the transaction
+    ctx.acct_mgmt()
+
+
+def test_hit_skips_pam():
+    """Test a hit doesn't call into the module stack."""
+    truenas_pypam.set_auth_cache(ttl=60)
+    try:
+        get_ctx().authenticate()
+        ctx = get_ctx()
+        ctx.authenticate()
+        assert not any(ctx.messages())
+    finally:
+        truenas_pypam.set_auth_cache()
+
+
+def test_wrong_password_misses(auth_cache):
+    """Test a different secret is not answered from the cache."""
+    get_ctx().authenticate()
+    hits, misses = lookups()
+
+    with pytest.raises(truenas_pypam.PAMError):
+        get_ctx(WRONG_PASSWORD).authenticate()
+    assert lookups() == (hits, misses + 1)
+    assert truenas_pypam.get_auth_cache()['entries'] == 1
+
+
+def test_failure_not_cached(auth_cache):
+    """Test failed authentications are not remembered."""
+    for _ in range(2):
+        with pytest.raises(truenas_pypam.PAMError):
+            get_ctx(WRONG_PASSWORD).authenticate()
+    assert truenas_pypam.get_auth_cache()['entries'] == 0
+
+
+def test_rhost_part_of_key(auth_cache):
+    """Test an authentication from another remote host misses."""
+    get_ctx(rhost='192.0.2.1').authenticate()
+    hits, misses = lookups()
+
+    get_ctx(rhost='192.0.2.2').authenticate()
+    assert lookups() == (hits, misses + 1)
+    get_ctx(rhost='192.0.2.1').authenticate()
+    assert lookups() == (hits + 1, misses + 1)
+
+
+def test_flags_part_of_key(auth_cache):
+    """Test disallow_null_authtok is part of the key."""
+    get_ctx().authenticate()
+    hits, misses = lookups()
+    get_ctx().authenticate(disallow_null_authtok=True)
+    assert lookups() == (hits, misses + 1)
+
+
+def test_opt_in(auth_cache):
+    """Test contexts without auth_cache=True don't use the cache."""
+    get_ctx().authenticate()
+    hits, misses = lookups()
+    get_ctx(auth_cache=False).authenticate()
+    assert lookups() == (hits, misses)
+
+
+def test_ttl_expiry(auth_cache):
+    """Test entries expire after ttl and hits don't extend them."""
+    auth_cache(ttl=0.3)
+    get_ctx().authenticate()
+    time.sleep(0.2)
+    hits, misses = lookups()
+    get_ctx().authenticate()
+    assert lookups() == (hits + 1, misses)
+
+    time.sleep(0.2)
+    get_ctx().authenticate()
+    assert lookups() == (hits + 1, misses + 1)
+
+
+def test_maxsize_bound(auth_cache):
+    """Test the number of entries never exceeds maxsize."""
+    auth_cache(ttl=60, maxsize=4)
+    for i in range(10):
+        get_ctx(rhost=f'198.51.100.{i}').authenticate()
+
+    cache = truenas_pypam.get_auth_cache()
+    assert cache['maxsize'] == 4
+    assert cache['entries'] == 4
+
+
+def test_set_clears(auth_cache):
+    """Test reconfiguring the cache empties it."""
+    get_ctx().authenticate()
+    auth_cache(ttl=60)
+    assert truenas_pypam.get_auth_cache()['entries'] == 0
+
+
+def test_reenable_after_disable(auth_cache):
+    """Test the cache can be enabled again after ttl=0 with a maxsize."""
+    auth_cache(ttl=0, maxsize=4)
+    assert truenas_pypam.get_auth_cache()['maxsize'] == 0
+
+    auth_cache(ttl=60)
+    hits, misses = lookups()
+    get_ctx().authenticate()
+    get_ctx().authenticate()
+    assert lookups() == (hits + 1, misses + 1)
+
+
+def test_invalidate_user(auth_cache):
+    """Test invalidate_auth_cache() drops the entries of a user."""
+    get_ctx().authenticate()
+    get_ctx(rhost='192.0.2.1').authenticate()
+
+    assert truenas_pypam.invalidate_auth_cache(user='alice') == 0
+    assert truenas_pypam.invalidate_auth_cache(user=TEST_USER) == 2
+    assert truenas_pypam.get_auth_cache()['entries'] == 0
+
+    hits, misses = lookups()
+    get_ctx().authenticate()
+    assert lookups() == (hits, misses + 1)
+
+
+def test_invalidate_service(auth_cache):
+    """Test invalidate_auth_cache() drops the entries of a service."""
+    get_ctx().authenticate()
+    assert truenas_pypam.invalidate_auth_cache(service_name='sshd') == 0
+    assert truenas_pypam.invalidate_auth_cache(service_name='login') == 1
+
+
+def test_invalidate_all(auth_cache):
+    """Test invalidate_auth_cache() without arguments drops everything."""
+    get_ctx().authenticate()
+    get_ctx(rhost='192.0.2.1').authenticate()
+    assert truenas_pypam.invalidate_auth_cache() == 2
+
+
+def test_audit_event_on_hit(auth_cache):
+    """Test a cache hit still raises the authenticate audit event."""
+    events = []
+
+    def hook(event, args):
+        if event == 'truenas_pypam.authenticate':
+            events.append(args)
+
+    get_ctx().authenticate()
+    sys.addaudithook(hook)
+    hits, misses = lookups()
+    get_ctx().authenticate()
+    assert lookups() == (hits + 1, misses)
+    assert len(events) == 1
+
+
+def test_authenticate_many(auth_cache):
+    """Test authenticate_many() uses the cache when asked to."""
+    creds = [(TEST_USER, CORRECT_PASSWORD), (TEST_USER, WRONG_PASSWORD)]
+    PAMCode = truenas_pypam.PAMCode
+
+    hits, misses = lookups()
+    results = truenas_pypam.authenticate_many('login', creds, auth_cache=True)
+    assert results == (PAMCode.PAM_SUCCESS, PAMCode.PAM_AUTH_ERR)
+    assert lookups() == (hits, misses + 2)
+
+    results = truenas_pypam.authenticate_many('login', creds, auth_cache=True)
+    assert results == (PAMCode.PAM_SUCCESS, PAMCode.PAM_AUTH_ERR)
+    assert lookups() == (hits + 1, misses + 3)
+
+    truenas_pypam.authenticate_many('login', creds[:1])
+    assert lookups() == (hits + 1, misses + 3)
+
+
+def test_hit_not_rate_limited(auth_cache):
+    """Test cached authentications take no rate limit tokens."""
+    truenas_pypam.set_auth_rate_limit(user_rate=1e-6, user_burst=1)
+    try:
+        get_ctx().authenticate()
+        for _ in range(3):
+            get_ctx().authenticate()
+        with pytest.raises(truenas_pypam.AuthRateLimited):
+            get_ctx(WRONG_PASSWORD).authenticate()
+    finally:
+        truenas_pypam.set_auth_rate_limit()
+
+
+def test_requires_responses():
+    """Test auth_cache can't be used with a conversation function."""
+    with pytest.raises(ValueError):
+        truenas_pypam.get_context(
+            user=TEST_USER,
+            conversation_function=lambda ctx, messages, private: None,
+            auth_cache=True
+        )
+
+
+def test_set_conversation_refused():
+    """Test a conversation function can't be added after get_context()."""
+    ctx = get_ctx()
+    with pytest.raises(ValueError, match='auth_cache'):
+        ctx.set_conversation(
+            conversation_function=lambda ctx, messages, private: None
+        )
+
+
+def test_unanswered_prompt_not_cached(auth_cache):
+    """Test a callback can't answer prompts the cache key doesn't cover."""
+    spec = importlib.util.find_spec('pam_tnpam_test')
+    if spec is None:
+        pytest.skip('pam_tnpam_test not built')
+
+    def callback(ctx, messages, private_data):
+        return [
+            private_data if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF
+            else None for m in messages
+        ]
+
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'tt-echo-on'), 'w') as f:
+            f.write(f'auth required {spec.origin} style=echo_on,echo_off '
+                    f'password={CORRECT_PASSWORD}\n')
+
+        for password in (CORRECT_PASSWORD, WRONG_PASSWORD):
+            ctx = truenas_pypam.get_context(
+                service_name='tt-echo-on', confdir=confdir, user=TEST_USER,
+                conversation_responses={MSGStyle.PAM_PROMPT_ECHO_ON: 'x'},
+                conversation_private_data=password,
+                auth_cache=True,
+            )
+            with pytest.raises(ValueError):
+                ctx.set_conversation(conversation_function=callback)
+
+            # The password prompt stays unanswered
+            with pytest.raises(truenas_pypam.PAMError):
+                ctx.authenticate()
+
+    assert truenas_pypam.get_auth_cache()['entries'] == 0
+
+
+def test_pool_context(auth_cache):
+    """Test contexts from a pool use the cache."""
+    pool = truenas_pypam.get_context_pool(maxsize=2)
+    kwargs = {
+        'user': TEST_USER,
+        'conversation_responses': {
+            MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        },
+        'auth_cache': True,
+    }
+    pool.get_context(**kwargs).authenticate()
+    hits, misses = lookups()
+    pool.get_context(**kwargs).authenticate()
+    assert lookups() == (hits + 1, misses)
+
+
+@pytest.mark.parametrize('kwargs', [
+    {'ttl': -1},
+    {'ttl': float('inf')},
+    {'ttl': float('nan')},
+    {'ttl': 1, 'maxsize': 0},
+])
+def test_invalid_settings(kwargs):
+    """Test invalid settings are rejected."""
+    with pytest.raises(ValueError):
+        truenas_pypam.set_auth_cache(**kwargs)
+
+
+def test_invalid_types():
+    """Test non-numeric settings are rejected."""
+    with pytest.raises(TypeError):
+        truenas_pypam.set_auth_cache(ttl='long')
+    with pytest.raises(TypeError):
+        truenas_pypam.set_auth_cache(60)
@@ -0,0 +1,96 @@
+"""Tests for truenas_pypam.authenticate_many()."""
+
+import os
+import tempfile
+import time
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+PAMCode = truenas_pypam.PAMCode
+
+
+@pytest.fixture
+def confdir():
+    """PAM confdir with plain and slow auth stacks."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'batch-test'), 'w') as f:
+            f.write('auth required pam_unix.so\n')
+        with open(os.path.join(confdir, 'batch-slow'), 'w') as f:
+            f.write('auth requisite pam_exec.so quiet /bin/sleep 0.5\n')
+            f.write('auth required pam_unix.so\n')
+        yield confdir
+
+
+def test_authenticate_many_results(confdir):
+    """Test results are returned in input order."""
+    results = truenas_pypam.authenticate_many('batch-test', [
+        (TEST_USER, CORRECT_PASSWORD),
+        (TEST_USER, WRONG_PASSWORD),
+        (TEST_USER, CORRECT_PASSWORD.encode(), '192.168.1.1'),
+        ('nonexistent_user_12345', CORRECT_PASSWORD, None),
+    ], confdir=confdir)
+
+    assert isinstance(results, tuple)
+    assert results[0] is PAMCode.PAM_SUCCESS
+    assert results[1] == PAMCode.PAM_AUTH_ERR
+    assert results[2] is PAMCode.PAM_SUCCESS
+    assert results[3] != PAMCode.PAM_SUCCESS
+
+
+def test_authenticate_many_empty(confdir):
+    """Test an empty batch."""
+    assert truenas_pypam.authenticate_many(
+        'batch-test', [], confdir=confdir
+    ) == ()
+
+
+@pytest.mark.parametrize("concurrency", [1, 3, 64])
+def test_authenticate_many_concurrency(confdir, concurrency):
+    """Test every credential is processed regardless of concurrency."""
+    creds = [(TEST_USER, CORRECT_PASSWORD), (TEST_USER, WRONG_PASSWORD)] * 5
+    results = truenas_pypam.authenticate_many(
+        'batch-test', creds, concurrency=concurrency, confdir=confdir
+    )
+    assert results == (PAMCode.PAM_SUCCESS, PAMCode.PAM_AUTH_ERR) * 5
+
+
+def test_authenticate_many_runs_in_parallel(confdir):
+    """Test PAM calls overlap when concurrency allows."""
+    creds = [(TEST_USER, CORRECT_PASSWORD)] * 4
+
+    start = time.monotonic()
+    results = truenas_pypam.authenticate_many(
+        'batch-slow', creds, concurrency=4, confdir=confdir
+    )
+    elapsed = time.monotonic() - start
+
+    assert results == (PAMCode.PAM_SUCCESS,) * 4
+    assert elapsed < 1.5
+
+
+@pytest.mark.parametrize("creds,exc", [
+    (None, TypeError),
+    ([TEST_USER], TypeError),
+    ([(TEST_USER,)], TypeError),
+    ([(TEST_USER, 1)], TypeError),
+    ([(TEST_USER, CORRECT_PASSWORD, 1)], TypeError),
+    ([(TEST_USER, 'a\0b')], ValueError),
+])
+def test_authenticate_many_invalid(confdir, creds, exc):
+    """Test validation of credentials."""
+    with pytest.raises(exc):
+        truenas_pypam.authenticate_many('batch-test', creds, confdir=confdir)
+
+
+def test_authenticate_many_invalid_concurrency(confdir):
+    """Test concurrency must be positive."""
+    with pytest.raises(ValueError):
+        truenas_pypam.authenticate_many(
+            'batch-test', [], concurrency=0, confdir=confdir
+        )
@@ -0,0 +1,143 @@
+"""Tests for truenas_pypam declarative conversation responses."""
+
+import asyncio
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+MSGStyle = truenas_pypam.MSGStyle
+
+
+def callback_basic_auth(ctx, messages, private_data):
+    """PAM conversation callback function for basic auth."""
+    private_data['called'] += 1
+    reply = []
+    for m in messages:
+        rep = None
+        if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF:
+            rep = private_data['password']
+        reply.append(rep)
+    return reply
+
+
+def test_responses_without_callback():
+    """Test authentication with only conversation_responses."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD,
+            MSGStyle.PAM_PROMPT_ECHO_ON: TEST_USER,
+        }
+    )
+    ctx.authenticate()
+    ctx.acct_mgmt()
+
+
+def test_responses_wrong_password():
+    """Test wrong password from conversation_responses raises PAMError."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_OFF: WRONG_PASSWORD}
+    )
+    with pytest.raises(truenas_pypam.PAMError) as exc_info:
+        ctx.authenticate()
+
+    assert exc_info.value.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+
+
+def test_responses_bytes_value():
+    """Test bytes are accepted as response values."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD.encode()
+        }
+    )
+    ctx.authenticate()
+
+
+def test_responses_take_precedence_over_callback():
+    """Test callback is not called when every prompt has a response."""
+    data = {'called': 0, 'password': WRONG_PASSWORD}
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_basic_auth,
+        conversation_private_data=data,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD}
+    )
+    ctx.authenticate()
+    assert data['called'] == 0
+
+
+def test_responses_fallback_to_callback():
+    """Test prompts without a declared response go to the callback."""
+    data = {'called': 0, 'password': CORRECT_PASSWORD}
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_basic_auth,
+        conversation_private_data=data,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_ON: TEST_USER}
+    )
+    ctx.authenticate()
+    assert data['called'] > 0
+
+
+def test_responses_unmatched_prompt_without_callback():
+    """Test conversation fails when a prompt cannot be answered."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_ON: TEST_USER}
+    )
+    with pytest.raises(truenas_pypam.PAMError):
+        ctx.authenticate()
+
+
+def test_responses_recorded_in_messages():
+    """Test natively answered messages appear in history."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD}
+    )
+    ctx.authenticate()
+
+    history = ctx.messages()
+    assert len(history) > 0
+    assert isinstance(history[0], tuple)
+    assert history[0][0].msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF
+    assert isinstance(history[0][0].msg, str)
+
+
+def test_responses_async():
+    """Test conversation_responses with the async API."""
+    async def run():
+        ctx = truenas_pypam.get_context(
+            user=TEST_USER,
+            conversation_responses={
+                MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+            }
+        )
+        await ctx.authenticate_async()
+
+    asyncio.run(run())
+
+
+@pytest.mark.parametrize("responses,exc", [
+    ('not a mapping', TypeError),
+    ({MSGStyle.PAM_PROMPT_ECHO_OFF: 1}, TypeError),
+    ({'PAM_PROMPT_ECHO_OFF': 'x'}, TypeError),
+    ({0: 'x'}, ValueError),
+    ({5: 'x'}, ValueError),
+    ({MSGStyle.PAM_PROMPT_ECHO_OFF: 'a\0b'}, ValueError),
+])
+def test_responses_invalid(responses, exc):
+    """Test validation of conversation_responses."""
+    with pytest.raises(exc):
+        truenas_pypam.get_context(
+            user=TEST_USER,
+            conversation_responses=responses
+        )
@@ -115,6 +115,9 @@ def test_get_context_invalid_conversation_function():
     'get_env',
     'set_env',
     'env_dict',
+    'login',
+    'memory_usage',
+    'update_env',
     'setcred',
 ])
 def test_context_has_methods(method_name):
@@ -0,0 +1,168 @@
+"""Tests for truenas_pypam operation deadlines (timeout arguments)."""
+
+import asyncio
+import time
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+
+def password_responses(messages, password=CORRECT_PASSWORD):
+    return [
+        password
+        if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF
+        else None
+        for m in messages
+    ]
+
+
+def conv_callback(ctx, messages, private_data):
+    """Answer with the password after sleeping for private_data['delay']."""
+    private_data['calls'] += 1
+    time.sleep(private_data['delay'])
+    return password_responses(messages)
+
+
+def get_ctx(delay=0.0, **kwargs):
+    private = {'calls': 0, 'delay': delay}
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=conv_callback,
+        conversation_private_data=private,
+        **kwargs
+    )
+    return ctx, private
+
+
+def test_no_timeout_by_default():
+    """Test operations are not limited unless a timeout is given."""
+    ctx, private = get_ctx(delay=0.2)
+    ctx.authenticate()
+    assert private['calls'] == 1
+
+
+def test_timeout_not_reached():
+    """Test operations completing in time are unaffected."""
+    ctx, private = get_ctx(timeout=10)
+    ctx.authenticate()
+    ctx.acct_mgmt()
+    assert private['calls'] == 1
+
+
+def test_slow_conversation_times_out():
+    """Test an answer arriving after the deadline fails the operation."""
+    ctx, private = get_ctx(delay=0.3)
+    with pytest.raises(TimeoutError):
+        ctx.authenticate(timeout=0.1)
+    assert private['calls'] == 1
+
+
+def test_context_timeout():
+    """Test the context timeout applies to every operation."""
+    ctx, private = get_ctx(delay=0.3, timeout=0.1)
+    with pytest.raises(TimeoutError):
+        ctx.authenticate()
+
+
+def test_expired_deadline_skips_conversation():
+    """Test a deadline that has passed fails without calling the callback."""
+    ctx, private = get_ctx()
+    with pytest.raises(TimeoutError):
+        ctx.authenticate(timeout=0)
+    assert private['calls'] == 0
+
+
+def test_responses_expired_deadline():
+    """Test declarative responses are also refused after the deadline."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        }
+    )
+    with pytest.raises(TimeoutError):
+        ctx.authenticate(timeout=0)
+
+
+def test_operation_overrides_context():
+    """Test the timeout of an operation replaces the context default."""
+    ctx, private = get_ctx(delay=0.3, timeout=0.1)
+    ctx.authenticate(timeout=10)
+    assert private['calls'] == 1
+
+
+def test_context_usable_after_timeout():
+    """Test a timed out operation can be retried on the same context."""
+    ctx, private = get_ctx()
+    with pytest.raises(TimeoutError):
+        ctx.authenticate(timeout=0)
+    ctx.authenticate()
+    assert private['calls'] == 1
+
+
+def test_authenticate_async_timeout():
+    """Test authenticate_async() enforces its timeout."""
+    async def run():
+        ctx, private = get_ctx(delay=0.3)
+        with pytest.raises(TimeoutError):
+            await ctx.authenticate_async(timeout=0.1)
+
+        ctx, private = get_ctx(delay=0.1)
+        await ctx.authenticate_async(timeout=10)
+
+    asyncio.run(run())
+
+
+def test_login_timeout():
+    """Test login() raises TimeoutError instead of returning a result."""
+    ctx, private = get_ctx(delay=0.3)
+    with pytest.raises(TimeoutError):
+        ctx.login(steps=('authenticate', 'acct_mgmt'), timeout=0.1)
+
+    ctx, private = get_ctx()
+    result = ctx.login(steps=('authenticate', 'acct_mgmt'), timeout=10)
+    assert result.code == truenas_pypam.PAMCode.PAM_SUCCESS
+
+
+def test_auth_begin_deadline():
+    """Test a parked resumable operation gives up at the context deadline."""
+    ctx, private = get_ctx(timeout=0.2)
+    messages = ctx.auth_begin()
+    assert messages
+
+    # Nothing resumes the operation, the worker ends it by itself
+    time.sleep(0.4)
+    with pytest.raises(TimeoutError):
+        ctx.auth_resume(responses=password_responses(messages), timeout=5)
+    assert private['calls'] == 0
+
+    # The context is free for another operation without auth_abort()
+    ctx.authenticate(timeout=10)
+
+
+def test_auth_begin_within_deadline():
+    """Test resumable operations completing in time are unaffected."""
+    ctx, private = get_ctx(timeout=10)
+    messages = ctx.auth_begin()
+    assert ctx.auth_resume(responses=password_responses(messages)) is None
+
+
+@pytest.mark.parametrize('timeout', [-1, float('nan')])
+def test_invalid_timeout(timeout):
+    """Test negative and NaN timeouts are rejected."""
+    with pytest.raises(ValueError):
+        get_ctx(timeout=timeout)
+
+    ctx, private = get_ctx()
+    with pytest.raises(ValueError):
+        ctx.authenticate(timeout=timeout)
+
+
+def test_invalid_timeout_type():
+    """Test non-numeric timeouts are rejected."""
+    with pytest.raises(TypeError):
+        get_ctx(timeout='soon')
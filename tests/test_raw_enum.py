@@ -1,5 +1,10 @@
 """Tests for truenas_pypam enum functionality."""
 
+import os
+import pickle
+import subprocess
+import sys
+import tempfile
 import pytest
 import truenas_pypam
 
@@ -157,3 +162,101 @@ def test_enum_member_hashing():
 
     assert test_dict[truenas_pypam.PAMCode.PAM_SUCCESS] == 'success'
     assert test_dict[truenas_pypam.PAMCode.PAM_AUTH_ERR] == 'auth_error'
+
+
+def run_fresh(code, *args):
+    """Run code in a new interpreter that hasn't imported truenas_pypam."""
+    proc = subprocess.run([sys.executable, '-c', code, *args],
+                          capture_output=True, text=True, timeout=60)
+    assert proc.returncode == 0, proc.stderr
+    return proc.stdout
+
+
+def test_enums_created_on_first_access():
+    """Test importing the module doesn't create the enum classes."""
+    out = run_fresh(
+        'import truenas_pypam\n'
+        'names = ("PAMCode", "MSGStyle", "CredOp", "LockPolicy")\n'
+        'print(any(n in vars(truenas_pypam) for n in names))\n'
+        'code = truenas_pypam.PAMCode\n'
+        'print("PAMCode" in vars(truenas_pypam), code is truenas_pypam.PAMCode)\n'
+    )
+    assert out.split() == ['False', 'True', 'True']
+
+
+def test_enum_created_by_error_is_module_attribute():
+    """Test a PAMError raised before any access uses the module's PAMCode."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'deny'), 'w') as f:
+            f.write('auth required pam_deny.so\n')
+
+        out = run_fresh(
+            'import sys, truenas_pypam\n'
+            'ctx = truenas_pypam.get_context(service_name="deny",\n'
+            '                                confdir=sys.argv[1], user="x",\n'
+            '                                conversation_responses={})\n'
+            'try:\n'
+            '    ctx.authenticate()\n'
+            'except truenas_pypam.PAMError as e:\n'
+            '    print(e.code is truenas_pypam.PAMCode.PAM_AUTH_ERR)\n',
+            confdir
+        )
+    assert out.split() == ['True']
+
+
+@pytest.mark.parametrize('enum_name', ['PAMCode', 'MSGStyle', 'CredOp', 'LockPolicy'])
+def test_enum_module_and_pickle(enum_name):
+    """Test enums belong to the module whichever code creates them."""
+    enum_type = getattr(truenas_pypam, enum_name)
+    assert enum_type.__module__ == 'truenas_pypam'
+    assert enum_type.__qualname__ == enum_name
+
+    member = next(iter(enum_type))
+    assert pickle.loads(pickle.dumps(member)) is member
+
+
+def test_enum_created_by_error_pickles():
+    """Test an enum first created by a C path still belongs to the module."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'deny'), 'w') as f:
+            f.write('auth required pam_deny.so\n')
+
+        out = run_fresh(
+            'import pickle, sys, truenas_pypam\n'
+            'ctx = truenas_pypam.get_context(service_name="deny",\n'
+            '                                confdir=sys.argv[1], user="x",\n'
+            '                                conversation_responses={})\n'
+            'try:\n'
+            '    ctx.authenticate()\n'
+            'except truenas_pypam.PAMError as e:\n'
+            '    print(type(e.code).__module__)\n'
+            '    print(pickle.loads(pickle.dumps(e.code)) is e.code)\n',
+            confdir
+        )
+    assert out.split() == ['truenas_pypam', 'True']
+
+
+def test_enums_listed_before_creation():
+    """Test dir() and star imports include enums that weren't created."""
+    out = run_fresh(
+        'import truenas_pypam\n'
+        'print("CredOp" in dir(truenas_pypam))\n'
+        'ns = {}\n'
+        'exec("from truenas_pypam import *", ns)\n'
+        'print(ns["LockPolicy"] is truenas_pypam.LockPolicy)\n'
+    )
+    assert out.split() == ['True', 'True']
+
+
+def test_unknown_module_attribute():
+    """Test other missing attributes still raise AttributeError."""
+    with pytest.raises(AttributeError, match='no attribute'):
+        truenas_pypam.NoSuchEnum
+
+
+@pytest.mark.parametrize('value', [2, truenas_pypam.PAMCode.PAM_SYMBOL_ERR])
+def test_setcred_requires_cred_op_member(value):
+    """Test setcred() refuses ints equal to a CredOp value."""
+    ctx = truenas_pypam.get_context(user='x', conversation_responses={})
+    with pytest.raises(TypeError, match='CredOp enum member'):
+        ctx.setcred(operation=value)
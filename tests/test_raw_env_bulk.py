@@ -0,0 +1,134 @@
+"""Tests for bulk truenas_pypam PAM environment updates."""
+
+import os
+import pytest
+import tempfile
+import truenas_pypam
+
+
+TEST_USER = 'bob'
+RESPONSES = {truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: 'Cats'}
+
+
+def get_ctx(**kwargs):
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses=RESPONSES,
+        **kwargs
+    )
+
+
+def test_update_env_sets_variables():
+    """Test update_env() sets every variable in the mapping."""
+    ctx = get_ctx()
+    ctx.update_env({'FOO': 'foo', 'BAR': 'bar'})
+    assert ctx.env_dict() == {'FOO': 'foo', 'BAR': 'bar'}
+
+
+def test_update_env_removes_none():
+    """Test None values remove variables."""
+    ctx = get_ctx()
+    ctx.update_env({'FOO': 'foo', 'BAR': 'bar'})
+    ctx.update_env({'FOO': None, 'BAZ': 'baz'})
+    assert ctx.env_dict() == {'BAR': 'bar', 'BAZ': 'baz'}
+
+
+def test_update_env_empty():
+    """Test an empty mapping is a no-op."""
+    ctx = get_ctx()
+    ctx.update_env({})
+    assert ctx.env_dict() == {}
+
+
+def test_update_env_readonly():
+    """Test readonly refuses to overwrite existing variables."""
+    ctx = get_ctx()
+    ctx.update_env({'FOO': 'foo'})
+    with pytest.raises(truenas_pypam.PAMError, match='FOO') as exc:
+        ctx.update_env({'BAR': 'bar', 'FOO': 'new'}, readonly=True)
+
+    assert 'FOO' in exc.value.message
+    # variables before the failing key remain set
+    assert ctx.env_dict() == {'FOO': 'foo', 'BAR': 'bar'}
+
+
+def test_update_env_reports_failed_key():
+    """Test removing an unset variable names the key in the error."""
+    ctx = get_ctx()
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        ctx.update_env({'MISSING': None})
+
+    assert exc.value.code == truenas_pypam.PAMCode.PAM_BAD_ITEM
+    assert "'MISSING'" in str(exc.value)
+
+
+def test_update_env_not_mapping():
+    """Test non-mapping arguments are rejected."""
+    ctx = get_ctx()
+    with pytest.raises(TypeError, match='must be a mapping'):
+        ctx.update_env(['FOO=foo'])
+
+
+@pytest.mark.parametrize("env,exc_type", [
+    ({1: 'foo'}, TypeError),
+    ({'FOO': 1}, TypeError),
+    ({'': 'foo'}, ValueError),
+    ({'FOO=BAR': 'foo'}, ValueError),
+    ({'FOO\0': 'foo'}, ValueError),
+    ({'FOO': 'foo\0'}, ValueError),
+])
+def test_update_env_invalid(env, exc_type):
+    """Test invalid names and values are rejected before anything is set."""
+    ctx = get_ctx()
+    with pytest.raises(exc_type):
+        ctx.update_env({'GOOD': 'good', **env})
+
+    assert ctx.env_dict() == {}
+
+
+def test_get_context_pam_env():
+    """Test get_context() applies pam_env when creating the handle."""
+    ctx = get_ctx(pam_env={'FOO': 'foo', 'BAR': 'bar'})
+    assert ctx.env_dict() == {'FOO': 'foo', 'BAR': 'bar'}
+    ctx.authenticate()
+
+
+def test_get_context_pam_env_none():
+    """Test pam_env=None is accepted."""
+    ctx = get_ctx(pam_env=None)
+    assert ctx.env_dict() == {}
+
+
+def test_get_context_pam_env_failure():
+    """Test get_context() reports which pam_env key failed."""
+    with pytest.raises(truenas_pypam.PAMError, match="'MISSING'"):
+        get_ctx(pam_env={'FOO': 'foo', 'MISSING': None})
+
+
+def test_get_context_pam_env_invalid():
+    """Test get_context() validates pam_env."""
+    with pytest.raises(TypeError):
+        get_ctx(pam_env={'FOO': 1})
+
+    with pytest.raises(TypeError):
+        get_ctx(pam_env='FOO=foo')
+
+
+def test_pool_context_pam_env():
+    """Test pooled contexts apply pam_env and don't leak it on reuse."""
+    pool = truenas_pypam.get_context_pool(maxsize=1)
+
+    ctx = pool.get_context(
+        user=TEST_USER,
+        conversation_responses=RESPONSES,
+        pam_env={'FOO': 'foo'}
+    )
+    assert ctx.env_dict() == {'FOO': 'foo'}
+    del ctx
+
+    ctx = pool.get_context(
+        user=TEST_USER,
+        conversation_responses=RESPONSES,
+        pam_env={'BAR': 'bar'}
+    )
+    assert 'BAR' in ctx.env_dict()
@@ -0,0 +1,182 @@
+"""Tests for the truenas_pypam PamEnv mapping view."""
+
+import collections.abc
+import pytest
+import threading
+import truenas_pypam
+
+
+TEST_USER = 'bob'
+RESPONSES = {truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: 'Cats'}
+
+
+def get_ctx(**kwargs):
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses=RESPONSES,
+        **kwargs
+    )
+
+
+def test_env_is_mapping():
+    """Test ctx.env is a read-only Mapping."""
+    env = get_ctx().env
+    assert isinstance(env, collections.abc.Mapping)
+    assert not isinstance(env, collections.abc.MutableMapping)
+    assert type(env).__name__ == 'PamEnv'
+
+    with pytest.raises(TypeError):
+        env['FOO'] = 'foo'
+
+
+def test_env_cannot_instantiate():
+    """Test PamEnv can only be obtained from a context."""
+    with pytest.raises(TypeError):
+        type(get_ctx().env)()
+
+
+def test_env_getitem():
+    """Test indexing looks up single variables."""
+    ctx = get_ctx(pam_env={'FOO': 'foo', 'BAR': 'bar'})
+    assert ctx.env['FOO'] == 'foo'
+    assert ctx.env['BAR'] == 'bar'
+
+    with pytest.raises(KeyError, match='MISSING'):
+        ctx.env['MISSING']
+
+
+@pytest.mark.parametrize("key", [1, None, '', 'FOO=foo', 'FOO\0'])
+def test_env_invalid_keys(key):
+    """Test keys that can't name a variable are not found."""
+    env = get_ctx(pam_env={'FOO': 'foo'}).env
+    assert key not in env
+    assert env.get(key) is None
+
+    with pytest.raises(KeyError):
+        env[key]
+
+
+def test_env_contains_and_get():
+    """Test the in operator and get()."""
+    env = get_ctx(pam_env={'FOO': 'foo'}).env
+    assert 'FOO' in env
+    assert 'MISSING' not in env
+    assert env.get('FOO') == 'foo'
+    assert env.get('MISSING') is None
+    assert env.get('MISSING', 'default') == 'default'
+
+    with pytest.raises(TypeError):
+        env.get()
+
+
+def test_env_is_live():
+    """Test the view reflects changes made after it was obtained."""
+    ctx = get_ctx()
+    env = ctx.env
+    assert len(env) == 0
+    assert 'FOO' not in env
+
+    ctx.set_env(name='FOO', value='foo')
+    assert env['FOO'] == 'foo'
+    assert len(env) == 1
+
+    ctx.update_env({'FOO': None, 'BAR': 'bar'})
+    assert 'FOO' not in env
+    assert list(env) == ['BAR']
+
+
+def test_env_snapshots():
+    """Test iteration, keys(), items(), values() and copy()."""
+    ctx = get_ctx(pam_env={'FOO': 'foo', 'BAR': 'bar'})
+    env = ctx.env
+    expected = {'FOO': 'foo', 'BAR': 'bar'}
+
+    assert sorted(env) == ['BAR', 'FOO']
+    assert set(env.keys()) == set(expected)
+    assert dict(env.items()) == expected
+    assert sorted(env.values()) == ['bar', 'foo']
+    assert dict(env) == expected
+
+    snapshot = env.copy()
+    assert snapshot == expected
+    ctx.set_env(name='BAZ', value='baz')
+    assert 'BAZ' not in snapshot
+    assert 'BAZ' in env
+
+
+def test_env_iteration_snapshot():
+    """Test changes during iteration don't affect the iterator."""
+    ctx = get_ctx(pam_env={'FOO': 'foo'})
+    names = []
+    for name in ctx.env:
+        ctx.set_env(name=name + '_COPY', value='x')
+        names.append(name)
+
+    assert names == ['FOO']
+
+
+def test_env_equality():
+    """Test comparisons with dicts and other views."""
+    env = get_ctx(pam_env={'FOO': 'foo'}).env
+    assert env == {'FOO': 'foo'}
+    assert env != {'FOO': 'bar'}
+    assert env == get_ctx(pam_env={'FOO': 'foo'}).env
+    assert env != get_ctx().env
+    assert env != 'FOO=foo'
+
+
+def test_env_repr():
+    """Test repr shows a snapshot."""
+    env = get_ctx(pam_env={'FOO': 'foo'}).env
+    assert repr(env) == "PamEnv({'FOO': 'foo'})"
+
+
+def test_env_empty_value():
+    """Test variables with empty values are visible through the view."""
+    ctx = get_ctx(pam_env={'EMPTY': ''})
+    assert ctx.env['EMPTY'] == ''
+    assert 'EMPTY' in ctx.env
+    assert ctx.env.copy() == {'EMPTY': ''}
+
+
+def test_env_outlives_reference():
+    """Test the view keeps its context alive."""
+    env = get_ctx(pam_env={'FOO': 'foo'}).env
+    assert env['FOO'] == 'foo'
+
+
+def test_env_match_mapping():
+    """Test the view matches mapping patterns."""
+    match get_ctx(pam_env={'FOO': 'foo'}).env:
+        case {'FOO': value}:
+            assert value == 'foo'
+        case _:
+            pytest.fail('mapping pattern did not match')
+
+
+def test_env_threads():
+    """Test lookups from several threads while the environment changes."""
+    ctx = get_ctx(pam_env={'FOO': 'foo'})
+    env = ctx.env
+    errors = []
+
+    def reader():
+        try:
+            for _ in range(500):
+                assert env.get('FOO') in ('foo', 'bar')
+                assert env.get('BAZ') in (None, 'baz')
+        except Exception as exc:
+            errors.append(exc)
+
+    threads = [threading.Thread(target=reader) for _ in range(4)]
+    for t in threads:
+        t.start()
+
+    for i in range(500):
+        ctx.update_env({'FOO': 'bar' if i % 2 else 'foo', 'BAZ': 'baz'})
+        ctx.set_env(name='BAZ')
+
+    for t in threads:
+        t.join()
+
+    assert not errors
@@ -0,0 +1,82 @@
+"""Tests for truenas_pypam PAMError exception type."""
+
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+WRONG_PASSWORD = 'Dogs'
+
+
+def get_error():
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: WRONG_PASSWORD
+        }
+    )
+    with pytest.raises(truenas_pypam.PAMError) as exc_info:
+        ctx.authenticate()
+
+    return exc_info.value
+
+
+def test_pam_error_is_runtime_error():
+    """Test PAMError remains a RuntimeError subclass."""
+    assert issubclass(truenas_pypam.PAMError, RuntimeError)
+
+
+def test_pam_error_attributes():
+    """Test attributes of a PAMError raised by the extension."""
+    exc = get_error()
+    assert exc.code is truenas_pypam.PAMCode.PAM_AUTH_ERR
+    assert exc.name == 'PAM_AUTH_ERR'
+    assert exc.err_str == 'Authentication failure'
+    assert exc.message == 'pam_authenticate() failed'
+    assert exc.location.startswith('src/ext/')
+
+
+def test_pam_error_str_and_args():
+    """Test str(), repr() and args of a raised PAMError."""
+    exc = get_error()
+    expected = '[PAM_AUTH_ERR]: pam_authenticate() failed'
+    assert str(exc) == expected
+    assert exc.args == (expected,)
+    assert repr(exc) == f'PAMError({expected!r})'
+
+
+def test_pam_error_shared_per_code_values():
+    """Test repeated failures reuse the same per-code objects."""
+    first = get_error()
+    second = get_error()
+    assert first is not second
+    assert first.name is second.name
+    assert first.err_str is second.err_str
+
+
+def test_pam_error_attributes_read_only():
+    """Test PAMError attributes may not be modified."""
+    exc = get_error()
+    with pytest.raises(AttributeError):
+        exc.code = truenas_pypam.PAMCode.PAM_SUCCESS
+
+
+def test_pam_error_from_python():
+    """Test PAMError constructed from python has default attributes."""
+    exc = truenas_pypam.PAMError('custom')
+    assert str(exc) == 'custom'
+    assert exc.args == ('custom',)
+    assert exc.code == truenas_pypam.PAMCode.PAM_SUCCESS
+    assert exc.name == ''
+    assert exc.message == ''
+    assert exc.location == ''
+
+
+def test_pam_error_subclass():
+    """Test PAMError may be subclassed."""
+    class MyError(truenas_pypam.PAMError):
+        pass
+
+    with pytest.raises(truenas_pypam.PAMError):
+        raise MyError('x')
@@ -0,0 +1,244 @@
+"""Tests for the truenas_pypam auth event buffer."""
+
+import asyncio
+import os
+import select
+import time
+import pytest
+import truenas_pypam
+
+# Test credentials from conftest.py. The events fixture enables the event
+# buffer for the test and disables it afterwards.
+from conftest import TEST_USER, TEST_PASSWORD as CORRECT_PASSWORD
+
+
+WRONG_PASSWORD = 'Dogs'
+
+PAMCode = truenas_pypam.PAMCode
+
+
+def get_ctx(password=CORRECT_PASSWORD, rhost=None, **kwargs):
+    """Context answering the password prompt, fail delay deferred."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: password
+        },
+        defer_fail_delay=True,
+        **kwargs
+    )
+    if rhost is not None:
+        ctx.rhost = rhost
+    return ctx
+
+
+def readable(fd):
+    return bool(select.select([fd], [], [], 0)[0])
+
+
+def test_default_disabled():
+    """Test nothing is recorded unless the buffer is enabled."""
+    state = truenas_pypam.get_event_buffer()
+    assert state['size'] == 0
+    assert state['pending'] == 0
+
+    recorded = state['recorded']
+    get_ctx().authenticate()
+    assert truenas_pypam.drain_events() == ()
+    assert truenas_pypam.get_event_buffer()['recorded'] == recorded
+
+
+def test_authenticate_event(events):
+    """Test an authentication is recorded with its details."""
+    before = time.time()
+    get_ctx(rhost='192.0.2.1').authenticate()
+
+    (event,) = truenas_pypam.drain_events()
+    assert isinstance(event, truenas_pypam.AuthEvent)
+    assert event.operation == 'pam_authenticate'
+    assert event.service_name == 'login'
+    assert event.user == TEST_USER
+    assert event.rhost == '192.0.2.1'
+    assert event.code == PAMCode.PAM_SUCCESS
+    assert isinstance(event.code, PAMCode)
+    assert event.latency_ns > 0
+    assert before - 1 <= event.timestamp <= time.time() + 1
+
+
+def test_failure_event(events):
+    """Test failed calls are recorded with their PAM result."""
+    with pytest.raises(truenas_pypam.PAMError):
+        get_ctx(WRONG_PASSWORD).authenticate()
+
+    (event,) = truenas_pypam.drain_events()
+    assert event.code == PAMCode.PAM_AUTH_ERR
+    assert event.rhost is None
+
+
+def test_operations_in_order(events):
+    """Test every operation of a transaction is recorded in order."""
+    ctx = get_ctx()
+    ctx.authenticate()
+    ctx.acct_mgmt()
+    ctx.login(steps=('setcred',))
+
+    assert [e.operation for e in truenas_pypam.drain_events()] == [
+        'pam_authenticate', 'pam_acct_mgmt', 'pam_setcred'
+    ]
+
+
+def test_drain_max(events):
+    """Test drain_events(max=) returns the oldest events first."""
+    for i in range(5):
+        get_ctx(rhost=f'192.0.2.{i}').authenticate()
+
+    first = truenas_pypam.drain_events(max=2)
+    assert [e.rhost for e in first] == ['192.0.2.0', '192.0.2.1']
+    assert truenas_pypam.get_event_buffer()['pending'] == 3
+    assert truenas_pypam.drain_events(max=0) == ()
+
+    rest = truenas_pypam.drain_events(max=None)
+    assert [e.rhost for e in rest] == ['192.0.2.2', '192.0.2.3', '192.0.2.4']
+    assert truenas_pypam.drain_events() == ()
+
+
+def test_full_buffer_drops_new(events):
+    """Test events beyond the size are lost and counted, not overwritten."""
+    events(size=2)
+    lost = truenas_pypam.get_event_buffer()['lost']
+    for i in range(4):
+        get_ctx(rhost=f'192.0.2.{i}').authenticate()
+
+    state = truenas_pypam.get_event_buffer()
+    assert state['size'] == 2
+    assert state['pending'] == 2
+    assert state['lost'] == lost + 2
+    assert [e.rhost for e in truenas_pypam.drain_events()] == [
+        '192.0.2.0', '192.0.2.1'
+    ]
+
+
+def test_set_discards_pending(events):
+    """Test reconfiguring the buffer discards pending events."""
+    get_ctx().authenticate()
+    events(size=8)
+    assert truenas_pypam.drain_events() == ()
+
+
+def test_event_fd(events):
+    """Test the eventfd is readable exactly while events are pending."""
+    fd = truenas_pypam.event_fd()
+    assert fd == truenas_pypam.event_fd()
+    assert not readable(fd)
+
+    get_ctx().authenticate()
+    get_ctx().authenticate()
+    assert readable(fd)
+
+    truenas_pypam.drain_events(max=1)
+    assert readable(fd)
+    truenas_pypam.drain_events()
+    assert not readable(fd)
+
+
+def test_event_fd_add_reader(events):
+    """Test a consumer can wait for events in an asyncio event loop."""
+    async def run():
+        loop = asyncio.get_running_loop()
+        fd = truenas_pypam.event_fd()
+        ready = asyncio.Event()
+        drained = []
+
+        def on_readable():
+            drained.extend(truenas_pypam.drain_events())
+            ready.set()
+
+        loop.add_reader(fd, on_readable)
+        try:
+            await get_ctx().authenticate_async()
+            await asyncio.wait_for(ready.wait(), 5)
+        finally:
+            loop.remove_reader(fd)
+        return drained
+
+    drained = asyncio.run(run())
+    assert [e.operation for e in drained] == ['pam_authenticate']
+
+
+def test_cache_hit_recorded(events):
+    """Test authentications answered by the credential cache are recorded."""
+    truenas_pypam.set_auth_cache(ttl=60)
+    try:
+        get_ctx(auth_cache=True).authenticate()
+        get_ctx(auth_cache=True).authenticate()
+    finally:
+        truenas_pypam.set_auth_cache()
+
+    recorded = truenas_pypam.drain_events()
+    assert [e.code for e in recorded] == [PAMCode.PAM_SUCCESS] * 2
+    assert recorded[1].latency_ns == 0
+
+
+def test_rate_limited_recorded(events):
+    """Test refused attempts are recorded as PAM_MAXTRIES."""
+    truenas_pypam.set_auth_rate_limit(user_rate=1e-6, user_burst=1)
+    try:
+        get_ctx().authenticate()
+        with pytest.raises(truenas_pypam.AuthRateLimited):
+            get_ctx().authenticate()
+    finally:
+        truenas_pypam.set_auth_rate_limit()
+
+    assert [e.code for e in truenas_pypam.drain_events()] == [
+        PAMCode.PAM_SUCCESS, PAMCode.PAM_MAXTRIES
+    ]
+
+
+def test_authenticate_many_recorded(events):
+    """Test every credential of authenticate_many() is recorded."""
+    truenas_pypam.authenticate_many('login', [
+        (TEST_USER, CORRECT_PASSWORD, '192.0.2.1'),
+        (TEST_USER, WRONG_PASSWORD),
+    ], concurrency=1)
+
+    recorded = sorted(truenas_pypam.drain_events(), key=lambda e: e.code)
+    assert [(e.rhost, e.code) for e in recorded] == [
+        ('192.0.2.1', PAMCode.PAM_SUCCESS),
+        (None, PAMCode.PAM_AUTH_ERR),
+    ]
+    assert all(e.operation == 'pam_authenticate' for e in recorded)
+
+
+def test_fork_child(events):
+    """Test a forked child starts with no events and its own eventfd."""
+    fd = truenas_pypam.event_fd()
+    get_ctx().authenticate()
+
+    pid = os.fork()
+    if pid == 0:
+        ok = truenas_pypam.drain_events() == () and not readable(fd)
+        get_ctx().authenticate()
+        ok = ok and readable(fd)
+        os._exit(0 if ok else 1)
+
+    _, status = os.waitpid(pid, 0)
+    assert os.waitstatus_to_exitcode(status) == 0
+
+    # The child's events don't reach the parent
+    assert len(truenas_pypam.drain_events()) == 1
+    assert not readable(fd)
+
+
+@pytest.mark.parametrize('size', [-1, 1 << 21])
+def test_invalid_size(size):
+    """Test out of range sizes are rejected."""
+    with pytest.raises(ValueError):
+        truenas_pypam.set_event_buffer(size=size)
+
+
+def test_invalid_max():
+    """Test invalid max values are rejected."""
+    with pytest.raises(ValueError):
+        truenas_pypam.drain_events(max=-1)
+    with pytest.raises(TypeError):
+        truenas_pypam.drain_events(max='all')
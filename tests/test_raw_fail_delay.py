@@ -0,0 +1,188 @@
+"""Tests for deferring the PAM fail delay to the caller."""
+
+import asyncio
+import os
+import tempfile
+import threading
+import time
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+FAIL_DELAY = 1000000  # usec
+
+# libpam randomizes the delay by up to 50% either way
+MIN_DELAY = FAIL_DELAY // 2
+MAX_DELAY = FAIL_DELAY * 3 // 2
+
+
+@pytest.fixture
+def confdir():
+    """pam_unix without its built-in delay so only fail_delay applies."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'delay-test'), 'w') as f:
+            f.write('auth required pam_unix.so nodelay\n')
+            f.write('account required pam_unix.so\n')
+        yield confdir
+
+
+def get_ctx(confdir, password, **kwargs):
+    return truenas_pypam.get_context(
+        service_name='delay-test',
+        user=TEST_USER,
+        confdir=confdir,
+        fail_delay=FAIL_DELAY,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: password
+        },
+        **kwargs
+    )
+
+
+def test_fail_delay_default(confdir):
+    """Test libpam sleeps inside pam_authenticate() by default."""
+    ctx = get_ctx(confdir, WRONG_PASSWORD)
+    start = time.monotonic()
+    with pytest.raises(truenas_pypam.PAMError):
+        ctx.authenticate()
+
+    assert time.monotonic() - start >= MIN_DELAY / 1e6
+    assert ctx.last_fail_delay == 0
+
+
+def test_fail_delay_deferred(confdir):
+    """Test the delay is recorded instead of slept with defer_fail_delay."""
+    ctx = get_ctx(confdir, WRONG_PASSWORD, defer_fail_delay=True)
+    start = time.monotonic()
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        ctx.authenticate()
+
+    assert exc.value.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+    assert time.monotonic() - start < MIN_DELAY / 1e6
+    assert MIN_DELAY <= ctx.last_fail_delay <= MAX_DELAY
+
+
+def test_fail_delay_deferred_success(confdir):
+    """Test no delay is reported for successful authentication."""
+    ctx = get_ctx(confdir, CORRECT_PASSWORD, defer_fail_delay=True)
+    ctx.authenticate()
+    assert ctx.last_fail_delay == 0
+
+
+def test_fail_delay_reset(confdir):
+    """Test last_fail_delay only reflects the most recent PAM call."""
+    ctx = get_ctx(confdir, WRONG_PASSWORD, defer_fail_delay=True)
+    with pytest.raises(truenas_pypam.PAMError):
+        ctx.authenticate()
+    assert ctx.last_fail_delay > 0
+
+    ctx.acct_mgmt()
+    assert ctx.last_fail_delay == 0
+
+
+def test_fail_delay_deferred_resumable(confdir):
+    """Test the delay is deferred for auth_begin() / auth_resume()."""
+    ctx = truenas_pypam.get_context(
+        service_name='delay-test',
+        user=TEST_USER,
+        confdir=confdir,
+        fail_delay=FAIL_DELAY,
+        conversation_function=lambda *args: None,
+        defer_fail_delay=True
+    )
+    messages = ctx.auth_begin(timeout=10)
+    start = time.monotonic()
+    with pytest.raises(truenas_pypam.PAMError):
+        ctx.auth_resume(responses=[WRONG_PASSWORD] * len(messages), timeout=10)
+
+    assert time.monotonic() - start < MIN_DELAY / 1e6
+    assert MIN_DELAY <= ctx.last_fail_delay <= MAX_DELAY
+
+
+def test_fail_delay_deferred_threads(confdir):
+    """Test failing threads are not parked for the duration of the delay."""
+    def fail():
+        with pytest.raises(truenas_pypam.PAMError):
+            get_ctx(confdir, WRONG_PASSWORD, defer_fail_delay=True).authenticate()
+
+    start = time.monotonic()
+    threads = [threading.Thread(target=fail) for _ in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert time.monotonic() - start < MIN_DELAY / 1e6
+
+
+def test_fail_delay_async(confdir):
+    """Test authenticate_async() applies the delay with an event loop timer."""
+    async def run():
+        ctx = get_ctx(confdir, WRONG_PASSWORD, defer_fail_delay=True)
+        ticks = 0
+
+        async def ticker():
+            nonlocal ticks
+            while True:
+                await asyncio.sleep(0.01)
+                ticks += 1
+
+        tick_task = asyncio.create_task(ticker())
+        start = time.monotonic()
+        with pytest.raises(truenas_pypam.PAMError):
+            await ctx.authenticate_async()
+        elapsed = time.monotonic() - start
+        tick_task.cancel()
+        return ctx, elapsed, ticks
+
+    ctx, elapsed, ticks = asyncio.run(run())
+    assert elapsed >= ctx.last_fail_delay / 1e6 * 0.9
+    assert MIN_DELAY <= ctx.last_fail_delay <= MAX_DELAY
+    # The event loop kept running while the delay was pending
+    assert ticks > 10
+
+
+def test_fail_delay_async_success(confdir):
+    """Test successful async authentication is not delayed."""
+    async def run():
+        ctx = get_ctx(confdir, CORRECT_PASSWORD, defer_fail_delay=True)
+        await ctx.authenticate_async()
+        return ctx
+
+    assert asyncio.run(run()).last_fail_delay == 0
+
+
+def test_fail_delay_pool(confdir):
+    """Test the callback is not inherited by the next context of a pool."""
+    pool = truenas_pypam.get_context_pool(
+        service_name='delay-test', confdir=confdir
+    )
+    pool.prewarm(count=1)
+
+    def pool_ctx(**kwargs):
+        return pool.get_context(
+            user=TEST_USER,
+            fail_delay=FAIL_DELAY,
+            conversation_responses={
+                truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: WRONG_PASSWORD
+            },
+            **kwargs
+        )
+
+    ctx = pool_ctx(defer_fail_delay=True)
+    with pytest.raises(truenas_pypam.PAMError):
+        ctx.authenticate()
+    assert ctx.last_fail_delay > 0
+    del ctx
+
+    ctx = pool_ctx()
+    start = time.monotonic()
+    with pytest.raises(truenas_pypam.PAMError):
+        ctx.authenticate()
+    assert time.monotonic() - start >= MIN_DELAY / 1e6
+    assert ctx.last_fail_delay == 0
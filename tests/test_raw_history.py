@@ -0,0 +1,107 @@
+"""Tests for truenas_pypam conversation message history."""
+
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+MSGStyle = truenas_pypam.MSGStyle
+
+
+def get_ctx(**kwargs):
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD},
+        **kwargs
+    )
+
+
+def callback_counting(ctx, messages, private_data):
+    """Answer the password prompt and record which conversation this is."""
+    private_data.append(messages)
+    return [
+        CORRECT_PASSWORD if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF else None
+        for m in messages
+    ]
+
+
+def test_default_history_size():
+    """Test history is bounded by default."""
+    ctx = get_ctx()
+    assert ctx.message_history.maxlen == 64
+
+
+def test_history_view_is_live():
+    """Test message_history reflects later conversations."""
+    ctx = get_ctx()
+    view = ctx.message_history
+    assert len(view) == 0
+
+    ctx.authenticate()
+    assert len(view) == 1
+    assert view[0][0].msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF
+    assert view[-1] is view[0]
+    assert list(view) == list(ctx.messages())
+
+
+def test_history_view_index_error():
+    """Test out of range index raises IndexError."""
+    ctx = get_ctx()
+    with pytest.raises(IndexError):
+        ctx.message_history[0]
+
+
+def test_history_view_read_only():
+    """Test the history view cannot be modified."""
+    ctx = get_ctx()
+    ctx.authenticate()
+    with pytest.raises(TypeError):
+        ctx.message_history[0] = ()
+
+
+def test_history_evicts_oldest():
+    """Test oldest conversation is dropped once history is full."""
+    seen = []
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_counting,
+        conversation_private_data=seen,
+        message_history_size=2
+    )
+    for i in range(3):
+        ctx.authenticate()
+
+    history = ctx.messages()
+    assert len(seen) == 3
+    assert len(history) == 2
+    assert history[0] is seen[1]
+    assert history[1] is seen[2]
+    assert list(ctx.message_history) == list(history)
+
+
+def test_history_disabled():
+    """Test message_history_size=0 disables the history."""
+    ctx = get_ctx(message_history_size=0)
+    ctx.authenticate()
+    assert ctx.messages() == ()
+    assert len(ctx.message_history) == 0
+
+
+def test_history_view_outlives_context():
+    """Test the view keeps its context alive."""
+    view = get_ctx().message_history
+    assert len(view) == 0
+
+
+@pytest.mark.parametrize("size,exc", [
+    (-1, ValueError),
+    ('a', TypeError),
+])
+def test_invalid_history_size(size, exc):
+    """Test validation of message_history_size."""
+    with pytest.raises(exc):
+        get_ctx(message_history_size=size)
@@ -0,0 +1,270 @@
+"""Tests for truenas_pypam lock policies."""
+
+import os
+import tempfile
+import threading
+import time
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+LockPolicy = truenas_pypam.LockPolicy
+PAMCode = truenas_pypam.PAMCode
+
+NTHREADS = 3
+DELAY = 0.5
+
+
+@pytest.fixture
+def confdir():
+    """PAM confdir with two slow auth stacks and lock policies reset."""
+    with tempfile.TemporaryDirectory() as confdir:
+        for service in ('lock-slow', 'lock-slow2'):
+            with open(os.path.join(confdir, service), 'w') as f:
+                f.write(f'auth requisite pam_exec.so quiet /bin/sleep {DELAY}\n')
+                f.write('auth required pam_unix.so\n')
+        try:
+            yield confdir
+        finally:
+            for service in ('lock-slow', 'lock-slow2', None):
+                truenas_pypam.set_lock_policy(None, service_name=service)
+
+
+def get_ctx(confdir, service='lock-slow', **kwargs):
+    return truenas_pypam.get_context(
+        service_name=service,
+        user=TEST_USER,
+        confdir=confdir,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        },
+        **kwargs
+    )
+
+
+def timed_threads(targets):
+    """Run targets in parallel threads and return (elapsed, errors)."""
+    barrier = threading.Barrier(len(targets))
+    errors = []
+
+    def wrapper(target):
+        barrier.wait()
+        try:
+            target()
+        except Exception as exc:
+            errors.append(exc)
+
+    threads = [threading.Thread(target=wrapper, args=(t,)) for t in targets]
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join(timeout=60)
+        assert not t.is_alive()
+
+    return time.monotonic() - start, errors
+
+
+def test_lock_policy_enum():
+    """Test LockPolicy members."""
+    assert LockPolicy.HANDLE == 0
+    assert [p.name for p in LockPolicy] == ['HANDLE', 'SERVICE', 'GROUP', 'GLOBAL']
+
+
+def test_lock_policy_default(confdir):
+    """Test contexts use only the handle lock by default."""
+    assert get_ctx(confdir).lock_policy is LockPolicy.HANDLE
+
+
+@pytest.mark.parametrize("policy,group", [
+    (LockPolicy.HANDLE, None),
+    (LockPolicy.SERVICE, None),
+    (LockPolicy.GROUP, 'shadow'),
+    (LockPolicy.GLOBAL, None),
+])
+def test_lock_policy_explicit(confdir, policy, group):
+    """Test an explicit lock_policy is used and PAM calls work under it."""
+    ctx = get_ctx(confdir, lock_policy=policy, lock_group=group)
+    assert ctx.lock_policy is policy
+    ctx.authenticate()
+
+
+@pytest.mark.parametrize("kwargs,exc", [
+    ({'lock_policy': 1}, TypeError),
+    ({'lock_policy': 'GLOBAL'}, TypeError),
+    ({'lock_policy': LockPolicy.GROUP}, ValueError),
+    ({'lock_policy': LockPolicy.SERVICE, 'lock_group': 'shadow'}, ValueError),
+    ({'lock_group': 'shadow'}, ValueError),
+])
+def test_lock_policy_invalid(confdir, kwargs, exc):
+    """Test invalid lock policy arguments are rejected."""
+    with pytest.raises(exc):
+        get_ctx(confdir, **kwargs)
+
+    with pytest.raises(exc):
+        truenas_pypam.set_lock_policy(
+            kwargs.get('lock_policy'), lock_group=kwargs.get('lock_group')
+        )
+
+
+def test_set_lock_policy(confdir):
+    """Test per-service and default policies from set_lock_policy()."""
+    truenas_pypam.set_lock_policy(LockPolicy.SERVICE, service_name='lock-slow')
+    assert get_ctx(confdir).lock_policy is LockPolicy.SERVICE
+    assert get_ctx(confdir, 'lock-slow2').lock_policy is LockPolicy.HANDLE
+
+    truenas_pypam.set_lock_policy(LockPolicy.GLOBAL)
+    assert get_ctx(confdir).lock_policy is LockPolicy.SERVICE
+    assert get_ctx(confdir, 'lock-slow2').lock_policy is LockPolicy.GLOBAL
+
+    # Explicit argument wins over registered policy
+    ctx = get_ctx(confdir, lock_policy=LockPolicy.HANDLE)
+    assert ctx.lock_policy is LockPolicy.HANDLE
+
+    truenas_pypam.set_lock_policy(None, service_name='lock-slow')
+    assert get_ctx(confdir).lock_policy is LockPolicy.GLOBAL
+
+    truenas_pypam.set_lock_policy(None)
+    assert get_ctx(confdir).lock_policy is LockPolicy.HANDLE
+
+
+def test_set_lock_policy_pool(confdir):
+    """Test pool contexts use the policy of the pool service."""
+    truenas_pypam.set_lock_policy(LockPolicy.SERVICE, service_name='lock-slow')
+    pool = truenas_pypam.get_context_pool(
+        service_name='lock-slow', confdir=confdir
+    )
+    ctx = pool.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        }
+    )
+    assert ctx.lock_policy is LockPolicy.SERVICE
+    ctx.authenticate()
+
+
+def test_lock_handle_parallel(confdir):
+    """Test contexts with the default policy authenticate in parallel."""
+    ctxs = [get_ctx(confdir) for _ in range(NTHREADS)]
+    elapsed, errors = timed_threads([c.authenticate for c in ctxs])
+    assert errors == []
+    assert elapsed < DELAY * NTHREADS - 0.2
+
+
+@pytest.mark.parametrize("policy,group", [
+    (LockPolicy.SERVICE, None),
+    (LockPolicy.GROUP, 'shadow'),
+    (LockPolicy.GLOBAL, None),
+])
+def test_lock_domain_serializes(confdir, policy, group):
+    """Test contexts sharing a lock domain do not run PAM in parallel."""
+    ctxs = [
+        get_ctx(confdir, lock_policy=policy, lock_group=group)
+        for _ in range(NTHREADS)
+    ]
+    elapsed, errors = timed_threads([c.authenticate for c in ctxs])
+    assert errors == []
+    assert elapsed >= DELAY * NTHREADS
+
+
+def test_lock_domains_independent(confdir):
+    """Test different services and groups do not serialize each other."""
+    ctxs = [
+        get_ctx(confdir, 'lock-slow', lock_policy=LockPolicy.SERVICE),
+        get_ctx(confdir, 'lock-slow2', lock_policy=LockPolicy.SERVICE),
+        get_ctx(confdir, lock_policy=LockPolicy.GROUP, lock_group='a'),
+        get_ctx(confdir, lock_policy=LockPolicy.GROUP, lock_group='b'),
+    ]
+    elapsed, errors = timed_threads([c.authenticate for c in ctxs])
+    assert errors == []
+    assert elapsed < DELAY * 2
+
+
+def test_lock_domain_callback_reentry(confdir):
+    """Test a conversation callback may use contexts of its own domain."""
+    other = get_ctx(confdir, lock_policy=LockPolicy.GLOBAL)
+
+    def conv(ctx, messages, private_data):
+        assert ctx.user == TEST_USER
+        assert other.user == TEST_USER
+        return [
+            CORRECT_PASSWORD
+            if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF
+            else None for m in messages
+        ]
+
+    ctx = truenas_pypam.get_context(
+        service_name='lock-slow',
+        user=TEST_USER,
+        confdir=confdir,
+        conversation_function=conv,
+        lock_policy=LockPolicy.GLOBAL
+    )
+    ctx.authenticate()
+
+
+def test_lock_domain_auth_begin(confdir):
+    """Test a paused resumable conversation keeps holding the domain."""
+    ctx = get_ctx(confdir, lock_policy=LockPolicy.GLOBAL)
+    ctx2 = truenas_pypam.get_context(
+        service_name='lock-slow',
+        user=TEST_USER,
+        confdir=confdir,
+        conversation_function=lambda c, m, p: [None] * len(m),
+        lock_policy=LockPolicy.GLOBAL
+    )
+    errors = []
+
+    def authenticate():
+        try:
+            ctx.authenticate()
+        except Exception as exc:
+            errors.append(exc)
+
+    messages = ctx2.auth_begin()
+    thread = threading.Thread(target=authenticate)
+    try:
+        assert len(messages) > 0
+        thread.start()
+        thread.join(timeout=DELAY * 3)
+        assert thread.is_alive()
+    finally:
+        ctx2.auth_resume(responses=[
+            CORRECT_PASSWORD
+            if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF
+            else None for m in messages
+        ])
+
+    thread.join(timeout=60)
+    assert not thread.is_alive()
+    assert errors == []
+
+
+def test_authenticate_many_lock_policy(confdir):
+    """Test authenticate_many() honours lock policies."""
+    creds = [(TEST_USER, CORRECT_PASSWORD)] * NTHREADS
+
+    start = time.monotonic()
+    results = truenas_pypam.authenticate_many(
+        'lock-slow', creds, concurrency=NTHREADS, confdir=confdir
+    )
+    assert results == (PAMCode.PAM_SUCCESS,) * NTHREADS
+    assert time.monotonic() - start < DELAY * NTHREADS - 0.2
+
+    truenas_pypam.set_lock_policy(LockPolicy.SERVICE, service_name='lock-slow')
+    start = time.monotonic()
+    results = truenas_pypam.authenticate_many(
+        'lock-slow', creds, concurrency=NTHREADS, confdir=confdir
+    )
+    assert results == (PAMCode.PAM_SUCCESS,) * NTHREADS
+    assert time.monotonic() - start >= DELAY * NTHREADS
+
+    with pytest.raises(ValueError):
+        truenas_pypam.authenticate_many(
+            'lock-slow', creds, confdir=confdir, lock_group='shadow'
+        )
@@ -0,0 +1,215 @@
+"""Tests for the truenas_pypam login() pipeline."""
+
+import os
+import sys
+import tempfile
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+ALL_STEPS = ('authenticate', 'acct_mgmt', 'setcred', 'open_session')
+
+
+@pytest.fixture
+def confdir():
+    """Services whose account or session stacks always fail."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'login-test'), 'w') as f:
+            f.write('auth required pam_unix.so nodelay\n')
+            f.write('account required pam_unix.so\n')
+            f.write('session required pam_permit.so\n')
+        with open(os.path.join(confdir, 'account-deny'), 'w') as f:
+            f.write('auth required pam_unix.so nodelay\n')
+            f.write('account required pam_deny.so\n')
+            f.write('session required pam_permit.so\n')
+        yield confdir
+
+
+def get_ctx(confdir, password=CORRECT_PASSWORD, service='login-test',
+            **kwargs):
+    return truenas_pypam.get_context(
+        service_name=service,
+        user=TEST_USER,
+        confdir=confdir,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: password
+        },
+        **kwargs
+    )
+
+
+def test_login_all_steps(confdir):
+    """Test the default pipeline runs every step."""
+    ctx = get_ctx(confdir)
+    result = ctx.login()
+
+    assert result.code == truenas_pypam.PAMCode.PAM_SUCCESS
+    assert result.step is None
+    assert result.completed == ALL_STEPS
+    assert type(result).__name__ == 'LoginResult'
+
+    code, step, completed = result
+    assert (code, step, completed) == (result.code, None, ALL_STEPS)
+
+    # authenticated and session state are updated
+    ctx.close_session()
+
+
+def test_login_session_state(confdir):
+    """Test a session opened by login() can't be opened again."""
+    ctx = get_ctx(confdir)
+    assert ctx.login().code == truenas_pypam.PAMCode.PAM_SUCCESS
+
+    with pytest.raises(ValueError, match='already opened'):
+        ctx.open_session()
+
+    with pytest.raises(ValueError, match='already opened'):
+        ctx.login(steps=['open_session'])
+
+
+def test_login_auth_failure(confdir):
+    """Test a failed authentication stops the pipeline."""
+    ctx = get_ctx(confdir, WRONG_PASSWORD)
+    result = ctx.login()
+
+    assert result.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+    assert result.step == 'authenticate'
+    assert result.completed == ()
+
+    # no session was opened
+    with pytest.raises(ValueError):
+        ctx.close_session()
+
+
+def test_login_acct_mgmt_failure(confdir):
+    """Test the result names the stage that failed."""
+    ctx = get_ctx(confdir, service='account-deny')
+    result = ctx.login()
+
+    assert result.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+    assert result.step == 'acct_mgmt'
+    assert result.completed == ('authenticate',)
+
+    # authentication succeeded so the session may be opened separately
+    ctx.open_session()
+    ctx.close_session()
+
+
+def test_login_subset(confdir):
+    """Test running a subset of the steps."""
+    ctx = get_ctx(confdir)
+    result = ctx.login(steps=('authenticate', 'acct_mgmt'))
+    assert result.completed == ('authenticate', 'acct_mgmt')
+
+    result = ctx.login(steps=['open_session'])
+    assert result.completed == ('open_session',)
+    ctx.close_session()
+
+
+def test_login_open_session_unauthenticated(confdir):
+    """Test open_session requires authentication first."""
+    ctx = get_ctx(confdir)
+    with pytest.raises(ValueError, match='pam_authenticate'):
+        ctx.login(steps=('acct_mgmt', 'open_session'))
+
+    with pytest.raises(ValueError, match='pam_authenticate'):
+        ctx.login(steps=('open_session', 'authenticate'))
+
+
+@pytest.mark.parametrize("steps,exc_type", [
+    ('authenticate', TypeError),
+    (42, TypeError),
+    ([1], TypeError),
+    ([], ValueError),
+    (['chauthtok'], ValueError),
+    (['authenticate', 'authenticate'], ValueError),
+])
+def test_login_invalid_steps(confdir, steps, exc_type):
+    """Test invalid steps are rejected before anything runs."""
+    ctx = get_ctx(confdir)
+    with pytest.raises(exc_type):
+        ctx.login(steps=steps)
+
+    with pytest.raises(ValueError):
+        ctx.open_session()
+
+
+def test_login_flags(confdir):
+    """Test silent and disallow_null_authtok are accepted."""
+    ctx = get_ctx(confdir)
+    result = ctx.login(silent=True, disallow_null_authtok=True)
+    assert result.code == truenas_pypam.PAMCode.PAM_SUCCESS
+    ctx.close_session()
+
+
+def test_login_conversation_exception(confdir):
+    """Test exceptions from the conversation function propagate."""
+    def callback(ctx, messages, private_data):
+        raise RuntimeError('conversation failed')
+
+    ctx = truenas_pypam.get_context(
+        service_name='login-test',
+        user=TEST_USER,
+        confdir=confdir,
+        conversation_function=callback
+    )
+
+    with pytest.raises(RuntimeError, match='conversation failed'):
+        ctx.login()
+
+
+def test_login_resume_busy(confdir):
+    """Test login() is refused while a resumable operation is pending."""
+    ctx = truenas_pypam.get_context(
+        service_name='login-test',
+        user=TEST_USER,
+        confdir=confdir,
+        conversation_function=lambda *args: None
+    )
+    ctx.auth_begin()
+    try:
+        with pytest.raises(RuntimeError, match='resumable'):
+            ctx.login()
+    finally:
+        ctx.auth_abort()
+
+
+def test_login_stats(confdir):
+    """Test each step is recorded in the context stats."""
+    ctx = get_ctx(confdir)
+    ctx.login()
+    stats = ctx.stats()
+    for name in ('pam_authenticate', 'pam_acct_mgmt', 'pam_setcred',
+                 'pam_open_session'):
+        assert stats[name]['count'] == 1
+
+    assert stats['lock_wait']['count'] == 1
+    ctx.close_session()
+
+
+def test_login_audit(confdir):
+    """Test login() raises the audit events of the individual steps."""
+    events = []
+
+    def hook(event, args):
+        if event.startswith('truenas_pypam.'):
+            events.append((event, args))
+
+    sys.addaudithook(hook)
+    ctx = get_ctx(confdir)
+    events.clear()
+    ctx.login()
+
+    assert events == [
+        ('truenas_pypam.authenticate', (TEST_USER,)),
+        ('truenas_pypam.acct_mgmt', (TEST_USER,)),
+        ('truenas_pypam.setcred',
+         (TEST_USER, truenas_pypam.CredOp.PAM_ESTABLISH_CRED)),
+        ('truenas_pypam.open_session', (TEST_USER,)),
+    ]
+    ctx.close_session()
@@ -0,0 +1,280 @@
+"""Tests for truenas_pypam memory accounting."""
+
+import gc
+import sys
+import threading
+import tracemalloc
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+COUNTERS = (
+    'contexts', 'open_sessions', 'pending_conversations',
+    'handle_bytes', 'responses', 'response_bytes',
+    'secret_bytes', 'secret_locked_bytes',
+)
+
+
+def get_ctx(**kwargs):
+    kwargs.setdefault('conversation_responses', {
+        truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+    })
+    return truenas_pypam.get_context(user=TEST_USER, **kwargs)
+
+
+def get_pooled_ctx(pool):
+    return pool.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        }
+    )
+
+
+def counter(name):
+    gc.collect()
+    return truenas_pypam.memory_stats()[name]
+
+
+def test_memory_stats_keys():
+    """Test memory_stats() reports every counter as an int."""
+    stats = truenas_pypam.memory_stats()
+    assert set(stats) == set(COUNTERS)
+    for name in COUNTERS:
+        assert isinstance(stats[name], int)
+        assert stats[name] >= 0
+
+
+def test_contexts_counter():
+    """Test live contexts are counted until deallocated."""
+    before = counter('contexts')
+    contexts = [get_ctx() for _ in range(3)]
+    assert counter('contexts') == before + 3
+
+    del contexts
+    assert counter('contexts') == before
+
+
+def test_failed_context_not_counted():
+    """Test a context that fails setup is not counted."""
+    before = counter('contexts')
+    with pytest.raises(ValueError):
+        get_ctx(message_history_size=-1)
+    assert counter('contexts') == before
+
+
+def test_handle_bytes_follow_contexts():
+    """Test handle estimates are added and removed with contexts."""
+    before = counter('handle_bytes')
+    ctx = get_ctx()
+    usage = ctx.memory_usage()
+    assert counter('handle_bytes') == before + usage['handle']
+
+    del ctx
+    assert counter('handle_bytes') == before
+
+
+def test_open_sessions_counter():
+    """Test open sessions are counted until closed."""
+    before = counter('open_sessions')
+    ctx = get_ctx()
+    ctx.authenticate()
+    ctx.open_session()
+    assert counter('open_sessions') == before + 1
+
+    ctx.close_session()
+    assert counter('open_sessions') == before
+
+
+def test_open_sessions_counter_dealloc():
+    """Test a context deallocated with an open session is uncounted."""
+    before = counter('open_sessions')
+    ctx = get_ctx()
+    ctx.authenticate()
+    ctx.open_session()
+    assert counter('open_sessions') == before + 1
+
+    del ctx
+    assert counter('open_sessions') == before
+
+
+def test_pending_conversations_counter():
+    """Test a conversation is counted while the callback runs."""
+    seen = []
+
+    def conv(ctx, messages, private):
+        seen.append(truenas_pypam.memory_stats()['pending_conversations'])
+        return [CORRECT_PASSWORD for _ in messages]
+
+    before = counter('pending_conversations')
+    ctx = truenas_pypam.get_context(user=TEST_USER, conversation_function=conv)
+    ctx.authenticate()
+
+    assert seen and all(n >= before + 1 for n in seen)
+    assert counter('pending_conversations') == before
+
+
+def test_pending_conversations_resumable():
+    """Test a parked resumable conversation is counted until resumed."""
+    before = counter('pending_conversations')
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=lambda ctx, messages, private: None
+    )
+    messages = ctx.auth_begin()
+    assert counter('pending_conversations') == before + 1
+
+    assert ctx.auth_resume(responses=[CORRECT_PASSWORD] * len(messages)) is None
+    assert counter('pending_conversations') == before
+
+
+def test_responses_counter_callback():
+    """Test response arrays from callbacks are counted with their text."""
+    def conv(ctx, messages, private):
+        return [CORRECT_PASSWORD for _ in messages]
+
+    stats = truenas_pypam.memory_stats()
+    ctx = truenas_pypam.get_context(user=TEST_USER, conversation_function=conv)
+    ctx.authenticate()
+    after = truenas_pypam.memory_stats()
+
+    assert after['responses'] >= stats['responses'] + 1
+    assert (after['response_bytes'] - stats['response_bytes'] >=
+            len(CORRECT_PASSWORD) + 1)
+
+
+def test_responses_counter_responder():
+    """Test response arrays from conversation_responses are counted."""
+    before = counter('responses')
+    ctx = get_ctx()
+    ctx.authenticate()
+    assert counter('responses') >= before + 1
+
+
+def test_responses_counter_threads():
+    """Test counters stay consistent with conversations on many threads."""
+    before = truenas_pypam.memory_stats()
+
+    def worker():
+        for _ in range(5):
+            get_ctx().authenticate()
+
+    threads = [threading.Thread(target=worker) for _ in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    gc.collect()
+    after = truenas_pypam.memory_stats()
+    assert after['responses'] >= before['responses'] + 20
+    assert after['contexts'] == before['contexts']
+    assert after['pending_conversations'] == before['pending_conversations']
+
+
+def test_sizeof():
+    """Test __sizeof__() includes the history ring and responses."""
+    small = get_ctx(message_history_size=0)
+    large = get_ctx(message_history_size=1000)
+    assert sys.getsizeof(small) > 0
+    assert large.__sizeof__() - small.__sizeof__() >= 1000 * 8
+
+    secret = 'x' * 4096
+    padded = get_ctx(
+        message_history_size=0,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: secret
+        }
+    )
+    assert (padded.__sizeof__() - small.__sizeof__() ==
+            len(secret) - len(CORRECT_PASSWORD))
+
+
+def test_memory_usage_keys():
+    """Test memory_usage() reports its parts and their total."""
+    ctx = get_ctx()
+    usage = ctx.memory_usage()
+    assert set(usage) == {'object', 'messages', 'handle', 'total'}
+    assert usage['object'] == ctx.__sizeof__()
+    assert usage['messages'] == 0
+    assert usage['total'] == usage['object'] + usage['messages'] + usage['handle']
+
+
+def test_memory_usage_messages():
+    """Test the message history is included once conversations happen."""
+    ctx = get_ctx()
+    before = ctx.memory_usage()['messages']
+    ctx.authenticate()
+
+    usage = ctx.memory_usage()
+    text = sum(len(m.msg) for conv in ctx.messages() for m in conv)
+    assert usage['messages'] > before + text
+
+
+def test_memory_usage_history_disabled():
+    """Test no message cost is reported with the history disabled."""
+    ctx = get_ctx(message_history_size=0)
+    ctx.authenticate()
+    assert ctx.memory_usage()['messages'] == 0
+
+
+def test_memory_usage_pooled_handle():
+    """Test a pooled context reports the estimate of the reused handle."""
+    pool = truenas_pypam.get_context_pool(maxsize=1)
+    ctx = get_pooled_ctx(pool)
+    estimate = ctx.memory_usage()['handle']
+    del ctx
+    assert pool.idle == 1
+
+    ctx = get_pooled_ctx(pool)
+    assert pool.reused == 1
+    assert ctx.memory_usage()['handle'] == estimate
+
+
+def test_memory_usage_handle_estimate_cached():
+    """Test contexts of the same service share one handle estimate."""
+    first = get_ctx().memory_usage()['handle']
+    estimates = []
+
+    def worker():
+        for _ in range(10):
+            estimates.append(get_ctx().memory_usage()['handle'])
+
+    threads = [threading.Thread(target=worker) for _ in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert estimates == [first] * 40
+
+
+def test_tracemalloc_domain():
+    """Test handle estimates are traced in TRACEMALLOC_DOMAIN."""
+    assert isinstance(truenas_pypam.TRACEMALLOC_DOMAIN, int)
+    traces = tracemalloc.Filter(True, __file__,
+                                domain=truenas_pypam.TRACEMALLOC_DOMAIN)
+
+    was_tracing = tracemalloc.is_tracing()
+    if not was_tracing:
+        tracemalloc.start()
+    try:
+        ctx = get_ctx()
+        handle = ctx.memory_usage()['handle']
+        if handle == 0:
+            pytest.skip('handle size estimates not available')
+
+        snapshot = tracemalloc.take_snapshot().filter_traces([traces])
+        assert sum(s.size for s in snapshot.statistics('filename')) == handle
+
+        del ctx
+        gc.collect()
+        snapshot = tracemalloc.take_snapshot().filter_traces([traces])
+        assert sum(s.size for s in snapshot.statistics('filename')) == 0
+    finally:
+        if not was_tracing:
+            tracemalloc.stop()
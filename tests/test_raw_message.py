@@ -0,0 +1,159 @@
+"""Tests for truenas_pypam conversation message objects."""
+
+import sys
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+MSGStyle = truenas_pypam.MSGStyle
+
+
+def get_messages():
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=lambda ctx, messages, private: None
+    )
+    messages = ctx.auth_begin()
+    assert messages
+    return ctx, messages
+
+
+def get_prompt():
+    ctx, messages = get_messages()
+    prompt = next(
+        m for m in messages if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF
+    )
+    return ctx, prompt
+
+
+def test_message_type():
+    """Test messages are struct_pam_message objects in a tuple."""
+    ctx, messages = get_messages()
+    assert isinstance(messages, tuple)
+    for m in messages:
+        assert type(m).__name__ == 'struct_pam_message'
+        assert type(m).__module__ == 'truenas_pypam'
+
+
+def test_message_fields():
+    """Test msg_style is a MSGStyle member and msg is str."""
+    ctx, prompt = get_prompt()
+    assert prompt.msg_style is MSGStyle.PAM_PROMPT_ECHO_OFF
+    assert isinstance(prompt.msg, str)
+    assert 'Password' in prompt.msg
+
+
+def test_message_style_shared():
+    """Test messages share the cached MSGStyle members."""
+    ctx1, prompt1 = get_prompt()
+    ctx2, prompt2 = get_prompt()
+    assert prompt1.msg_style is prompt2.msg_style
+
+
+def test_message_bytes():
+    """Test msg_bytes gives the undecoded text."""
+    ctx, prompt = get_prompt()
+    assert isinstance(prompt.msg_bytes, bytes)
+    assert prompt.msg_bytes == prompt.msg.encode()
+
+
+def test_message_lazy_decode():
+    """Test the text is decoded once on first access and then cached."""
+    ctx, prompt = get_prompt()
+    size = sys.getsizeof(prompt)
+    prompt.msg_bytes
+    assert sys.getsizeof(prompt) == size
+
+    text = prompt.msg
+    assert sys.getsizeof(prompt) > size
+    assert prompt.msg is text
+
+
+def test_message_sequence():
+    """Test messages index and unpack as (msg_style, msg)."""
+    ctx, prompt = get_prompt()
+    assert len(prompt) == 2
+    assert prompt[0] is prompt.msg_style
+    assert prompt[1] == prompt.msg
+    assert prompt[-1] == prompt.msg
+    with pytest.raises(IndexError):
+        prompt[2]
+
+    style, text = prompt
+    assert style is prompt.msg_style
+    assert text == prompt.msg
+
+
+def test_message_match():
+    """Test messages work with sequence patterns."""
+    ctx, prompt = get_prompt()
+    match prompt:
+        case (MSGStyle.PAM_PROMPT_ECHO_OFF, text):
+            assert text == prompt.msg
+        case _:
+            pytest.fail('message did not match sequence pattern')
+
+
+def test_message_equality():
+    """Test messages compare equal to each other and to tuples."""
+    ctx1, prompt1 = get_prompt()
+    ctx2, prompt2 = get_prompt()
+    assert prompt1 == prompt2
+    assert not prompt1 != prompt2
+    assert prompt1 == (prompt1.msg_style, prompt1.msg)
+    assert (prompt1.msg_style, prompt1.msg) == prompt1
+    assert prompt1 != (MSGStyle.PAM_TEXT_INFO, prompt1.msg)
+    assert prompt1 != 'Password: '
+
+
+def test_message_hash():
+    """Test messages hash like the equal tuple."""
+    ctx, prompt = get_prompt()
+    assert hash(prompt) == hash((prompt.msg_style, prompt.msg))
+    assert prompt in {(prompt.msg_style, prompt.msg)}
+
+
+def test_message_repr():
+    """Test repr() shows both fields."""
+    ctx, prompt = get_prompt()
+    text = repr(prompt)
+    assert text.startswith('truenas_pypam.struct_pam_message(')
+    assert 'PAM_PROMPT_ECHO_OFF' in text
+    assert repr(prompt.msg) in text
+
+
+def test_message_immutable():
+    """Test messages can't be created or modified from python."""
+    ctx, prompt = get_prompt()
+    with pytest.raises(TypeError):
+        type(prompt)()
+    with pytest.raises(AttributeError):
+        prompt.msg = 'changed'
+    with pytest.raises(AttributeError):
+        prompt.msg_style = MSGStyle.PAM_TEXT_INFO
+
+
+def test_message_survives_context():
+    """Test messages stay valid after their context is gone."""
+    ctx, messages = get_messages()
+    prompt = messages[-1]
+    ctx.auth_resume(responses=[CORRECT_PASSWORD] * len(messages))
+    del ctx
+    assert 'Password' in prompt.msg
+
+
+def test_message_history():
+    """Test the message history holds message objects."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD}
+    )
+    ctx.authenticate()
+    history = ctx.messages()
+    assert history
+    assert any(m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF
+               for conv in history for m in conv)
@@ -0,0 +1,111 @@
+"""Tests for the passwd entry of truenas_pypam contexts."""
+
+import os
+import pwd
+import threading
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+
+def get_ctx(user=TEST_USER):
+    return truenas_pypam.get_context(
+        user=user,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        }
+    )
+
+
+def test_passwd_fields():
+    """Test ctx.passwd matches the pwd module."""
+    pw = pwd.getpwnam(TEST_USER)
+    passwd = get_ctx().passwd
+
+    assert passwd['pw_name'] == pw.pw_name
+    assert passwd['pw_uid'] == pw.pw_uid
+    assert passwd['pw_gid'] == pw.pw_gid
+    assert passwd['pw_gecos'] == pw.pw_gecos
+    assert passwd['pw_dir'] == pw.pw_dir
+    assert passwd['pw_shell'] == pw.pw_shell
+
+
+def test_passwd_grouplist():
+    """Test grouplist matches os.getgrouplist()."""
+    pw = pwd.getpwnam(TEST_USER)
+    passwd = get_ctx().passwd
+    assert isinstance(passwd['grouplist'], tuple)
+    assert sorted(passwd['grouplist']) == sorted(
+        os.getgrouplist(TEST_USER, pw.pw_gid)
+    )
+    assert pw.pw_gid in passwd['grouplist']
+
+
+def test_passwd_after_acct_mgmt():
+    """Test the entry is available after authentication and acct_mgmt()."""
+    ctx = get_ctx()
+    ctx.authenticate()
+    ctx.acct_mgmt()
+    assert ctx.passwd['pw_name'] == TEST_USER
+
+
+def test_passwd_copy():
+    """Test each access returns an independent dict."""
+    ctx = get_ctx()
+    first = ctx.passwd
+    first['pw_name'] = 'changed'
+    assert ctx.passwd['pw_name'] == TEST_USER
+    assert ctx.passwd == ctx.passwd
+
+
+def test_passwd_unknown_user():
+    """Test ctx.passwd is None for a user NSS doesn't know."""
+    assert get_ctx('no_such_user_truenas_pypam').passwd is None
+
+
+def test_passwd_follows_user():
+    """Test the entry is looked up again when PAM_USER changes."""
+    ctx = get_ctx()
+    assert ctx.passwd['pw_name'] == TEST_USER
+    ctx.user = 'root'
+    assert ctx.passwd['pw_uid'] == 0
+    ctx.user = 'no_such_user_truenas_pypam'
+    assert ctx.passwd is None
+
+
+def test_passwd_read_only():
+    """Test ctx.passwd can't be assigned."""
+    ctx = get_ctx()
+    try:
+        ctx.passwd = {}
+    except AttributeError:
+        pass
+    else:
+        raise AssertionError('passwd should be read-only')
+
+
+def test_passwd_threads():
+    """Test concurrent access to the entry of a shared context."""
+    ctx = get_ctx()
+    errors = []
+
+    def worker():
+        try:
+            for i in range(200):
+                if i % 50 == 0:
+                    ctx.user = 'root' if i % 100 else TEST_USER
+                passwd = ctx.passwd
+                assert passwd['pw_name'] in (TEST_USER, 'root')
+        except Exception as exc:
+            errors.append(exc)
+
+    threads = [threading.Thread(target=worker) for _ in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert errors == []
@@ -0,0 +1,164 @@
+"""Tests for truenas_pypam PamContextPool."""
+
+import os
+import tempfile
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+SERVICE = 'pool-test'
+
+
+@pytest.fixture
+def pool():
+    """Pool for a PAM stack that does not depend on the host."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, SERVICE), 'w') as f:
+            f.write('auth required pam_unix.so\n')
+            f.write('account required pam_unix.so\n')
+            f.write('session required pam_permit.so\n')
+        yield truenas_pypam.get_context_pool(
+            service_name=SERVICE,
+            confdir=confdir,
+            maxsize=2
+        )
+
+
+def get_ctx(pool, password=CORRECT_PASSWORD, **kwargs):
+    return pool.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: password
+        },
+        **kwargs
+    )
+
+
+def test_pool_attributes(pool):
+    """Test attributes of a new pool."""
+    assert pool.service_name == SERVICE
+    assert os.path.isdir(pool.confdir)
+    assert pool.maxsize == 2
+    assert pool.idle == 0
+
+
+def test_pool_reuses_handle(pool):
+    """Test a released handle is given to the next context."""
+    ctx = get_ctx(pool)
+    ctx.authenticate()
+    ctx.acct_mgmt()
+    del ctx
+
+    assert pool.idle == 1
+    assert pool.started == 1
+
+    ctx = get_ctx(pool)
+    assert pool.idle == 0
+    assert pool.reused == 1
+    ctx.authenticate()
+
+
+def test_pool_failed_auth_then_success(pool):
+    """Test a handle used for a failed authentication is reusable."""
+    ctx = get_ctx(pool, WRONG_PASSWORD)
+    with pytest.raises(truenas_pypam.PAMError) as exc_info:
+        ctx.authenticate()
+    assert exc_info.value.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+    del ctx
+
+    ctx = get_ctx(pool)
+    assert pool.reused == 1
+    ctx.authenticate()
+
+
+def test_pool_resets_items_and_env(pool):
+    """Test items and environment do not leak to the next context."""
+    ctx = get_ctx(pool, rhost='192.168.1.1', ruser='remoteuser')
+    ctx.set_env(name='POOL_TEST', value='1')
+    assert ctx.env_dict() == {'POOL_TEST': '1'}
+    del ctx
+
+    ctx = get_ctx(pool)
+    assert pool.reused == 1
+    assert ctx.user == TEST_USER
+    assert ctx.rhost is None
+    assert ctx.ruser is None
+    assert ctx.env_dict() == {}
+
+
+def test_pool_does_not_reuse_after_setcred(pool):
+    """Test handles with established credentials are not returned."""
+    ctx = get_ctx(pool)
+    ctx.authenticate()
+    ctx.setcred(operation=truenas_pypam.CredOp.PAM_ESTABLISH_CRED)
+    del ctx
+
+    assert pool.idle == 0
+
+
+def test_pool_does_not_reuse_after_session(pool):
+    """Test handles that opened a session are not returned."""
+    ctx = get_ctx(pool)
+    ctx.authenticate()
+    ctx.open_session()
+    ctx.close_session()
+    del ctx
+
+    assert pool.idle == 0
+
+
+def test_pool_maxsize(pool):
+    """Test idle handles are capped at maxsize."""
+    contexts = [get_ctx(pool) for i in range(3)]
+    assert pool.started == 3
+    del contexts
+
+    assert pool.idle == pool.maxsize
+
+
+def test_pool_prewarm_and_clear(pool):
+    """Test prewarm() fills the pool and clear() empties it."""
+    assert pool.prewarm(count=1) == 1
+    assert pool.prewarm() == pool.maxsize
+    assert pool.started == pool.maxsize
+
+    ctx = get_ctx(pool)
+    assert pool.reused == 1
+    ctx.authenticate()
+
+    pool.clear()
+    assert pool.idle == 0
+
+
+def test_pool_context_outlives_pool(pool):
+    """Test a context keeps its pool alive."""
+    ctx = get_ctx(pool)
+    del pool
+    ctx.authenticate()
+
+
+def test_pool_rejects_service_name(pool):
+    """Test service_name and confdir come from the pool."""
+    with pytest.raises(TypeError):
+        get_ctx(pool, service_name='login')
+
+    with pytest.raises(TypeError):
+        get_ctx(pool, confdir='/etc/pam.d')
+
+
+def test_pool_requires_user(pool):
+    """Test get_context() argument validation is shared."""
+    with pytest.raises(ValueError, match='user is required'):
+        pool.get_context(conversation_function=lambda *args: [])
+
+
+@pytest.mark.parametrize("maxsize", [0, -1])
+def test_pool_invalid_maxsize(maxsize):
+    """Test maxsize must be positive."""
+    with pytest.raises(ValueError):
+        truenas_pypam.get_context_pool(maxsize=maxsize)
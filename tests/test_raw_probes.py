@@ -0,0 +1,43 @@
+"""Tests for the truenas_pypam USDT probes."""
+
+import pytest
+import truenas_pypam
+
+
+PROBES = (
+    'op__entry', 'op__return', 'start__return',
+    'conv__entry', 'conv__return', 'batch__return',
+)
+
+
+def read_extension():
+    with open(truenas_pypam.__file__, 'rb') as f:
+        return f.read()
+
+
+HAVE_PROBES = b'.note.stapsdt' in read_extension()
+
+
+@pytest.mark.skipif(not HAVE_PROBES, reason='built without <sys/sdt.h>')
+@pytest.mark.parametrize("probe", PROBES)
+def test_probe_present(probe):
+    """Test each probe is described in the stapsdt notes."""
+    assert b'truenas_pypam\0' + probe.encode() + b'\0' in read_extension()
+
+
+@pytest.mark.skipif(not HAVE_PROBES, reason='built without <sys/sdt.h>')
+def test_probe_semaphores():
+    """Test probe semaphores live in the .probes section."""
+    assert b'.probes' in read_extension()
+
+
+def test_probes_inactive():
+    """Test PAM calls work the same with probes compiled in or out."""
+    ctx = truenas_pypam.get_context(
+        user='bob',
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: 'Cats'
+        }
+    )
+    ctx.authenticate()
+    ctx.acct_mgmt()
@@ -0,0 +1,418 @@
+"""Tests for truenas_pypam.PamProcessPool (PAM calls in worker processes)."""
+
+import asyncio
+import gc
+import os
+import signal
+import tempfile
+import threading
+import time
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+PAMCode = truenas_pypam.PAMCode
+MSGStyle = truenas_pypam.MSGStyle
+DELAY = 0.5
+
+
+@pytest.fixture
+def pool():
+    return truenas_pypam.get_process_pool(workers=2)
+
+
+@pytest.fixture(scope='module')
+def confdir():
+    """PAM confdir with a slow stack and one whose session sets the env."""
+    with tempfile.TemporaryDirectory() as confdir:
+        envfile = os.path.join(confdir, 'env.conf')
+        with open(envfile, 'w') as f:
+            f.write('PROCPOOL_TEST DEFAULT=from-worker\n')
+
+        with open(os.path.join(confdir, 'procpool-slow'), 'w') as f:
+            f.write(f'auth requisite pam_exec.so quiet /bin/sleep {DELAY}\n')
+            f.write('auth required pam_permit.so\n')
+
+        with open(os.path.join(confdir, 'procpool-env'), 'w') as f:
+            f.write('auth required pam_permit.so\n')
+            f.write('account required pam_permit.so\n')
+            f.write(f'session required pam_env.so readenv=0 conffile={envfile}\n')
+
+        yield confdir
+
+
+def password_responses(messages, password=CORRECT_PASSWORD):
+    return [
+        password if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF else None
+        for m in messages
+    ]
+
+
+def get_ctx(pool, password=CORRECT_PASSWORD, **kwargs):
+    return pool.get_context(
+        user=TEST_USER,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_OFF: password},
+        **kwargs
+    )
+
+
+def wait_exited(pid, timeout=5):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            os.kill(pid, 0)
+        except ProcessLookupError:
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def test_pool_attributes(pool):
+    """Test the pool starts workers only when contexts need them."""
+    assert type(pool).__name__ == 'PamProcessPool'
+    assert pool.workers == 2
+    assert pool.max_requests == 0
+    assert pool.spawned == 0
+    assert pool.pids == ()
+
+    ctx = get_ctx(pool)
+    assert pool.spawned == 1
+    (pid,) = pool.pids
+    assert pid != os.getpid()
+    del ctx
+
+
+def test_authenticate(pool):
+    """Test authentication succeeds and fails as in process."""
+    ctx = get_ctx(pool)
+    ctx.authenticate()
+    ctx.acct_mgmt()
+
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        get_ctx(pool, WRONG_PASSWORD).authenticate()
+    assert exc.value.code == PAMCode.PAM_AUTH_ERR
+
+
+def test_conversation_callback(pool):
+    """Test the python callback runs in the application for the worker."""
+    seen = []
+
+    def callback(ctx, messages, private_data):
+        seen.append((os.getpid(), private_data))
+        return password_responses(messages)
+
+    ctx = pool.get_context(
+        user=TEST_USER,
+        conversation_function=callback,
+        conversation_private_data='private',
+    )
+    ctx.authenticate()
+    assert seen == [(os.getpid(), 'private')]
+
+
+def test_items_and_env_sent_to_worker(pool):
+    """Test items and environment set by the application reach the worker."""
+    ctx = get_ctx(pool, pam_env={'APP_VAR': 'app'})
+    ctx.rhost = '192.0.2.1'
+    ctx.set_env(name='OTHER', value='x')
+    ctx.authenticate()
+
+    assert ctx.rhost == '192.0.2.1'
+    assert ctx.env_dict() == {'APP_VAR': 'app', 'OTHER': 'x'}
+
+    ctx.set_env(name='OTHER')
+    ctx.acct_mgmt()
+    assert ctx.env_dict() == {'APP_VAR': 'app'}
+
+
+def test_env_set_by_worker(pool, confdir):
+    """Test the environment set by modules in the worker is visible."""
+    ctx = get_ctx(pool, service_name='procpool-env', confdir=confdir)
+    ctx.authenticate()
+    assert 'PROCPOOL_TEST' not in ctx.env_dict()
+
+    ctx.open_session()
+    assert ctx.get_env(name='PROCPOOL_TEST') == 'from-worker'
+    ctx.close_session()
+
+
+def test_login(pool, confdir):
+    """Test login() runs every step in the worker."""
+    ctx = get_ctx(pool, service_name='procpool-env', confdir=confdir)
+    result = ctx.login(steps=('authenticate', 'acct_mgmt', 'open_session'))
+    assert result.code == PAMCode.PAM_SUCCESS
+    assert ctx.get_env(name='PROCPOOL_TEST') == 'from-worker'
+    ctx.close_session()
+
+
+def test_authenticate_async(pool):
+    """Test the *_async() methods use the worker."""
+    async def run():
+        await get_ctx(pool).authenticate_async()
+        with pytest.raises(truenas_pypam.PAMError):
+            await get_ctx(pool, WRONG_PASSWORD).authenticate_async()
+
+    asyncio.run(run())
+
+
+def test_auth_begin_resume(pool):
+    """Test a resumable authentication parks the worker conversation."""
+    ctx = pool.get_context(
+        user=TEST_USER,
+        conversation_function=lambda c, m, p: password_responses(m),
+    )
+    messages = ctx.auth_begin()
+    assert messages
+    assert ctx.auth_resume(responses=password_responses(messages)) is None
+
+
+def test_workers_run_in_parallel(pool, confdir):
+    """Test contexts of different workers are not serialized."""
+    ctxs = [
+        get_ctx(pool, service_name='procpool-slow', confdir=confdir)
+        for _ in range(2)
+    ]
+    assert len(pool.pids) == 2
+
+    threads = [threading.Thread(target=ctx.authenticate) for ctx in ctxs]
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    elapsed = time.monotonic() - start
+    assert elapsed < DELAY * 1.8, f'took {elapsed:.2f}s'
+
+
+def test_contexts_share_workers():
+    """Test contexts beyond the number of workers share them."""
+    pool = truenas_pypam.get_process_pool(workers=1)
+    ctxs = [get_ctx(pool) for _ in range(3)]
+    for ctx in ctxs:
+        ctx.authenticate()
+    assert pool.spawned == 1
+
+
+def test_max_requests_recycles():
+    """Test a worker that served max_requests calls is replaced."""
+    pool = truenas_pypam.get_process_pool(workers=1, max_requests=2)
+    ctx = get_ctx(pool)
+    (old,) = pool.pids
+    ctx.authenticate()
+    ctx.acct_mgmt()
+    assert pool.pids == ()
+
+    # The retired worker still serves its contexts
+    ctx.authenticate()
+
+    new_ctx = get_ctx(pool)
+    new_ctx.authenticate()
+    (new,) = pool.pids
+    assert new != old
+    assert pool.spawned == 2
+
+    del ctx
+    assert wait_exited(old)
+
+
+def test_killed_worker(pool):
+    """Test operations fail with PAMError once the worker is gone."""
+    ctx = get_ctx(pool)
+    ctx.authenticate()
+    (pid,) = pool.pids
+
+    os.kill(pid, signal.SIGKILL)
+    assert wait_exited(pid)
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        ctx.authenticate()
+    assert exc.value.code == PAMCode.PAM_SYSTEM_ERR
+
+    # New contexts get a new worker
+    get_ctx(pool).authenticate()
+    assert pool.pids and pool.pids[0] != pid
+
+
+def test_worker_killed_during_call(pool, confdir):
+    """Test a worker dying in the middle of a PAM call fails the call."""
+    ctx = get_ctx(pool, service_name='procpool-slow', confdir=confdir)
+    (pid,) = pool.pids
+
+    threading.Timer(DELAY / 4, os.kill, (pid, signal.SIGKILL)).start()
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        ctx.authenticate()
+    assert exc.value.code == PAMCode.PAM_SYSTEM_ERR
+
+
+def test_hung_worker_killed_at_deadline(pool, confdir):
+    """Test the worker is killed when a PAM call outlives its deadline."""
+    ctx = get_ctx(pool, service_name='procpool-slow', confdir=confdir)
+    (pid,) = pool.pids
+
+    start = time.monotonic()
+    with pytest.raises(TimeoutError):
+        ctx.authenticate(timeout=DELAY / 5)
+    assert time.monotonic() - start < DELAY
+    assert wait_exited(pid)
+    assert pid not in pool.pids
+
+
+def test_same_worker_from_conversation():
+    """Test a callback can't use another context of the same worker."""
+    pool = truenas_pypam.get_process_pool(workers=1)
+    other = get_ctx(pool)
+    errors = []
+
+    def callback(ctx, messages, private_data):
+        try:
+            other.authenticate()
+        except RuntimeError as e:
+            errors.append(e)
+        return password_responses(messages)
+
+    ctx = pool.get_context(user=TEST_USER, conversation_function=callback)
+    ctx.authenticate()
+    assert len(errors) == 1
+
+    other.authenticate()
+
+
+def test_drop_context_from_conversation():
+    """Test a callback can drop the last reference to a context of its worker."""
+    pool = truenas_pypam.get_process_pool(workers=1)
+    others = [get_ctx(pool), get_ctx(pool)]
+
+    # The second one is only freed by the garbage collector
+    cycle = [others.pop()]
+    cycle.append(cycle)
+    del cycle
+
+    def callback(ctx, messages, private_data):
+        others.clear()
+        gc.collect()
+        return password_responses(messages)
+
+    ctx = pool.get_context(user=TEST_USER, conversation_function=callback)
+    ctx.authenticate()
+    assert others == []
+
+    # The worker ended both handles and still serves its contexts
+    ctx.authenticate()
+    get_ctx(pool).authenticate()
+    assert pool.spawned == 1
+
+
+@pytest.mark.parametrize('workers', [1, 2])
+def test_get_context_from_conversation(workers):
+    """Test a callback can't get a context of the worker it converses for."""
+    pool = truenas_pypam.get_process_pool(workers=workers)
+    created = []
+    errors = []
+
+    def callback(ctx, messages, private_data):
+        try:
+            new = get_ctx(pool)
+            new.authenticate()
+            created.append(new)
+        except truenas_pypam.PAMError as e:
+            errors.append(e)
+        return password_responses(messages)
+
+    ctx = pool.get_context(user=TEST_USER, conversation_function=callback)
+    ctx.authenticate()
+
+    if workers == 1:
+        assert created == []
+        assert errors[0].code == PAMCode.PAM_SYSTEM_ERR
+    else:
+        assert errors == []
+        assert pool.spawned == 2
+        created[0].authenticate()
+
+
+def test_get_context_from_concurrent_conversations():
+    """Test callbacks of two workers creating contexts don't deadlock."""
+    pool = truenas_pypam.get_process_pool(workers=2)
+    barrier = threading.Barrier(2, timeout=10)
+    errors = []
+
+    def callback(ctx, messages, private_data):
+        # Both workers are locked by a conversation now
+        barrier.wait()
+        try:
+            get_ctx(pool)
+        except truenas_pypam.PAMError as e:
+            errors.append(e.code)
+        barrier.wait()
+        return password_responses(messages)
+
+    ctxs = [
+        pool.get_context(user=TEST_USER, conversation_function=callback)
+        for _ in range(2)
+    ]
+    assert pool.spawned == 2
+
+    threads = [threading.Thread(target=c.authenticate) for c in ctxs]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join(timeout=30)
+        assert not t.is_alive()
+
+    assert errors == [PAMCode.PAM_SYSTEM_ERR] * 2
+    get_ctx(pool).authenticate()
+
+
+def test_close_all_sessions(pool, confdir):
+    """Test close_all_sessions() ends worker transactions."""
+    ctx = get_ctx(pool, service_name='procpool-env', confdir=confdir)
+    ctx.authenticate()
+    ctx.open_session()
+
+    closed = truenas_pypam.close_all_sessions()
+    assert (TEST_USER, PAMCode.PAM_SUCCESS) in closed
+    with pytest.raises(ValueError):
+        ctx.authenticate()
+
+
+def test_start_failure(pool, confdir):
+    """Test pam_start_confdir() errors in the worker are raised."""
+    with pytest.raises(truenas_pypam.PAMError):
+        get_ctx(pool, service_name='procpool-missing',
+                confdir=os.path.join(confdir, 'missing'))
+
+
+def test_fork_child(pool):
+    """Test a forked child can't use the workers of the parent."""
+    ctx = get_ctx(pool)
+    ctx.authenticate()
+
+    pid = os.fork()
+    if pid == 0:
+        try:
+            ctx.authenticate()
+        except truenas_pypam.PAMError as e:
+            os._exit(0 if e.code == PAMCode.PAM_SYSTEM_ERR else 1)
+        os._exit(2)
+
+    _, status = os.waitpid(pid, 0)
+    assert os.waitstatus_to_exitcode(status) == 0
+
+    # The parent's worker is unaffected
+    ctx.authenticate()
+
+
+@pytest.mark.parametrize('kwargs', [
+    {'workers': 0},
+    {'workers': 257},
+    {'max_requests': -1},
+])
+def test_invalid_arguments(kwargs):
+    """Test out of range arguments are rejected."""
+    with pytest.raises(ValueError):
+        truenas_pypam.get_process_pool(**kwargs)
@@ -0,0 +1,284 @@
+"""Tests for truenas_pypam authentication rate limiting."""
+
+import asyncio
+import threading
+import time
+import pytest
+import truenas_pypam
+
+# Test credentials from conftest.py. The rate_limit fixture removes any
+# limits set by the test.
+from conftest import TEST_USER, TEST_PASSWORD as CORRECT_PASSWORD
+
+
+WRONG_PASSWORD = 'Dogs'
+
+# Slow enough that no token is refilled during a test
+SLOW = 1e-6
+
+
+def get_ctx(password=CORRECT_PASSWORD, rhost=None, **kwargs):
+    """Context answering the password prompt, fail delay deferred."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: password
+        },
+        defer_fail_delay=True,
+        **kwargs
+    )
+    if rhost is not None:
+        ctx.rhost = rhost
+    return ctx
+
+
+def rejected(key):
+    return truenas_pypam.get_auth_rate_limit()[key]['rejected']
+
+
+def test_default_disabled():
+    """Test no limits are set by default."""
+    limits = truenas_pypam.get_auth_rate_limit()
+    assert set(limits) == {'rhost', 'user'}
+    for key in ('rhost', 'user'):
+        assert limits[key]['rate'] == 0
+        assert limits[key]['burst'] == 0
+        assert isinstance(limits[key]['rejected'], int)
+
+    for _ in range(5):
+        get_ctx().authenticate()
+
+
+def test_get_reports_limits(rate_limit):
+    """Test get_auth_rate_limit() reports the configured limits."""
+    rate_limit(rhost_rate=2.5, rhost_burst=10, user_rate=1, user_burst=3)
+    limits = truenas_pypam.get_auth_rate_limit()
+    assert limits['rhost']['rate'] == 2.5
+    assert limits['rhost']['burst'] == 10
+    assert limits['user']['rate'] == 1.0
+    assert limits['user']['burst'] == 3
+
+
+def test_exception_type():
+    """Test AuthRateLimited is a PAMError."""
+    assert issubclass(truenas_pypam.AuthRateLimited, truenas_pypam.PAMError)
+
+
+def test_user_limit(rate_limit):
+    """Test attempts beyond the user burst are refused."""
+    rate_limit(user_rate=SLOW, user_burst=2)
+    before = rejected('user')
+
+    get_ctx().authenticate()
+    get_ctx().authenticate()
+    with pytest.raises(truenas_pypam.AuthRateLimited) as exc:
+        get_ctx().authenticate()
+
+    assert exc.value.code == truenas_pypam.PAMCode.PAM_MAXTRIES
+    assert rejected('user') == before + 1
+
+
+def test_failed_attempts_count(rate_limit):
+    """Test failed attempts take tokens like successful ones."""
+    rate_limit(user_rate=SLOW, user_burst=2)
+
+    for _ in range(2):
+        with pytest.raises(truenas_pypam.PAMError) as exc:
+            get_ctx(WRONG_PASSWORD).authenticate()
+        assert not isinstance(exc.value, truenas_pypam.AuthRateLimited)
+
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        get_ctx().authenticate()
+
+
+def test_refused_attempt_skips_pam(rate_limit):
+    """Test a refused attempt does not run the conversation."""
+    calls = []
+
+    def conv(ctx, messages, private):
+        calls.append(messages)
+        return [CORRECT_PASSWORD for _ in messages]
+
+    rate_limit(user_rate=SLOW, user_burst=1)
+    get_ctx().authenticate()
+
+    ctx = truenas_pypam.get_context(user=TEST_USER, conversation_function=conv)
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        ctx.authenticate()
+    assert calls == []
+
+
+def test_rhost_limit(rate_limit):
+    """Test remote hosts are limited independently of each other."""
+    rate_limit(rhost_rate=SLOW, rhost_burst=1)
+    before = rejected('rhost')
+
+    get_ctx(rhost='192.0.2.1').authenticate()
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        get_ctx(rhost='192.0.2.1').authenticate()
+
+    get_ctx(rhost='192.0.2.2').authenticate()
+    assert rejected('rhost') == before + 1
+
+
+def test_no_rhost_not_limited(rate_limit):
+    """Test attempts without a remote host skip the rhost limit."""
+    rate_limit(rhost_rate=SLOW, rhost_burst=1)
+    for _ in range(3):
+        get_ctx().authenticate()
+
+
+def test_rhost_refusal_spares_user(rate_limit):
+    """Test an attempt refused for its rhost takes no user token."""
+    rate_limit(rhost_rate=SLOW, rhost_burst=1, user_rate=SLOW, user_burst=2)
+
+    get_ctx(rhost='192.0.2.1').authenticate()
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        get_ctx(rhost='192.0.2.1').authenticate()
+
+    # One user token left
+    get_ctx(rhost='192.0.2.2').authenticate()
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        get_ctx(rhost='192.0.2.3').authenticate()
+
+
+def test_refill(rate_limit):
+    """Test buckets refill at the configured rate."""
+    rate_limit(user_rate=20, user_burst=1)
+    get_ctx().authenticate()
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        get_ctx().authenticate()
+
+    time.sleep(0.1)
+    get_ctx().authenticate()
+
+
+def test_reconfigure_refills(rate_limit):
+    """Test setting new limits refills every bucket."""
+    rate_limit(user_rate=SLOW, user_burst=1)
+    get_ctx().authenticate()
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        get_ctx().authenticate()
+
+    rate_limit(user_rate=SLOW, user_burst=1)
+    get_ctx().authenticate()
+
+
+def test_disable(rate_limit):
+    """Test calling without arguments removes the limits."""
+    rate_limit(user_rate=SLOW, user_burst=1)
+    get_ctx().authenticate()
+
+    rate_limit()
+    for _ in range(3):
+        get_ctx().authenticate()
+
+
+def test_auth_begin_limited(rate_limit):
+    """Test auth_begin() is subject to the limits."""
+    rate_limit(user_rate=SLOW, user_burst=1)
+    get_ctx().authenticate()
+
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=lambda ctx, messages, private: None
+    )
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        ctx.auth_begin()
+
+
+def test_authenticate_async_limited(rate_limit):
+    """Test authenticate_async() is subject to the limits."""
+    rate_limit(user_rate=SLOW, user_burst=1)
+
+    async def run():
+        await get_ctx().authenticate_async()
+        with pytest.raises(truenas_pypam.AuthRateLimited):
+            await get_ctx().authenticate_async()
+
+    asyncio.run(run())
+
+
+def test_login_limited(rate_limit):
+    """Test login() raises AuthRateLimited instead of returning a result."""
+    rate_limit(user_rate=SLOW, user_burst=1)
+    get_ctx().authenticate()
+
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        get_ctx().login(steps=('authenticate',))
+
+
+def test_authenticate_many_limited(rate_limit):
+    """Test refused credentials of a batch report PAM_MAXTRIES."""
+    rate_limit(rhost_rate=SLOW, rhost_burst=2)
+    results = truenas_pypam.authenticate_many('login', [
+        (TEST_USER, CORRECT_PASSWORD, '192.0.2.1'),
+        (TEST_USER, CORRECT_PASSWORD, '192.0.2.1'),
+        (TEST_USER, CORRECT_PASSWORD, '192.0.2.1'),
+        (TEST_USER, CORRECT_PASSWORD, '192.0.2.2'),
+    ], concurrency=1)
+
+    PAMCode = truenas_pypam.PAMCode
+    assert results == (PAMCode.PAM_SUCCESS, PAMCode.PAM_SUCCESS,
+                       PAMCode.PAM_MAXTRIES, PAMCode.PAM_SUCCESS)
+
+
+def test_many_keys_bounded(rate_limit):
+    """Test a flood of distinct keys doesn't break limiting of old keys."""
+    rate_limit(rhost_rate=SLOW, rhost_burst=1)
+    results = truenas_pypam.authenticate_many('login', [
+        (TEST_USER, CORRECT_PASSWORD, f'198.51.100.{i}')
+        for i in range(200)
+    ])
+    assert truenas_pypam.PAMCode.PAM_MAXTRIES not in results
+
+    get_ctx(rhost='192.0.2.1').authenticate()
+    with pytest.raises(truenas_pypam.AuthRateLimited):
+        get_ctx(rhost='192.0.2.1').authenticate()
+
+
+def test_threads(rate_limit):
+    """Test exactly burst attempts succeed across concurrent threads."""
+    rate_limit(user_rate=SLOW, user_burst=10)
+    outcomes = []
+    lock = threading.Lock()
+
+    def worker():
+        for _ in range(5):
+            try:
+                get_ctx().authenticate()
+                result = True
+            except truenas_pypam.AuthRateLimited:
+                result = False
+            with lock:
+                outcomes.append(result)
+
+    threads = [threading.Thread(target=worker) for _ in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert len(outcomes) == 20
+    assert outcomes.count(True) == 10
+
+
+@pytest.mark.parametrize('kwargs', [
+    {'user_rate': -1, 'user_burst': 1},
+    {'user_rate': float('inf'), 'user_burst': 1},
+    {'user_rate': float('nan'), 'user_burst': 1},
+    {'user_rate': 1},
+    {'rhost_rate': 1, 'rhost_burst': 0},
+])
+def test_invalid_limits(kwargs):
+    """Test invalid limits are rejected."""
+    with pytest.raises(ValueError):
+        truenas_pypam.set_auth_rate_limit(**kwargs)
+
+
+def test_invalid_types():
+    """Test non-numeric limits are rejected."""
+    with pytest.raises(TypeError):
+        truenas_pypam.set_auth_rate_limit(user_rate='fast', user_burst=1)
+    with pytest.raises(TypeError):
+        truenas_pypam.set_auth_rate_limit(1.0, 1)
@@ -0,0 +1,270 @@
+"""Tests for truenas_pypam resumable authentication (auth_begin / auth_resume)."""
+
+import os
+import tempfile
+import time
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+
+def callback_unexpected(ctx, messages, private_data):
+    """Conversation callback that must never be called by resumable auth."""
+    private_data['called'] = True
+    return [None] * len(messages)
+
+
+def get_ctx(**kwargs):
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_unexpected,
+        conversation_private_data={'called': False},
+        **kwargs
+    )
+
+
+def password_responses(messages, password):
+    return [
+        password
+        if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF
+        else None
+        for m in messages
+    ]
+
+
+@pytest.fixture
+def slow_confdir():
+    """PAM confdir with an auth stack that stalls before prompting."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'resume-slow'), 'w') as f:
+            f.write('auth requisite pam_exec.so quiet /bin/sleep 2\n')
+            f.write('auth required pam_unix.so\n')
+        yield confdir
+
+
+@pytest.mark.parametrize("method_name", [
+    'auth_begin',
+    'auth_resume',
+    'auth_abort',
+])
+def test_context_has_resume_methods(method_name):
+    """Test that PAM context has expected resumable auth methods."""
+    ctx = get_ctx()
+    assert callable(getattr(ctx, method_name))
+
+
+def test_auth_begin_returns_messages():
+    """Test auth_begin returns the pending conversation messages."""
+    ctx = get_ctx()
+    messages = ctx.auth_begin()
+
+    assert isinstance(messages, tuple)
+    assert len(messages) > 0
+    assert any(
+        m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF
+        for m in messages
+    )
+
+    # Messages are recorded in history the same as callback conversations
+    assert ctx.messages()[-1] == messages
+    ctx.auth_abort()
+
+
+def test_auth_resume_correct_password():
+    """Test resuming with correct password completes authentication."""
+    ctx = get_ctx()
+    messages = ctx.auth_begin()
+    assert ctx.auth_resume(
+        responses=password_responses(messages, CORRECT_PASSWORD)
+    ) is None
+
+    # Context is usable for the rest of the PAM transaction
+    ctx.acct_mgmt()
+
+
+def test_auth_resume_wrong_password():
+    """Test resuming with wrong password raises PAMError."""
+    ctx = get_ctx()
+    messages = ctx.auth_begin()
+
+    with pytest.raises(truenas_pypam.PAMError) as exc_info:
+        ctx.auth_resume(responses=password_responses(messages, WRONG_PASSWORD))
+
+    assert exc_info.value.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+    assert exc_info.value.message.startswith('pam_authenticate()')
+
+
+def test_auth_begin_does_not_use_callback():
+    """Test the conversation callback is bypassed."""
+    data = {'called': False}
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_unexpected,
+        conversation_private_data=data
+    )
+    messages = ctx.auth_begin()
+    ctx.auth_resume(responses=password_responses(messages, CORRECT_PASSWORD))
+    assert data['called'] is False
+
+
+def test_auth_resume_without_begin():
+    """Test auth_resume fails when no conversation is pending."""
+    ctx = get_ctx()
+    with pytest.raises(RuntimeError, match='No PAM conversation is pending'):
+        ctx.auth_resume(responses=[])
+
+
+def test_auth_resume_requires_responses():
+    """Test auth_resume requires responses."""
+    ctx = get_ctx()
+    with pytest.raises(ValueError, match='responses is required'):
+        ctx.auth_resume()
+
+
+def test_auth_begin_twice():
+    """Test auth_begin fails while another operation is in progress."""
+    ctx = get_ctx()
+    ctx.auth_begin()
+    with pytest.raises(RuntimeError, match='already in progress'):
+        ctx.auth_begin()
+    ctx.auth_abort()
+
+
+def test_sync_op_rejected_while_pending():
+    """Test that regular PAM operations are rejected mid-conversation."""
+    ctx = get_ctx()
+    ctx.auth_begin()
+    with pytest.raises(RuntimeError, match='auth_resume'):
+        ctx.authenticate()
+    ctx.auth_abort()
+
+
+@pytest.mark.parametrize("touch", [
+    lambda ctx: ctx.user,
+    lambda ctx: setattr(ctx, 'user', 'alice'),
+    lambda ctx: setattr(ctx, 'rhost', 'localhost'),
+    lambda ctx: ctx.set_env(name='FOO', value='bar'),
+    lambda ctx: ctx.update_env({'FOO': 'bar'}),
+    lambda ctx: ctx.get_env(name='FOO'),
+    lambda ctx: ctx.env_dict(),
+    lambda ctx: ctx.env['FOO'],
+])
+def test_handle_rejected_while_pending(touch):
+    """Test the handle can't be used while the worker is parked in it."""
+    ctx = get_ctx()
+    messages = ctx.auth_begin()
+    with pytest.raises(RuntimeError, match='auth_resume'):
+        touch(ctx)
+
+    assert ctx.auth_resume(
+        responses=password_responses(messages, CORRECT_PASSWORD)
+    ) is None
+    assert ctx.user == TEST_USER
+
+
+def test_auth_resume_wrong_response_count():
+    """Test invalid responses leave the conversation pending."""
+    ctx = get_ctx()
+    messages = ctx.auth_begin()
+
+    with pytest.raises(ValueError, match='more elements'):
+        ctx.auth_resume(responses=[None] * (len(messages) + 1))
+
+    assert ctx.auth_resume(
+        responses=password_responses(messages, CORRECT_PASSWORD)
+    ) is None
+
+
+def test_auth_abort():
+    """Test aborting a pending conversation allows a new one to start."""
+    ctx = get_ctx()
+    ctx.auth_begin()
+    assert ctx.auth_abort() is None
+
+    with pytest.raises(RuntimeError):
+        ctx.auth_resume(responses=[None])
+
+    messages = ctx.auth_begin()
+    assert ctx.auth_resume(
+        responses=password_responses(messages, CORRECT_PASSWORD)
+    ) is None
+
+    # no-op when idle
+    assert ctx.auth_abort() is None
+
+
+def test_dealloc_with_pending_conversation():
+    """Test that dropping a context mid-conversation does not hang."""
+    ctx = get_ctx()
+    ctx.auth_begin()
+    del ctx
+
+
+@pytest.mark.parametrize("timeout", [-1, float('nan'), 'a'])
+def test_auth_begin_invalid_timeout(timeout):
+    """Test auth_begin validates timeout."""
+    ctx = get_ctx()
+    with pytest.raises((ValueError, TypeError)):
+        ctx.auth_begin(timeout=timeout)
+
+
+def test_auth_begin_timeout(slow_confdir):
+    """Test timeout while the PAM stack is busy before prompting."""
+    ctx = get_ctx(service_name='resume-slow', confdir=slow_confdir)
+
+    with pytest.raises(TimeoutError):
+        ctx.auth_begin(timeout=0.2)
+
+    # Once timed out, the only valid operation is to abort
+    with pytest.raises(RuntimeError, match='timed out'):
+        ctx.auth_resume(responses=[None])
+
+    ctx.auth_abort()
+
+
+def test_auth_abort_timeout(slow_confdir):
+    """Test auth_abort() stops waiting for a PAM call stuck in a module."""
+    ctx = get_ctx(service_name='resume-slow', confdir=slow_confdir)
+
+    with pytest.raises(TimeoutError):
+        ctx.auth_begin(timeout=0.1)
+
+    start = time.monotonic()
+    with pytest.raises(TimeoutError):
+        ctx.auth_abort(timeout=0.2)
+    assert time.monotonic() - start < 1
+
+    # The operation stays aborted until the call returns and is collected
+    with pytest.raises(RuntimeError, match='in progress'):
+        ctx.authenticate()
+    assert ctx.auth_abort() is None
+    assert ctx.auth_abort(timeout=0) is None
+
+
+def test_auth_abort_cuts_fail_delay():
+    """Test aborting a failed attempt doesn't wait out the fail delay."""
+    ctx = get_ctx(fail_delay=3000000)
+    messages = ctx.auth_begin()
+
+    with pytest.raises(TimeoutError):
+        ctx.auth_resume(
+            responses=password_responses(messages, WRONG_PASSWORD),
+            timeout=0.2
+        )
+
+    start = time.monotonic()
+    assert ctx.auth_abort(timeout=1) is None
+    assert time.monotonic() - start < 1
+
+
+@pytest.mark.parametrize("timeout", [-1, float('nan'), 'a'])
+def test_auth_abort_invalid_timeout(timeout):
+    """Test auth_abort validates timeout."""
+    ctx = get_ctx()
+    with pytest.raises((ValueError, TypeError)):
+        ctx.auth_abort(timeout=timeout)
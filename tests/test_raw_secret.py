@@ -0,0 +1,191 @@
+"""Tests for buffer-protocol conversation responses and the secret arena."""
+
+import gc
+import sys
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+WRONG_PASSWORD = 'Dogs'
+
+MSGStyle = truenas_pypam.MSGStyle
+
+SECRET_TYPES = (
+    str,
+    lambda s: s.encode(),
+    lambda s: bytearray(s.encode()),
+    lambda s: memoryview(s.encode()),
+)
+
+
+def callback_ctx(response, **kwargs):
+    def conv(ctx, messages, private):
+        return [
+            response if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF else None
+            for m in messages
+        ]
+
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=conv,
+        defer_fail_delay=True,
+        **kwargs
+    )
+
+
+def responder_ctx(value, **kwargs):
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={MSGStyle.PAM_PROMPT_ECHO_OFF: value},
+        defer_fail_delay=True,
+        **kwargs
+    )
+
+
+def secret_bytes():
+    gc.collect()
+    return truenas_pypam.memory_stats()['secret_bytes']
+
+
+@pytest.mark.parametrize('make', SECRET_TYPES)
+def test_callback_response_types(make):
+    """Test callbacks may answer with str and bytes-like objects."""
+    callback_ctx(make(CORRECT_PASSWORD)).authenticate()
+
+
+@pytest.mark.parametrize('make', SECRET_TYPES)
+def test_callback_response_types_wrong(make):
+    """Test bytes-like responses are passed through unchanged."""
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        callback_ctx(make(WRONG_PASSWORD)).authenticate()
+    assert exc.value.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+
+
+def test_callback_response_memoryview_slice():
+    """Test a contiguous slice of a larger buffer is used as is."""
+    data = b'xx' + CORRECT_PASSWORD.encode() + b'yy'
+    callback_ctx(memoryview(data)[2:-2]).authenticate()
+
+
+@pytest.mark.parametrize('response,exc', [
+    (1, TypeError),
+    (b'a\0b', ValueError),
+    (bytearray(b'a\0b'), ValueError),
+    ('a\0b', ValueError),
+])
+def test_callback_response_invalid(response, exc):
+    """Test invalid response items are rejected."""
+    with pytest.raises(exc):
+        callback_ctx(response).authenticate()
+
+
+def test_callback_response_noncontiguous():
+    """Test non-contiguous buffers are rejected."""
+    data = memoryview(b'C_a_t_s_')[::2]
+    with pytest.raises((TypeError, BufferError)):
+        callback_ctx(data).authenticate()
+
+
+def test_callback_response_no_utf8_cache():
+    """Test non-ASCII str responses are not left with a cached encoding."""
+    password = 'pässwörd'
+    size = sys.getsizeof(password)
+    with pytest.raises(truenas_pypam.PAMError):
+        callback_ctx(password).authenticate()
+    assert sys.getsizeof(password) == size
+
+
+@pytest.mark.parametrize('make', SECRET_TYPES)
+def test_responder_value_types(make):
+    """Test conversation_responses values may be bytes-like objects."""
+    responder_ctx(make(CORRECT_PASSWORD)).authenticate()
+
+
+def test_responder_value_copied():
+    """Test a bytearray may be wiped once the context is created."""
+    password = bytearray(CORRECT_PASSWORD.encode())
+    ctx = responder_ctx(password)
+    password[:] = bytes(len(password))
+    ctx.authenticate()
+
+
+def test_responder_value_invalid():
+    """Test invalid conversation_responses values are rejected."""
+    with pytest.raises(TypeError):
+        responder_ctx(1.5)
+    with pytest.raises(ValueError):
+        responder_ctx(bytearray(b'a\0b'))
+
+
+def test_secret_bytes_accounting():
+    """Test stored secrets are counted until the context is destroyed."""
+    before = secret_bytes()
+    ctx = responder_ctx(CORRECT_PASSWORD)
+    assert secret_bytes() == before + len(CORRECT_PASSWORD) + 1
+
+    del ctx
+    assert secret_bytes() == before
+
+
+def test_secret_arena_locked():
+    """Test the secret arena is locked in memory where permitted."""
+    ctx = responder_ctx(CORRECT_PASSWORD)
+    locked = truenas_pypam.memory_stats()['secret_locked_bytes']
+    if locked == 0:
+        pytest.skip('mlock() not permitted')
+
+    with open('/proc/self/status') as f:
+        vmlck = next(line for line in f if line.startswith('VmLck:'))
+    assert int(vmlck.split()[1]) * 1024 >= locked
+    ctx.authenticate()
+
+
+def test_secret_arena_overflow():
+    """Test secrets beyond the arena capacity still work and are freed."""
+    before = secret_bytes()
+    value = 'x' * 1000
+    contexts = [responder_ctx(value) for _ in range(100)]
+    assert secret_bytes() == before + 100 * (len(value) + 1)
+
+    responder_ctx(CORRECT_PASSWORD).authenticate()
+
+    del contexts
+    assert secret_bytes() == before
+
+
+def test_secret_arena_reuse():
+    """Test freed arena space is reused."""
+    before = secret_bytes()
+    for _ in range(5000):
+        responder_ctx(CORRECT_PASSWORD)
+    assert secret_bytes() == before
+
+
+@pytest.mark.parametrize('make', SECRET_TYPES)
+def test_resume_response_types(make):
+    """Test auth_resume() accepts bytes-like responses."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=lambda ctx, messages, private: None
+    )
+    messages = ctx.auth_begin()
+    responses = [
+        make(CORRECT_PASSWORD)
+        if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF else None
+        for m in messages
+    ]
+    assert ctx.auth_resume(responses=responses) is None
+
+
+@pytest.mark.parametrize('make', SECRET_TYPES)
+def test_authenticate_many_secret_types(make):
+    """Test authenticate_many() accepts bytes-like secrets."""
+    before = secret_bytes()
+    results = truenas_pypam.authenticate_many('login', [
+        (TEST_USER, make(CORRECT_PASSWORD)),
+    ])
+    assert results == (truenas_pypam.PAMCode.PAM_SUCCESS,)
+    assert secret_bytes() == before
@@ -0,0 +1,262 @@
+"""Tests for the truenas_pypam session registry and close_all_sessions()."""
+
+import gc
+import sys
+import threading
+import time
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+
+@pytest.fixture
+def registry():
+    """Start and finish every test with an empty registry."""
+    gc.collect()
+    truenas_pypam.close_all_sessions()
+    assert truenas_pypam.open_session_count() == 0
+    yield
+    truenas_pypam.close_all_sessions()
+
+
+def open_ctx(**kwargs):
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        },
+        **kwargs
+    )
+    ctx.authenticate()
+    ctx.open_session()
+    return ctx
+
+
+def test_open_session_count(registry):
+    """Test contexts are listed while their session is open."""
+    ctx1 = open_ctx()
+    ctx2 = open_ctx()
+    assert truenas_pypam.open_session_count() == 2
+
+    ctx1.close_session()
+    assert truenas_pypam.open_session_count() == 1
+
+    del ctx2
+    assert truenas_pypam.open_session_count() == 0
+
+
+def test_login_registers_session(registry):
+    """Test sessions opened by login() are listed."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        },
+    )
+    ctx.login(steps=('authenticate', 'open_session'))
+    assert truenas_pypam.open_session_count() == 1
+
+
+def test_close_all_sessions(registry):
+    """Test every open session is closed and its handle ended."""
+    ctxs = [open_ctx() for _ in range(5)]
+    closed = open_ctx()
+    closed.close_session()
+
+    results = truenas_pypam.close_all_sessions(concurrency=3)
+    assert len(results) == 5
+    assert all(r == (TEST_USER, truenas_pypam.PAMCode.PAM_SUCCESS)
+               for r in results)
+    assert truenas_pypam.open_session_count() == 0
+
+    for ctx in ctxs:
+        with pytest.raises(ValueError, match='ended'):
+            ctx.authenticate()
+
+        with pytest.raises(ValueError, match='not opened'):
+            ctx.close_session()
+
+    # contexts without an open session are left alone
+    closed.authenticate()
+
+
+def test_close_all_sessions_empty(registry):
+    """Test close_all_sessions() with nothing to close."""
+    assert truenas_pypam.close_all_sessions() == ()
+
+
+def test_close_all_sessions_stats(registry):
+    """Test pam_close_session() is recorded in the context stats."""
+    ctx = open_ctx()
+    truenas_pypam.close_all_sessions()
+    assert ctx.stats()['pam_close_session']['count'] == 1
+
+
+def test_close_all_sessions_dealloc_after(registry):
+    """Test ended contexts can still be deallocated."""
+    ctx = open_ctx()
+    truenas_pypam.close_all_sessions()
+    del ctx
+    gc.collect()
+
+
+def test_close_all_sessions_pool(registry):
+    """Test ended handles are not returned to a pool."""
+    pool = truenas_pypam.get_context_pool(maxsize=2)
+    ctx = pool.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        },
+    )
+    ctx.authenticate()
+    ctx.open_session()
+
+    truenas_pypam.close_all_sessions()
+    del ctx
+    assert pool.idle == 0
+
+
+def test_close_all_sessions_deadline_skips_busy(registry):
+    """Test sessions whose handle stays locked are skipped at the deadline."""
+    block = threading.Event()
+    entered = threading.Event()
+    release = threading.Event()
+
+    def callback(ctx, messages, private_data):
+        if block.is_set():
+            entered.set()
+            release.wait()
+        return [CORRECT_PASSWORD for m in messages]
+
+    busy = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback,
+    )
+    busy.authenticate()
+    busy.open_session()
+    free = open_ctx()
+
+    # Hold the handle lock of busy in a conversation
+    block.set()
+    worker = threading.Thread(target=lambda: busy.authenticate())
+    worker.start()
+    if not entered.wait(5):
+        release.set()
+        worker.join()
+        pytest.fail('authenticate did not converse')
+
+    try:
+        start = time.monotonic()
+        results = truenas_pypam.close_all_sessions(deadline=0.2)
+        assert time.monotonic() - start < 2
+    finally:
+        release.set()
+        worker.join()
+
+    assert sorted(results, key=lambda r: r[1] is None) == [
+        (TEST_USER, truenas_pypam.PAMCode.PAM_SUCCESS),
+        (TEST_USER, None),
+    ]
+    # the skipped session is still open and listed
+    assert truenas_pypam.open_session_count() == 1
+    busy.close_session()
+    assert truenas_pypam.open_session_count() == 0
+    del free
+
+
+def test_close_all_sessions_skips_resumable(registry):
+    """Test sessions of contexts in auth_begin() are left open."""
+    ctx = open_ctx()
+    other = open_ctx()
+    messages = ctx.auth_begin()
+    assert messages
+
+    start = time.monotonic()
+    results = truenas_pypam.close_all_sessions()
+    assert time.monotonic() - start < 2
+    assert sorted(results, key=lambda r: r[1] is None) == [
+        (TEST_USER, truenas_pypam.PAMCode.PAM_SUCCESS),
+        (TEST_USER, None),
+    ]
+    assert truenas_pypam.open_session_count() == 1
+
+    # the context is untouched and the operation completes normally
+    assert ctx.auth_resume(responses=[
+        CORRECT_PASSWORD
+        if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF
+        else None for m in messages
+    ]) is None
+    ctx.close_session()
+    assert truenas_pypam.open_session_count() == 0
+
+    with pytest.raises(ValueError):
+        other.authenticate()
+
+
+def test_close_all_sessions_deadline_zero(registry):
+    """Test an expired deadline skips everything."""
+    ctx = open_ctx()
+    assert truenas_pypam.close_all_sessions(deadline=0) == ((TEST_USER, None),)
+    assert truenas_pypam.open_session_count() == 1
+    ctx.close_session()
+
+
+@pytest.mark.parametrize("kwargs,exc_type", [
+    ({'concurrency': 0}, ValueError),
+    ({'concurrency': 'x'}, TypeError),
+    ({'deadline': -1}, ValueError),
+    ({'deadline': 'x'}, TypeError),
+])
+def test_close_all_sessions_invalid(registry, kwargs, exc_type):
+    """Test argument validation."""
+    ctx = open_ctx()
+    with pytest.raises(exc_type):
+        truenas_pypam.close_all_sessions(**kwargs)
+
+    assert truenas_pypam.open_session_count() == 1
+    ctx.close_session()
+
+
+def test_close_all_sessions_concurrent_dealloc(registry):
+    """Test contexts dropped by other threads during teardown."""
+    ctxs = [open_ctx() for _ in range(20)]
+    stop = threading.Event()
+
+    def dropper():
+        while ctxs and not stop.is_set():
+            try:
+                ctxs.pop()
+            except IndexError:
+                break
+
+    threads = [threading.Thread(target=dropper) for _ in range(2)]
+    for t in threads:
+        t.start()
+
+    results = truenas_pypam.close_all_sessions(concurrency=4)
+    stop.set()
+    for t in threads:
+        t.join()
+
+    assert all(r[1] == truenas_pypam.PAMCode.PAM_SUCCESS for r in results)
+    assert truenas_pypam.open_session_count() == 0
+
+
+def test_close_all_sessions_audit(registry):
+    """Test a close_session audit event is raised for every session."""
+    events = []
+
+    def hook(event, args):
+        if event == 'truenas_pypam.close_session':
+            events.append(args)
+
+    sys.addaudithook(hook)
+    ctxs = [open_ctx() for _ in range(3)]
+    events.clear()
+    truenas_pypam.close_all_sessions()
+    assert events == [(TEST_USER,)] * 3
@@ -0,0 +1,184 @@
+"""Tests for truenas_pypam latency statistics."""
+
+import os
+import tempfile
+import threading
+import time
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+NAMES = {
+    'pam_start', 'pam_authenticate', 'pam_acct_mgmt', 'pam_setcred',
+    'pam_open_session', 'pam_close_session', 'pam_chauthtok',
+    'lock_wait', 'conversation',
+}
+NBUCKETS = 40
+
+
+def callback_basic_auth(ctx, messages, private_data):
+    """PAM conversation callback that sleeps before answering."""
+    time.sleep(private_data)
+    reply = []
+    for m in messages:
+        rep = None
+        if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF:
+            rep = CORRECT_PASSWORD
+        reply.append(rep)
+    return reply
+
+
+def get_ctx(delay=0, **kwargs):
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_basic_auth,
+        conversation_private_data=delay,
+        **kwargs
+    )
+
+
+def bucket_of(ns):
+    return min(ns.bit_length(), NBUCKETS - 1)
+
+
+def check_hist(hist):
+    assert set(hist) == {'count', 'total_ns', 'max_ns', 'buckets'}
+    assert len(hist['buckets']) == NBUCKETS
+    assert sum(hist['buckets']) == hist['count']
+    if hist['count']:
+        assert hist['max_ns'] <= hist['total_ns']
+        assert hist['buckets'][bucket_of(hist['max_ns'])] > 0
+
+
+def test_ctx_stats_format():
+    """Test the layout of the per-context stats."""
+    ctx = get_ctx()
+    ctx.authenticate()
+    ctx.acct_mgmt()
+
+    stats = ctx.stats()
+    assert set(stats) == NAMES
+    for hist in stats.values():
+        check_hist(hist)
+
+    assert stats['pam_start']['count'] == 1
+    assert stats['pam_authenticate']['count'] == 1
+    assert stats['pam_acct_mgmt']['count'] == 1
+    assert stats['pam_setcred']['count'] == 0
+    assert stats['conversation']['count'] >= 1
+    assert stats['lock_wait']['count'] >= 2
+
+
+def test_ctx_stats_conversation_time():
+    """Test time spent in the callback is attributed to the conversation."""
+    ctx = get_ctx(0.2)
+    ctx.authenticate()
+
+    stats = ctx.stats()
+    assert stats['conversation']['total_ns'] >= 200_000_000
+    assert stats['pam_authenticate']['total_ns'] >= stats['conversation']['total_ns']
+    assert stats['lock_wait']['max_ns'] < 200_000_000
+
+
+def test_ctx_stats_reset():
+    """Test stats are zeroed when read with reset=True."""
+    ctx = get_ctx()
+    ctx.authenticate()
+
+    assert ctx.stats(reset=True)['pam_authenticate']['count'] == 1
+    stats = ctx.stats()
+    for hist in stats.values():
+        assert hist['count'] == 0
+        assert hist['max_ns'] == 0
+        assert not any(hist['buckets'])
+
+
+def test_ctx_stats_separate():
+    """Test each context has its own stats."""
+    ctx1 = get_ctx()
+    ctx2 = get_ctx()
+    ctx1.authenticate()
+
+    assert ctx1.stats()['pam_authenticate']['count'] == 1
+    assert ctx2.stats()['pam_authenticate']['count'] == 0
+
+
+def test_ctx_stats_pool():
+    """Test pooled contexts do not record pam_start for reused handles."""
+    pool = truenas_pypam.get_context_pool(service_name='login')
+    pool.prewarm(count=1)
+
+    ctx = pool.get_context(
+        user=TEST_USER,
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: CORRECT_PASSWORD
+        }
+    )
+    ctx.authenticate()
+
+    stats = ctx.stats()
+    assert stats['pam_start']['count'] == 0
+    assert stats['pam_authenticate']['count'] == 1
+    assert stats['conversation']['count'] == 0
+
+
+def test_ctx_stats_lock_wait():
+    """Test waiting for another thread's PAM call is recorded as lock wait."""
+    ctx = get_ctx(0.3)
+    thread = threading.Thread(target=ctx.authenticate)
+    thread.start()
+    time.sleep(0.1)
+    ctx.stats(reset=True)
+    assert ctx.user == TEST_USER
+    thread.join()
+
+    assert ctx.stats()['lock_wait']['max_ns'] >= 100_000_000
+
+
+def test_global_stats():
+    """Test process-wide stats aggregate all contexts and can be reset."""
+    truenas_pypam.stats(reset=True)
+
+    for _ in range(3):
+        get_ctx().authenticate()
+
+    stats = truenas_pypam.stats()
+    assert set(stats) == NAMES
+    for hist in stats.values():
+        check_hist(hist)
+
+    assert stats['pam_start']['count'] >= 3
+    assert stats['pam_authenticate']['count'] >= 3
+
+    truenas_pypam.stats(reset=True)
+    assert truenas_pypam.stats()['pam_authenticate']['count'] == 0
+
+
+def test_global_stats_authenticate_many():
+    """Test authenticate_many() is included in process-wide stats."""
+    with tempfile.TemporaryDirectory() as confdir:
+        with open(os.path.join(confdir, 'stats-test'), 'w') as f:
+            f.write('auth required pam_unix.so\n')
+
+        truenas_pypam.stats(reset=True)
+        truenas_pypam.authenticate_many(
+            'stats-test', [(TEST_USER, CORRECT_PASSWORD)] * 4, confdir=confdir
+        )
+
+    stats = truenas_pypam.stats()
+    assert stats['pam_start']['count'] == 4
+    assert stats['pam_authenticate']['count'] == 4
+
+
+@pytest.mark.parametrize("kwargs", [{'reset': 1, 'extra': 1}])
+def test_stats_invalid_args(kwargs):
+    """Test unknown arguments are rejected."""
+    with pytest.raises(TypeError):
+        truenas_pypam.stats(**kwargs)
+
+    with pytest.raises(TypeError):
+        get_ctx().stats(**kwargs)
@@ -0,0 +1,115 @@
+"""Tests for truenas_pypam in isolated subinterpreters (PEP 684)."""
+
+import threading
+import pytest
+import truenas_pypam
+
+try:
+    import _interpreters
+except ImportError:
+    _interpreters = None
+
+
+pytestmark = pytest.mark.skipif(
+    _interpreters is None, reason='requires python 3.13 subinterpreters'
+)
+
+
+AUTH_SCRIPT = '''
+import truenas_pypam
+
+ctx = truenas_pypam.get_context(
+    user='bob',
+    conversation_responses={
+        truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: 'Cats'
+    }
+)
+ctx.authenticate()
+
+try:
+    truenas_pypam.get_context(
+        user='bob',
+        conversation_responses={
+            truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: 'Dogs'
+        }
+    ).authenticate()
+except truenas_pypam.PAMError as e:
+    assert e.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
+else:
+    raise AssertionError('wrong password accepted')
+'''
+
+ASYNC_SCRIPT = '''
+import asyncio
+import truenas_pypam
+
+def conv(ctx, messages, private_data):
+    return [private_data if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF
+            else None for m in messages]
+
+async def run():
+    ctx = truenas_pypam.get_context(
+        user='bob',
+        conversation_function=conv,
+        conversation_private_data='Cats'
+    )
+    await ctx.authenticate_async()
+    assert len(ctx.message_history) > 0
+
+asyncio.run(run())
+'''
+
+
+def run_isolated(script):
+    """Run script in a new interpreter with its own GIL."""
+    interp = _interpreters.create('isolated')
+    try:
+        excinfo = _interpreters.run_string(interp, script)
+    finally:
+        _interpreters.destroy(interp)
+
+    assert excinfo is None, excinfo.formatted
+
+
+def test_subinterp_authenticate():
+    """Test authentication from an isolated subinterpreter."""
+    run_isolated(AUTH_SCRIPT)
+
+
+def test_subinterp_async():
+    """Test the async API and callbacks from an isolated subinterpreter."""
+    run_isolated(ASYNC_SCRIPT)
+
+
+def test_subinterp_parallel():
+    """Test authentication in several subinterpreters at the same time."""
+    errors = []
+
+    def worker():
+        try:
+            run_isolated(AUTH_SCRIPT)
+        except Exception as exc:
+            errors.append(exc)
+
+    threads = [threading.Thread(target=worker) for _ in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join(timeout=60)
+
+    assert errors == []
+
+
+def test_subinterp_main_unaffected():
+    """Test main interpreter module still works after subinterpreters."""
+    run_isolated(AUTH_SCRIPT)
+
+    with pytest.raises(truenas_pypam.PAMError) as exc_info:
+        truenas_pypam.get_context(
+            user='bob',
+            conversation_responses={
+                truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF: 'Dogs'
+            }
+        ).authenticate()
+
+    assert exc_info.value.code == truenas_pypam.PAMCode.PAM_AUTH_ERR
@@ -0,0 +1,207 @@
+"""Tests for the pam_tnpam_test module built with the extension."""
+
+import importlib.util
+import os
+import tempfile
+import time
+import pytest
+import truenas_pypam
+
+
+TEST_USER = 'synthetic'
+PASSWORD = 'secret'
+
+PAMCode = truenas_pypam.PAMCode
+MSGStyle = truenas_pypam.MSGStyle
+
+SPEC = importlib.util.find_spec('pam_tnpam_test')
+MODULE = SPEC.origin if SPEC is not None else None
+
+pytestmark = pytest.mark.skipif(MODULE is None,
+                                reason='pam_tnpam_test not built')
+
+STACKS = {
+    'tt-basic': f'auth required {MODULE} password={PASSWORD}\n',
+    'tt-rounds': (
+        f'auth required {MODULE} rounds=3 style=info,echo_on,echo_off '
+        f'password={PASSWORD} export\n'
+    ),
+    'tt-delay': f'auth required {MODULE} delay_us=200000\n',
+    'tt-fail-every': f'auth required {MODULE} fail_every=2\n',
+    'tt-fail-rate': f'auth required {MODULE} fail_rate=0.5 seed=7\n',
+    'tt-fail-all': f'auth required {MODULE} fail_rate=1 result=maxtries\n',
+    'tt-incomplete': f'auth required {MODULE} incomplete=2\n',
+    'tt-resume': (
+        f'auth required {MODULE} rounds=2 incomplete_round=1 export\n'
+    ),
+    'tt-groups': (
+        f'auth required {MODULE} rounds=0\n'
+        f'account required {MODULE} result=acct_expired fail_rate=1\n'
+        f'session required {MODULE} export\n'
+        f'password required {MODULE} password={PASSWORD}\n'
+    ),
+    'tt-typo': f'auth required {MODULE} rounds=1 passwd={PASSWORD}\n',
+}
+
+
+@pytest.fixture(scope='module')
+def confdir():
+    """PAM confdir with stacks of the synthetic module."""
+    with tempfile.TemporaryDirectory() as confdir:
+        for service, stack in STACKS.items():
+            with open(os.path.join(confdir, service), 'w') as f:
+                f.write(stack)
+        yield confdir
+
+
+def get_ctx(confdir, service, password=PASSWORD, **kwargs):
+    if 'conversation_function' not in kwargs:
+        kwargs['conversation_responses'] = {
+            MSGStyle.PAM_PROMPT_ECHO_OFF: password,
+            MSGStyle.PAM_PROMPT_ECHO_ON: '123456',
+        }
+    return truenas_pypam.get_context(
+        service_name=service,
+        confdir=confdir,
+        user=TEST_USER,
+        **kwargs
+    )
+
+
+def recording_callback(ctx, messages, private_data):
+    private_data.append([(m.msg_style, m.msg) for m in messages])
+    return [
+        PASSWORD if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_OFF else
+        '123456' if m.msg_style == MSGStyle.PAM_PROMPT_ECHO_ON else None
+        for m in messages
+    ]
+
+
+def count_failures(ctx_factory, calls):
+    failures = 0
+    for _ in range(calls):
+        try:
+            ctx_factory().authenticate()
+        except truenas_pypam.PAMError:
+            failures += 1
+    return failures
+
+
+def test_password(confdir):
+    """Test the configured password is required, for any user."""
+    get_ctx(confdir, 'tt-basic').authenticate()
+
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        get_ctx(confdir, 'tt-basic', password='wrong').authenticate()
+    assert exc.value.code == PAMCode.PAM_AUTH_ERR
+
+
+def test_rounds_and_styles(confdir):
+    """Test every round asks the configured message styles."""
+    rounds = []
+    ctx = get_ctx(confdir, 'tt-rounds',
+                  conversation_function=recording_callback,
+                  conversation_private_data=rounds)
+    ctx.authenticate()
+
+    assert len(rounds) == 3
+    for messages in rounds:
+        assert [style for style, _ in messages] == [
+            MSGStyle.PAM_TEXT_INFO,
+            MSGStyle.PAM_PROMPT_ECHO_ON,
+            MSGStyle.PAM_PROMPT_ECHO_OFF,
+        ]
+    assert rounds[2][2][1] == 'Password 3.2: '
+    assert ctx.get_env(name='TNPAM_TEST_ROUNDS') == '3'
+
+
+def test_delay(confdir):
+    """Test delay_us adds latency to the call."""
+    start = time.monotonic()
+    get_ctx(confdir, 'tt-delay').authenticate()
+    assert time.monotonic() - start >= 0.2
+
+
+def test_fail_every(confdir):
+    """Test fail_every fails exactly that share of consecutive calls."""
+    failures = count_failures(lambda: get_ctx(confdir, 'tt-fail-every'), 10)
+    assert failures == 5
+
+
+def test_fail_rate(confdir):
+    """Test fail_rate fails about that share of calls."""
+    failures = count_failures(lambda: get_ctx(confdir, 'tt-fail-rate'), 200)
+    assert 60 < failures < 140
+
+
+def test_failure_result(confdir):
+    """Test result= selects the code of failures."""
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        get_ctx(confdir, 'tt-fail-all').authenticate()
+    assert exc.value.code == PAMCode.PAM_MAXTRIES
+
+
+def test_incomplete(confdir):
+    """Test incomplete= returns PAM_INCOMPLETE before the stack completes."""
+    ctx = get_ctx(confdir, 'tt-incomplete')
+    for _ in range(2):
+        with pytest.raises(truenas_pypam.PAMError) as exc:
+            ctx.authenticate()
+        assert exc.value.code == PAMCode.PAM_INCOMPLETE
+    ctx.authenticate()
+
+
+def test_incomplete_round_resumes(confdir):
+    """Test a call after PAM_INCOMPLETE resumes at the next round."""
+    rounds = []
+    ctx = get_ctx(confdir, 'tt-resume',
+                  conversation_function=recording_callback,
+                  conversation_private_data=rounds)
+
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        ctx.authenticate()
+    assert exc.value.code == PAMCode.PAM_INCOMPLETE
+    assert [m[0][1] for m in rounds] == ['Password 1.0: ']
+
+    ctx.authenticate()
+    assert [m[0][1] for m in rounds] == ['Password 1.0: ', 'Password 2.0: ']
+    assert ctx.get_env(name='TNPAM_TEST_ROUNDS') == '2'
+
+
+def test_management_groups(confdir):
+    """Test account, session and password groups use the same arguments."""
+    ctx = get_ctx(confdir, 'tt-groups')
+    ctx.authenticate()
+
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        ctx.acct_mgmt()
+    assert exc.value.code == PAMCode.PAM_ACCT_EXPIRED
+
+    ctx.open_session()
+    assert ctx.get_env(name='TNPAM_TEST_CALLS') == '1'
+    ctx.close_session()
+    assert ctx.get_env(name='TNPAM_TEST_CALLS') == '1'
+
+    ctx.chauthtok()
+    with pytest.raises(truenas_pypam.PAMError):
+        get_ctx(confdir, 'tt-groups', password='wrong').chauthtok()
+
+
+def test_unknown_argument(confdir):
+    """Test a misspelled argument fails instead of being ignored."""
+    with pytest.raises(truenas_pypam.PAMError) as exc:
+        get_ctx(confdir, 'tt-typo').authenticate()
+    assert exc.value.code == PAMCode.PAM_SERVICE_ERR
+
+
+def test_process_pool(confdir):
+    """Test the module drives conversations of a process pool worker."""
+    pool = truenas_pypam.get_process_pool(workers=1)
+    rounds = []
+    ctx = pool.get_context(service_name='tt-rounds', confdir=confdir,
+                           user=TEST_USER,
+                           conversation_function=recording_callback,
+                           conversation_private_data=rounds)
+    ctx.authenticate()
+    assert len(rounds) == 3
+    assert ctx.get_env(name='TNPAM_TEST_ROUNDS') == '3'
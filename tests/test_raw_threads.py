@@ -0,0 +1,142 @@
+"""Tests for truenas_pypam use from multiple threads."""
+
+import sys
+import sysconfig
+import threading
+import pytest
+import truenas_pypam
+
+
+# Test credentials from examples/raw_basic_auth.py
+TEST_USER = 'bob'
+CORRECT_PASSWORD = 'Cats'
+
+NTHREADS = 4
+
+
+def callback_basic_auth(ctx, messages, private_data):
+    """PAM conversation callback function for basic auth."""
+    reply = []
+    for m in messages:
+        rep = None
+        if m.msg_style == truenas_pypam.MSGStyle.PAM_PROMPT_ECHO_OFF:
+            rep = private_data['password']
+        reply.append(rep)
+    return reply
+
+
+def get_ctx():
+    return truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_basic_auth,
+        conversation_private_data={'password': CORRECT_PASSWORD}
+    )
+
+
+def run_threads(target, count=NTHREADS):
+    """Start count threads at the same time and collect exceptions."""
+    barrier = threading.Barrier(count)
+    errors = []
+
+    def wrapper():
+        barrier.wait()
+        try:
+            target()
+        except Exception as exc:
+            errors.append(exc)
+
+    threads = [threading.Thread(target=wrapper) for _ in range(count)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join(timeout=60)
+        assert not t.is_alive()
+
+    return errors
+
+
+@pytest.mark.skipif(
+    not sysconfig.get_config_var('Py_GIL_DISABLED'),
+    reason='requires free-threaded python'
+)
+def test_import_does_not_enable_gil():
+    """Test the module declares it does not need the GIL."""
+    assert not sys._is_gil_enabled()
+
+
+def test_threads_separate_contexts():
+    """Test concurrent authentication on separate contexts."""
+    errors = run_threads(lambda: get_ctx().authenticate())
+    assert errors == []
+
+
+def test_threads_shared_context():
+    """Test concurrent authentication on a shared context doesn't deadlock.
+
+    Threads waiting for the handle must not hold the GIL while the thread
+    that owns the handle runs the python conversation callback.
+    """
+    ctx = get_ctx()
+    errors = run_threads(ctx.authenticate)
+    assert errors == []
+    assert len(ctx.messages()) >= NTHREADS
+
+
+def test_threads_close_session_once():
+    """Test only one of several concurrent close_session() calls succeeds."""
+    ctx = get_ctx()
+    ctx.authenticate()
+    ctx.open_session()
+
+    errors = run_threads(ctx.close_session)
+    assert len(errors) == NTHREADS - 1
+    assert all(isinstance(e, ValueError) for e in errors)
+
+
+def test_threads_set_conversation():
+    """Test replacing the callback while other threads converse."""
+    ctx = get_ctx()
+    stop = threading.Event()
+
+    def swap():
+        while not stop.is_set():
+            ctx.set_conversation(conversation_function=callback_basic_auth)
+
+    swapper = threading.Thread(target=swap)
+    swapper.start()
+    try:
+        errors = run_threads(ctx.authenticate)
+    finally:
+        stop.set()
+        swapper.join()
+
+    assert errors == []
+
+
+def test_threads_history_readers():
+    """Test reading message history while conversations append to it."""
+    ctx = truenas_pypam.get_context(
+        user=TEST_USER,
+        conversation_function=callback_basic_auth,
+        conversation_private_data={'password': CORRECT_PASSWORD},
+        message_history_size=2
+    )
+    view = ctx.message_history
+    stop = threading.Event()
+
+    def read():
+        while not stop.is_set():
+            for entry in view:
+                assert isinstance(entry, tuple)
+            assert len(ctx.messages()) <= 2
+
+    reader = threading.Thread(target=read)
+    reader.start()
+    try:
+        errors = run_threads(ctx.authenticate)
+    finally:
+        stop.set()
+        reader.join()
+
+    assert errors == []
+    assert len(view) == 2